@@ -0,0 +1,498 @@
+/*
+ * Microbenchmarks for crypto/.
+ *
+ * Measures ops/sec and bytes/sec of the crypto primitives over payload sizes
+ * from 16 B to 16 MiB and over the supported key sizes and hashes. Results
+ * are written as CSV or JSON. Given a baseline written by an earlier run, the
+ * results are compared against it and the exit status is 1 if anything got
+ * slower than the threshold allows.
+ *
+ * Usage: crypto_bench [options]
+ *
+ *   -f csv|json   Output format (default csv).
+ *   -o file       Write the results to file instead of stdout.
+ *   -b file       Compare with a baseline (CSV or JSON from this tool). The
+ *                 comparison is printed to stdout; the results are only
+ *                 written if -o is given.
+ *   -t percent    Slowdown that counts as a regression (default 10).
+ *   -s seconds    Minimum time to run each case for (default 0.2).
+ *   -m bytes      Largest payload (default 16777216).
+ *   -p prefix     Only run operations whose name starts with prefix.
+ *
+ * Example:
+ *   crypto_bench -o base.csv
+ *   (change crypto/)
+ *   crypto_bench -b base.csv
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <openssl/rand.h>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "../crypto/aes.h"
+#include "../crypto/base64.h"
+#include "../crypto/constants.h"
+#include "../crypto/hmac.h"
+#include "../crypto/memory.h"
+#include "../crypto/rsa.h"
+#include "../global_config/types.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+// Results are added here so the compiler cannot drop the work.
+volatile size_t bench_sink;
+
+struct BenchOptions
+{
+    std::string format{"csv"};
+    std::string out_path;
+    std::string baseline_path;
+    double threshold = 10;
+    double min_seconds = 0.2;
+    size_t max_bytes = 16 * 1024 * 1024;
+    std::string prefix;
+};
+
+BenchOptions options;
+
+/*
+ * One measured case. variant is the key size and/or hash, or "-".
+ */
+struct BenchResult
+{
+    std::string op;
+    std::string variant;
+    size_t bytes;
+    long iterations;
+    double seconds;
+
+    double ops_per_sec() const { return iterations / seconds; }
+    double bytes_per_sec() const { return ops_per_sec() * bytes; }
+    // Identifies the case when comparing with a baseline.
+    std::string key() const
+    {
+        return op + " " + variant + " " + std::to_string(bytes);
+    }
+};
+
+std::vector<BenchResult> results;
+
+/**
+ * Times f, which processes bytes bytes per call, for at least
+ * options.min_seconds. The number of calls per timing doubles until the time
+ * is reached, so fast operations are not dominated by reading the clock.
+ */
+template <class F>
+void bench(const std::string &op, const std::string &variant, size_t bytes,
+        F f)
+{
+    if (op.compare(0, options.prefix.size(), options.prefix) != 0)
+        return;
+
+    // Warm up caches and the SecureArena.
+    f();
+
+    long iterations = 0;
+    double seconds = 0;
+    for (long batch = 1; seconds < options.min_seconds; batch *= 2)
+    {
+        bench_clock::time_point start = bench_clock::now();
+        for (long i = 0; i < batch; i++)
+            f();
+        seconds += std::chrono::duration<double>(bench_clock::now() - start)
+            .count();
+        iterations += batch;
+    }
+
+    results.push_back(BenchResult{op, variant, bytes, iterations, seconds});
+    fprintf(stderr, "%-18s %-12s %10zu %14.1f ops/s\n", op.c_str(),
+            variant.c_str(), bytes, results.back().ops_per_sec());
+}
+
+/**
+ * Returns the payload sizes: 16 B and then every power of 16 up to
+ * options.max_bytes.
+ */
+std::vector<size_t> payload_sizes()
+{
+    std::vector<size_t> sizes;
+    for (size_t n = 16; n <= options.max_bytes; n *= 16)
+        sizes.push_back(n);
+    return sizes;
+}
+
+std::string hash_name(int hash)
+{
+    switch (hash)
+    {
+        case SHA256:
+            return "sha256";
+        case SHA512:
+            return "sha512";
+        default:
+            return "sha1";
+    }
+}
+
+void bench_aes(const uchar_vec &payload)
+{
+    for (int key_bits : {128, 256})
+    {
+        std::string variant = std::to_string(key_bits);
+
+        bench("get_new_AES_key", variant, key_bits / 8, [&]()
+        {
+            secure_vec key;
+            bench_sink += get_new_AES_key(key_bits, key);
+        });
+
+        secure_vec key;
+        get_new_AES_key(key_bits, key);
+
+        for (size_t n : payload_sizes())
+        {
+            const_uchar_span plaintext{payload.data(), n};
+            uchar_vec ciphertext(aes_encrypt_size(n));
+            uchar_vec decrypted(aes_decrypt_size(ciphertext.size()));
+
+            bench("aes_encrypt", variant, n, [&]()
+            {
+                bench_sink += aes_encrypt(key.data(), plaintext, key_bits,
+                        ciphertext);
+            });
+
+            int len = aes_encrypt(key.data(), plaintext, key_bits, ciphertext);
+            const_uchar_span encrypted{ciphertext.data(), (size_t) len};
+
+            bench("aes_decrypt", variant, n, [&]()
+            {
+                bench_sink += aes_decrypt(key.data(), encrypted, key_bits,
+                        decrypted);
+            });
+        }
+    }
+}
+
+void bench_hmac(const uchar_vec &payload)
+{
+    uchar_vec key(32);
+    RAND_bytes(key.data(), key.size());
+
+    for (int hash : {SHA1, SHA256, SHA512})
+    {
+        uchar_vec mac(hmac_size(hash));
+        for (size_t n : payload_sizes())
+        {
+            const_uchar_span data{payload.data(), n};
+            bench("hmac", hash_name(hash), n, [&]()
+            {
+                bench_sink += hmac(key, data, hash, mac);
+            });
+        }
+    }
+}
+
+void bench_rsa(const uchar_vec &payload)
+{
+    for (int bits : {2048, 3072, 4096})
+    {
+        std::string variant = std::to_string(bits);
+
+        bench("get_new_RSA_pair", variant, 0, [&]()
+        {
+            bench_sink += std::get<0>(get_new_RSA_pair(bits)).size();
+        });
+
+        uchar_vec public_der, private_der;
+        std::tie(public_der, private_der) = get_new_RSA_pair(bits);
+        RSA *public_key = DER_decode_RSA_public(public_der.data(),
+                public_der.size());
+        RSA *private_key = DER_decode_RSA_private(private_der.data(),
+                private_der.size());
+
+        // RSA only ever wraps data keys, so encrypt one.
+        const_uchar_span data_key{payload.data(), 32};
+        uchar_vec ciphertext(rsa_size(public_key));
+        uchar_vec decrypted(rsa_size(private_key));
+
+        bench("rsa_encrypt", variant, data_key.size(), [&]()
+        {
+            bench_sink += rsa_encrypt(public_key, data_key, ciphertext);
+        });
+
+        int len = rsa_encrypt(public_key, data_key, ciphertext);
+        const_uchar_span encrypted{ciphertext.data(), (size_t) len};
+
+        bench("rsa_decrypt", variant, data_key.size(), [&]()
+        {
+            bench_sink += rsa_decrypt(private_key, encrypted, decrypted);
+        });
+
+        for (int hash : {SHA1, SHA256, SHA512})
+        {
+            std::string sig_variant = variant + "/" + hash_name(hash);
+            uchar_vec sig(rsa_size(private_key));
+
+            for (size_t n : payload_sizes())
+            {
+                const_uchar_span msg{payload.data(), n};
+
+                bench("rsa_sign", sig_variant, n, [&]()
+                {
+                    bench_sink += rsa_sign(private_key, msg, hash, sig);
+                });
+
+                int sig_len = rsa_sign(private_key, msg, hash, sig);
+                const_uchar_span signature{sig.data(), (size_t) sig_len};
+
+                bench("rsa_verify", sig_variant, n, [&]()
+                {
+                    bench_sink += rsa_verify(public_key, signature, msg, hash);
+                });
+            }
+        }
+
+        RSA_free(public_key);
+        RSA_free(private_key);
+    }
+}
+
+void bench_base64(const uchar_vec &payload)
+{
+    for (size_t n : payload_sizes())
+    {
+        const_uchar_span data{payload.data(), n};
+        uchar_vec encoded(base64_encode_size(n));
+
+        bench("base64_encode", "-", n, [&]()
+        {
+            bench_sink += base64_encode(data, encoded);
+        });
+
+        std::string text{encoded.begin(), encoded.end()};
+        bench("base64_decode", "-", n, [&]()
+        {
+            bench_sink += base64_decode(text).size();
+        });
+    }
+}
+
+void bench_memory(uchar_vec &payload)
+{
+    for (size_t n : payload_sizes())
+    {
+        bench("secure_memset", "-", n, [&]()
+        {
+            secure_memset(payload.data(), 0, n);
+        });
+    }
+}
+
+/**
+ * Writes the results in the chosen format.
+ */
+void write_results(FILE *out)
+{
+    if (options.format == "json")
+    {
+        fprintf(out, "{\"benchmark\":\"crypto\",\"results\":[\n");
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const BenchResult &r = results[i];
+            fprintf(out, "{\"op\":\"%s\",\"variant\":\"%s\",\"bytes\":%zu,"
+                    "\"iterations\":%ld,\"seconds\":%.6f,"
+                    "\"ops_per_sec\":%.1f,\"bytes_per_sec\":%.1f}%s\n",
+                    r.op.c_str(), r.variant.c_str(), r.bytes, r.iterations,
+                    r.seconds, r.ops_per_sec(), r.bytes_per_sec(),
+                    i + 1 < results.size() ? "," : "");
+        }
+        fprintf(out, "]}\n");
+    }
+    else
+    {
+        fprintf(out, "op,variant,bytes,iterations,seconds,ops_per_sec,"
+                "bytes_per_sec\n");
+        for (const BenchResult &r : results)
+            fprintf(out, "%s,%s,%zu,%ld,%.6f,%.1f,%.1f\n", r.op.c_str(),
+                    r.variant.c_str(), r.bytes, r.iterations, r.seconds,
+                    r.ops_per_sec(), r.bytes_per_sec());
+    }
+}
+
+/**
+ * Returns the value of "key": in a JSON line written by write_results(), or
+ * an empty string.
+ */
+std::string json_field(const std::string &line, const std::string &key)
+{
+    std::string name = "\"" + key + "\":";
+    size_t start = line.find(name);
+    if (start == std::string::npos)
+        return std::string{};
+
+    start += name.size();
+    if (line[start] == '"')
+        return line.substr(start + 1, line.find('"', start + 1) - start - 1);
+    return line.substr(start, line.find_first_of(",}", start) - start);
+}
+
+/**
+ * Reads a baseline written by write_results() in either format. Returns the
+ * ops/sec of each case by BenchResult::key().
+ */
+std::map<std::string, double> read_baseline(const std::string &path)
+{
+    std::map<std::string, double> baseline;
+    std::ifstream in{path};
+
+    for (std::string line; std::getline(in, line); )
+    {
+        BenchResult r;
+        std::string bytes, ops;
+
+        if (line.find("\"op\":") != std::string::npos)
+        {
+            r.op = json_field(line, "op");
+            r.variant = json_field(line, "variant");
+            bytes = json_field(line, "bytes");
+            ops = json_field(line, "ops_per_sec");
+        }
+        else
+        {
+            std::istringstream fields{line};
+            std::string iterations, seconds;
+            std::getline(fields, r.op, ',');
+            std::getline(fields, r.variant, ',');
+            std::getline(fields, bytes, ',');
+            std::getline(fields, iterations, ',');
+            std::getline(fields, seconds, ',');
+            std::getline(fields, ops, ',');
+        }
+
+        // Skips the CSV header and anything else that is not a result.
+        char *end;
+        r.bytes = strtoull(bytes.c_str(), &end, 10);
+        if (bytes.empty() || *end)
+            continue;
+        baseline[r.key()] = atof(ops.c_str());
+    }
+    return baseline;
+}
+
+/**
+ * Prints each result next to its baseline. Returns the number of cases that
+ * are slower than the threshold allows.
+ */
+int compare(const std::map<std::string, double> &baseline)
+{
+    int regressions = 0;
+
+    printf("%-18s %-12s %10s %14s %14s %8s\n", "op", "variant", "bytes",
+            "base ops/s", "ops/s", "change");
+    for (const BenchResult &r : results)
+    {
+        auto it = baseline.find(r.key());
+        if (it == baseline.end() || it->second <= 0)
+        {
+            printf("%-18s %-12s %10zu %14s %14.1f %8s\n", r.op.c_str(),
+                    r.variant.c_str(), r.bytes, "-", r.ops_per_sec(), "new");
+            continue;
+        }
+
+        double change = (r.ops_per_sec() - it->second) / it->second * 100;
+        bool regressed = change < -options.threshold;
+        if (regressed)
+            regressions++;
+        printf("%-18s %-12s %10zu %14.1f %14.1f %+7.1f%%%s\n", r.op.c_str(),
+                r.variant.c_str(), r.bytes, it->second, r.ops_per_sec(),
+                change, regressed ? " REGRESSION" : "");
+    }
+
+    printf("\n%d regression(s) beyond %.1f%%\n", regressions,
+            options.threshold);
+    return regressions;
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg{argv[i]};
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "crypto_bench: %s needs a value\n", argv[i]);
+            return 2;
+        }
+
+        const char *value = argv[++i];
+        if (arg == "-f")
+            options.format = value;
+        else if (arg == "-o")
+            options.out_path = value;
+        else if (arg == "-b")
+            options.baseline_path = value;
+        else if (arg == "-t")
+            options.threshold = atof(value);
+        else if (arg == "-s")
+            options.min_seconds = atof(value);
+        else if (arg == "-m")
+            options.max_bytes = strtoull(value, nullptr, 10);
+        else if (arg == "-p")
+            options.prefix = value;
+        else
+        {
+            fprintf(stderr, "crypto_bench: unknown option %s\n", argv[i - 1]);
+            return 2;
+        }
+    }
+
+    std::map<std::string, double> baseline;
+    if (!options.baseline_path.empty())
+    {
+        baseline = read_baseline(options.baseline_path);
+        if (baseline.empty())
+        {
+            fprintf(stderr, "crypto_bench: no results in %s\n",
+                    options.baseline_path.c_str());
+            return 2;
+        }
+    }
+
+    uchar_vec payload(options.max_bytes < 32 ? 32 : options.max_bytes);
+    RAND_bytes(payload.data(), payload.size());
+
+    bench_aes(payload);
+    bench_hmac(payload);
+    bench_rsa(payload);
+    bench_base64(payload);
+    bench_memory(payload);
+
+    if (!options.out_path.empty())
+    {
+        FILE *out = fopen(options.out_path.c_str(), "w");
+        if (!out)
+        {
+            fprintf(stderr, "crypto_bench: cannot write %s\n",
+                    options.out_path.c_str());
+            return 2;
+        }
+        write_results(out);
+        fclose(out);
+    }
+    else if (baseline.empty())
+    {
+        write_results(stdout);
+    }
+
+    if (!baseline.empty())
+        return compare(baseline) ? 1 : 0;
+    return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Microbenchmark for Logger::log.
+ *
+ * Compares the per-call cost of the asynchronous logger with the previous
+ * implementation, which opened, formatted, wrote and closed the log file on
+ * every call.
+ *
+ * Usage: logger_bench [iterations] [threads] [log file]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../logger/logger.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+/**
+ * The previous Logger::log, kept for comparison.
+ */
+void sync_log(const std::string &path, const std::string &msg)
+{
+    std::ofstream out;
+    out.open(path, 
+            std::ios_base::app | std::ios_base::in | std::ios_base::out);
+
+    // Formatted time
+    time_t rawtime;
+    struct tm * timeinfo;
+    time(&rawtime);
+    timeinfo = localtime(&rawtime);
+    char time_buffer [80];
+    strftime (time_buffer, 80, "%F %r:\t", timeinfo);
+
+    out << time_buffer 
+        << msg << std::endl;
+    out.close();
+}
+
+/**
+ * Returns the nanoseconds per call for n calls between start and end.
+ */
+double ns_per_call(bench_clock::time_point start, bench_clock::time_point end,
+        long n)
+{
+    return std::chrono::duration<double, std::nano>(end - start).count() / n;
+}
+
+/**
+ * Counts the lines in the file at path.
+ */
+long count_lines(const std::string &path)
+{
+    std::ifstream in{path};
+    long lines = 0;
+    std::string line;
+    while (std::getline(in, line))
+        ++lines;
+    return lines;
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    int threads = argc > 2 ? atoi(argv[2]) : 1;
+    std::string path = argc > 3 ? argv[3] : "/tmp/eso_logger_bench.log";
+
+    // A typical esol request line.
+    std::string msg{"Requested from esol: REQUEST_ENCRYPT com.example.set 1"};
+
+    // The synchronous logger is slow, so time fewer calls.
+    long sync_iterations = iterations / 100 > 1000 ? iterations / 100 : 1000;
+    std::string sync_path = path + ".sync";
+    remove(sync_path.c_str());
+
+    auto start = bench_clock::now();
+    for (long i = 0; i < sync_iterations; i++)
+        sync_log(sync_path, msg);
+    auto end = bench_clock::now();
+
+    printf("sync logger (open/write/close):  %10.1f ns/call (%ld calls)\n",
+            ns_per_call(start, end, sync_iterations), sync_iterations);
+    remove(sync_path.c_str());
+
+    remove(path.c_str());
+    Logger::set_path(path);
+    // Start the writer and create this thread's ring before timing.
+    Logger::log("logger_bench started");
+    Logger::flush();
+
+    long per_thread = iterations / threads;
+    std::vector<std::thread> workers;
+
+    start = bench_clock::now();
+    for (int t = 0; t < threads; t++)
+        workers.emplace_back([&msg, per_thread]
+        {
+            for (long i = 0; i < per_thread; i++)
+                Logger::log(msg, LogLevel::Debug);
+        });
+    for (auto &w : workers)
+        w.join();
+    end = bench_clock::now();
+
+    printf("async logger, %d thread(s):      %10.1f ns/call (%ld calls)\n",
+            threads, ns_per_call(start, end, per_thread * threads) * threads,
+            per_thread * threads);
+
+    start = bench_clock::now();
+    Logger::flush();
+    end = bench_clock::now();
+
+    printf("final flush:                     %10.1f ms\n",
+            std::chrono::duration<double, std::milli>(end - start).count());
+
+    // Lines that did not fit in a full ring are dropped and reported in the
+    // log instead.
+    printf("lines written:                   %10ld\n", count_lines(path) - 1);
+
+    return 0;
+}
@@ -47,15 +47,21 @@ def index():
 def requestCreateCredential(setName, version, credType, expiration, primary,
         secondary):
     # Maps the the selected credential type to its algorithm, key size, 
-    # and type. Type 1 = credential, 2 = symmetric, 3 = asymmetric.
+    # and type. Type 1 = credential, 2 = symmetric, 3 = asymmetric,
+    # 4 = ECDSA, 5 = Ed25519.
     # See db_types.h
+    # The keys match the 'algo-size' strings shown by viewSet so that new
+    # versions of an existing set can be requested with the same type.
     # TODO set a safe password size
     credMap = { 'Username / Password'   : ('PASS',  '33', '1'),
                 'AES-128'               : ('AES',  '128', '2'),
                 'AES-256'               : ('AES',  '256', '2'),
                 'RSA-1024'              : ('RSA', '1024', '3'),
                 'RSA-2048'              : ('RSA', '2048', '3'),
-                'RSA-4096'              : ('RSA', '4096', '3')
+                'RSA-4096'              : ('RSA', '4096', '3'),
+                'ECDSA-256'             : ('ECDSA', '256', '4'),
+                'ECDSA-384'             : ('ECDSA', '384', '4'),
+                'ED25519-256'           : ('ED25519', '256', '5')
             }
 
     (credAlgo, credSize, credType) = credMap[credType]
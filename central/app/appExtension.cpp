@@ -42,7 +42,7 @@ int request_daemon(uchar_vec msg_type, std::string msg)
         // Send request type.
         uds_stream.send(msg_type);
 
-        Logger::log(std::string{"Sending to esoca: "} + msg, LogLevel::Debug);
+        ESO_LOG(LogLevel::Debug, "Sending to esoca: ", msg);
 
         // Send the actual message.
         uds_stream.send(msg);
@@ -5,6 +5,49 @@
  * Config file for the daemon.
  */
 
-const char* ESOCA_SOCKET_PATH = "/home/jac/Desktop/eso/central/esoca/esoca_socket";
+#include <cstddef>
+#include <cstdint>
+
+#include "../../global_config/paths.h"
+#include "../../logger/logger.h"
+
+const std::string ESOCA_SOCKET_PATH = eso_path("central/esoca/esoca_socket");
+
+// Messages more verbose than this level are not logged.
+const LogLevel ESOCA_LOG_LEVEL = LogLevel::Info;
+
+// Sampled request spans are appended here, one JSON object per line.
+const std::string ESOCA_TRACE_PATH =
+    eso_path("central/esoca/esoca_trace.jsonl");
+// The fraction of requests that start a new trace. 0 disables tracing.
+const double ESOCA_TRACE_SAMPLE_RATE = 0.01;
+
+// Every propagated change is logged here, in ESOCA_CHANGE_LOG_PATH.log and
+// .old, so that an esod that missed some can catch up (see change_log.h).
+// Between one and two segments of this size are kept.
+const std::string ESOCA_CHANGE_LOG_PATH =
+    eso_path("central/esoca/esoca_changes");
+const uint64_t ESOCA_CHANGE_LOG_SEGMENT_BYTES = 64 << 20;
+// The most changes sent in answer to one GET_CHANGES.
+const size_t ESOCA_CHANGES_PER_REPLY = 1024;
+// Threads answering GET_CHANGES and SYNC_TREE, or 0 for one per core, and
+// how many connections may wait for one before the accepting thread answers
+// them itself. A send or receive that takes longer than
+// ESOCA_SERVE_TIMEOUT_MS ends the connection.
+const unsigned int ESOCA_SERVE_THREADS = 4;
+const size_t ESOCA_SERVE_QUEUE = 64;
+const int ESOCA_SERVE_TIMEOUT_MS = 30000;
+
+// How long esoca waits after a change for more before sending them to a
+// distribution server together, and the most it sends at once (see
+// propagation_queue.h).
+const unsigned int ESOCA_PROPAGATE_DEBOUNCE_MS = 20;
+const size_t ESOCA_PROPAGATE_BATCH_MAX = 256;
+// The wait before connecting again to a server that could not be reached,
+// doubling with each failure from the first value up to the second.
+const uint64_t ESOCA_PROPAGATE_RETRY_MIN_MS = 100;
+const uint64_t ESOCA_PROPAGATE_RETRY_MAX_MS = 30000;
+// A batch that takes longer than this to send and be acknowledged fails.
+const int ESOCA_PROPAGATE_TIMEOUT_MS = 30000;
 
 #endif
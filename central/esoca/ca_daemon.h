@@ -2,19 +2,29 @@
 #define ESO_CENTRAL_ESOCA_CA_DAEMON
 
 #include <signal.h>
+#include <fstream>
 #include <sstream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "change_log.h"
+#include "propagation_queue.h"
 #include "../config/esoca_config.h"
 #include "../config/mysql_config.h"
 #include "../../crypto/aes.h"
 #include "../../crypto/base64.h"
+#include "../../crypto/ec.h"
 #include "../../crypto/memory.h"
 #include "../../crypto/password.h"
 #include "../../crypto/rsa.h"
 #include "../../daemon/daemon.h"
-#include "../../database/mysql_conn.h"
+#include "../../daemon/propagation.h"
+#include "../../daemon/worker_pool.h"
+#include "../../database/backend.h"
+#include "../../database/hash_tree.h"
 #include "../../logger/logger.h"
 #include "../../global_config/global_config.h"
 #include "../../global_config/message_config.h"
@@ -22,6 +32,10 @@
 #include "../../socket/tcp_stream.h"
 #include "../../socket/uds_socket.h"
 #include "../../socket/uds_stream.h"
+#include "../../stats/propagation.h"
+#include "../../stats/report.h"
+#include "../../stats/trace.h"
+#include "../../util/network.h"
 #include "../../util/parser.h"
 
 /* 
@@ -35,7 +49,17 @@ class CADaemon : public Daemon
         int work() const;
         const char * lock_path() const;
         // Propagates a message to the distribution servers.
-        void propagate(const uchar_vec msg_type, const std::string msg) const;
+        bool propagate(const uchar_vec msg_type, const std::string msg) const;
+        // Answers the distribution servers' GET_CHANGES on ESOCA_PORT.
+        void serve_changes() const;
+        // Answers one connection to ESOCA_PORT.
+        void serve_change_request(TCP_Stream &tcp_stream) const;
+        // Returns true if stream is from a host in locations_config.
+        bool from_distribution_server(const TCP_Stream &stream) const;
+        // Sends the changes after seq, or every row if they are not logged.
+        void send_changes(TCP_Stream &stream, uint64_t seq) const;
+        // Compares esoca's hash tree with a distribution server's.
+        void sync_tree(TCP_Stream &stream, uint64_t seq) const;
 };
 
 int CADaemon::start() const
@@ -45,44 +69,58 @@ int CADaemon::start() const
 
 const char * CADaemon::lock_path() const
 {
-    // TODO create config file?
-    std::string path = "/home/jac/Desktop/eso/central/esoca/esoca_lock";
+    static const std::string path = eso_path("central/esoca/esoca_lock");
     return path.c_str();
 }
 
 /**
- * Propagates a message to the distribution servers.
+ * Propagates a message to the distribution servers. The message is stamped
+ * with the next sequence number so that its progress can be measured; see
+ * stats/propagation.h. It is logged, so that a server that misses it can
+ * fetch it later with GET_CHANGES, and then queued for the servers, which
+ * are sent the changes in batches; see propagation_queue.h.
+ *
+ * A change that cannot be logged is not sent: its sequence number is not in
+ * the log, so esoca would number another change the same after a restart
+ * and the servers would drop that one as already applied. The servers pick
+ * the change up instead when they next compare hash trees with esoca.
  *
  * @param msg_type The type of the message (ex: UPDATE_PERM).
  * @param msg The message to send
+ *
+ * @return true if the change was logged and queued.
  */
-void CADaemon::propagate(const uchar_vec msg_type, const std::string msg) const
+bool CADaemon::propagate(const uchar_vec msg_type, const std::string msg) const
 {
-    // Read conifg file for distribution locations.
-    // Send distribution_msg to all distribution servers.
-    // TODO config this location somewhere
-    std::ifstream input( "/home/jac/Desktop/eso/global_config/locations_config" );
-    for (std::string line; getline(input, line); )
-    {
-        auto values = split_string(line, LOC_DELIMITER);
-
-        TCP_Socket tcp_socket;
-        TCP_Stream tcp_stream = tcp_socket.connect(
-                values[0], values[1]);
+    LoggedChange change{PropagationStamp::next(), msg_type, msg};
+    Span span{"esoca.propagate"};
+    span.tag("seq", std::to_string(change.stamp.seq));
 
-        std::string log_msg{"esoca to esod: "};
-        log_msg += msg;
-        Logger::log(log_msg, LogLevel::Debug);
-
-        tcp_stream.send(msg_type);
-        tcp_stream.send(msg);
+    if (ChangeLog::instance().append(change.stamp, msg_type, msg) != OK)
+    {
+        Logger::log("esoca could not log change "
+                + std::to_string(change.stamp.seq) + "; it was not sent to "
+                "the distribution servers.", LogLevel::Error);
+        return false;
     }
+
+    ESO_LOG(LogLevel::Debug, "esoca to esod: ", msg);
+    PropagationQueue::instance().push(change_key(msg_type, msg), change);
+    return true;
 }
 
 int CADaemon::work() const
 {
+    Logger::set_level(ESOCA_LOG_LEVEL);
+    Tracer::instance().configure("esoca", ESOCA_TRACE_PATH,
+            ESOCA_TRACE_SAMPLE_RATE);
+
     // TODO save pid
 
+    // Go on numbering changes from the last one logged.
+    propagation_last_seq = ChangeLog::instance().last_seq();
+    std::thread{&CADaemon::serve_changes, this}.detach();
+
     UDS_Socket uds_socket{std::string{ESOCA_SOCKET_PATH}};
     if(uds_socket.listen())
     {
@@ -96,11 +134,11 @@ int CADaemon::work() const
     // Accept client connections.
     while (true)
     {
-        Logger::log("esoca is waiting for a UDS connection.", LogLevel::Debug);
+        ESO_LOG(LogLevel::Debug, "esoca is waiting for a UDS connection.");
 
         UDS_Stream uds_stream = uds_socket.accept();
 
-        Logger::log("esoca accepted new UDS connection.", LogLevel::Debug);
+        ESO_LOG(LogLevel::Debug, "esoca accepted new UDS connection.");
 
         // TODO authenticate to make sure it is our web requesting access
 
@@ -112,35 +150,41 @@ int CADaemon::work() const
         // Holds the message we receive.
         uchar_vec recv_msg;
         
-        recv_msg = uds_stream.recv();
-        Logger::log(std::string{"Requested from esoca: "} +
-                to_string(recv_msg));
+        TraceContext parent;
+        recv_msg = recv_request(uds_stream, parent);
+        ESO_LOG(LogLevel::Info, "Requested from esoca: ", recv_msg);
+
+        // The root span of the change. Its trace is sent on with the change.
+        Span request_span{"esoca.request", parent};
 
         // Check for valid request.
         if (recv_msg == NEW_PERM)
         {
+            request_span.tag("op", "new_perm");
             recv_msg = uds_stream.recv();
             Logger::log(recv_msg);
 
             Permission perm = Permission{recv_msg};
 
             // Attempt to update database.
-            MySQL_Conn conn;
+            Storage &conn = storage();
             int status = conn.create_permission(perm);
 
             // Propagate to distribution servers.
-            propagate(UPDATE_PERM, perm.serialize());
+            if (!propagate(UPDATE_PERM, perm.serialize()))
+                uds_stream.send(INVALID_REQUEST);
 
         }
         else if (recv_msg == UPDATE_PERM)
         {
+            request_span.tag("op", "update_perm");
             recv_msg = uds_stream.recv();
             Logger::log(recv_msg);
 
             Permission perm = Permission{recv_msg};
 
             // Attempt to update database.
-            MySQL_Conn conn;
+            Storage &conn = storage();
             int status = conn.update_permission(perm);
 
             /*
@@ -153,27 +197,30 @@ int CADaemon::work() const
             perm = conn.get_permission(perm);
 
             // Propagate to distribution servers.
-            propagate(UPDATE_PERM, perm.serialize());
+            if (!propagate(UPDATE_PERM, perm.serialize()))
+                uds_stream.send(INVALID_REQUEST);
         }
         else if (recv_msg == DELETE_PERM)
         {
+            request_span.tag("op", "delete_perm");
             Permission perm = Permission{uds_stream.recv()};
 
              // Update esoca's database.
-            MySQL_Conn conn;
+            Storage &conn = storage();
             conn.delete_permission(perm) ;
 
             // Propagate to distribution servers.
-            propagate(DELETE_PERM, perm.serialize());
+            if (!propagate(DELETE_PERM, perm.serialize()))
+                uds_stream.send(INVALID_REQUEST);
         }
         else if (recv_msg == NEW_CRED)
         {
+            request_span.tag("op", "new_cred");
             // Receive the serialized credential.
             recv_msg = uds_stream.recv();
             
-            std::string log_msg{"esoca: Serialized credential: "};
-            log_msg += to_string(recv_msg);
-            Logger::log(log_msg, LogLevel::Debug);
+            ESO_LOG(LogLevel::Debug, "esoca: Serialized credential: ",
+                    recv_msg);
 
             Credential cred = Credential(recv_msg);
 
@@ -206,6 +253,42 @@ int CADaemon::work() const
                 secure_memset(&pubKey_enc[0], 0, pubKey_enc.size()); 
                 secure_memset(&priKey_enc[0], 0, priKey_enc.size());
             }
+            else if (cred.type == ECDSA || cred.type == ED25519)
+            {
+                // Get keys
+                auto key_store = (cred.type == ECDSA)
+                    ? get_new_ECDSA_pair(cred.size)
+                    : get_new_Ed25519_pair();
+
+                uchar_vec &pub_key = std::get<0>(key_store);
+                // In secure memory, which is wiped when it is freed.
+                secure_vec &pri_key = std::get<1>(key_store);
+
+                // An unsupported size or curve gives no keys.
+                if (pub_key.empty() || pri_key.empty())
+                {
+                    Logger::log("esoca could not generate keys for "
+                            + cred.set_name + "; the credential was not "
+                            "created.", LogLevel::Error);
+                    secure_wipe(pub_key);
+                    uds_stream.send(INVALID_REQUEST);
+                    continue;
+                }
+
+                // Encode keys. The private key is encoded in secure memory
+                // too, so the only plain copy is the credential's.
+                uchar_vec pubKey_enc = base64_encode(pub_key);
+                secure_vec priKey_enc(base64_encode_size(pri_key.size()));
+                priKey_enc.resize(base64_encode(pri_key, priKey_enc));
+
+                cred.pubKey = to_string(pubKey_enc);
+                cred.priKey.assign(priKey_enc.begin(), priKey_enc.end());
+
+                // TODO encrypt + mac
+                // Wipe keys
+                secure_wipe(pub_key);
+                secure_wipe(pubKey_enc);
+            }
             else if (cred.type == SYMMETRIC)
             {
                 int size = cred.size;
@@ -223,16 +306,26 @@ int CADaemon::work() const
             }
 
             // Update esoca's database.
-            MySQL_Conn conn;
+            Storage &conn = storage();
             conn.create_credential(cred) ;
 
             // Propagate to distribution servers.
-            propagate(NEW_CRED, cred.serialize());
+            if (!propagate(NEW_CRED, cred.serialize()))
+                uds_stream.send(INVALID_REQUEST);
         }
         else if (recv_msg == PING)
         {
             uds_stream.send(PING);
         }
+        else if (recv_msg == REQUEST_STATS)
+        {
+            std::string report = stats_report_header("esoca");
+            append_propagation_report(report);
+            MySQL_Pool::instance().append_to(report);
+            ChangeLog::instance().append_to(report);
+            PropagationQueue::instance().append_to(report);
+            uds_stream.send(report);
+        }
         else
         {
             std::string log_msg{"esoca invalid request: "};
@@ -240,11 +333,317 @@ int CADaemon::work() const
             Logger::log(log_msg);
         }
 
-        Logger::log("esoca is closing UDS connection.", LogLevel::Debug);
+        ESO_LOG(LogLevel::Debug, "esoca is closing UDS connection.");
     }
 
     Logger::log("accept() error", LogLevel::Error);
     return 1;
 }
 
+/*
+ * Runs on its own thread, so that a distribution server catching up does
+ * not hold up the changes being made. Each connection is answered on one of
+ * ESOCA_SERVE_THREADS, so that a slow server does not hold up the others.
+ */
+void CADaemon::serve_changes() const
+{
+    TCP_Socket tcp_socket;
+    if (tcp_socket.listen(std::to_string(ESOCA_PORT)) != 0)
+    {
+        Logger::log("esoca cannot listen for GET_CHANGES; distribution "
+                "servers will not be able to catch up.", LogLevel::Error);
+        return;
+    }
+
+    WorkerPool servers{ESOCA_SERVE_THREADS, ESOCA_SERVE_QUEUE};
+    while (true)
+    {
+        // A std::function must be copyable, so the stream is shared.
+        auto stream = std::make_shared<TCP_Stream>(tcp_socket.accept());
+        if (!servers.submit([this, stream]()
+                {
+                    serve_change_request(*stream);
+                }))
+            serve_change_request(*stream);
+    }
+}
+
+/*
+ * One request per connection. The replies hold every row, private keys
+ * included, so only the hosts in locations_config are answered.
+ */
+void CADaemon::serve_change_request(TCP_Stream &tcp_stream) const
+{
+    if (!from_distribution_server(tcp_stream))
+    {
+        Logger::log("esoca refused a TCP connection from "
+                + tcp_stream.peer_address() + ", which is not a "
+                "distribution server.", LogLevel::Warning);
+        return;
+    }
+    tcp_stream.set_timeout(ESOCA_SERVE_TIMEOUT_MS);
+
+    TraceContext parent;
+    uchar_vec recv_msg = recv_request(tcp_stream, parent);
+    Span request_span{"esoca.request", parent};
+
+    if (recv_msg == GET_CHANGES)
+    {
+        request_span.tag("op", "get_changes");
+        std::string seq = to_string(tcp_stream.recv());
+        try
+        {
+            send_changes(tcp_stream, std::stoull(seq));
+        }
+        catch (const std::exception &e)
+        {
+            Logger::log("esoca invalid GET_CHANGES: " + seq);
+            tcp_stream.send(INVALID_REQUEST);
+        }
+    }
+    else if (recv_msg == SYNC_TREE)
+    {
+        request_span.tag("op", "sync_tree");
+        std::string seq = to_string(tcp_stream.recv());
+        try
+        {
+            sync_tree(tcp_stream, std::stoull(seq));
+        }
+        catch (const std::exception &e)
+        {
+            Logger::log("esoca invalid SYNC_TREE: " + seq);
+            tcp_stream.send(INVALID_REQUEST);
+        }
+    }
+    else if (recv_msg == PING)
+    {
+        tcp_stream.send(PING);
+    }
+    else
+    {
+        std::string log_msg{"esoca invalid TCP request: "};
+        log_msg += std::string{recv_msg.begin(), recv_msg.end()};
+        Logger::log(log_msg);
+    }
+}
+
+/*
+ * The config is read for each connection, so that a server added to it is
+ * answered without a restart.
+ */
+bool CADaemon::from_distribution_server(const TCP_Stream &stream) const
+{
+    std::string peer = stream.peer_address();
+    if (peer.empty())
+        return false;
+
+    std::ifstream input{LOCATIONS_CONFIG_PATH};
+    for (std::string line; getline(input, line); )
+    {
+        auto values = split_string(line, LOC_DELIMITER);
+        if (values.empty())
+            continue;
+
+        for (const std::string &address : resolve_addresses(values[0]))
+            if (address == peer)
+                return true;
+    }
+    return false;
+}
+
+/*
+ * Sends the reply to GET_CHANGES; see message_config.h.
+ *
+ * If the log no longer has the changes after seq, every row is sent
+ * instead, stamped with the last sequence number, which is read before the
+ * rows are, and marked as full so that the server drops the rows it holds
+ * that are not among them. A change made while they are read may be sent
+ * both as a row and again in the next reply, which is harmless, as changes
+ * are applied the same way twice.
+ */
+void CADaemon::send_changes(TCP_Stream &stream, uint64_t seq) const
+{
+    ChangeLog &log = ChangeLog::instance();
+    uint64_t last = log.last_seq();
+
+    std::vector<LoggedChange> changes;
+    if (log.read_since(seq, ESOCA_CHANGES_PER_REPLY, changes))
+    {
+        uint64_t through = changes.empty() ? seq : changes.back().stamp.seq;
+        stream.send(std::to_string(changes.size()) + MSG_DELIMITER
+                + std::to_string(through) + MSG_DELIMITER
+                + std::to_string(last) + MSG_DELIMITER + "0");
+
+        for (LoggedChange &change : changes)
+        {
+            change.stamp.sent_us = wall_now_us();
+            stream.send(change.msg_type);
+            stream.send(change.msg);
+            stream.send(change.stamp.serialize());
+        }
+        ESO_LOG(LogLevel::Debug, "esoca sent ", changes.size(),
+                " changes after ", seq);
+        return;
+    }
+
+    Logger::log("A distribution server at change " + std::to_string(seq)
+            + " is too far behind the change log; sending every row.",
+            LogLevel::Warning);
+
+    Storage &conn = storage();
+    std::vector<Permission> perms;
+    std::vector<Credential> creds;
+    if (conn.scan_permissions(perms) != OK
+            || conn.scan_credentials(creds) != OK)
+    {
+        stream.send(INVALID_REQUEST);
+        return;
+    }
+
+    PropagationStamp stamp;
+    stamp.seq = last;
+    stamp.origin_us = stamp.sent_us = wall_now_us();
+    std::string serialized_stamp = stamp.serialize();
+
+    stream.send(std::to_string(perms.size() + creds.size()) + MSG_DELIMITER
+            + std::to_string(last) + MSG_DELIMITER + std::to_string(last)
+            + MSG_DELIMITER + "1");
+    for (const Permission &perm : perms)
+    {
+        stream.send(UPDATE_PERM);
+        stream.send(perm.serialize());
+        stream.send(serialized_stamp);
+    }
+    for (const Credential &cred : creds)
+    {
+        stream.send(NEW_CRED);
+        stream.send(cred.serialize());
+        stream.send(serialized_stamp);
+    }
+}
+
+/*
+ * Answers SYNC_TREE; see message_config.h. The distribution server must
+ * have applied every logged change, so that the two trees are of the same
+ * changes and any difference is one that propagation lost.
+ *
+ * The tree is built from a scan of every row, and kept until the next
+ * change, so the servers of a quiet system share one scan. Requests that
+ * need a new one wait for the first to build it.
+ */
+void CADaemon::sync_tree(TCP_Stream &stream, uint64_t seq) const
+{
+    // The latest tree. A request walks the one it started with, so a newer
+    // tree can replace it meanwhile.
+    static std::mutex tree_mutex;
+    static std::shared_ptr<const HashTree> latest;
+    static uint64_t tree_seq = 0;
+
+    ChangeLog &log = ChangeLog::instance();
+    uint64_t last = log.last_seq();
+    if (seq != last)
+    {
+        ESO_LOG(LogLevel::Debug, "esoca: SYNC_TREE at ", seq, " but at ",
+                last);
+        stream.send(INVALID_REQUEST);
+        return;
+    }
+
+    std::unique_lock<std::mutex> tree_lock{tree_mutex};
+    if (!latest || tree_seq != last)
+    {
+        Storage &conn = storage();
+        std::vector<Permission> perms;
+        std::vector<Credential> creds;
+        // A change logged during the scan may or may not be in it.
+        if (conn.scan_permissions(perms) != OK
+                || conn.scan_credentials(creds) != OK
+                || log.last_seq() != last)
+        {
+            stream.send(INVALID_REQUEST);
+            return;
+        }
+        latest = std::make_shared<const HashTree>(std::move(perms),
+                std::move(creds));
+        tree_seq = last;
+    }
+    std::shared_ptr<const HashTree> tree = latest;
+    tree_lock.unlock();
+
+    std::string reply;
+    put_hash(reply, tree->node(0, 0));
+    stream.send(reply);
+
+    std::vector<size_t> nodes;
+    while (true)
+    {
+        std::vector<std::string> request = split_string(stream.recv(),
+                MSG_DELIMITER);
+        if (request.size() != 2 || request[1].empty())
+            return;
+
+        unsigned int level = std::stoul(request[0]);
+        std::vector<std::string> indices = split_string(request[1], ',');
+        // A level has HASH_TREE_FANOUT^level nodes, and esod names each at
+        // most once, in order.
+        size_t width = 1;
+        for (unsigned int i = 0; i < level && i < HASH_TREE_DEPTH; i++)
+            width *= HASH_TREE_FANOUT;
+        if (level > HASH_TREE_DEPTH || indices.size() > width)
+        {
+            Logger::log("esoca: SYNC_TREE asked for too many nodes.",
+                    LogLevel::Warning);
+            stream.send(INVALID_REQUEST);
+            return;
+        }
+        nodes.clear();
+        for (const std::string &index : indices)
+        {
+            size_t node = std::stoull(index);
+            if (node >= width || (!nodes.empty() && node <= nodes.back()))
+            {
+                Logger::log("esoca: SYNC_TREE asked for a bad node.",
+                        LogLevel::Warning);
+                stream.send(INVALID_REQUEST);
+                return;
+            }
+            nodes.push_back(node);
+        }
+        if (level == HASH_TREE_DEPTH)
+            break;
+
+        reply.clear();
+        for (size_t node : nodes)
+        {
+            size_t first = node * HASH_TREE_FANOUT;
+            for (size_t i = first; i < first + HASH_TREE_FANOUT; i++)
+                put_hash(reply, tree->node(level + 1, i));
+        }
+        stream.send(reply);
+    }
+
+    // The leaves that differ: send their rows.
+    std::vector<const Permission *> perms;
+    std::vector<const Credential *> creds;
+    for (size_t leaf : nodes)
+    {
+        for (const Permission *perm : tree->permissions(leaf))
+            perms.push_back(perm);
+        for (const Credential *cred : tree->credentials(leaf))
+            creds.push_back(cred);
+    }
+
+    stream.send(std::to_string(perms.size() + creds.size()));
+    for (const Permission *perm : perms)
+    {
+        stream.send(UPDATE_PERM);
+        stream.send(perm->serialize());
+    }
+    for (const Credential *cred : creds)
+    {
+        stream.send(NEW_CRED);
+        stream.send(cred->serialize());
+    }
+}
+
 #endif
@@ -0,0 +1,417 @@
+#ifndef ESO_CENTRAL_ESOCA_CHANGE_LOG
+#define ESO_CENTRAL_ESOCA_CHANGE_LOG
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "../config/esoca_config.h"
+#include "../../database/db_error.h"
+#include "../../database/file_storage.h"
+#include "../../global_config/types.h"
+#include "../../logger/logger.h"
+#include "../../stats/propagation.h"
+#include "../../stats/report.h"
+#include "../../util/crc32.h"
+
+/*
+ * A change as esoca propagated it.
+ */
+struct LoggedChange
+{
+    PropagationStamp stamp;
+    // The message type (ex: UPDATE_PERM) and the message.
+    uchar_vec msg_type;
+    std::string msg;
+};
+
+/*
+ * Every change esoca has propagated, in sequence number order, so that an
+ * esod that missed some can ask for the changes after the last one it
+ * applied (GET_CHANGES) instead of being sent everything again.
+ *
+ * A change is appended and synced before it is sent to any esod. The log is
+ * kept in two files:
+ *
+ *   <path>.log  the newest changes.
+ *   <path>.old  the changes before those.
+ *
+ * When <path>.log reaches the segment size it is renamed over <path>.old and
+ * a new one is started, so between one and two segments of history are
+ * kept. An esod that has been away longer than that has to be sent every
+ * row instead.
+ *
+ * Both files are a magic string followed by records in the framing of
+ * database/file_storage.h:
+ *
+ *   u32 size | u32 crc32 | u64 seq | u64 origin_us | type | message
+ *
+ * A torn record at the end of <path>.log is cut off when the log is opened.
+ * Each file's sequence numbers and offsets are indexed in memory, so a
+ * catch-up reads only the changes it returns.
+ */
+class ChangeLog
+{
+public:
+    // The log at ESOCA_CHANGE_LOG_PATH.
+    static ChangeLog &instance();
+
+    // Opens the log kept in path.log and path.old, creating it if needed.
+    // If it cannot be opened, appends fail but esoca runs on.
+    ChangeLog(const std::string &path, uint64_t segment_bytes);
+    ~ChangeLog();
+
+    // Appends a change and syncs it. The stamp's sequence number must be
+    // greater than last_seq(). Returns 0 on success, else an error code
+    // from db_error.h.
+    int append(const PropagationStamp &stamp, const uchar_vec &msg_type,
+            const std::string &msg);
+
+    // The sequence number of the newest change, or 0 if there is none.
+    uint64_t last_seq() const;
+
+    // Sets changes to at most max of the changes after seq, oldest first.
+    // Returns false if the log no longer holds all of them, or if seq is
+    // newer than any it holds.
+    bool read_since(uint64_t seq, size_t max,
+            std::vector<LoggedChange> &changes) const;
+
+    // Appends the log's size and catch-up counters to a stats report.
+    void append_to(std::string &report) const;
+private:
+    ChangeLog(const ChangeLog &) = delete;
+    ChangeLog &operator=(const ChangeLog &) = delete;
+
+    // One of the two files.
+    struct Segment
+    {
+        std::string path;
+        int fd;
+        uint64_t size;
+        // (seq, offset) of every record, in order.
+        std::vector<std::pair<uint64_t, uint64_t>> index;
+    };
+
+    // Opens and indexes a segment. Only the newest is writable; a torn tail
+    // is cut off it, and it is started if it is empty.
+    void open_segment(Segment &segment, bool writable);
+    // Renames the full segment over the old one and starts a new one.
+    void rotate();
+    // Reads the record at offset in segment.
+    static bool read(const Segment &segment, uint64_t offset,
+            LoggedChange &change);
+    // Decodes the record at p, before end, and moves p past it. Returns
+    // false, leaving p, if the record is torn or damaged.
+    static bool decode(const char *&p, const char *end, LoggedChange &change);
+
+    uint64_t _segment_bytes;
+
+    mutable std::mutex _mutex;
+    Segment _old;
+    Segment _current;
+    uint64_t _last_seq;
+
+    // GET_CHANGES answered from the log, the changes returned, and those
+    // the log could not answer.
+    mutable uint64_t _reads;
+    mutable uint64_t _changes_read;
+    mutable uint64_t _misses;
+};
+
+const char CHANGE_LOG_MAGIC[] = "ESOCHG1\n";
+const size_t CHANGE_LOG_MAGIC_SIZE = sizeof CHANGE_LOG_MAGIC - 1;
+
+ChangeLog &ChangeLog::instance()
+{
+    static ChangeLog *log = new ChangeLog{ESOCA_CHANGE_LOG_PATH,
+        ESOCA_CHANGE_LOG_SEGMENT_BYTES};
+    return *log;
+}
+
+ChangeLog::ChangeLog(const std::string &path, uint64_t segment_bytes)
+    : _segment_bytes{segment_bytes}, _old{path + ".old", -1, 0, {}},
+    _current{path + ".log", -1, 0, {}}, _last_seq{0}, _reads{0},
+    _changes_read{0}, _misses{0}
+{
+    open_segment(_old, false);
+    open_segment(_current, true);
+
+    if (!_current.index.empty())
+        _last_seq = _current.index.back().first;
+    else if (!_old.index.empty())
+        _last_seq = _old.index.back().first;
+
+    ESO_LOG(LogLevel::Info, "ChangeLog: opened ", path, " at seq ", _last_seq,
+            ".");
+}
+
+ChangeLog::~ChangeLog()
+{
+    if (_old.fd >= 0)
+        close(_old.fd);
+    if (_current.fd >= 0)
+        close(_current.fd);
+}
+
+bool ChangeLog::decode(const char *&p, const char *end, LoggedChange &change)
+{
+    if ((size_t) (end - p) < FILE_STORAGE_RECORD_HEADER)
+        return false;
+
+    uint32_t size, crc;
+    memcpy(&size, p, sizeof size);
+    memcpy(&crc, p + sizeof size, sizeof crc);
+    const char *payload = p + FILE_STORAGE_RECORD_HEADER;
+    if (size == 0 || (size_t) (end - payload) < size
+            || crc32(payload, size) != crc)
+        return false;
+
+    FieldReader in{payload, payload + size, true};
+    change.stamp.seq = in.u64();
+    change.stamp.origin_us = in.u64();
+    std::string msg_type = in.string();
+    change.msg = in.string();
+    if (!in.ok || in.p != in.end)
+        return false;
+    change.msg_type.assign(msg_type.begin(), msg_type.end());
+
+    p = payload + size;
+    return true;
+}
+
+void ChangeLog::open_segment(Segment &segment, bool writable)
+{
+    int flags = writable ? O_RDWR | O_CREAT | O_APPEND : O_RDONLY;
+    segment.fd = open(segment.path.c_str(), flags, 0600);
+    if (segment.fd < 0)
+    {
+        if (writable || errno != ENOENT)
+            Logger::log("ChangeLog: cannot open " + segment.path + ": "
+                    + strerror(errno), LogLevel::Error);
+        return;
+    }
+
+    struct stat st;
+    if (fstat(segment.fd, &st) != 0)
+        st.st_size = 0;
+    size_t size = st.st_size;
+
+    size_t good = 0;
+    if (size >= CHANGE_LOG_MAGIC_SIZE)
+    {
+        void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, segment.fd,
+                0);
+        if (data != MAP_FAILED)
+        {
+            const char *bytes = static_cast<const char *>(data);
+            if (memcmp(bytes, CHANGE_LOG_MAGIC, CHANGE_LOG_MAGIC_SIZE) == 0)
+            {
+                const char *p = bytes + CHANGE_LOG_MAGIC_SIZE;
+                const char *end = bytes + size;
+                const char *record = p;
+                LoggedChange change;
+                while (p < end && decode(p, end, change))
+                {
+                    // Appends only ever go forward, so an out of order
+                    // record means the rest is not to be trusted.
+                    if (!segment.index.empty()
+                            && change.stamp.seq <= segment.index.back().first)
+                        break;
+                    segment.index.emplace_back(change.stamp.seq,
+                            record - bytes);
+                    record = p;
+                }
+                good = record - bytes;
+            }
+            else
+            {
+                Logger::log(segment.path + " is not a change log.",
+                        LogLevel::Error);
+            }
+            munmap(data, size);
+        }
+    }
+
+    segment.size = good;
+    if (!writable || (good > 0 && good == size))
+        return;
+
+    // Cut off the torn tail, or start a new log.
+    if (good > 0)
+        Logger::log(segment.path + " has a torn tail; cutting it off.",
+                LogLevel::Warning);
+    if (good == 0)
+    {
+        if (ftruncate(segment.fd, 0) != 0
+                || !write_all(segment.fd, CHANGE_LOG_MAGIC,
+                    CHANGE_LOG_MAGIC_SIZE))
+        {
+            Logger::log("ChangeLog: cannot write " + segment.path,
+                    LogLevel::Error);
+            close(segment.fd);
+            segment.fd = -1;
+            return;
+        }
+        good = CHANGE_LOG_MAGIC_SIZE;
+    }
+    else if (ftruncate(segment.fd, good) != 0)
+    {
+        Logger::log("ChangeLog: cannot truncate " + segment.path,
+                LogLevel::Error);
+    }
+    fsync(segment.fd);
+    segment.size = good;
+}
+
+int ChangeLog::append(const PropagationStamp &stamp,
+        const uchar_vec &msg_type, const std::string &msg)
+{
+    std::string payload;
+    put_u64(payload, stamp.seq);
+    put_u64(payload, stamp.origin_us);
+    put_string(payload, std::string{msg_type.begin(), msg_type.end()});
+    put_string(payload, msg);
+
+    std::string data;
+    put_u32(data, payload.size());
+    put_u32(data, crc32(payload.data(), payload.size()));
+    data += payload;
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (stamp.seq <= _last_seq)
+        return INVALID_PARAMS;
+    if (_current.fd < 0)
+        return CANNOT_CONNECT;
+
+    if (!write_all(_current.fd, data.data(), data.size())
+            || fdatasync(_current.fd) != 0)
+    {
+        Logger::log("ChangeLog: cannot append to " + _current.path + ": "
+                + strerror(errno), LogLevel::Error);
+        // Drop whatever part of the record was written.
+        if (ftruncate(_current.fd, _current.size) != 0)
+            Logger::log("ChangeLog: cannot truncate " + _current.path,
+                    LogLevel::Error);
+        return CANNOT_QUERY;
+    }
+
+    _current.index.emplace_back(stamp.seq, _current.size);
+    _current.size += data.size();
+    _last_seq = stamp.seq;
+
+    if (_current.size >= _segment_bytes)
+        rotate();
+    return OK;
+}
+
+void ChangeLog::rotate()
+{
+    if (rename(_current.path.c_str(), _old.path.c_str()) != 0)
+    {
+        Logger::log("ChangeLog: cannot rename " + _current.path + ": "
+                + strerror(errno), LogLevel::Error);
+        return;
+    }
+
+    // The open descriptor follows the file to its new name.
+    if (_old.fd >= 0)
+        close(_old.fd);
+    _old.fd = _current.fd;
+    _old.size = _current.size;
+    _old.index.swap(_current.index);
+
+    _current.fd = -1;
+    _current.size = 0;
+    _current.index.clear();
+    open_segment(_current, true);
+    sync_parent_dir(_current.path);
+}
+
+uint64_t ChangeLog::last_seq() const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _last_seq;
+}
+
+bool ChangeLog::read(const Segment &segment, uint64_t offset,
+        LoggedChange &change)
+{
+    char header[FILE_STORAGE_RECORD_HEADER];
+    if (pread(segment.fd, header, sizeof header, offset)
+            != (ssize_t) sizeof header)
+        return false;
+
+    uint32_t size;
+    memcpy(&size, header, sizeof size);
+    std::string record(sizeof header + size, '\0');
+    if (pread(segment.fd, &record[0], record.size(), offset)
+            != (ssize_t) record.size())
+        return false;
+
+    const char *p = record.data();
+    return decode(p, p + record.size(), change);
+}
+
+bool ChangeLog::read_since(uint64_t seq, size_t max,
+        std::vector<LoggedChange> &changes) const
+{
+    changes.clear();
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    const Segment *oldest = _old.index.empty() ? &_current : &_old;
+    // Changes before the oldest one kept are gone, and a seq past the
+    // newest means esod applied changes from a log that has been lost.
+    if (seq > _last_seq || (!oldest->index.empty()
+                && seq + 1 < oldest->index.front().first))
+    {
+        _misses++;
+        return false;
+    }
+
+    std::pair<uint64_t, uint64_t> after{seq, UINT64_MAX};
+    for (const Segment *segment : {&_old, &_current})
+    {
+        auto it = std::upper_bound(segment->index.begin(),
+                segment->index.end(), after);
+        for (; it != segment->index.end() && changes.size() < max; ++it)
+        {
+            LoggedChange change;
+            if (!read(*segment, it->second, change))
+            {
+                Logger::log("ChangeLog: cannot read " + segment->path,
+                        LogLevel::Error);
+                _misses++;
+                return false;
+            }
+            changes.push_back(std::move(change));
+        }
+    }
+
+    _reads++;
+    _changes_read += changes.size();
+    return true;
+}
+
+void ChangeLog::append_to(std::string &report) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    const Segment &oldest = _old.index.empty() ? _current : _old;
+    append_counter(report, "change_log_last_seq", _last_seq);
+    append_counter(report, "change_log_first_seq",
+            oldest.index.empty() ? 0 : oldest.index.front().first);
+    append_counter(report, "change_log_bytes", _old.size + _current.size);
+    append_counter(report, "change_log_reads", _reads);
+    append_counter(report, "change_log_changes_read", _changes_read);
+    append_counter(report, "change_log_misses", _misses);
+}
+
+#endif
@@ -0,0 +1,345 @@
+#ifndef ESO_CENTRAL_ESOCA_PROPAGATION_QUEUE
+#define ESO_CENTRAL_ESOCA_PROPAGATION_QUEUE
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "change_log.h"
+#include "../config/esoca_config.h"
+#include "../../database/credential.h"
+#include "../../database/permission.h"
+#include "../../database/storage.h"
+#include "../../daemon/propagation.h"
+#include "../../global_config/global_config.h"
+#include "../../global_config/message_config.h"
+#include "../../logger/logger.h"
+#include "../../socket/exception.h"
+#include "../../socket/tcp_socket.h"
+#include "../../socket/tcp_stream.h"
+#include "../../stats/histogram.h"
+#include "../../stats/propagation.h"
+#include "../../stats/report.h"
+#include "../../stats/trace.h"
+#include "../../util/parser.h"
+
+/*
+ * Sends esoca's changes on to the distribution servers.
+ *
+ * Each server has its own queue of the changes it has not been sent, which
+ * holds only the newest change to each row: a change to a row that is still
+ * queued replaces it. A thread for each server waits
+ * ESOCA_PROPAGATE_DEBOUNCE_MS after a change is queued for more to arrive,
+ * so that a burst of edits goes out together, and then sends up to
+ * ESOCA_PROPAGATE_BATCH_MAX of them, in sequence number order, as one batch
+ * on a connection it keeps open (see CHANGE_STREAM in message_config.h).
+ * The server acknowledges each batch.
+ *
+ * A batch covers every sequence number from the one after the previous batch
+ * to its last, including the changes that were replaced, so the server can
+ * tell a replaced change from a lost one. A server that finds a gap fetches
+ * the missing changes from the change log.
+ *
+ * If a batch cannot be sent, its changes go back in the queue, unless newer
+ * ones to the same rows have arrived meanwhile, and the thread waits before
+ * connecting again. The wait starts at ESOCA_PROPAGATE_RETRY_MIN_MS and
+ * doubles with each failure, up to ESOCA_PROPAGATE_RETRY_MAX_MS, so an
+ * unreachable server neither holds up the others nor is hammered with
+ * connection attempts.
+ */
+class PropagationQueue
+{
+public:
+    static PropagationQueue &instance();
+
+    // Queues a logged change for every distribution server. key identifies
+    // the row it changes.
+    void push(const std::string &key, const LoggedChange &change);
+
+    // Appends each server's counters to a stats report.
+    void append_to(std::string &report);
+private:
+    PropagationQueue() {}
+
+    // A change waiting to be sent.
+    struct Queued
+    {
+        std::string key;
+        LoggedChange change;
+    };
+
+    // A distribution server and the changes it has not been sent.
+    struct Destination
+    {
+        std::string host;
+        std::string port;
+        std::string name;
+
+        std::mutex mutex;
+        // Signalled when a change is queued.
+        std::condition_variable queued_cv;
+        // By sequence number.
+        std::map<uint64_t, Queued> pending;
+        // The sequence number of each key's change in pending.
+        std::unordered_map<std::string, uint64_t> keys;
+        // The newest change queued, and the last one the server has
+        // acknowledged.
+        uint64_t queued_through;
+        uint64_t sent_through;
+
+        // Guarded by mutex, for the stats report.
+        uint64_t batches;
+        uint64_t changes_sent;
+        uint64_t superseded;
+        uint64_t failures;
+        uint64_t connects;
+        uint64_t backoff_ms;
+    };
+
+    // Sends dest's changes for the life of the daemon.
+    void send_loop(Destination &dest);
+    // Sends one batch and waits for the acknowledgement. Connects first if
+    // stream is not open. Returns false, closing stream, on failure.
+    bool send_batch(Destination &dest, std::unique_ptr<TCP_Stream> &stream,
+            uint64_t first, uint64_t through,
+            const std::vector<Queued> &batch);
+    // Puts a failed batch back, except for rows with newer changes queued.
+    // dest.mutex is held.
+    void requeue(Destination &dest, std::vector<Queued> &batch);
+
+    std::mutex _mutex;
+    // By name. Destinations are never removed, as their threads use them.
+    std::map<std::string, std::unique_ptr<Destination>> _dests;
+};
+
+/*
+ * Returns the row a change is to, as a key for PropagationQueue::push().
+ */
+std::string change_key(const uchar_vec &msg_type, const std::string &msg)
+{
+    if (msg_type == NEW_CRED)
+        return "C" + credential_key(Credential{msg});
+    return "P" + permission_key(Permission{msg});
+}
+
+PropagationQueue &PropagationQueue::instance()
+{
+    static PropagationQueue *queue = new PropagationQueue;
+    return *queue;
+}
+
+void PropagationQueue::push(const std::string &key,
+        const LoggedChange &change)
+{
+    // Read conifg file for distribution locations.
+    std::vector<Destination *> dests;
+    std::ifstream input{LOCATIONS_CONFIG_PATH};
+    for (std::string line; getline(input, line); )
+    {
+        auto values = split_string(line, LOC_DELIMITER);
+        if (values.size() < 2)
+            continue;
+
+        std::string name = destination_name(values[0], values[1]);
+        std::lock_guard<std::mutex> lock{_mutex};
+        std::unique_ptr<Destination> &dest = _dests[name];
+        if (!dest)
+        {
+            dest.reset(new Destination);
+            dest->host = values[0];
+            dest->port = values[1];
+            dest->name = name;
+            // Earlier changes, from before esoca started, are fetched from
+            // the change log if the server missed them.
+            dest->queued_through = dest->sent_through = change.stamp.seq - 1;
+            dest->batches = dest->changes_sent = dest->superseded = 0;
+            dest->failures = dest->connects = 0;
+            dest->backoff_ms = 0;
+            std::thread{&PropagationQueue::send_loop, this,
+                std::ref(*dest)}.detach();
+        }
+        dests.push_back(dest.get());
+    }
+
+    for (Destination *dest : dests)
+    {
+        // Every distribution server is in the backlog until it is sent to.
+        DestinationStats::instance().queued(dest->name);
+
+        std::lock_guard<std::mutex> lock{dest->mutex};
+        auto found = dest->keys.find(key);
+        if (found != dest->keys.end())
+        {
+            // The newer change makes the queued one pointless.
+            dest->pending.erase(found->second);
+            dest->superseded++;
+            DestinationStats::instance().done(dest->name, true);
+        }
+        dest->keys[key] = change.stamp.seq;
+        dest->pending[change.stamp.seq] = Queued{key, change};
+        dest->queued_through = std::max(dest->queued_through,
+                change.stamp.seq);
+        dest->queued_cv.notify_one();
+    }
+}
+
+void PropagationQueue::send_loop(Destination &dest)
+{
+    std::unique_ptr<TCP_Stream> stream;
+    std::vector<Queued> batch;
+
+    std::unique_lock<std::mutex> lock{dest.mutex};
+    while (true)
+    {
+        dest.queued_cv.wait(lock, [&] { return !dest.pending.empty(); });
+
+        auto deadline = std::chrono::steady_clock::now()
+            + std::chrono::milliseconds(ESOCA_PROPAGATE_DEBOUNCE_MS);
+        dest.queued_cv.wait_until(lock, deadline, [&]
+        {
+            return dest.pending.size() >= ESOCA_PROPAGATE_BATCH_MAX;
+        });
+
+        batch.clear();
+        while (!dest.pending.empty()
+                && batch.size() < ESOCA_PROPAGATE_BATCH_MAX)
+        {
+            auto first = dest.pending.begin();
+            dest.keys.erase(first->second.key);
+            batch.push_back(std::move(first->second));
+            dest.pending.erase(first);
+        }
+        uint64_t first = dest.sent_through + 1;
+        uint64_t through = dest.pending.empty() ? dest.queued_through
+            : batch.back().change.stamp.seq;
+        lock.unlock();
+
+        bool sent = send_batch(dest, stream, first, through, batch);
+        for (size_t i = 0; i < batch.size(); i++)
+            DestinationStats::instance().done(dest.name, sent);
+
+        lock.lock();
+        if (sent)
+        {
+            dest.sent_through = through;
+            dest.batches++;
+            dest.changes_sent += batch.size();
+            dest.backoff_ms = 0;
+            continue;
+        }
+
+        dest.failures++;
+        requeue(dest, batch);
+        dest.backoff_ms = dest.backoff_ms == 0 ? ESOCA_PROPAGATE_RETRY_MIN_MS
+            : std::min(dest.backoff_ms * 2, ESOCA_PROPAGATE_RETRY_MAX_MS);
+        uint64_t backoff_ms = dest.backoff_ms;
+        lock.unlock();
+        std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
+        lock.lock();
+    }
+}
+
+void PropagationQueue::requeue(Destination &dest, std::vector<Queued> &batch)
+{
+    for (Queued &queued : batch)
+    {
+        if (dest.keys.count(queued.key))
+        {
+            dest.superseded++;
+            continue;
+        }
+        DestinationStats::instance().queued(dest.name);
+        uint64_t seq = queued.change.stamp.seq;
+        dest.keys[queued.key] = seq;
+        dest.pending[seq] = std::move(queued);
+    }
+}
+
+bool PropagationQueue::send_batch(Destination &dest,
+        std::unique_ptr<TCP_Stream> &stream, uint64_t first, uint64_t through,
+        const std::vector<Queued> &batch)
+{
+    uint64_t start = stats_now_ns();
+    Span span{"esoca.propagate"};
+    span.tag("dest", dest.name);
+    span.tag("changes", std::to_string(batch.size()));
+
+    try
+    {
+        if (!stream)
+        {
+            TCP_Socket tcp_socket;
+            stream.reset(new TCP_Stream{tcp_socket.connect(dest.host,
+                        dest.port)});
+            stream->set_timeout(ESOCA_PROPAGATE_TIMEOUT_MS);
+            stream->send(CHANGE_STREAM);
+
+            std::lock_guard<std::mutex> lock{dest.mutex};
+            dest.connects++;
+        }
+    }
+    catch (const connect_exception &e)
+    {
+        Logger::log("Could not connect to " + dest.name + " to propagate "
+                "changes.", LogLevel::Error);
+        return false;
+    }
+
+    stream->send(std::to_string(first) + MSG_DELIMITER
+            + std::to_string(through) + MSG_DELIMITER
+            + std::to_string(batch.size()));
+    for (const Queued &queued : batch)
+    {
+        PropagationStamp stamp = queued.change.stamp;
+        stamp.sent_us = wall_now_us();
+        stream->send(queued.change.msg_type);
+        stream->send(queued.change.msg);
+        stream->send(stamp.serialize());
+    }
+
+    // The server acknowledges with the last change it has applied.
+    uchar_vec ack = stream->recv();
+    propagation_record(PROP_FORWARD, start);
+    if (stream->failed() || ack.empty())
+    {
+        Logger::log("Lost the connection to " + dest.name + " while "
+                "propagating changes.", LogLevel::Error);
+        stream.reset();
+        return false;
+    }
+
+    ESO_LOG(LogLevel::Debug, "esoca sent ", batch.size(), " changes to ",
+            dest.name, " through ", through, "; it is at ", ack);
+    return true;
+}
+
+void PropagationQueue::append_to(std::string &report)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    for (auto &entry : _dests)
+    {
+        Destination &dest = *entry.second;
+        std::lock_guard<std::mutex> dest_lock{dest.mutex};
+        std::string prefix = "propagate_" + dest.name + "_";
+        append_counter(report, prefix + "batches", dest.batches);
+        append_counter(report, prefix + "changes_sent", dest.changes_sent);
+        append_counter(report, prefix + "superseded", dest.superseded);
+        append_counter(report, prefix + "failures", dest.failures);
+        append_counter(report, prefix + "connects", dest.connects);
+        append_counter(report, prefix + "pending", dest.pending.size());
+        append_counter(report, prefix + "backoff_ms", dest.backoff_ms);
+    }
+}
+
+#endif
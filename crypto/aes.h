@@ -6,137 +6,304 @@
 #include <openssl/rand.h>
 
 #include "memory.h"
+#include "secure_arena.h"
 #include "../global_config/types.h"
+#include "../util/probes.h"
 
 /*
  * Uses the method from NIST.SP.800-133 where the key = U ^ V. In this case, 
  * U is buf and V = 0; A different V can be supplied later as long as it is
  * independent of U.
  *
- * Returns a empty uchar_vec if not successful.
+ * The key is generated into memory from the SecureArena.
+ * Returns false if not successful.
  */
-uchar_vec get_new_AES_key(int size)
+bool get_new_AES_key(int size, secure_vec &key)
 {
     // Input is in bits! We need to convert to bytes, and then to the amount of
     // bytes we will need to allocate.
     // Previously: size / 8
     int len = size / (8*sizeof(char));
 
-    // Convert size from bits to bytes when allocating memory.
-    unsigned char *buf = (unsigned char*) malloc(len);
-    if(!buf)
-        return uchar_vec{};
+    key.assign(len, 0);
 
     // RAND_bytes puts num cryptographically strong pseudo-random bytes into
     // buf.
     // int RAND_bytes(unsigned char *buf, int num);
-    if(!RAND_bytes(buf, len))
+    if(!RAND_bytes(&key[0], len))
+    {
+        key.clear();
+        return false;
+    }
+
+    // key has now been initialized. 
+    return true;
+}
+
+/*
+ * As above, but the key is returned in ordinary memory for callers that encode
+ * it straight away.
+ *
+ * Returns a empty uchar_vec if not successful.
+ */
+uchar_vec get_new_AES_key(int size)
+{
+    secure_vec buf;
+    if (!get_new_AES_key(size, buf))
         return uchar_vec{};
 
-    uchar_vec key{&buf[0], &buf[0]+len};
+    return uchar_vec{buf.begin(), buf.end()};
+}
 
-    free((void*)secure_memset(buf, 0, len));
+/*
+ * Returns the largest ciphertext aes_encrypt can produce for len bytes of
+ * plaintext. PKCS#7 padding always adds between 1 and AES_BLOCK_SIZE bytes.
+ */
+size_t aes_encrypt_size(size_t len)
+{
+    return (len / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE;
+}
 
-    // buf has now been initialized. 
-    return key;
+/*
+ * Returns the output buffer aes_decrypt needs for len bytes of ciphertext.
+ * EVP_DecryptUpdate may write up to a block more than it is given.
+ */
+size_t aes_decrypt_size(size_t len)
+{
+    return len + AES_BLOCK_SIZE;
 }
 
 /*
- * This will encrypt *len bytes of data using AES-CBC mode.
- * 
+ * This will encrypt plaintext using AES-CBC mode into the caller's buffer,
+ * without allocating.
+ *
  * @param size The size of the key in bits.
+ * @param out Must hold at least aes_encrypt_size(plaintext.size()) bytes.
+ *
+ * @return The length of the ciphertext, or -1 if something went wrong.
  */
-uchar_vec aes_encrypt(unsigned char *key, uchar_vec plaintext, int size)
+int aes_encrypt(const unsigned char *key, const_uchar_span plaintext, int size,
+        uchar_span out)
 {
-    // Used to keep track of the length of the ciphertext.
-    int l = plaintext.size();
-    int *len = &l;
+    ESO_PROBE_SCOPE(aes_encrypt, plaintext.size());
 
-    EVP_CIPHER_CTX e;
+    if (out.size() < aes_encrypt_size(plaintext.size()))
+        return -1;
 
-    EVP_CIPHER_CTX_init(&e);
+    const EVP_CIPHER *cipher;
     switch (size)
     {
         case 128:
-            EVP_EncryptInit_ex(&e, EVP_aes_128_cbc(), NULL, key, NULL);
+            cipher = EVP_aes_128_cbc();
             break;
         case 256:
-            EVP_EncryptInit_ex(&e, EVP_aes_256_cbc(), NULL, key, NULL);
+            cipher = EVP_aes_256_cbc();
             break;
+        default:
+            return -1;
     }
 
-    // The max ciphertext length for n bytes of plaintext is 
-    // n + AES_BLOCK_SIZE - 1 bytes.
-    int c_len = *len + AES_BLOCK_SIZE, f_len = 0;
-    unsigned char *ciphertext = (unsigned char *) malloc(c_len);
-
-    // TODO Allows reusing of 'e' for multiple encryption cycles
-    // however... we are only using it for one...
-    EVP_EncryptInit_ex(&e, NULL, NULL, NULL, NULL);
-
-    // Update ciphertext, c_len is filled with the length of ciphertext 
-    // generated, *len is the size of plaintext in bytes.
-    EVP_EncryptUpdate(&e, ciphertext, &c_len, &plaintext[0], *len);
-
-    // update ciphertext with the final remaining bytes.
-    EVP_EncryptFinal_ex(&e, ciphertext+c_len, &f_len);
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx)
+        return -1;
 
-    *len = c_len + f_len;
+    // c_len is filled with the length of ciphertext generated by the update,
+    // f_len with the final remaining bytes.
+    int c_len = 0, f_len = 0;
+    bool ok = EVP_EncryptInit_ex(ctx, cipher, NULL, key, NULL)
+        && EVP_EncryptUpdate(ctx, out.data(), &c_len, plaintext.data(),
+                plaintext.size())
+        && EVP_EncryptFinal_ex(ctx, out.data() + c_len, &f_len);
 
-    EVP_CIPHER_CTX_cleanup(&e);
+    EVP_CIPHER_CTX_free(ctx);
 
-    // Construct the return value.
-    uchar_vec ret{&ciphertext[0], &ciphertext[0]+l};
-
-    // Free allocated memory.
-    free(ciphertext);
-
-    return ret;
+    return ok ? c_len + f_len : -1;
 }
 
 /*
- * This will decrypt *len bytes of ciphertext using AES-CBC mode.
+ * This will decrypt ciphertext using AES-CBC mode into the caller's buffer,
+ * without allocating.
  *
  * @param size The size of the key in bits.
+ * @param out Must hold at least aes_decrypt_size(ciphertext.size()) bytes.
+ *
+ * @return The length of the plaintext, or -1 if something went wrong.
  */
-uchar_vec aes_decrypt(unsigned char *key, uchar_vec ciphertext, int size)
+int aes_decrypt(const unsigned char *key, const_uchar_span ciphertext,
+        int size, uchar_span out)
 {
-    // Used to keep track of the length of the ciphertext.
-    int l = ciphertext.size();
-    int *len = &l;
+    ESO_PROBE_SCOPE(aes_decrypt, ciphertext.size());
 
-    EVP_CIPHER_CTX e;
+    if (out.size() < aes_decrypt_size(ciphertext.size()))
+        return -1;
 
-    EVP_CIPHER_CTX_init(&e);
+    const EVP_CIPHER *cipher;
     switch (size)
     {
         case 128:
-            EVP_DecryptInit_ex(&e, EVP_aes_128_cbc(), NULL, key, NULL);
+            cipher = EVP_aes_128_cbc();
             break;
         case 256:
-            EVP_DecryptInit_ex(&e, EVP_aes_256_cbc(), NULL, key, NULL);
+            cipher = EVP_aes_256_cbc();
             break;
+        default:
+            return -1;
     }
 
-    // Because we have padding ON, we must allocate an extra cipher block size of memory.
-    int p_len = *len, f_len = 0;
-    unsigned char *plaintext = (unsigned char *) malloc(p_len + AES_BLOCK_SIZE);
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx)
+        return -1;
 
-    // TODO Check these params.
-    EVP_DecryptInit_ex(&e, NULL, NULL, NULL, NULL);
-    EVP_DecryptUpdate(&e, plaintext, &p_len, &ciphertext[0], *len);
-    EVP_DecryptFinal_ex(&e, plaintext+p_len, &f_len);
+    int p_len = 0, f_len = 0;
+    bool ok = EVP_DecryptInit_ex(ctx, cipher, NULL, key, NULL)
+        && EVP_DecryptUpdate(ctx, out.data(), &p_len, ciphertext.data(),
+                ciphertext.size())
+        && EVP_DecryptFinal_ex(ctx, out.data() + p_len, &f_len);
 
-    *len = p_len + f_len;
+    EVP_CIPHER_CTX_free(ctx);
 
-    EVP_CIPHER_CTX_cleanup(&e);
+    return ok ? p_len + f_len : -1;
+}
 
-    uchar_vec ret{&plaintext[0], &plaintext[0]+*len};
+/*
+ * This will encrypt plaintext using AES-CBC mode.
+ * 
+ * @param size The size of the key in bits.
+ */
+uchar_vec aes_encrypt(const unsigned char *key, const uchar_vec &plaintext,
+        int size)
+{
+    uchar_vec ciphertext(aes_encrypt_size(plaintext.size()));
+
+    int len = aes_encrypt(key, plaintext, size, ciphertext);
+    if (len < 0)
+        return uchar_vec{};
+
+    ciphertext.resize(len);
+    return ciphertext;
+}
 
-    // Free allocated memory.
-    free(plaintext);
+/*
+ * This will decrypt ciphertext using AES-CBC mode.
+ *
+ * @param size The size of the key in bits.
+ */
+uchar_vec aes_decrypt(const unsigned char *key, const uchar_vec &ciphertext,
+        int size)
+{
+    // The scratch buffer, which may hold a partial block of plaintext past
+    // the end, is in secure memory and wiped when it goes out of scope.
+    secure_vec buf(aes_decrypt_size(ciphertext.size()));
+
+    int len = aes_decrypt(key, ciphertext, size, buf);
+    if (len < 0)
+        return uchar_vec{};
+
+    return uchar_vec{buf.begin(), buf.begin() + len};
+}
+
+/*
+ * AES-GCM parameters. A 96 bit IV is the size recommended by NIST SP 800-38D.
+ */
+const int AES_GCM_IV_SIZE   = 12;
+const int AES_GCM_TAG_SIZE  = 16;
+
+/*
+ * Encrypts plaintext using AES-256-GCM. aad is authenticated but not
+ * encrypted. The authentication tag is written to tag.
+ *
+ * @param key A 256 bit key.
+ * @param iv An AES_GCM_IV_SIZE byte IV. It must never be reused with the same
+ * key.
+ *
+ * Returns the ciphertext, or an empty uchar_vec if not successful.
+ */
+uchar_vec aes_gcm_encrypt(const unsigned char *key, const uchar_vec &iv,
+        const uchar_vec &aad, const uchar_vec &plaintext, uchar_vec &tag)
+{
+    ESO_PROBE_SCOPE(aes_gcm_encrypt, plaintext.size());
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx)
+        return uchar_vec{};
+
+    // GCM is a stream mode, so the ciphertext is as long as the plaintext.
+    uchar_vec ciphertext(plaintext.size() + AES_BLOCK_SIZE);
+    int len = 0, f_len = 0;
+
+    bool ok = EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL)
+        && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, iv.size(), NULL)
+        && EVP_EncryptInit_ex(ctx, NULL, NULL, key, iv.data())
+        && (aad.empty() || EVP_EncryptUpdate(ctx, NULL, &len, aad.data(), 
+                    aad.size()))
+        && EVP_EncryptUpdate(ctx, &ciphertext[0], &len, plaintext.data(),
+                plaintext.size())
+        && EVP_EncryptFinal_ex(ctx, &ciphertext[0] + len, &f_len);
+
+    if (ok)
+    {
+        tag.resize(AES_GCM_TAG_SIZE);
+        ok = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, AES_GCM_TAG_SIZE,
+                &tag[0]);
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+
+    if (!ok)
+        return uchar_vec{};
+
+    ciphertext.resize(len + f_len);
+    return ciphertext;
+}
+
+/*
+ * Decrypts and authenticates ciphertext produced by aes_gcm_encrypt(). The
+ * plaintext is written to plaintext.
+ *
+ * Returns true only if the tag matched the ciphertext and aad.
+ */
+bool aes_gcm_decrypt(const unsigned char *key, const uchar_vec &iv,
+        const uchar_vec &aad, const uchar_vec &ciphertext, 
+        const uchar_vec &tag, uchar_vec &plaintext)
+{
+    ESO_PROBE_SCOPE(aes_gcm_decrypt, ciphertext.size());
+
+    if (tag.size() != (size_t) AES_GCM_TAG_SIZE)
+        return false;
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx)
+        return false;
+
+    plaintext.resize(ciphertext.size() + AES_BLOCK_SIZE);
+    int len = 0, f_len = 0;
+
+    // OpenSSL 1.0.1 takes a non-const pointer for the expected tag.
+    uchar_vec expected_tag{tag};
+
+    bool ok = EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL)
+        && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, iv.size(), NULL)
+        && EVP_DecryptInit_ex(ctx, NULL, NULL, key, iv.data())
+        && (aad.empty() || EVP_DecryptUpdate(ctx, NULL, &len, aad.data(),
+                    aad.size()))
+        && EVP_DecryptUpdate(ctx, &plaintext[0], &len, ciphertext.data(),
+                ciphertext.size())
+        && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, AES_GCM_TAG_SIZE,
+                &expected_tag[0])
+        // Fails if the tag does not match.
+        && EVP_DecryptFinal_ex(ctx, &plaintext[0] + len, &f_len) > 0;
+
+    EVP_CIPHER_CTX_free(ctx);
+
+    if (!ok)
+    {
+        secure_memset(&plaintext[0], 0, plaintext.size());
+        plaintext.clear();
+        return false;
+    }
 
-    return ret;
+    plaintext.resize(len + f_len);
+    return true;
 }
 
 #endif
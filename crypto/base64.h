@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "secure_arena.h"
 #include "../global_config/types.h"
 
 /*
@@ -16,27 +17,30 @@ static char b64table[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
 "abcdefghijklmnopqrstuvwxyz"
 "0123456789+/";
 
-/* 
- * Accepts a binary buffer with an associated size.
- * Returns a base64 encoded, uchar_v.
- * The return is empty if there was an error.
+/*
+ * Returns the length of the base64 encoding of len bytes.
  */
-uchar_vec base64_encode(uchar_vec v_input)
+size_t base64_encode_size(size_t len)
 {
-    int len = v_input.size();
-
-    unsigned char *input = &v_input[0];
-
-    unsigned char *output, *p;
-    size_t i = 0, mod = len % 3, toalloc;
-    toalloc = (len / 3) * 4 + (3 - mod) % 3 + 1;
+    return (len + 2) / 3 * 4;
+}
 
+/* 
+ * Accepts a binary buffer and base64 encodes it into the caller's buffer,
+ * which must hold at least base64_encode_size(input.size()) bytes. The output
+ * is not NULL-terminated.
+ *
+ * Returns the length of the encoding, or 0 if out is too small.
+ */
+size_t base64_encode(const_uchar_span in, uchar_span out)
+{
+    size_t len = in.size();
+    if (out.size() < base64_encode_size(len))
+        return 0;
 
-    p = output = (unsigned char *)malloc(((len / 3) + (mod ? 1 : 0)) * 4 + 1);
-    if (!p)
-    {
-        return uchar_vec{};
-    }
+    const unsigned char *input = in.data();
+    unsigned char *p = out.data();
+    size_t i = 0, mod = len % 3;
 
     while (i < len - mod) 
     {
@@ -47,50 +51,34 @@ uchar_vec base64_encode(uchar_vec v_input)
         i += 2;
     }
 
-    if (!mod) 
+    if (mod == 1) 
     {
-        *p = 0;
-        
-        // Set the result and free the allocated memory.
-        int final_len = strlen((const char *) output);
-        uchar_vec result{&output[0], &output[0] + final_len};
-        free((void*) secure_memset(output, 0, final_len));
-        
-        return result;
+        *p++ = b64table[input[i] >> 2];
+        *p++ = b64table[(input[i] << 4) & 0x3f];
+        *p++ = '=';
+        *p++ = '=';
     } 
-    else 
+    else if (mod == 2)
     {
-        *p++ = b64table[input[i++] >> 2];
-        *p++ = b64table[((input[i - 1] << 4) | (input[i] >> 4)) & 0x3f];
-        if (mod == 1) 
-        {
-            *p++ = '=';
-            *p++ = '=';
-            *p = 0;
-
-            // Set the result and free the allocated memory.
-            int final_len = strlen((const char *) output);
-            uchar_vec result{&output[0], &output[0] + final_len};
-            free((void*) secure_memset(output, 0, final_len));
-
-            return result;
-
-        } 
-        else 
-        {
-            *p++ = b64table[(input[i] << 2) & 0x3f];
-            *p++ = '=';
-
-            *p = 0;
+        *p++ = b64table[input[i] >> 2];
+        *p++ = b64table[((input[i] << 4) | (input[i + 1] >> 4)) & 0x3f];
+        *p++ = b64table[(input[i + 1] << 2) & 0x3f];
+        *p++ = '=';
+    }
 
-            // Set the result and free the allocated memory.
-            int final_len = strlen((const char *) output);
-            uchar_vec result{&output[0], &output[0] + final_len};
-            free((void*) secure_memset(output, 0, final_len));
+    return p - out.data();
+}
 
-            return result;
-        }
-    }
+/* 
+ * Accepts a binary buffer with an associated size.
+ * Returns a base64 encoded, uchar_v.
+ * The return is empty if there was an error.
+ */
+uchar_vec base64_encode(const uchar_vec &v_input)
+{
+    uchar_vec result(base64_encode_size(v_input.size()));
+    result.resize(base64_encode(v_input, result));
+    return result;
 }
 
 static char b64revtb[256] = { 
@@ -230,4 +218,24 @@ unsigned char *base64_decode(unsigned char *buf, size_t *len)
     return outbuf;
 }
 
+/*
+ * Decodes base64 encoded key material into memory from the SecureArena, which
+ * is wiped when the returned buffer is released.
+ *
+ * Returns an empty buffer if there was an error.
+ */
+secure_vec base64_decode(const std::string &buf)
+{
+    secure_vec out(3 * (buf.length() / 4 + 1));
+
+    int err;
+    size_t len = raw_base64_decode((unsigned char *) buf.c_str(), &out[0], 1,
+            &err);
+    if (err)
+        return secure_vec{};
+
+    out.resize(len);
+    return out;
+}
+
 #endif
@@ -0,0 +1,177 @@
+#ifndef ESO_CRYPTO_DATA_KEY_CACHE
+#define ESO_CRYPTO_DATA_KEY_CACHE
+
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "secure_arena.h"
+#include "../global_config/global_config.h"
+#include "../global_config/types.h"
+
+/*
+ * A bounded cache of unwrapped envelope data keys, so that repeatedly
+ * decrypting blobs that share a wrapped key skips the RSA private key
+ * operation.
+ *
+ * Entries are indexed by the credential they were unwrapped with and the
+ * digest of the wrapped key. Including the credential stops a caller with
+ * permission on one set from using a key that was unwrapped for another set.
+ * Keys are held in the SecureArena and are wiped when they are evicted or
+ * expire.
+ */
+class DataKeyCache
+{
+public:
+    DataKeyCache(size_t capacity = 1024,
+            std::chrono::seconds max_age = std::chrono::seconds{300});
+    ~DataKeyCache();
+    // Returns true and sets data_key if a live entry exists.
+    bool get(const std::string &set_name, unsigned int version,
+            const uchar_vec &wrapped_digest, secure_vec &data_key);
+    // Adds an unwrapped data key, evicting the least recently used entry if
+    // the cache is full.
+    void put(const std::string &set_name, unsigned int version,
+            const uchar_vec &wrapped_digest, const secure_vec &data_key);
+    // Wipes and removes every entry.
+    void clear();
+    // Hit and miss counts since the cache was created.
+    unsigned long hits() const;
+    unsigned long misses() const;
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct Entry
+    {
+        secure_vec data_key;
+        clock::time_point created;
+        // Position in lru.
+        std::list<std::string>::iterator lru_pos;
+    };
+
+    std::string make_index(const std::string &set_name, unsigned int version,
+            const uchar_vec &wrapped_digest) const;
+    void erase(std::unordered_map<std::string, Entry>::iterator it);
+
+    size_t _capacity;
+    std::chrono::seconds _max_age;
+    std::unordered_map<std::string, Entry> _entries;
+    // Most recently used index at the front.
+    std::list<std::string> _lru;
+    unsigned long _hits;
+    unsigned long _misses;
+    mutable std::mutex _mutex;
+};
+
+DataKeyCache::DataKeyCache(size_t capacity, std::chrono::seconds max_age)
+    : _capacity{capacity}, _max_age{max_age}, _hits{0}, _misses{0}
+{
+
+}
+
+DataKeyCache::~DataKeyCache()
+{
+    clear();
+}
+
+/*
+ * Returns the map index for the given credential and wrapped key digest.
+ */
+std::string DataKeyCache::make_index(const std::string &set_name,
+        unsigned int version, const uchar_vec &wrapped_digest) const
+{
+    std::string index{set_name};
+    index += MSG_DELIMITER;
+    index += std::to_string(version);
+    index += MSG_DELIMITER;
+    index.append(wrapped_digest.begin(), wrapped_digest.end());
+    return index;
+}
+
+/*
+ * Removes the entry, which wipes its key. The caller must hold the lock.
+ */
+void DataKeyCache::erase(std::unordered_map<std::string, Entry>::iterator it)
+{
+    _lru.erase(it->second.lru_pos);
+    _entries.erase(it);
+}
+
+bool DataKeyCache::get(const std::string &set_name, unsigned int version,
+        const uchar_vec &wrapped_digest, secure_vec &data_key)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    auto it = _entries.find(make_index(set_name, version, wrapped_digest));
+    if (it == _entries.end())
+    {
+        ++_misses;
+        return false;
+    }
+
+    // Expired keys are removed rather than returned.
+    if (clock::now() - it->second.created > _max_age)
+    {
+        erase(it);
+        ++_misses;
+        return false;
+    }
+
+    // Move to the front of the LRU list.
+    _lru.splice(_lru.begin(), _lru, it->second.lru_pos);
+
+    data_key = it->second.data_key;
+    ++_hits;
+    return true;
+}
+
+void DataKeyCache::put(const std::string &set_name, unsigned int version,
+        const uchar_vec &wrapped_digest, const secure_vec &data_key)
+{
+    if (_capacity == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    std::string index = make_index(set_name, version, wrapped_digest);
+
+    auto it = _entries.find(index);
+    if (it != _entries.end())
+        erase(it);
+
+    // Evict the least recently used entries.
+    while (_entries.size() >= _capacity)
+        erase(_entries.find(_lru.back()));
+
+    _lru.push_front(index);
+
+    Entry entry;
+    entry.data_key = data_key;
+    entry.created = clock::now();
+    entry.lru_pos = _lru.begin();
+    _entries.emplace(index, std::move(entry));
+}
+
+void DataKeyCache::clear()
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    while (!_entries.empty())
+        erase(_entries.begin());
+}
+
+unsigned long DataKeyCache::hits() const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _hits;
+}
+
+unsigned long DataKeyCache::misses() const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _misses;
+}
+
+#endif
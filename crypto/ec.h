@@ -0,0 +1,415 @@
+/*
+ * Helper methods for elliptic-curve keys (ECDSA and Ed25519).
+ *
+ * ECDSA private keys are stored as DER-encoded ECPrivateKey structures, which
+ * name their curve. ECDSA public keys are stored as compressed curve points,
+ * so the curve has to be supplied (from the credential size) when decoding.
+ * Ed25519 keys are stored in their raw 32 byte form.
+ *
+ * <openssl/x509.h> is deliberately not included: it pulls in <openssl/sha.h>,
+ * whose SHA1()/SHA256()/SHA512() functions clash with constants.h.
+ */
+
+#ifndef ESO_CRYPTO_EC
+#define ESO_CRYPTO_EC
+
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+#include <openssl/opensslv.h>
+#include <tuple>
+#include <utility>
+
+#include "constants.h"
+#include "memory.h"
+#include "secure_arena.h"
+#include "../global_config/types.h"
+#include "../logger/logger.h"
+#include "../util/probes.h"
+
+// Ed25519 was added in OpenSSL 1.1.1. When building against an older
+// version the Ed25519 functions below log an error and return empty results.
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+#define ESO_HAVE_ED25519 1
+#endif
+
+/*
+ * Returns the OpenSSL curve identifier for an ECDSA key of the given size in
+ * bits, or NID_undef if the size is not supported.
+ */
+int ec_curve_nid(int size)
+{
+    switch (size)
+    {
+        case 256:
+            return NID_X9_62_prime256v1;
+        case 384:
+            return NID_secp384r1;
+        case 521:
+            return NID_secp521r1;
+        default:
+            return NID_undef;
+    }
+}
+
+/*
+ * Returns the message digest for one of the hash constants in constants.h or
+ * nullptr if the hash is unknown.
+ */
+const EVP_MD *ec_digest(int algo)
+{
+    switch (algo)
+    {
+        case SHA1:
+            return EVP_sha1();
+        case SHA256:
+            return EVP_sha256();
+        case SHA512:
+            return EVP_sha512();
+        default:
+            return nullptr;
+    }
+}
+
+/*
+ * Returns true if the key is an Ed25519 key. Ed25519 signs the message
+ * directly and does not use a separate message digest.
+ */
+bool is_Ed25519_key(EVP_PKEY *key)
+{
+#ifdef ESO_HAVE_ED25519
+    return EVP_PKEY_id(key) == EVP_PKEY_ED25519;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Wraps the EC_KEY in an EVP_PKEY. The EVP_PKEY takes ownership of ec_key,
+ * which is freed if an error occurs. Returns nullptr on error.
+ */
+EVP_PKEY *wrap_EC_key(EC_KEY *ec_key)
+{
+    if (!ec_key)
+        return nullptr;
+
+    EVP_PKEY *pkey = EVP_PKEY_new();
+    if (!pkey || !EVP_PKEY_assign_EC_KEY(pkey, ec_key))
+    {
+        Logger::log("Error assigning EC key.", LogLevel::Error);
+        EVP_PKEY_free(pkey);
+        EC_KEY_free(ec_key);
+        return nullptr;
+    }
+    return pkey;
+}
+
+/*
+ * Returns an EVP_PKEY structure containing the ECDSA public key specified by
+ * the encoded point. size is the key size the point was generated with.
+ */
+EVP_PKEY *decode_ECDSA_public(const unsigned char *buf, long len, int size)
+{
+    int nid = ec_curve_nid(size);
+    if (nid == NID_undef)
+        return nullptr;
+
+    EC_KEY *ec_key = EC_KEY_new_by_curve_name(nid);
+    if (!ec_key || !o2i_ECPublicKey(&ec_key, &buf, len))
+    {
+        Logger::log("Error decoding ECDSA public key.", LogLevel::Error);
+        EC_KEY_free(ec_key);
+        return nullptr;
+    }
+    return wrap_EC_key(ec_key);
+}
+
+/*
+ * Returns an EVP_PKEY structure containing the ECDSA private key specified by
+ * the DER encoding.
+ */
+EVP_PKEY *decode_ECDSA_private(const unsigned char *buf, long len)
+{
+    return wrap_EC_key(d2i_ECPrivateKey(0, &buf, len));
+}
+
+/*
+ * Generates a new ECDSA key pair on the curve matching size (see
+ * ec_curve_nid). Returns a tuple containing the encoded public and private
+ * keys, which are empty if generation failed. The private key is in secure
+ * memory and wiped when it is freed.
+ *
+ * Tuple is <public_key, private_key>
+ */
+std::tuple<uchar_vec, secure_vec> get_new_ECDSA_pair(int size)
+{
+    int nid = ec_curve_nid(size);
+    if (nid == NID_undef)
+    {
+        Logger::log("Unsupported ECDSA key size.", LogLevel::Error);
+        return std::make_tuple(uchar_vec{}, secure_vec{});
+    }
+
+    EC_KEY *ec_key = EC_KEY_new_by_curve_name(nid);
+    if (!ec_key)
+    {
+        Logger::log("Error allocating EC key.", LogLevel::Error);
+        return std::make_tuple(uchar_vec{}, secure_vec{});
+    }
+
+    // Encode the curve by name rather than by its explicit parameters (the
+    // default in older versions of OpenSSL), and store compressed points.
+    EC_KEY_set_asn1_flag(ec_key, OPENSSL_EC_NAMED_CURVE);
+    EC_KEY_set_conv_form(ec_key, POINT_CONVERSION_COMPRESSED);
+
+    // TODO Seed PRNG
+    if (!EC_KEY_generate_key(ec_key))
+    {
+        Logger::log("Error generating EC key.", LogLevel::Error);
+        EC_KEY_free(ec_key);
+        return std::make_tuple(uchar_vec{}, secure_vec{});
+    }
+
+    int public_len = i2o_ECPublicKey(ec_key, nullptr);
+    int private_len = i2d_ECPrivateKey(ec_key, nullptr);
+    if (public_len <= 0 || private_len <= 0)
+    {
+        Logger::log("Error encoding EC key pair.", LogLevel::Error);
+        EC_KEY_free(ec_key);
+        return std::make_tuple(uchar_vec{}, secure_vec{});
+    }
+
+    uchar_vec pub(public_len);
+    secure_vec pri(private_len);
+
+    // The encoders advance the pointer they are given, so use a copy.
+    unsigned char *next = &pub[0];
+    i2o_ECPublicKey(ec_key, &next);
+    next = &pri[0];
+    i2d_ECPrivateKey(ec_key, &next);
+
+    // The private key is erased before the memory is returned to the system.
+    EC_KEY_free(ec_key);
+
+    return std::make_tuple(std::move(pub), std::move(pri));
+}
+
+/*
+ * Returns an EVP_PKEY structure containing the raw Ed25519 public key.
+ */
+EVP_PKEY *decode_Ed25519_public(const unsigned char *buf, long len)
+{
+#ifdef ESO_HAVE_ED25519
+    return EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, nullptr, buf, len);
+#else
+    return nullptr;
+#endif
+}
+
+/*
+ * Returns an EVP_PKEY structure containing the raw Ed25519 private key.
+ */
+EVP_PKEY *decode_Ed25519_private(const unsigned char *buf, long len)
+{
+#ifdef ESO_HAVE_ED25519
+    return EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519, nullptr, buf, len);
+#else
+    return nullptr;
+#endif
+}
+
+/*
+ * Generates a new Ed25519 key pair. Returns a tuple containing the raw public
+ * and private keys, which are empty if generation failed or Ed25519 is not
+ * supported. The private key is in secure memory and wiped when it is freed.
+ *
+ * Tuple is <public_key, private_key>
+ */
+std::tuple<uchar_vec, secure_vec> get_new_Ed25519_pair()
+{
+#ifdef ESO_HAVE_ED25519
+    EVP_PKEY *pkey = nullptr;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, nullptr);
+
+    if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0
+            || EVP_PKEY_keygen(ctx, &pkey) <= 0)
+    {
+        Logger::log("Error generating Ed25519 key.", LogLevel::Error);
+        EVP_PKEY_CTX_free(ctx);
+        return std::make_tuple(uchar_vec{}, secure_vec{});
+    }
+    EVP_PKEY_CTX_free(ctx);
+
+    size_t public_len = 0, private_len = 0;
+    if (EVP_PKEY_get_raw_public_key(pkey, nullptr, &public_len) != 1
+            || EVP_PKEY_get_raw_private_key(pkey, nullptr, &private_len) != 1
+            || public_len == 0 || private_len == 0)
+    {
+        Logger::log("Error encoding Ed25519 key pair.", LogLevel::Error);
+        EVP_PKEY_free(pkey);
+        return std::make_tuple(uchar_vec{}, secure_vec{});
+    }
+
+    uchar_vec pub(public_len);
+    secure_vec pri(private_len);
+    bool encoded = EVP_PKEY_get_raw_public_key(pkey, &pub[0], &public_len) == 1
+        && EVP_PKEY_get_raw_private_key(pkey, &pri[0], &private_len) == 1;
+
+    EVP_PKEY_free(pkey);
+
+    if (!encoded)
+    {
+        Logger::log("Error encoding Ed25519 key pair.", LogLevel::Error);
+        return std::make_tuple(uchar_vec{}, secure_vec{});
+    }
+
+    return std::make_tuple(std::move(pub), std::move(pri));
+#else
+    Logger::log("Ed25519 is not supported by this OpenSSL version.",
+            LogLevel::Error);
+    return std::make_tuple(uchar_vec{}, secure_vec{});
+#endif
+}
+
+/**
+ * Signs the message using an ECDSA or Ed25519 private key.
+ *
+ * @param private_key The private key to sign with.
+ * @param msg The message to sign.
+ * @param algo The hash to use. Ignored for Ed25519 keys.
+ *
+ * @return The signature or an empty uchar_vec{} if something went wrong.
+ */
+uchar_vec ec_sign(EVP_PKEY *private_key, uchar_vec msg, int algo)
+{
+    ESO_PROBE_SCOPE(ec_sign, msg.size());
+
+    if (!private_key)
+    {
+        Logger::log("No key given to ec_sign.", LogLevel::Error);
+        return uchar_vec{};
+    }
+
+    const EVP_MD *md = nullptr;
+    if (!is_Ed25519_key(private_key) && !(md = ec_digest(algo)))
+    {
+        Logger::log("Unable to get message digest algo.", LogLevel::Error);
+        return uchar_vec{};
+    }
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_create();
+    if (!ctx)
+    {
+        Logger::log("Error allocating context.", LogLevel::Error);
+        return uchar_vec{};
+    }
+
+    if (EVP_DigestSignInit(ctx, nullptr, md, nullptr, private_key) <= 0)
+    {
+        Logger::log("EVP_DigestSignInit: failed.", LogLevel::Error);
+        EVP_MD_CTX_destroy(ctx);
+        return uchar_vec{};
+    }
+
+    // Will hold the signature and length.
+    uchar_vec sig;
+    size_t siglen = 0;
+    bool ok = false;
+
+#ifdef ESO_HAVE_ED25519
+    if (md == nullptr)
+    {
+        // Ed25519 only supports one-shot signing.
+        if (EVP_DigestSign(ctx, nullptr, &siglen, msg.data(), msg.size()) > 0)
+        {
+            sig.resize(siglen);
+            ok = EVP_DigestSign(ctx, &sig[0], &siglen, msg.data(),
+                    msg.size()) > 0;
+        }
+    }
+    else
+#endif
+    if (EVP_DigestSignUpdate(ctx, msg.data(), msg.size()) > 0
+            && EVP_DigestSignFinal(ctx, nullptr, &siglen) > 0)
+    {
+        // The first call only returns the maximum signature length.
+        sig.resize(siglen);
+        ok = EVP_DigestSignFinal(ctx, &sig[0], &siglen) > 0;
+    }
+
+    EVP_MD_CTX_destroy(ctx);
+
+    if (!ok)
+    {
+        Logger::log("EC signing failed.", LogLevel::Error);
+        return uchar_vec{};
+    }
+
+    // DER-encoded ECDSA signatures vary in length.
+    sig.resize(siglen);
+    return sig;
+}
+
+/**
+ * Verifies the signature using an ECDSA or Ed25519 public key.
+ *
+ * @param public_key The public key to use.
+ * @param sig The signature to verify.
+ * @param msg The message to compare to.
+ * @param algo The hash to use. Ignored for Ed25519 keys.
+ *
+ * @return True if the signature is verified, false otherwise or if an error
+ * occurred.
+ */
+bool ec_verify(EVP_PKEY *public_key, uchar_vec sig, uchar_vec msg, int algo)
+{
+    ESO_PROBE_SCOPE(ec_verify, msg.size());
+
+    if (!public_key)
+    {
+        Logger::log("No key given to ec_verify.", LogLevel::Error);
+        return false;
+    }
+
+    const EVP_MD *md = nullptr;
+    if (!is_Ed25519_key(public_key) && !(md = ec_digest(algo)))
+    {
+        Logger::log("Unable to get message digest algo.", LogLevel::Error);
+        return false;
+    }
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_create();
+    if (!ctx)
+    {
+        Logger::log("Error allocating context.", LogLevel::Error);
+        return false;
+    }
+
+    if (EVP_DigestVerifyInit(ctx, nullptr, md, nullptr, public_key) <= 0)
+    {
+        Logger::log("EVP_DigestVerifyInit: failed.", LogLevel::Error);
+        EVP_MD_CTX_destroy(ctx);
+        return false;
+    }
+
+    bool ret = false;
+
+#ifdef ESO_HAVE_ED25519
+    if (md == nullptr)
+    {
+        ret = EVP_DigestVerify(ctx, sig.data(), sig.size(), msg.data(),
+                msg.size()) == 1;
+    }
+    else
+#endif
+    if (EVP_DigestVerifyUpdate(ctx, msg.data(), msg.size()) > 0)
+    {
+        ret = EVP_DigestVerifyFinal(ctx, sig.data(), sig.size()) == 1;
+    }
+
+    EVP_MD_CTX_destroy(ctx);
+
+    return ret;
+}
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Envelope (hybrid) encryption for asymmetric credentials.
+ *
+ * RSA-OAEP can only encrypt a little less than the modulus size, so payloads
+ * are encrypted with a fresh AES-256-GCM data key and only the data key is
+ * encrypted ("wrapped") with the RSA public key. The result is a single
+ * self-describing blob (all integers are big-endian):
+ *
+ *   magic       4 bytes     'E','S','O','E'
+ *   version     1 byte      ENVELOPE_VERSION
+ *   key_len     2 bytes     length of the wrapped key
+ *   wrapped     key_len     RSA-OAEP encryption of the data key
+ *   iv          12 bytes
+ *   tag         16 bytes    GCM tag over the ciphertext, using everything up
+ *                           to and including the wrapped key as AAD
+ *   ciphertext  remainder
+ */
+
+#ifndef ESO_CRYPTO_ENVELOPE
+#define ESO_CRYPTO_ENVELOPE
+
+#include <algorithm>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+
+#include "aes.h"
+#include "memory.h"
+#include "rsa.h"
+#include "secure_arena.h"
+#include "../global_config/types.h"
+#include "../util/probes.h"
+
+// Identifies an envelope blob.
+const uchar_vec ENVELOPE_MAGIC{'E','S','O','E'};
+
+// The current version of the envelope format.
+const unsigned char ENVELOPE_VERSION = 1;
+
+// The size of the data keys in bits.
+const int ENVELOPE_KEY_SIZE = 256;
+
+/*
+ * The parsed fields of an envelope blob.
+ */
+struct Envelope
+{
+    // The authenticated header: magic, version, key length and wrapped key.
+    uchar_vec header;
+    // The RSA-wrapped data key.
+    uchar_vec wrapped_key;
+    uchar_vec iv;
+    uchar_vec tag;
+    uchar_vec ciphertext;
+};
+
+/**
+ * Encrypts data with a new data key which is wrapped with the given public
+ * key.
+ *
+ * @param public_key The public RSA key of the set.
+ * @param data The data to encrypt.
+ *
+ * @return The envelope blob, or an empty uchar_vec if something went wrong.
+ */
+uchar_vec envelope_seal(RSA *public_key, const uchar_vec &data)
+{
+    ESO_PROBE_SCOPE(envelope_seal, data.size());
+
+    // The data key is wiped when it goes out of scope.
+    secure_vec data_key;
+    if (!get_new_AES_key(ENVELOPE_KEY_SIZE, data_key))
+        return uchar_vec{};
+
+    uchar_vec wrapped_key(rsa_size(public_key));
+    int wrapped_len = rsa_encrypt(public_key, data_key, wrapped_key);
+    wrapped_key.resize(wrapped_len < 0 ? 0 : wrapped_len);
+
+    uchar_vec iv(AES_GCM_IV_SIZE);
+    if (wrapped_key.empty() || wrapped_key.size() > 0xFFFF
+            || !RAND_bytes(&iv[0], iv.size()))
+        return uchar_vec{};
+
+    // Build the header, which is authenticated as AAD.
+    uchar_vec blob{ENVELOPE_MAGIC};
+    blob.push_back(ENVELOPE_VERSION);
+    blob.push_back(wrapped_key.size() >> 8);
+    blob.push_back(wrapped_key.size() & 0xFF);
+    blob.insert(blob.end(), wrapped_key.begin(), wrapped_key.end());
+
+    uchar_vec tag;
+    uchar_vec ciphertext = aes_gcm_encrypt(&data_key[0], iv, blob, data, tag);
+
+    if (tag.empty())
+        return uchar_vec{};
+
+    blob.insert(blob.end(), iv.begin(), iv.end());
+    blob.insert(blob.end(), tag.begin(), tag.end());
+    blob.insert(blob.end(), ciphertext.begin(), ciphertext.end());
+
+    return blob;
+}
+
+/**
+ * Splits an envelope blob into its fields.
+ *
+ * @return False if the blob is not a well-formed envelope.
+ */
+bool parse_envelope(const uchar_vec &blob, Envelope &env)
+{
+    size_t pos = ENVELOPE_MAGIC.size();
+
+    // Magic, version and key length.
+    if (blob.size() < pos + 3
+            || !std::equal(ENVELOPE_MAGIC.begin(), ENVELOPE_MAGIC.end(),
+                blob.begin())
+            || blob[pos] != ENVELOPE_VERSION)
+        return false;
+
+    size_t key_len = (blob[pos + 1] << 8) + blob[pos + 2];
+    pos += 3;
+
+    if (blob.size() < pos + key_len + AES_GCM_IV_SIZE + AES_GCM_TAG_SIZE)
+        return false;
+
+    env.header = uchar_vec{blob.begin(), blob.begin() + pos + key_len};
+    env.wrapped_key = uchar_vec{blob.begin() + pos,
+        blob.begin() + pos + key_len};
+    pos += key_len;
+
+    env.iv = uchar_vec{blob.begin() + pos, blob.begin() + pos + AES_GCM_IV_SIZE};
+    pos += AES_GCM_IV_SIZE;
+
+    env.tag = uchar_vec{blob.begin() + pos,
+        blob.begin() + pos + AES_GCM_TAG_SIZE};
+    pos += AES_GCM_TAG_SIZE;
+
+    env.ciphertext = uchar_vec{blob.begin() + pos, blob.end()};
+
+    return true;
+}
+
+/**
+ * Decrypts the payload of a parsed envelope with the unwrapped data key. The
+ * plaintext, which may be empty, is written to plaintext.
+ *
+ * @return True only if the data key is the right size and authentication
+ * succeeded.
+ */
+bool envelope_decrypt(const Envelope &env, const secure_vec &data_key,
+        uchar_vec &plaintext)
+{
+    ESO_PROBE_SCOPE(envelope_decrypt, env.ciphertext.size());
+
+    plaintext.clear();
+    if (data_key.size() != (size_t) ENVELOPE_KEY_SIZE / 8)
+        return false;
+
+    return aes_gcm_decrypt(&data_key[0], env.iv, env.header, env.ciphertext,
+            env.tag, plaintext);
+}
+
+/*
+ * Returns the SHA-256 digest of data. Used to index unwrapped data keys.
+ * (<openssl/sha.h> cannot be included alongside constants.h.)
+ */
+uchar_vec sha256_digest(const uchar_vec &data)
+{
+    uchar_vec digest(EVP_MAX_MD_SIZE);
+    unsigned int len = 0;
+
+    if (!EVP_Digest(data.data(), data.size(), &digest[0], &len, EVP_sha256(),
+                nullptr))
+        return uchar_vec{};
+
+    digest.resize(len);
+    return digest;
+}
+
+#endif
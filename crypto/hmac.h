@@ -6,59 +6,80 @@
 
 #include "constants.h"
 #include "../global_config/types.h"
+#include "../util/probes.h"
 
-/**
- * Implements HMAC-*, where * is one of the allowable modes specified above. If
- * an invalid hash is specified, the default will be SHA-1.
- *
- * @param key   The key to use with the specified hash.
- * @param data  The data to hash.
- * @param hash  The hash to use.
- *
+/*
+ * Returns the digest for the given hash. If an invalid hash is specified, the
+ * default will be SHA-1.
  */
-uchar_vec hmac(const std::string key, const uchar_vec data, 
-        const int hash) 
+const EVP_MD *hmac_digest(const int hash)
 {
-    // Initialize HMAC context.
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
-
-    // The result of the HMAC.
-    unsigned char* result;
-
-    // Length will be set in the switch.
-    unsigned int len = -1;
-
     // TODO Implement more hashes.
     switch(hash)
     {
         case (SHA256):
-            len = 64;
-            HMAC_Init_ex(&ctx, key.c_str(), key.length(), EVP_sha256(), nullptr);
-            break;
+            return EVP_sha256();
         case (SHA512):
-            len = 128;
-            HMAC_Init_ex(&ctx, key.c_str(), key.length(), EVP_sha512(), nullptr);
-            break;
+            return EVP_sha512();
         case(SHA1):
         default:
-            len = 20;
-            HMAC_Init_ex(&ctx, key.c_str(), key.length(), EVP_sha1(), nullptr);
-            break;
+            return EVP_sha1();
     }
+}
+
+/*
+ * Returns the length of the HMAC produced with the given hash.
+ */
+size_t hmac_size(const int hash)
+{
+    return EVP_MD_size(hmac_digest(hash));
+}
+
+/**
+ * Implements HMAC-*, where * is one of the allowable modes specified above,
+ * writing the result into the caller's buffer without allocating.
+ *
+ * @param key   The key to use with the specified hash.
+ * @param data  The data to hash.
+ * @param hash  The hash to use.
+ * @param out   Must hold at least hmac_size(hash) bytes.
+ *
+ * @return The length of the HMAC, or -1 if something went wrong.
+ */
+int hmac(const_uchar_span key, const_uchar_span data, const int hash,
+        uchar_span out)
+{
+    ESO_PROBE_SCOPE(hmac, data.size());
+
+    if (out.size() < hmac_size(hash))
+        return -1;
 
-    result = (unsigned char*)malloc(sizeof(char) * len);
+    unsigned int len = 0;
+    if (!HMAC(hmac_digest(hash), key.data(), key.size(), data.data(),
+                data.size(), out.data(), &len))
+        return -1;
 
-    // Hash data. 
-    HMAC_Update(&ctx, &data[0], data.size());
-    HMAC_Final(&ctx, result, &len);
-    HMAC_CTX_cleanup(&ctx);
+    return len;
+}
+
+/**
+ * Implements HMAC-*, where * is one of the allowable modes specified above. If
+ * an invalid hash is specified, the default will be SHA-1.
+ *
+ * @param key   The key to use with the specified hash.
+ * @param data  The data to hash.
+ * @param hash  The hash to use.
+ *
+ */
+uchar_vec hmac(const std::string &key, const uchar_vec &data, const int hash) 
+{
+    uchar_vec res(hmac_size(hash));
 
-    // We are going to return a char_vec.
-    uchar_vec res{&result[0], &result[0]+len};
-    // Free the allocated memory.
-    free(result);
+    int len = hmac(key, data, hash, res);
+    if (len < 0)
+        return uchar_vec{};
 
+    res.resize(len);
     return res;
 }
 
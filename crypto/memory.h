@@ -2,6 +2,7 @@
 #define ESO_CRYPTO_MEMORY
 
 #include <stddef.h>
+#include <string.h>
 /*
  * Secure version of memset, memcpy, memmove.
  * Adapted from "Secure Programming Cookbook for C and C++ - VM (2003)"
@@ -15,13 +16,27 @@
 
 /*
  * A secure version of memset.
+ *
+ * The library memset is vectorized, unlike a volatile byte loop. The empty asm
+ * statement tells the compiler that the buffer may be read afterwards, so the
+ * call cannot be removed as a dead store.
  */
 volatile void *secure_memset(volatile void *dst, int c, size_t len) 
 {
-    volatile char *buf;
+    memset((void *) dst, c, len);
+    __asm__ __volatile__("" : : "r"(dst) : "memory");
+    return dst;
+}
 
-    for (buf = (volatile char *)dst; len; buf[--len] = c);
-        return dst;
+/*
+ * Securely erases a buffer (uchar_vec, secure_vec, std::string). Does
+ * nothing to an empty one.
+ */
+template <typename Buffer>
+void secure_wipe(Buffer &buf)
+{
+    if (!buf.empty())
+        secure_memset(&buf[0], 0, buf.size() * sizeof buf[0]);
 }
 
 /*
@@ -6,14 +6,17 @@
 #define ESO_CENTRAL_CRYPTO_RSA
 
 #include <openssl/bn.h>
+#include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <openssl/rsa.h>
 #include <tuple>
 
 #include "constants.h"
 #include "memory.h"
+#include "secure_arena.h"
 #include "../global_config/types.h"
 #include "../logger/logger.h"
+#include "../util/probes.h"
 
 /* 
  * Returns the malloc'd buffer, and puts the size of the buffer into the integer
@@ -113,71 +116,127 @@ std::tuple<uchar_vec, uchar_vec> get_new_RSA_pair(int bits)
     return std::make_tuple(pub, pri);
 }
 
+/*
+ * Returns the length of the output of rsa_encrypt, rsa_sign and the buffer
+ * rsa_decrypt needs, which is the size of the modulus in bytes.
+ */
+size_t rsa_size(RSA *key)
+{
+    return RSA_size(key);
+}
+
+/*
+ * Returns the message digest for one of the hash constants in constants.h or
+ * nullptr if the hash is unknown.
+ */
+const EVP_MD *rsa_digest(int algo)
+{
+    switch (algo)
+    {
+        case SHA1:
+            return EVP_sha1();
+        case SHA256:
+            return EVP_sha256();
+        case SHA512:
+            return EVP_sha512();
+        default:
+            return nullptr;
+    }
+}
+
 /**
- * Encrypts data using the given public key.
+ * Encrypts data using the given public key into the caller's buffer.
  *
  * @param public_key The public RSA key.
  * @param data The data to encrypt.
+ * @param out Must hold at least rsa_size(public_key) bytes.
+ *
+ * @return The length of the ciphertext, or -1 if something went wrong.
  */
-uchar_vec rsa_encrypt(RSA* public_key, uchar_vec data)
+int rsa_encrypt(RSA* public_key, const_uchar_span data, uchar_span out)
 {
-    // Will hold the ciphertext.
-    unsigned char *cipher = new unsigned char[RSA_size(public_key)];
-    memset(cipher,'\0', RSA_size(public_key));
+    ESO_PROBE_SCOPE(rsa_encrypt, data.size());
+
+    if (out.size() < rsa_size(public_key))
+        return -1;
 
     // TODO seed PRNG
     // Encrypt msg using the public key.
-    int encrypted_length = RSA_public_encrypt(data.size(), &data[0],
-            cipher, public_key, RSA_PKCS1_OAEP_PADDING);
+    int encrypted_length = RSA_public_encrypt(data.size(), data.data(),
+            out.data(), public_key, RSA_PKCS1_OAEP_PADDING);
 
-    if (!encrypted_length)
+    if (encrypted_length <= 0)
     {
         Logger::log("Error: encrypted_length was not valid.", LogLevel::Error);
+        return -1;
     }
 
-    uchar_vec result{&cipher[0], &cipher[0]+encrypted_length};
-
-    delete [] cipher;
-
-    return result;
+    return encrypted_length;
 }
 
 /**
+ * Decrypts data using the given private key into the caller's buffer.
+ *
+ * @param private_key The private RSA key.
+ * @param data The data to decrypt.
+ * @param out Must hold at least rsa_size(private_key) bytes.
  *
+ * @return The length of the original message, or -1 if something went wrong.
  */
-uchar_vec rsa_decrypt(RSA* private_key, uchar_vec data)
+int rsa_decrypt(RSA* private_key, const_uchar_span data, uchar_span out)
 {
-    // Will contain the original message.
-    unsigned char* orig = new unsigned char[RSA_size(private_key)];
+    ESO_PROBE_SCOPE(rsa_decrypt, data.size());
 
-    // Decrypt.
-    int orig_size = RSA_private_decrypt(data.size(), &data[0], orig, private_key, RSA_PKCS1_OAEP_PADDING);
+    if (out.size() < rsa_size(private_key))
+        return -1;
 
-    uchar_vec result{&orig[0], &orig[0]+orig_size};
+    // Decrypt.
+    int orig_size = RSA_private_decrypt(data.size(), data.data(), out.data(),
+            private_key, RSA_PKCS1_OAEP_PADDING);
 
-    delete [] orig;
+    // RSA_private_decrypt returns -1 if the data could not be decrypted.
+    if (orig_size < 0)
+    {
+        Logger::log("Error: RSA decryption failed.", LogLevel::Error);
+        return -1;
+    }
 
-    return result;
+    return orig_size;
 }
 
-
 /**
- * Signs the message using RSA and the specified algorithm.
+ * Signs the message using RSA and the specified algorithm, writing the
+ * signature into the caller's buffer.
  *
  * @param private_key The private key to sign with.
  * @param msg The message to sign.
  * @param algo The algorithm to use to sign.
+ * @param out Must hold at least rsa_size(private_key) bytes.
  *
- * @return The signature or an empty char_vec{} if something went wrong.
+ * @return The length of the signature or -1 if something went wrong.
  */
-uchar_vec rsa_sign(RSA *private_key, uchar_vec msg, int algo)
+int rsa_sign(RSA *private_key, const_uchar_span msg, int algo, uchar_span out)
 {
+    ESO_PROBE_SCOPE(rsa_sign, msg.size());
+
+    const EVP_MD *md = rsa_digest(algo);
+
+    // Check to ensure we have obtained the message algorithm.
+    if (!md)
+    {
+        Logger::log("Unable to get message digest algo.", LogLevel::Error);
+        return -1;
+    }
+
+    if (out.size() < rsa_size(private_key))
+        return -1;
+
     // Allocate the EVP signing key.
     EVP_PKEY *signing_key = EVP_PKEY_new();
     if (!signing_key)
     {
         Logger::log("Error allocating mem for signing_key ", LogLevel::Error);
-        return uchar_vec{};
+        return -1;
     }
 
     // Set the signing key.
@@ -188,114 +247,39 @@ uchar_vec rsa_sign(RSA *private_key, uchar_vec msg, int algo)
 
         EVP_PKEY_free(signing_key);
     
-        return uchar_vec{};
+        return -1;
     }
 
     EVP_MD_CTX *ctx = EVP_MD_CTX_create();
-
-    // Configure the message digest algorithm.
-    OpenSSL_add_all_algorithms();
-
-    const EVP_MD *md;
-
-    // Try to obtain the message digest algorithm.
-    switch (algo)
+    if (!ctx)
     {
-        case SHA1:
-            md = EVP_get_digestbyname("sha1");
-            break;
-        case SHA256:
-            md = EVP_get_digestbyname("sha256");
-            break;
-        case SHA512:
-            md = EVP_get_digestbyname("sha512");
-            break;
-        default:
-            EVP_PKEY_free(signing_key);
-            return uchar_vec{};
-    }
+        Logger::log("Error allocating context.", LogLevel::Error);
 
-    // Check to ensure we have obtained the message algorithm.
-    if (!md)
-    {
-        Logger::log("Unable to get message digest algo.", LogLevel::Error);
         EVP_PKEY_free(signing_key);
-        EVP_cleanup();
-        EVP_MD_CTX_cleanup(ctx);
-        EVP_MD_CTX_destroy(ctx);
 
-        return uchar_vec{};
+        return -1;
     }
 
-    // Initalize the EVP sign.
+    // Will hold the signature length.
+    unsigned int siglen = 0;
+    int ret = -1;
+
+    // Initalize the EVP sign, update it with the message and retrieve the
+    // signature.
     if (!EVP_SignInit(ctx, md))
-    {
         Logger::log("EVP_SignInit: failed.", LogLevel::Error);
-
-        EVP_cleanup();
-        EVP_PKEY_free(signing_key);
-        EVP_MD_CTX_cleanup(ctx);
-        EVP_MD_CTX_destroy(ctx);
-
-        return uchar_vec{};
-    } 
-
-    // Update the signature with the message.
-    if (!EVP_SignUpdate(ctx, &msg[0], msg.size()))
-    {
+    else if (!EVP_SignUpdate(ctx, msg.data(), msg.size()))
         Logger::log("EVP_SignUpdate: failed.", LogLevel::Error);
-
-        EVP_cleanup();
-        EVP_PKEY_free(signing_key);
-        EVP_MD_CTX_cleanup(ctx);
-        EVP_MD_CTX_destroy(ctx);
-
-        return uchar_vec{};
-    }
-
-    // Will hold the signature and length.
-    unsigned char *sig;
-    size_t siglen;
-
-    sig = (unsigned char *) malloc(EVP_PKEY_size(signing_key));
-
-    // Check that the allocation worked.
-    if (!sig)
-    {
-        Logger::log("malloc failed", LogLevel::Error);
-
-        EVP_cleanup();
-        EVP_PKEY_free(signing_key);
-        EVP_MD_CTX_cleanup(ctx);
-        EVP_MD_CTX_destroy(ctx);
-
-        return uchar_vec{};
-    }
-
-    // Retrieve the signature.
-    if (!EVP_SignFinal(ctx, sig, &siglen, signing_key))
-    {
+    else if (!EVP_SignFinal(ctx, out.data(), &siglen, signing_key))
         Logger::log("EVP_SignFinal: failed.", LogLevel::Error);
-
-        free(sig);
-        EVP_cleanup();
-        EVP_PKEY_free(signing_key);
-        EVP_MD_CTX_cleanup(ctx);
-        EVP_MD_CTX_destroy(ctx);
-
-        return uchar_vec{};
-    }
+    else
+        ret = siglen;
 
     // Clean up EVP context.
-    EVP_cleanup();
     EVP_PKEY_free(signing_key);
-    EVP_MD_CTX_cleanup(ctx);
     EVP_MD_CTX_destroy(ctx);
 
-    // Free allocated material.
-    free(sig);
-
-    return uchar_vec{&sig[0], &sig[0]+siglen};
+    return ret;
 }
 
 /**
@@ -309,8 +293,20 @@ uchar_vec rsa_sign(RSA *private_key, uchar_vec msg, int algo)
  * @return True if the signature is verified, false otherwise or if an error
  * occurred.
  */
-bool rsa_verify(RSA *public_key, uchar_vec sig, uchar_vec msg, int algo)
+bool rsa_verify(RSA *public_key, const_uchar_span sig, const_uchar_span msg,
+        int algo)
 {
+    ESO_PROBE_SCOPE(rsa_verify, msg.size());
+
+    const EVP_MD *md = rsa_digest(algo);
+
+    // Check to ensure we have obtained the message digest algorithm.
+    if (!md)
+    {
+        Logger::log("Unable to get message digest algo.", LogLevel::Error);
+        return false;
+    }
+
     EVP_PKEY *verify_key = EVP_PKEY_new();
 
     // Allocate the verify key.
@@ -330,39 +326,6 @@ bool rsa_verify(RSA *public_key, uchar_vec sig, uchar_vec msg, int algo)
         return false;
     }
 
-    // Configure the message digest algorithm.
-    OpenSSL_add_all_algorithms();
-
-    const EVP_MD *md;
-
-    // Try to obtain the message digest algorithm.
-    switch (algo)
-    {
-        case SHA1:
-            md = EVP_get_digestbyname("sha1");
-            break;
-        case SHA256:
-            md = EVP_get_digestbyname("sha256");
-            break;
-        case SHA512:
-            md = EVP_get_digestbyname("sha512");
-            break;
-        default:
-            EVP_PKEY_free(verify_key);
-            return false;
-    }
-
-    // Check to ensure we have obtained the message digest algorithm.
-    if (!md)
-    {
-        Logger::log("Unable to get message digest algo.", LogLevel::Error);
-
-        EVP_PKEY_free(verify_key);
-        EVP_cleanup();
-
-        return false;
-    }
-
     // Now we verify the signature.
     EVP_MD_CTX *ctx = EVP_MD_CTX_create();
 
@@ -372,58 +335,99 @@ bool rsa_verify(RSA *public_key, uchar_vec sig, uchar_vec msg, int algo)
         Logger::log("Error allocating context.", LogLevel::Error);
 
         EVP_PKEY_free(verify_key);
-        EVP_cleanup();
 
         return false;
     }
 
-    // Initalize the context with the specified algorithm.
-    if(!EVP_VerifyInit(ctx, md))
-    {
-        Logger::log("Error init verify.", LogLevel::Error);
-
-        // Free everything
-        EVP_PKEY_free(verify_key);
-        EVP_MD_CTX_cleanup(ctx);
-        EVP_MD_CTX_destroy(ctx);
-        EVP_cleanup();
-
-        return false;
-    }
+    bool ret = false;
 
-    // Update the context with our data.
-    if(!EVP_VerifyUpdate(ctx, &msg[0], msg.size()))
-    {
+    // Initalize the context with the specified algorithm, update it with our
+    // data and verify the signature.
+    if (!EVP_VerifyInit(ctx, md))
+        Logger::log("Error init verify.", LogLevel::Error);
+    else if (!EVP_VerifyUpdate(ctx, msg.data(), msg.size()))
         Logger::log("Error update verify.", LogLevel::Error);
-
-        // Free everything
-        EVP_PKEY_free(verify_key);
-        EVP_MD_CTX_cleanup(ctx);
-        EVP_MD_CTX_destroy(ctx);
-        EVP_cleanup();
-
-        return false;
-    }
-
-    bool ret = false;
-    
-    // Verify the signature.
-    if(EVP_VerifyFinal(ctx, &sig[0], sig.size(), verify_key))
-    {
-        ret = true;
-    }
     else
-    {
-        ret = false;
-    }
+        ret = EVP_VerifyFinal(ctx, sig.data(), sig.size(), verify_key) == 1;
 
     // Clean up
-    EVP_cleanup();
     EVP_PKEY_free(verify_key);
-    EVP_MD_CTX_cleanup(ctx);
     EVP_MD_CTX_destroy(ctx);
 
     return ret;
 }
 
+/**
+ * Encrypts data using the given public key.
+ *
+ * @param public_key The public RSA key.
+ * @param data The data to encrypt.
+ */
+uchar_vec rsa_encrypt(RSA* public_key, const uchar_vec &data)
+{
+    uchar_vec result(rsa_size(public_key));
+
+    int len = rsa_encrypt(public_key, data, result);
+    if (len < 0)
+        return uchar_vec{};
+
+    result.resize(len);
+    return result;
+}
+
+/**
+ * Decrypts data using the given private key.
+ *
+ * @param private_key The private RSA key.
+ * @param data The data to decrypt.
+ *
+ * @return The original message or an empty uchar_vec if something went wrong.
+ */
+uchar_vec rsa_decrypt(RSA* private_key, const uchar_vec &data)
+{
+    // The scratch buffer is in secure memory and wiped when it goes out of
+    // scope.
+    secure_vec buf(rsa_size(private_key));
+
+    int len = rsa_decrypt(private_key, data, buf);
+    if (len < 0)
+        return uchar_vec{};
+
+    return uchar_vec{buf.begin(), buf.begin() + len};
+}
+
+/**
+ * Signs the message using RSA and the specified algorithm.
+ *
+ * @param private_key The private key to sign with.
+ * @param msg The message to sign.
+ * @param algo The algorithm to use to sign.
+ *
+ * @return The signature or an empty char_vec{} if something went wrong.
+ */
+uchar_vec rsa_sign(RSA *private_key, const uchar_vec &msg, int algo)
+{
+    uchar_vec sig(rsa_size(private_key));
+
+    int len = rsa_sign(private_key, msg, algo, sig);
+    if (len < 0)
+        return uchar_vec{};
+
+    sig.resize(len);
+    return sig;
+}
+
+/**
+ * Verifies the signature using RSA and the specified algorithm.
+ *
+ * @return True if the signature is verified, false otherwise or if an error
+ * occurred.
+ */
+bool rsa_verify(RSA *public_key, const uchar_vec &sig, const uchar_vec &msg,
+        int algo)
+{
+    return rsa_verify(public_key, const_uchar_span{sig}, const_uchar_span{msg},
+            algo);
+}
+
 #endif
@@ -0,0 +1,282 @@
+#ifndef ESO_CRYPTO_SECURE_ARENA
+#define ESO_CRYPTO_SECURE_ARENA
+
+#include <cstddef>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "memory.h"
+
+/*
+ * A pool allocator for key material and crypto scratch buffers.
+ *
+ * Small requests are served from slabs of fixed size classes (32 bytes to
+ * 4 KiB). Each slab is its own mapping with an inaccessible guard page on
+ * either side, is locked into memory so it is never swapped, and is excluded
+ * from core dumps where the kernel supports it. Requests larger than the
+ * biggest size class get a dedicated guarded mapping.
+ *
+ * Memory is wiped when it is returned, so every allocation starts zeroed.
+ *
+ * If the memory lock limit (RLIMIT_MEMLOCK) is exhausted the arena keeps
+ * working with unlocked memory; stats().unlocked reports how much.
+ */
+
+// Usage counters of the arena. Sizes are in bytes.
+struct SecureArenaStats
+{
+    // Memory mapped for keys, excluding guard pages.
+    size_t reserved;
+    // Reserved memory that could not be locked.
+    size_t unlocked;
+    // Memory handed out, rounded up to the size class.
+    size_t in_use;
+    // The largest in_use has been.
+    size_t peak_in_use;
+    unsigned long allocations;
+    unsigned long frees;
+};
+
+class SecureArena
+{
+public:
+    // The process wide arena.
+    static SecureArena &instance();
+    // Returns zeroed memory for n bytes. Throws std::bad_alloc on failure.
+    void *allocate(size_t n);
+    // Wipes and releases memory returned by allocate(n).
+    void deallocate(void *p, size_t n);
+    SecureArenaStats stats() const;
+private:
+    // The arena is never destroyed so that it can be used by other statics.
+    SecureArena();
+    SecureArena(const SecureArena &) = delete;
+    SecureArena &operator=(const SecureArena &) = delete;
+
+    // Returns the size class index for n, or NUM_CLASSES if n is too large.
+    size_t size_class(size_t n) const;
+    // Maps len bytes between two guard pages and returns the usable region.
+    // Sets locked to whether the region could be locked.
+    unsigned char *map_guarded(size_t len, bool &locked);
+    void unmap_guarded(unsigned char *p, size_t len, bool locked);
+    // Adds a slab of slots to the free list of size class c.
+    bool grow(size_t c);
+
+    static const size_t MIN_CLASS = 32;
+    static const size_t NUM_CLASSES = 8;
+    static const size_t SLAB_SIZE = 64 * 1024;
+
+    size_t _page_size;
+    // Intrusive free lists, one per size class.
+    void *_free[NUM_CLASSES];
+    // Large allocations, the length of their mapping and if it is locked.
+    std::unordered_map<void *, std::pair<size_t, bool>> _large;
+    SecureArenaStats _stats;
+    mutable std::mutex _mutex;
+};
+
+SecureArena &SecureArena::instance()
+{
+    static SecureArena *arena = new SecureArena;
+    return *arena;
+}
+
+SecureArena::SecureArena()
+    : _page_size{(size_t) sysconf(_SC_PAGESIZE)}, _stats()
+{
+    for (size_t c = 0; c < NUM_CLASSES; c++)
+        _free[c] = nullptr;
+}
+
+size_t SecureArena::size_class(size_t n) const
+{
+    size_t c = 0;
+    for (size_t class_size = MIN_CLASS; c < NUM_CLASSES; c++, class_size <<= 1)
+        if (n <= class_size)
+            break;
+    return c;
+}
+
+unsigned char *SecureArena::map_guarded(size_t len, bool &locked)
+{
+    size_t total = len + 2 * _page_size;
+    void *base = mmap(nullptr, total, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return nullptr;
+
+    unsigned char *region = (unsigned char *) base + _page_size;
+
+    // Overruns in either direction fault instead of reading other keys.
+    mprotect(base, _page_size, PROT_NONE);
+    mprotect(region + len, _page_size, PROT_NONE);
+
+    locked = mlock(region, len) == 0;
+    if (!locked)
+        _stats.unlocked += len;
+#ifdef MADV_DONTDUMP
+    madvise(region, len, MADV_DONTDUMP);
+#endif
+
+    _stats.reserved += len;
+    return region;
+}
+
+void SecureArena::unmap_guarded(unsigned char *p, size_t len, bool locked)
+{
+    if (locked)
+        munlock(p, len);
+    else
+        _stats.unlocked -= len;
+    munmap(p - _page_size, len + 2 * _page_size);
+    _stats.reserved -= len;
+}
+
+bool SecureArena::grow(size_t c)
+{
+    size_t class_size = MIN_CLASS << c;
+
+    bool locked;
+    unsigned char *slab = map_guarded(SLAB_SIZE, locked);
+    if (!slab)
+        return false;
+
+    // Thread every slot onto the free list.
+    for (size_t off = SLAB_SIZE; off >= class_size; off -= class_size)
+    {
+        void *slot = slab + off - class_size;
+        *(void **) slot = _free[c];
+        _free[c] = slot;
+    }
+
+    return true;
+}
+
+void *SecureArena::allocate(size_t n)
+{
+    if (n == 0)
+        n = 1;
+
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    size_t c = size_class(n);
+    size_t used;
+    void *p;
+
+    if (c < NUM_CLASSES)
+    {
+        if (!_free[c] && !grow(c))
+            throw std::bad_alloc{};
+
+        p = _free[c];
+        _free[c] = *(void **) p;
+        // The rest of the slot was wiped when it was freed.
+        *(void **) p = nullptr;
+        used = MIN_CLASS << c;
+    }
+    else
+    {
+        used = (n + _page_size - 1) / _page_size * _page_size;
+        bool locked;
+        p = map_guarded(used, locked);
+        if (!p)
+            throw std::bad_alloc{};
+        _large[p] = std::make_pair(used, locked);
+    }
+
+    _stats.in_use += used;
+    if (_stats.in_use > _stats.peak_in_use)
+        _stats.peak_in_use = _stats.in_use;
+    _stats.allocations++;
+
+    return p;
+}
+
+void SecureArena::deallocate(void *p, size_t n)
+{
+    if (!p)
+        return;
+
+    if (n == 0)
+        n = 1;
+
+    // Only the bytes that may have been written need wiping.
+    secure_memset(p, 0, n);
+
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    size_t c = size_class(n);
+    if (c < NUM_CLASSES)
+    {
+        *(void **) p = _free[c];
+        _free[c] = p;
+        _stats.in_use -= MIN_CLASS << c;
+    }
+    else
+    {
+        auto it = _large.find(p);
+        if (it == _large.end())
+            return;
+        unmap_guarded((unsigned char *) p, it->second.first,
+                it->second.second);
+        _stats.in_use -= it->second.first;
+        _large.erase(it);
+    }
+
+    _stats.frees++;
+}
+
+SecureArenaStats SecureArena::stats() const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _stats;
+}
+
+/*
+ * An allocator backed by the SecureArena, so that standard containers can
+ * hold key material.
+ */
+template <class T>
+struct secure_allocator
+{
+    typedef T value_type;
+
+    secure_allocator() {}
+    template <class U> secure_allocator(const secure_allocator<U> &) {}
+
+    T *allocate(size_t n)
+    {
+        if (n > std::numeric_limits<size_t>::max() / sizeof(T))
+            throw std::bad_alloc{};
+        return (T *) SecureArena::instance().allocate(n * sizeof(T));
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        SecureArena::instance().deallocate(p, n * sizeof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const secure_allocator<T> &, const secure_allocator<U> &)
+{
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const secure_allocator<T> &, const secure_allocator<U> &)
+{
+    return false;
+}
+
+// A byte buffer for keys and plaintext. It is wiped when released.
+typedef std::vector<unsigned char, secure_allocator<unsigned char>> secure_vec;
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef ESO_DAEMON_PROPAGATION
+#define ESO_DAEMON_PROPAGATION
+
+#include <string>
+
+/*
+ * Returns the name a destination is reported under.
+ */
+std::string destination_name(const std::string &host, const std::string &port)
+{
+    return host + ":" + port;
+}
+
+#endif
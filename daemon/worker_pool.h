@@ -0,0 +1,73 @@
+#ifndef ESO_DAEMON_WORKER_POOL
+#define ESO_DAEMON_WORKER_POOL
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/*
+ * A fixed set of threads that run the tasks handed to them, oldest first.
+ * The threads run for the life of the daemon, so the pool must not be
+ * destroyed.
+ */
+class WorkerPool
+{
+public:
+    // Starts threads threads, or one per core if threads is 0. At most
+    // max_queued tasks wait for a thread.
+    WorkerPool(unsigned int threads, size_t max_queued);
+    // Queues task. Returns false, without queuing it, if the queue is full,
+    // in which case the caller should run it itself.
+    bool submit(std::function<void()> task);
+private:
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    void run();
+
+    std::mutex _mutex;
+    std::condition_variable _queued;
+    std::deque<std::function<void()>> _tasks;
+    size_t _max_queued;
+};
+
+WorkerPool::WorkerPool(unsigned int threads, size_t max_queued)
+    : _max_queued{max_queued}
+{
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+
+    for (unsigned int i = 0; i < threads; i++)
+        std::thread{&WorkerPool::run, this}.detach();
+}
+
+bool WorkerPool::submit(std::function<void()> task)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (_tasks.size() >= _max_queued)
+        return false;
+    _tasks.push_back(std::move(task));
+    _queued.notify_one();
+    return true;
+}
+
+void WorkerPool::run()
+{
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock{_mutex};
+            _queued.wait(lock, [&] { return !_tasks.empty(); });
+            task = std::move(_tasks.front());
+            _tasks.pop_front();
+        }
+        task();
+    }
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef ESO_DATABASE_BACKEND
+#define ESO_DATABASE_BACKEND
+
+#include <cstring>
+
+#include "file_storage.h"
+#include "memory_storage.h"
+#include "mysql_conn.h"
+#include "replica_storage.h"
+#include "storage.h"
+#include "../logger/logger.h"
+
+/*
+ * Returns the daemon's storage backend, chosen by STORAGE_BACKEND in its
+ * mysql_config.h: "mysql", "replica", "file" or "memory". An unknown name
+ * falls back to MySQL.
+ */
+Storage &storage()
+{
+    static Storage *backend = []() -> Storage *
+    {
+        if (strcmp(STORAGE_BACKEND, "memory") == 0)
+        {
+            Logger::log("Using in-memory storage.");
+            return new MemoryStorage;
+        }
+        if (strcmp(STORAGE_BACKEND, "file") == 0)
+            return new FileStorage{STORAGE_PATH};
+        if (strcmp(STORAGE_BACKEND, "replica") == 0)
+            return new ReplicaStorage{*new MySQL_Conn};
+        if (strcmp(STORAGE_BACKEND, "mysql") != 0)
+            Logger::log(std::string{"Unknown storage backend "}
+                    + STORAGE_BACKEND + ", using MySQL.", LogLevel::Error);
+        return new MySQL_Conn;
+    }();
+    return *backend;
+}
+
+#endif
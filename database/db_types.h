@@ -7,6 +7,8 @@
 const int USERPASS      = 1;
 const int SYMMETRIC     = 2;
 const int ASYMMETRIC    = 3;
+const int ECDSA         = 4;
+const int ED25519       = 5;
 
 /*
  * Entity-type types.
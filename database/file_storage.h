@@ -0,0 +1,763 @@
+#ifndef ESO_DATABASE_FILE_STORAGE
+#define ESO_DATABASE_FILE_STORAGE
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "credential.h"
+#include "db_error.h"
+#include "permission.h"
+#include "storage.h"
+#include "../logger/logger.h"
+#include "../util/crc32.h"
+
+/*
+ * A Storage backend kept in two files next to the daemon, so that a local
+ * daemon needs no MySQL server:
+ *
+ *   <path>.log       every change since the last compaction, appended and
+ *                    synced before it is applied.
+ *   <path>.snapshot  every row as of the last compaction.
+ *
+ * All rows are held in hash maps keyed by primary key, so a lookup is one
+ * probe and never touches the disk. Opening the store maps the snapshot,
+ * loads it and replays the log over it.
+ *
+ * Both files are a magic string followed by records:
+ *
+ *   u32 size | u32 crc32 | u8 type | payload
+ *
+ * where size and the CRC cover the type and payload. A record holds a whole
+ * row, as it is after the change, or the key of a deleted row, so replaying
+ * one twice is harmless. Numbers are in host byte order; the files are not
+ * meant to be copied between machines.
+ *
+ * A crash can leave a torn record at the end of the log, which is detected
+ * by its size or CRC and cut off when the store is next opened. Changes
+ * whose append was not synced are lost; esol fetches anything it is missing
+ * from esod again.
+ *
+ * When the log grows past FILE_STORAGE_COMPACT_BYTES and is larger than the
+ * snapshot, a new snapshot is written beside the old one, synced and renamed
+ * over it, and the log is emptied.
+ */
+
+// The log size that triggers a compaction.
+const uint64_t FILE_STORAGE_COMPACT_BYTES = 4 << 20;
+
+class FileStorage : public Storage
+{
+public:
+    // Opens the store kept in path.log and path.snapshot, creating it if
+    // needed. If the log cannot be opened, the store still serves what it
+    // loaded, but every write fails.
+    explicit FileStorage(const std::string &path);
+    ~FileStorage();
+
+    int create_permission(const Permission perm) const;
+    int insert_permission(const Permission perm) const;
+    int update_permission(const Permission perm) const;
+    int delete_permission(const Permission perm) const;
+    int create_credential(const Credential cred) const;
+    int delete_credential(const Credential cred) const;
+
+    int insert_permissions(const std::vector<Permission> &perms) const;
+    int delete_permissions(const std::vector<Permission> &perms) const;
+    int create_credentials(const std::vector<Credential> &creds) const;
+
+    Credential get_credential(const Credential cred) const;
+    std::vector<Credential> get_all_credentials(const char *set_name) const;
+    Permission get_permission(const Permission perm) const;
+    std::vector<Permission> get_all_permissions(const char *set_name) const;
+
+    int scan_permissions(std::vector<Permission> &perms) const;
+    int scan_credentials(std::vector<Credential> &creds) const;
+private:
+    FileStorage(const FileStorage &) = delete;
+    FileStorage &operator=(const FileStorage &) = delete;
+
+    enum RecordType : uint8_t
+    {
+        PUT_PERMISSION = 1,
+        DELETE_PERMISSION = 2,
+        PUT_CREDENTIAL = 3,
+        DELETE_CREDENTIAL = 4
+    };
+
+    // A change, or a row of the snapshot.
+    struct Record
+    {
+        RecordType type;
+        Permission perm;
+        Credential cred;
+    };
+
+    // Appends the record to out.
+    static void encode(const Record &record, std::string &out);
+    // Reads the record at p, before end, and moves p past it. Returns false,
+    // leaving p, if the record is torn or damaged.
+    static bool decode(const char *&p, const char *end, Record &record);
+
+    // Loads the snapshot. Returns its size.
+    uint64_t load_snapshot(const std::string &path);
+    // Opens the log, replays it and cuts off a torn tail.
+    void open_log();
+    // Decodes the records of a file read at data, after its magic string,
+    // and applies them. Returns the offset just past the last good record.
+    size_t replay(const char *data, size_t size) const;
+
+    // The callers of the methods below hold _mutex.
+
+    // Appends records to the log, syncs it, and then applies them. Returns
+    // 0 on success, in which case the store may also be compacted.
+    int commit(const std::vector<Record> &records) const;
+    void apply(const Record &record) const;
+    void compact() const;
+    const Permission *find(const std::string &perm_key) const;
+
+    std::string _log_path;
+    std::string _snapshot_path;
+
+    // Methods are const like MySQL_Conn's, but the rows and files are ours.
+    mutable std::mutex _mutex;
+    mutable int _log_fd;
+    mutable uint64_t _log_size;
+    mutable uint64_t _snapshot_size;
+    mutable std::unordered_map<std::string, Permission> _permissions;
+    mutable std::unordered_map<std::string, Credential> _credentials;
+};
+
+const char FILE_STORAGE_LOG_MAGIC[] = "ESOLOG1\n";
+const char FILE_STORAGE_SNAPSHOT_MAGIC[] = "ESOSNP1\n";
+const size_t FILE_STORAGE_MAGIC_SIZE = sizeof FILE_STORAGE_LOG_MAGIC - 1;
+// The size and CRC before each record.
+const size_t FILE_STORAGE_RECORD_HEADER = 8;
+
+/*
+ * Writes all size bytes at data to fd. Returns false on error.
+ */
+bool write_all(int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+/*
+ * Syncs the directory holding path, so that a file renamed into it stays
+ * there after a crash.
+ */
+void sync_parent_dir(const std::string &path)
+{
+    size_t slash = path.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+    int fd = open(dir.c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+void put_u32(std::string &out, uint32_t value)
+{
+    out.append(reinterpret_cast<const char *>(&value), sizeof value);
+}
+
+void put_u64(std::string &out, uint64_t value)
+{
+    out.append(reinterpret_cast<const char *>(&value), sizeof value);
+}
+
+void put_string(std::string &out, const std::string &value)
+{
+    put_u32(out, value.size());
+    out += value;
+}
+
+/*
+ * Reads the fields of a record's payload. ok is cleared if one runs past
+ * the end.
+ */
+struct FieldReader
+{
+    uint32_t u32()
+    {
+        uint32_t value = 0;
+        if (end - p < (ptrdiff_t) sizeof value)
+        {
+            ok = false;
+            return 0;
+        }
+        memcpy(&value, p, sizeof value);
+        p += sizeof value;
+        return value;
+    }
+
+    uint64_t u64()
+    {
+        uint64_t value = 0;
+        if (end - p < (ptrdiff_t) sizeof value)
+        {
+            ok = false;
+            return 0;
+        }
+        memcpy(&value, p, sizeof value);
+        p += sizeof value;
+        return value;
+    }
+
+    std::string string()
+    {
+        uint32_t size = u32();
+        if (!ok || (size_t) (end - p) < size)
+        {
+            ok = false;
+            return std::string{};
+        }
+        std::string value{p, size};
+        p += size;
+        return value;
+    }
+
+    const char *p;
+    const char *end;
+    bool ok;
+};
+
+FileStorage::FileStorage(const std::string &path)
+    : _log_path{path + ".log"}, _snapshot_path{path + ".snapshot"},
+    _log_fd{-1}, _log_size{0}, _snapshot_size{0}
+{
+    _snapshot_size = load_snapshot(_snapshot_path);
+    open_log();
+
+    ESO_LOG(LogLevel::Info, "FileStorage: opened ", path, " with ",
+            _permissions.size(), " permissions and ", _credentials.size(),
+            " credentials.");
+}
+
+FileStorage::~FileStorage()
+{
+    if (_log_fd >= 0)
+        close(_log_fd);
+}
+
+void FileStorage::encode(const Record &record, std::string &out)
+{
+    std::string payload(1, (char) record.type);
+    if (record.type == PUT_PERMISSION || record.type == DELETE_PERMISSION)
+    {
+        put_string(payload, record.perm.set_name);
+        put_string(payload, record.perm.entity);
+        put_u32(payload, record.perm.entity_type);
+        put_u32(payload, record.perm.op);
+        put_string(payload, record.perm.loc);
+    }
+    else
+    {
+        const Credential &cred = record.cred;
+        put_string(payload, cred.set_name);
+        put_u32(payload, cred.version);
+        put_u32(payload, cred.type);
+        put_string(payload, cred.algo);
+        put_u32(payload, cred.size);
+        put_string(payload, cred.p_owner);
+        put_string(payload, cred.s_owner);
+        put_string(payload, cred.expiration);
+        put_string(payload, cred.symKey);
+        put_string(payload, cred.priKey);
+        put_string(payload, cred.pubKey);
+        put_string(payload, cred.user);
+        put_string(payload, cred.pass);
+    }
+
+    put_u32(out, payload.size());
+    put_u32(out, crc32(payload.data(), payload.size()));
+    out += payload;
+}
+
+bool FileStorage::decode(const char *&p, const char *end, Record &record)
+{
+    if ((size_t) (end - p) < FILE_STORAGE_RECORD_HEADER)
+        return false;
+
+    uint32_t size, crc;
+    memcpy(&size, p, sizeof size);
+    memcpy(&crc, p + sizeof size, sizeof crc);
+    const char *payload = p + FILE_STORAGE_RECORD_HEADER;
+    if (size == 0 || (size_t) (end - payload) < size
+            || crc32(payload, size) != crc)
+        return false;
+
+    FieldReader in{payload + 1, payload + size, true};
+    record.type = (RecordType) payload[0];
+    switch (record.type)
+    {
+        case PUT_PERMISSION:
+        case DELETE_PERMISSION:
+            record.perm.set_name = in.string();
+            record.perm.entity = in.string();
+            record.perm.entity_type = in.u32();
+            record.perm.op = in.u32();
+            record.perm.loc = in.string();
+            break;
+        case PUT_CREDENTIAL:
+        case DELETE_CREDENTIAL:
+            record.cred.set_name = in.string();
+            record.cred.version = in.u32();
+            record.cred.type = in.u32();
+            record.cred.algo = in.string();
+            record.cred.size = in.u32();
+            record.cred.p_owner = in.string();
+            record.cred.s_owner = in.string();
+            record.cred.expiration = in.string();
+            record.cred.symKey = in.string();
+            record.cred.priKey = in.string();
+            record.cred.pubKey = in.string();
+            record.cred.user = in.string();
+            record.cred.pass = in.string();
+            break;
+        default:
+            return false;
+    }
+    if (!in.ok || in.p != in.end)
+        return false;
+
+    p = payload + size;
+    return true;
+}
+
+size_t FileStorage::replay(const char *data, size_t size) const
+{
+    const char *p = data + FILE_STORAGE_MAGIC_SIZE;
+    const char *end = data + size;
+    Record record;
+    while (p < end && decode(p, end, record))
+        apply(record);
+    return p - data;
+}
+
+uint64_t FileStorage::load_snapshot(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < FILE_STORAGE_MAGIC_SIZE)
+    {
+        close(fd);
+        return 0;
+    }
+
+    // Mapped rather than read, so the rows are decoded straight from the
+    // page cache.
+    size_t size = st.st_size;
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        Logger::log("FileStorage: cannot map " + path, LogLevel::Error);
+        return 0;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    const char *bytes = static_cast<const char *>(data);
+    if (memcmp(bytes, FILE_STORAGE_SNAPSHOT_MAGIC, FILE_STORAGE_MAGIC_SIZE))
+        Logger::log(path + " is not a snapshot; ignoring it.", LogLevel::Error);
+    else if (replay(bytes, size) != size)
+        Logger::log(path + " is damaged; ignoring the rest of it.",
+                LogLevel::Error);
+
+    munmap(data, size);
+    return size;
+}
+
+void FileStorage::open_log()
+{
+    _log_fd = open(_log_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (_log_fd < 0)
+    {
+        Logger::log("FileStorage: cannot open " + _log_path + ": "
+                + strerror(errno), LogLevel::Error);
+        return;
+    }
+
+    struct stat st;
+    if (fstat(_log_fd, &st) != 0)
+        st.st_size = 0;
+    size_t size = st.st_size;
+
+    size_t good = 0;
+    if (size >= FILE_STORAGE_MAGIC_SIZE)
+    {
+        void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, _log_fd, 0);
+        if (data != MAP_FAILED)
+        {
+            const char *bytes = static_cast<const char *>(data);
+            if (memcmp(bytes, FILE_STORAGE_LOG_MAGIC, FILE_STORAGE_MAGIC_SIZE))
+                Logger::log(_log_path + " is not a log; starting it again.",
+                        LogLevel::Error);
+            else
+                good = replay(bytes, size);
+            munmap(data, size);
+        }
+    }
+
+    if (good > 0 && good == size)
+    {
+        _log_size = size;
+        return;
+    }
+
+    // Cut off the torn tail, or start a new log.
+    if (good > 0)
+        Logger::log(_log_path + " has a torn tail; cutting it off.",
+                LogLevel::Warning);
+    if (good == 0)
+    {
+        if (ftruncate(_log_fd, 0) != 0
+                || !write_all(_log_fd, FILE_STORAGE_LOG_MAGIC,
+                    FILE_STORAGE_MAGIC_SIZE))
+        {
+            Logger::log("FileStorage: cannot write " + _log_path,
+                    LogLevel::Error);
+            close(_log_fd);
+            _log_fd = -1;
+            return;
+        }
+        good = FILE_STORAGE_MAGIC_SIZE;
+    }
+    else if (ftruncate(_log_fd, good) != 0)
+    {
+        Logger::log("FileStorage: cannot truncate " + _log_path,
+                LogLevel::Error);
+    }
+    fsync(_log_fd);
+    _log_size = good;
+}
+
+void FileStorage::apply(const Record &record) const
+{
+    switch (record.type)
+    {
+        case PUT_PERMISSION:
+            _permissions[permission_key(record.perm)] = record.perm;
+            break;
+        case DELETE_PERMISSION:
+            _permissions.erase(permission_key(record.perm));
+            break;
+        case PUT_CREDENTIAL:
+            _credentials[credential_key(record.cred)] = record.cred;
+            break;
+        case DELETE_CREDENTIAL:
+            _credentials.erase(credential_key(record.cred));
+            break;
+    }
+}
+
+int FileStorage::commit(const std::vector<Record> &records) const
+{
+    if (records.empty())
+        return OK;
+    if (_log_fd < 0)
+        return CANNOT_CONNECT;
+
+    std::string data;
+    for (const Record &record : records)
+        encode(record, data);
+
+    if (!write_all(_log_fd, data.data(), data.size())
+            || fdatasync(_log_fd) != 0)
+    {
+        Logger::log("FileStorage: cannot append to " + _log_path + ": "
+                + strerror(errno), LogLevel::Error);
+        // Drop whatever part of the records was written.
+        if (ftruncate(_log_fd, _log_size) != 0)
+            Logger::log("FileStorage: cannot truncate " + _log_path,
+                    LogLevel::Error);
+        return CANNOT_QUERY;
+    }
+    _log_size += data.size();
+
+    for (const Record &record : records)
+        apply(record);
+
+    if (_log_size > FILE_STORAGE_COMPACT_BYTES && _log_size > _snapshot_size)
+        compact();
+    return OK;
+}
+
+void FileStorage::compact() const
+{
+    std::string data{FILE_STORAGE_SNAPSHOT_MAGIC, FILE_STORAGE_MAGIC_SIZE};
+    Record record;
+    record.type = PUT_PERMISSION;
+    for (auto &row : _permissions)
+    {
+        record.perm = row.second;
+        encode(record, data);
+    }
+    record.type = PUT_CREDENTIAL;
+    for (auto &row : _credentials)
+    {
+        record.cred = row.second;
+        encode(record, data);
+    }
+
+    // The old snapshot stays in place until the new one is complete.
+    std::string tmp_path = _snapshot_path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    bool written = fd >= 0 && write_all(fd, data.data(), data.size())
+        && fsync(fd) == 0;
+    if (fd >= 0)
+        close(fd);
+    if (!written || rename(tmp_path.c_str(), _snapshot_path.c_str()) != 0)
+    {
+        Logger::log("FileStorage: cannot write " + _snapshot_path
+                + "; keeping the log.", LogLevel::Error);
+        unlink(tmp_path.c_str());
+        return;
+    }
+    sync_parent_dir(_snapshot_path);
+    _snapshot_size = data.size();
+
+    // Everything in the log is now in the snapshot. If we crash before the
+    // log is emptied, replaying it over the snapshot changes nothing.
+    if (ftruncate(_log_fd, FILE_STORAGE_MAGIC_SIZE) != 0)
+    {
+        Logger::log("FileStorage: cannot empty " + _log_path,
+                LogLevel::Error);
+        return;
+    }
+    fdatasync(_log_fd);
+    _log_size = FILE_STORAGE_MAGIC_SIZE;
+
+    ESO_LOG(LogLevel::Info, "FileStorage: compacted to ", _snapshot_size,
+            " bytes.");
+}
+
+const Permission *FileStorage::find(const std::string &perm_key) const
+{
+    auto found = _permissions.find(perm_key);
+    return found == _permissions.end() ? nullptr : &found->second;
+}
+
+int FileStorage::create_permission(const Permission perm) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (find(permission_key(perm)))
+        return ALREADY_EXISTS;
+    return commit({Record{PUT_PERMISSION, perm, Credential{}}});
+}
+
+int FileStorage::insert_permission(const Permission perm) const
+{
+    return insert_permissions({perm});
+}
+
+int FileStorage::update_permission(const Permission perm) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    const Permission *old = find(permission_key(perm));
+    if (!old)
+        return OK;
+
+    Record record{PUT_PERMISSION, *old, Credential{}};
+    record.perm.op = perm.op;
+    return commit({record});
+}
+
+int FileStorage::delete_permission(const Permission perm) const
+{
+    return delete_permissions({perm});
+}
+
+int FileStorage::create_credential(const Credential cred) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (_credentials.count(credential_key(cred)))
+        return ALREADY_EXISTS;
+    return commit({Record{PUT_CREDENTIAL, Permission{}, cred}});
+}
+
+int FileStorage::delete_credential(const Credential cred) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (!_credentials.count(credential_key(cred)))
+        return OK;
+    return commit({Record{DELETE_CREDENTIAL, Permission{}, cred}});
+}
+
+/*
+ * Like INSERT ... ON DUPLICATE KEY UPDATE op, only the op of an existing
+ * permission changes. All of the batch is appended with one sync.
+ */
+int FileStorage::insert_permissions(const std::vector<Permission> &perms)
+    const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    std::vector<Record> records;
+    // The rows as this batch leaves them, for repeated keys.
+    std::unordered_map<std::string, size_t> batch;
+    for (const Permission &perm : perms)
+    {
+        std::string k = permission_key(perm);
+        Record record{PUT_PERMISSION, perm, Credential{}};
+
+        auto earlier = batch.find(k);
+        const Permission *old = earlier != batch.end()
+            ? &records[earlier->second].perm : find(k);
+        if (old)
+        {
+            record.perm = *old;
+            record.perm.op = perm.op;
+        }
+
+        batch[k] = records.size();
+        records.push_back(record);
+    }
+    return commit(records);
+}
+
+int FileStorage::delete_permissions(const std::vector<Permission> &perms)
+    const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    std::vector<Record> records;
+    for (const Permission &perm : perms)
+    {
+        if (find(permission_key(perm)))
+            records.push_back(Record{DELETE_PERMISSION, perm, Credential{}});
+    }
+    return commit(records);
+}
+
+/*
+ * Like INSERT IGNORE, credentials that already exist are skipped.
+ */
+int FileStorage::create_credentials(const std::vector<Credential> &creds)
+    const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    std::vector<Record> records;
+    std::unordered_set<std::string> batch;
+    for (const Credential &cred : creds)
+    {
+        std::string k = credential_key(cred);
+        if (!_credentials.count(k) && batch.insert(k).second)
+            records.push_back(Record{PUT_CREDENTIAL, Permission{}, cred});
+    }
+    return commit(records);
+}
+
+Credential FileStorage::get_credential(const Credential cred) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    auto found = _credentials.find(credential_key(cred));
+    if (found == _credentials.end())
+        return Credential{};
+    return found->second;
+}
+
+/*
+ * A scan of every credential; local daemons only look credentials up by
+ * key.
+ */
+std::vector<Credential> FileStorage::get_all_credentials(const char *set_name)
+    const
+{
+    std::vector<Credential> creds;
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    for (auto &row : _credentials)
+    {
+        if (row.second.set_name != set_name)
+            continue;
+
+        // Without the keys, as from MySQL_Conn.
+        Credential cred;
+        cred.set_name = row.second.set_name;
+        cred.version = row.second.version;
+        cred.type = row.second.type;
+        cred.expiration = row.second.expiration;
+        cred.p_owner = row.second.p_owner;
+        cred.s_owner = row.second.s_owner;
+        cred.algo = row.second.algo;
+        cred.size = row.second.size;
+        creds.push_back(cred);
+    }
+    return creds;
+}
+
+Permission FileStorage::get_permission(const Permission perm) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    const Permission *found = find(permission_key(perm));
+    return found ? *found : Permission{};
+}
+
+/*
+ * A scan of every permission, like get_all_credentials().
+ */
+std::vector<Permission> FileStorage::get_all_permissions(const char *set_name)
+    const
+{
+    std::vector<Permission> perms;
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    for (auto &row : _permissions)
+    {
+        if (row.second.set_name == set_name)
+            perms.push_back(row.second);
+    }
+    return perms;
+}
+
+int FileStorage::scan_permissions(std::vector<Permission> &perms) const
+{
+    perms.clear();
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    perms.reserve(_permissions.size());
+    for (auto &row : _permissions)
+        perms.push_back(row.second);
+    return OK;
+}
+
+int FileStorage::scan_credentials(std::vector<Credential> &creds) const
+{
+    creds.clear();
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    creds.reserve(_credentials.size());
+    for (auto &row : _credentials)
+        creds.push_back(row.second);
+    return OK;
+}
+
+#endif
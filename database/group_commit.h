@@ -0,0 +1,347 @@
+#ifndef ESO_DATABASE_GROUP_COMMIT
+#define ESO_DATABASE_GROUP_COMMIT
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "credential.h"
+#include "db_error.h"
+#include "backend.h"
+#include "permission.h"
+#include "../logger/logger.h"
+#include "../stats/propagation.h"
+#include "../stats/report.h"
+
+/*
+ * Writes propagated changes to the daemon's database in batches.
+ *
+ * A change is queued and written later by a background thread, which waits
+ * up to GROUP_COMMIT_WINDOW_US after the first change of a batch for more to
+ * arrive, or until GROUP_COMMIT_MAX are queued (see the daemon's
+ * mysql_config.h). The batch is then written in queue order with the batch
+ * writes of the storage backend, one transaction for each run of changes of
+ * the same kind. If a batch fails, its changes are written one at a time, so
+ * that one bad change does not lose the others.
+ *
+ * A change is visible to readers once it is written, so a read that must see
+ * every change received so far calls flush() first.
+ *
+ * The apply latency of a change is recorded from when it was queued until
+ * it was committed.
+ *
+ * A change may carry the sequence number esoca gave it. After each batch,
+ * the hook set with on_written() is called with the highest one written.
+ * Once a change could not be written, it is called only with those written
+ * before it, so that a position saved from the hook stays before the lost
+ * change, which is then fetched and written again after a restart.
+ */
+class GroupCommit
+{
+public:
+    static GroupCommit &instance();
+
+    void insert_permission(const Permission &perm, uint64_t seq = 0);
+    void delete_permission(const Permission &perm, uint64_t seq = 0);
+    void create_credential(const Credential &cred, uint64_t seq = 0);
+
+    // Sets the function called on the writing thread with the highest
+    // sequence number of each batch written. Must be set before the first
+    // change is queued.
+    void on_written(std::function<void(uint64_t)> hook);
+
+    // The number of changes queued so far, to pass to flush().
+    uint64_t position() const;
+
+    // Waits until every change queued before the call has been written.
+    // Returns at once if none are waiting. Returns false if a change queued
+    // after position since could not be written.
+    bool flush(uint64_t since = 0);
+
+    // Appends the batching counters to a stats report.
+    void append_to(std::string &report);
+private:
+    GroupCommit();
+
+    enum class Change
+    {
+        InsertPermission,
+        DeletePermission,
+        CreateCredential
+    };
+
+    // A change waiting to be written.
+    struct Pending
+    {
+        Change change;
+        Permission perm;
+        Credential cred;
+        // stats_now_ns() when it was queued.
+        uint64_t queued_ns;
+        // esoca's sequence number for the change, or 0.
+        uint64_t seq;
+        // Its place in the queue, counting from 1.
+        uint64_t position;
+    };
+
+    void queue(Pending pending);
+    // The background thread: writes batches as they fill up.
+    void write_loop();
+    // Writes a batch in order. Returns the index of the first change that
+    // could not be written, or the batch's size.
+    size_t write(const std::vector<Pending> &batch);
+    // Writes batch[first, last), which are all the same kind of change.
+    // Returns the index of the first that could not be written, or last.
+    size_t write_run(const std::vector<Pending> &batch, size_t first,
+            size_t last);
+    // Writes one change on its own. Returns 0 on success.
+    int write_one(const Pending &pending) const;
+
+    std::mutex _mutex;
+    // Signalled when a change is queued or a flush is requested.
+    std::condition_variable _queued_cv;
+    // Signalled when a batch has been written.
+    std::condition_variable _written_cv;
+    std::vector<Pending> _pending;
+    bool _flush_requested;
+    std::function<void(uint64_t)> _written_hook;
+
+    // Changes queued and written since the daemon started, and the end of
+    // the last batch in which a change could not be written, or 0. Atomic so
+    // that flush() need not lock when nothing is waiting.
+    std::atomic<uint64_t> _queued;
+    std::atomic<uint64_t> _written;
+    std::atomic<uint64_t> _last_failed;
+
+    // Transactions written, runs that failed and were written one change at
+    // a time, and changes that could not be written.
+    uint64_t _batches;
+    uint64_t _fallbacks;
+    uint64_t _failed;
+};
+
+GroupCommit &GroupCommit::instance()
+{
+    static GroupCommit *group_commit = new GroupCommit;
+    return *group_commit;
+}
+
+/*
+ * The first use is in the daemon's work(), after it has forked, so the
+ * thread runs in the daemon process.
+ */
+GroupCommit::GroupCommit()
+    : _flush_requested{false}, _queued{0}, _written{0}, _last_failed{0},
+    _batches{0}, _fallbacks{0}, _failed{0}
+{
+    std::thread{&GroupCommit::write_loop, this}.detach();
+}
+
+void GroupCommit::insert_permission(const Permission &perm, uint64_t seq)
+{
+    queue(Pending{Change::InsertPermission, perm, Credential{},
+            stats_now_ns(), seq, 0});
+}
+
+void GroupCommit::delete_permission(const Permission &perm, uint64_t seq)
+{
+    queue(Pending{Change::DeletePermission, perm, Credential{},
+            stats_now_ns(), seq, 0});
+}
+
+void GroupCommit::create_credential(const Credential &cred, uint64_t seq)
+{
+    queue(Pending{Change::CreateCredential, Permission{}, cred,
+            stats_now_ns(), seq, 0});
+}
+
+void GroupCommit::on_written(std::function<void(uint64_t)> hook)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    _written_hook = std::move(hook);
+}
+
+void GroupCommit::queue(Pending pending)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    pending.position = ++_queued;
+    _pending.push_back(std::move(pending));
+    _queued_cv.notify_one();
+}
+
+uint64_t GroupCommit::position() const
+{
+    return _queued.load();
+}
+
+/*
+ * A change queued after the call that failed may also make it return false,
+ * which only makes the caller try again.
+ */
+bool GroupCommit::flush(uint64_t since)
+{
+    uint64_t target = _queued.load();
+    if (_written.load() < target)
+    {
+        std::unique_lock<std::mutex> lock{_mutex};
+        _flush_requested = true;
+        _queued_cv.notify_one();
+        _written_cv.wait(lock, [&] { return _written.load() >= target; });
+    }
+    return _last_failed.load() <= since;
+}
+
+void GroupCommit::write_loop()
+{
+    std::vector<Pending> batch;
+
+    std::unique_lock<std::mutex> lock{_mutex};
+    while (true)
+    {
+        _queued_cv.wait(lock, [&] { return !_pending.empty(); });
+
+        auto deadline = std::chrono::steady_clock::now()
+            + std::chrono::microseconds(GROUP_COMMIT_WINDOW_US);
+        _queued_cv.wait_until(lock, deadline, [&]
+        {
+            return _flush_requested || _pending.size() >= GROUP_COMMIT_MAX;
+        });
+
+        batch.swap(_pending);
+        _flush_requested = false;
+        lock.unlock();
+
+        size_t written = write(batch);
+
+        uint64_t seq = 0;
+        if (_last_failed.load() == 0)
+            for (size_t i = 0; i < written; i++)
+                seq = std::max(seq, batch[i].seq);
+        if (seq > 0 && _written_hook)
+            _written_hook(seq);
+
+        lock.lock();
+        if (written < batch.size())
+            _last_failed = batch.back().position;
+        _written += batch.size();
+        batch.clear();
+        _written_cv.notify_all();
+    }
+}
+
+size_t GroupCommit::write(const std::vector<Pending> &batch)
+{
+    size_t failed = batch.size();
+    size_t first = 0;
+    while (first < batch.size())
+    {
+        size_t last = first + 1;
+        while (last < batch.size()
+                && batch[last].change == batch[first].change)
+            last++;
+
+        size_t run_failed = write_run(batch, first, last);
+        if (run_failed < last)
+            failed = std::min(failed, run_failed);
+        first = last;
+    }
+    return failed;
+}
+
+size_t GroupCommit::write_run(const std::vector<Pending> &batch,
+        size_t first, size_t last)
+{
+    Storage &conn = storage();
+    int ret;
+    if (batch[first].change == Change::CreateCredential)
+    {
+        std::vector<Credential> creds;
+        for (size_t i = first; i < last; i++)
+            creds.push_back(batch[i].cred);
+        ret = conn.create_credentials(creds);
+    }
+    else
+    {
+        std::vector<Permission> perms;
+        for (size_t i = first; i < last; i++)
+            perms.push_back(batch[i].perm);
+        if (batch[first].change == Change::InsertPermission)
+            ret = conn.insert_permissions(perms);
+        else
+            ret = conn.delete_permissions(perms);
+    }
+
+    uint64_t fallbacks = 0;
+    uint64_t failed = 0;
+    size_t first_failed = last;
+    // The transaction was rolled back, so none of the run was written.
+    if (ret != OK && last - first > 1)
+    {
+        Logger::log("GroupCommit: batch failed, writing its changes one at "
+                "a time.", LogLevel::Error);
+        fallbacks = 1;
+        for (size_t i = first; i < last; i++)
+        {
+            if (write_one(batch[i]) != OK)
+            {
+                failed++;
+                first_failed = std::min(first_failed, i);
+            }
+            propagation_record(PROP_APPLY, batch[i].queued_ns);
+        }
+    }
+    else
+    {
+        if (ret != OK)
+        {
+            failed = 1;
+            first_failed = first;
+        }
+        for (size_t i = first; i < last; i++)
+            propagation_record(PROP_APPLY, batch[i].queued_ns);
+    }
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    _batches++;
+    _fallbacks += fallbacks;
+    _failed += failed;
+    return first_failed;
+}
+
+/*
+ * A credential is written as a batch of one, which skips one that is
+ * already there, as a batch does: changes may be applied twice.
+ */
+int GroupCommit::write_one(const Pending &pending) const
+{
+    Storage &conn = storage();
+    switch (pending.change)
+    {
+        case Change::InsertPermission:
+            return conn.insert_permission(pending.perm);
+        case Change::DeletePermission:
+            return conn.delete_permission(pending.perm);
+        case Change::CreateCredential:
+            return conn.create_credentials({pending.cred});
+    }
+    return CANNOT_QUERY;
+}
+
+void GroupCommit::append_to(std::string &report)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    append_counter(report, "group_commit_queued", _queued.load());
+    append_counter(report, "group_commit_written", _written.load());
+    append_counter(report, "group_commit_transactions", _batches);
+    append_counter(report, "group_commit_fallbacks", _fallbacks);
+    append_counter(report, "group_commit_failed", _failed);
+}
+
+#endif
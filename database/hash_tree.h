@@ -0,0 +1,173 @@
+#ifndef ESO_DATABASE_HASH_TREE
+#define ESO_DATABASE_HASH_TREE
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "credential.h"
+#include "permission.h"
+#include "storage.h"
+#include "../util/hash.h"
+
+/*
+ * A hash tree over every permission and credential, for finding the rows
+ * two copies of a database disagree on without sending the rows.
+ *
+ * Each row falls in one of HASH_TREE_LEAVES leaves, picked by the hash of
+ * its primary key. A leaf's hash is the sum of the hashes of its rows, each
+ * of which covers every field, so it does not depend on the order rows are
+ * read in. Every other node's hash is the hash of its HASH_TREE_FANOUT
+ * children's. Two copies whose roots match hold the same rows; otherwise
+ * comparing the children of nodes that differ, one level at a time, leads
+ * to the leaves that differ, and only their rows need to be compared.
+ *
+ * The hashes are 64-bit and not cryptographic: they detect divergence, they
+ * do not authenticate anything.
+ */
+
+const unsigned int HASH_TREE_FANOUT = 16;
+// Levels below the root. Level HASH_TREE_DEPTH is the leaves.
+const unsigned int HASH_TREE_DEPTH = 3;
+const size_t HASH_TREE_LEAVES = 16 * 16 * 16;
+
+class HashTree
+{
+public:
+    // Builds the tree over perms and creds, which it keeps.
+    HashTree(std::vector<Permission> perms, std::vector<Credential> creds);
+
+    // The hash of the index'th node of level, where the root is level 0.
+    // Returns 0 for a node that does not exist.
+    uint64_t node(unsigned int level, size_t index) const;
+
+    // The rows in a leaf.
+    std::vector<const Permission *> permissions(size_t leaf) const;
+    std::vector<const Credential *> credentials(size_t leaf) const;
+
+    // The leaf a row falls in and the hash of the row.
+    static size_t leaf(const Permission &perm);
+    static size_t leaf(const Credential &cred);
+    static uint64_t hash(const Permission &perm);
+    static uint64_t hash(const Credential &cred);
+private:
+    std::vector<Permission> _perms;
+    std::vector<Credential> _creds;
+    // The rows of each leaf, as indices into _perms and _creds.
+    std::vector<std::vector<size_t>> _leaf_perms;
+    std::vector<std::vector<size_t>> _leaf_creds;
+    // _levels[level][index]
+    std::vector<std::vector<uint64_t>> _levels;
+};
+
+/*
+ * Appends a hash to a message, most significant byte first.
+ */
+void put_hash(std::string &out, uint64_t hash)
+{
+    for (int shift = 56; shift >= 0; shift -= 8)
+        out += (char) (hash >> shift);
+}
+
+/*
+ * Reads the hash at offset in a message written with put_hash().
+ */
+uint64_t get_hash(const std::vector<unsigned char> &in, size_t offset)
+{
+    uint64_t hash = 0;
+    for (size_t i = 0; i < 8; i++)
+        hash = (hash << 8) | in[offset + i];
+    return hash;
+}
+
+// Seeds that keep permissions and credentials with equal keys apart.
+const uint64_t HASH_TREE_PERMISSION_SEED = 1;
+const uint64_t HASH_TREE_CREDENTIAL_SEED = 2;
+
+HashTree::HashTree(std::vector<Permission> perms,
+        std::vector<Credential> creds)
+    : _perms(std::move(perms)), _creds(std::move(creds)),
+    _leaf_perms(HASH_TREE_LEAVES), _leaf_creds(HASH_TREE_LEAVES),
+    _levels(HASH_TREE_DEPTH + 1)
+{
+    std::vector<uint64_t> &leaves = _levels[HASH_TREE_DEPTH];
+    leaves.assign(HASH_TREE_LEAVES, 0);
+
+    for (size_t i = 0; i < _perms.size(); i++)
+    {
+        size_t at = leaf(_perms[i]);
+        _leaf_perms[at].push_back(i);
+        leaves[at] += hash(_perms[i]);
+    }
+    for (size_t i = 0; i < _creds.size(); i++)
+    {
+        size_t at = leaf(_creds[i]);
+        _leaf_creds[at].push_back(i);
+        leaves[at] += hash(_creds[i]);
+    }
+
+    for (unsigned int level = HASH_TREE_DEPTH; level > 0; level--)
+    {
+        const std::vector<uint64_t> &children = _levels[level];
+        std::vector<uint64_t> &parents = _levels[level - 1];
+        parents.assign(children.size() / HASH_TREE_FANOUT, 0);
+        for (size_t i = 0; i < parents.size(); i++)
+        {
+            std::string data;
+            for (unsigned int j = 0; j < HASH_TREE_FANOUT; j++)
+                put_hash(data, children[i * HASH_TREE_FANOUT + j]);
+            parents[i] = hash_bytes(data);
+        }
+    }
+}
+
+uint64_t HashTree::node(unsigned int level, size_t index) const
+{
+    if (level > HASH_TREE_DEPTH || index >= _levels[level].size())
+        return 0;
+    return _levels[level][index];
+}
+
+std::vector<const Permission *> HashTree::permissions(size_t leaf) const
+{
+    std::vector<const Permission *> rows;
+    if (leaf < HASH_TREE_LEAVES)
+        for (size_t i : _leaf_perms[leaf])
+            rows.push_back(&_perms[i]);
+    return rows;
+}
+
+std::vector<const Credential *> HashTree::credentials(size_t leaf) const
+{
+    std::vector<const Credential *> rows;
+    if (leaf < HASH_TREE_LEAVES)
+        for (size_t i : _leaf_creds[leaf])
+            rows.push_back(&_creds[i]);
+    return rows;
+}
+
+size_t HashTree::leaf(const Permission &perm)
+{
+    return hash_bytes(permission_key(perm), HASH_TREE_PERMISSION_SEED)
+        % HASH_TREE_LEAVES;
+}
+
+size_t HashTree::leaf(const Credential &cred)
+{
+    return hash_bytes(credential_key(cred), HASH_TREE_CREDENTIAL_SEED)
+        % HASH_TREE_LEAVES;
+}
+
+uint64_t HashTree::hash(const Permission &perm)
+{
+    return hash_bytes(perm.serialize(), HASH_TREE_PERMISSION_SEED);
+}
+
+uint64_t HashTree::hash(const Credential &cred)
+{
+    return hash_bytes(cred.serialize(), HASH_TREE_CREDENTIAL_SEED);
+}
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef ESO_DATABASE_MEMORY_STORAGE
+#define ESO_DATABASE_MEMORY_STORAGE
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "credential.h"
+#include "db_error.h"
+#include "permission.h"
+#include "storage.h"
+
+/*
+ * A Storage backend that keeps everything in the daemon's memory, for
+ * benchmarks, tests and local daemons that only cache what esod sends them.
+ * Nothing survives a restart.
+ *
+ * Rows are kept in maps ordered by primary key, so the rows of a set are
+ * adjacent. One lock guards both maps; every operation is a few map lookups,
+ * so it is held only briefly.
+ */
+class MemoryStorage : public Storage
+{
+public:
+    int create_permission(const Permission perm) const;
+    int insert_permission(const Permission perm) const;
+    int update_permission(const Permission perm) const;
+    int delete_permission(const Permission perm) const;
+    int create_credential(const Credential cred) const;
+    int delete_credential(const Credential cred) const;
+
+    int insert_permissions(const std::vector<Permission> &perms) const;
+    int delete_permissions(const std::vector<Permission> &perms) const;
+    int create_credentials(const std::vector<Credential> &creds) const;
+
+    Credential get_credential(const Credential cred) const;
+    std::vector<Credential> get_all_credentials(const char *set_name) const;
+    Permission get_permission(const Permission perm) const;
+    std::vector<Permission> get_all_permissions(const char *set_name) const;
+
+    int scan_permissions(std::vector<Permission> &perms) const;
+    int scan_credentials(std::vector<Credential> &creds) const;
+private:
+    // (set_name, entity, loc), the primary key of a permission.
+    typedef std::tuple<std::string, std::string, std::string> PermissionKey;
+    // (set_name, version), the primary key of a credential.
+    typedef std::pair<std::string, unsigned int> CredentialKey;
+
+    static PermissionKey key(const Permission &perm);
+    static CredentialKey key(const Credential &cred);
+
+    // Callers hold _mutex.
+    void insert_locked(const Permission &perm) const;
+
+    // The methods are const like MySQL_Conn's, but the rows are ours.
+    mutable std::mutex _mutex;
+    mutable std::map<PermissionKey, Permission> _permissions;
+    mutable std::map<CredentialKey, Credential> _credentials;
+};
+
+MemoryStorage::PermissionKey MemoryStorage::key(const Permission &perm)
+{
+    return PermissionKey{perm.set_name, perm.entity, perm.loc};
+}
+
+MemoryStorage::CredentialKey MemoryStorage::key(const Credential &cred)
+{
+    return CredentialKey{cred.set_name, cred.version};
+}
+
+int MemoryStorage::create_permission(const Permission perm) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (!_permissions.insert(std::make_pair(key(perm), perm)).second)
+        return ALREADY_EXISTS;
+    return OK;
+}
+
+/*
+ * Like INSERT ... ON DUPLICATE KEY UPDATE op, only the op of an existing
+ * permission changes.
+ */
+void MemoryStorage::insert_locked(const Permission &perm) const
+{
+    auto inserted = _permissions.insert(std::make_pair(key(perm), perm));
+    if (!inserted.second)
+        inserted.first->second.op = perm.op;
+}
+
+int MemoryStorage::insert_permission(const Permission perm) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    insert_locked(perm);
+    return OK;
+}
+
+int MemoryStorage::update_permission(const Permission perm) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    auto found = _permissions.find(key(perm));
+    if (found != _permissions.end())
+        found->second.op = perm.op;
+    return OK;
+}
+
+int MemoryStorage::delete_permission(const Permission perm) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    _permissions.erase(key(perm));
+    return OK;
+}
+
+int MemoryStorage::create_credential(const Credential cred) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (!_credentials.insert(std::make_pair(key(cred), cred)).second)
+        return ALREADY_EXISTS;
+    return OK;
+}
+
+int MemoryStorage::delete_credential(const Credential cred) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    _credentials.erase(key(cred));
+    return OK;
+}
+
+int MemoryStorage::insert_permissions(const std::vector<Permission> &perms)
+    const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    for (const Permission &perm : perms)
+        insert_locked(perm);
+    return OK;
+}
+
+int MemoryStorage::delete_permissions(const std::vector<Permission> &perms)
+    const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    for (const Permission &perm : perms)
+        _permissions.erase(key(perm));
+    return OK;
+}
+
+int MemoryStorage::create_credentials(const std::vector<Credential> &creds)
+    const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    for (const Credential &cred : creds)
+        _credentials.insert(std::make_pair(key(cred), cred));
+    return OK;
+}
+
+Credential MemoryStorage::get_credential(const Credential cred) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    auto found = _credentials.find(key(cred));
+    if (found == _credentials.end())
+        return Credential{};
+    return found->second;
+}
+
+std::vector<Credential> MemoryStorage::get_all_credentials(
+        const char *set_name) const
+{
+    std::vector<Credential> creds;
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    for (auto it = _credentials.lower_bound(CredentialKey{set_name, 0});
+            it != _credentials.end() && it->first.first == set_name; ++it)
+    {
+        // Without the keys, as from MySQL_Conn.
+        Credential cred;
+        cred.set_name = it->second.set_name;
+        cred.version = it->second.version;
+        cred.type = it->second.type;
+        cred.expiration = it->second.expiration;
+        cred.p_owner = it->second.p_owner;
+        cred.s_owner = it->second.s_owner;
+        cred.algo = it->second.algo;
+        cred.size = it->second.size;
+        creds.push_back(cred);
+    }
+    return creds;
+}
+
+Permission MemoryStorage::get_permission(const Permission perm) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    auto found = _permissions.find(key(perm));
+    if (found == _permissions.end())
+        return Permission{};
+    return found->second;
+}
+
+std::vector<Permission> MemoryStorage::get_all_permissions(
+        const char *set_name) const
+{
+    std::vector<Permission> perms;
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    for (auto it = _permissions.lower_bound(PermissionKey{set_name, "", ""});
+            it != _permissions.end() && std::get<0>(it->first) == set_name;
+            ++it)
+        perms.push_back(it->second);
+    return perms;
+}
+
+int MemoryStorage::scan_permissions(std::vector<Permission> &perms) const
+{
+    perms.clear();
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    perms.reserve(_permissions.size());
+    for (auto &row : _permissions)
+        perms.push_back(row.second);
+    return OK;
+}
+
+int MemoryStorage::scan_credentials(std::vector<Credential> &creds) const
+{
+    creds.clear();
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    creds.reserve(_credentials.size());
+    for (auto &row : _credentials)
+        creds.push_back(row.second);
+    return OK;
+}
+
+#endif
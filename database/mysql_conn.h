@@ -1,14 +1,22 @@
 #ifndef ESO_DATABASE_MYSQL_CONN
 #define ESO_DATABASE_MYSQL_CONN
 
+#include <functional>
 #include <string.h>
+#include <string>
 #include <vector>
 
 #include "credential.h"
 #include "db_error.h"
 #include "db_types.h"
+#include "mysql_pool.h"
+#include "mysql_stmt.h"
 #include "permission.h"
+#include "storage.h"
+#include "../crypto/secure_arena.h"
 #include "../logger/logger.h"
+#include "../stats/trace.h"
+#include "../util/probes.h"
 
 // Include these after all other files because of the min/max macro problems
 #include <my_global.h>
@@ -46,7 +54,10 @@ CREATE TABLE credentials (
 */
 
 
-class MySQL_Conn
+/*
+ * The Storage backend that keeps everything in the daemon's MySQL database.
+ */
+class MySQL_Conn : public Storage
 {
 public:
     MySQL_Conn();
@@ -69,9 +80,16 @@ public:
     // Creates a new credential, using all the input fields from the given
     // credential.
     int create_credential(const Credential) const;
+
+    // Batch versions of insert_permission, delete_permission and
+    // create_credential. Each writes all of its changes in one transaction
+    // with multi-row statements.
+    int insert_permissions(const std::vector<Permission> &perms) const;
+    int delete_permissions(const std::vector<Permission> &perms) const;
+    int create_credentials(const std::vector<Credential> &creds) const;
     
-    // TODO
-    int delete_credential() const;
+    // Delete the credential with the given set name and version.
+    int delete_credential(const Credential cred) const;
 
     // Get the credential with the given primary key.
     Credential get_credential(const Credential cred) const;
@@ -87,15 +105,70 @@ public:
     // Get all permissions associated with the given set name.
     std::vector<Permission> get_all_permissions(const char *set_name) const;
 
+    // Get every permission and every credential.
+    int scan_permissions(std::vector<Permission> &perms) const;
+    int scan_credentials(std::vector<Credential> &creds) const;
+
     ~MySQL_Conn();
 
 private:
-    void log_error(MYSQL *conn) const;
-    int perform_query(const char *query) const;
-    MYSQL_RES* get_result(const char *query) const;
+    void log_error(MYSQL_STMT *stmt) const;
+    int execute(const std::string &sql, MySQL_Binds &params) const;
+    int query(const std::string &sql, MySQL_Binds &params,
+            MySQL_Binds &results,
+            const std::function<void(MYSQL_STMT *)> &on_row) const;
+    int run(const std::string &sql, MySQL_Binds &params, MySQL_Binds &results,
+            const std::function<void(MYSQL_STMT *)> &on_row, bool &found)
+        const;
+    int run_on(PooledConnection *conn, const std::string &sql,
+            MySQL_Binds &params, MySQL_Binds &results,
+            const std::function<void(MYSQL_STMT *)> &on_row, bool &found,
+            unsigned int &err) const;
+    int transaction(const std::function<int(PooledConnection *,
+                unsigned int &)> &body) const;
+    template <class T>
+    int write_rows(const std::vector<T> &rows, const char *prefix,
+            const char *table, const char *middle, const char *row,
+            const char *separator, const char *suffix, size_t row_params,
+            void (*bind)(MySQL_Binds &, size_t, const T &)) const;
 
 };
 
+/*
+ * The longest values of the string columns, in bytes. A character may take
+ * up to four bytes.
+ */
+const size_t SET_NAME_BYTES = 255 * 4;
+const size_t ENTITY_BYTES = 32 * 4;
+const size_t LOC_BYTES = 300 * 4;
+const size_t ALGO_BYTES = 255 * 4;
+const size_t OWNER_BYTES = 32 * 4;
+const size_t EXPIRATION_BYTES = 32 * 4;
+
+/*
+ * Returns "<prefix><table><suffix>", the SQL of a statement on the given
+ * table.
+ */
+std::string statement_sql(const char *prefix, const char *table,
+        const char *suffix)
+{
+    return std::string{prefix} + table + suffix;
+}
+
+/*
+ * Copies a key column read with fetch_secure() into a credential field.
+ *
+ * Only the fetch buffer is in secure memory. Credential holds its keys in
+ * std::string fields, as every caller expects, so the copy is in ordinary
+ * heap memory: it may be swapped out and is not wiped when the credential
+ * is freed. Keeping keys out of ordinary memory would need Credential
+ * itself to hold them in secure_vec.
+ */
+void assign_key(std::string &field, const secure_vec &key)
+{
+    field.assign(key.begin(), key.end());
+}
+
 MySQL_Conn::MySQL_Conn()
 {
 
@@ -106,6 +179,65 @@ MySQL_Conn::~MySQL_Conn()
 
 }
 
+/*
+ * Binds the columns of a permission row, starting at parameter first.
+ */
+void bind_permission_row(MySQL_Binds &params, size_t first,
+        const Permission &perm)
+{
+    params.param(first, perm.set_name);
+    params.param(first + 1, perm.entity);
+    params.param(first + 2, (int64_t) perm.entity_type);
+    params.param(first + 3, (int64_t) perm.op);
+    params.param(first + 4, perm.loc);
+}
+
+/*
+ * Binds the primary key of a permission, starting at parameter first.
+ */
+void bind_permission_key(MySQL_Binds &params, size_t first,
+        const Permission &perm)
+{
+    params.param(first, perm.set_name);
+    params.param(first + 1, perm.entity);
+    params.param(first + 2, perm.loc);
+}
+
+/*
+ * Binds the columns of a credential row, starting at parameter first. Only
+ * the key fields of the credential's type are stored.
+ */
+void bind_credential_row(MySQL_Binds &params, size_t first,
+        const Credential &cred)
+{
+    params.param(first, cred.set_name);
+    params.param(first + 1, (int64_t) cred.version);
+    params.param(first + 2, (int64_t) cred.type);
+    params.param(first + 3, cred.algo);
+    params.param(first + 4, (int64_t) cred.size);
+    params.param(first + 5, cred.p_owner);
+    params.param(first + 6, cred.s_owner);
+    params.param(first + 7, cred.expiration);
+    for (size_t i = first + 8; i < first + 13; i++)
+        params.null_param(i);
+    switch (cred.type)
+    {
+        case USERPASS:
+            params.param(first + 11, cred.user);
+            params.param(first + 12, cred.pass);
+            break;
+        case SYMMETRIC:
+            params.param(first + 8, cred.symKey);
+            break;
+        case ASYMMETRIC:
+        case ECDSA:
+        case ED25519:
+            params.param(first + 9, cred.priKey);
+            params.param(first + 10, cred.pubKey);
+            break;
+    }
+}
+
 /*
  * Creates a new permission. Does not do "ON DUPLICATE KEY UPDATE" because we
  * want to create a credential only once, and not update it if someone else
@@ -113,33 +245,18 @@ MySQL_Conn::~MySQL_Conn()
  */
 int MySQL_Conn::create_permission(const Permission perm) const
 {
-    Logger::log("Entering MySQL_Conn::create_permission()", LogLevel::Debug);
+    ESO_LOG(LogLevel::Debug, "Entering MySQL_Conn::create_permission()");
 	
-    // Form query
-    std::string query{"INSERT INTO "};
-    query.append(PERM_LOC);
-    query += "(set_name, entity, entity_type, op, loc) VALUES ('";
-    query.append(perm.set_name);
-    query += "', '";
-    query.append(perm.entity); 
-    query += "', ";
-    query.append(std::to_string(perm.entity_type));
-    query += ", ";
-    query.append(std::to_string(perm.op));
-    query += ", '";
-    query.append(perm.loc);
-    query +="')";
-
-    Logger::log(query.c_str());
-
-    int ret = perform_query(query.c_str());
+    static const std::string sql = statement_sql("INSERT INTO ", PERM_LOC,
+            "(set_name, entity, entity_type, op, loc) VALUES (?, ?, ?, ?, ?)");
+
+    MySQL_Binds params{5};
+    bind_permission_row(params, 0, perm);
+    int ret = execute(sql, params);
         
-    std::string log_msg{"Exiting MySQL_Conn::create_permission() with return = "};
-    log_msg += std::to_string(ret);
-    Logger::log(log_msg, LogLevel::Debug);
+    ESO_LOG(LogLevel::Debug,
+            "Exiting MySQL_Conn::create_permission() with return = ", ret);
     return ret;
-
-
 }
 
 /*
@@ -147,28 +264,20 @@ int MySQL_Conn::create_permission(const Permission perm) const
  */
 int  MySQL_Conn::update_permission(const Permission perm) const
 {
-    Logger::log("Entering MySQL_Conn::update_permission()", LogLevel::Debug);
+    ESO_LOG(LogLevel::Debug, "Entering MySQL_Conn::update_permission()");
 	
-    // Form query
-    std::string query{"UPDATE "};
-    query.append(PERM_LOC);
-    query += " SET op=";
-    query.append(std::to_string(perm.op));
-    query += " WHERE set_name='";
-    query.append(perm.set_name);
-    query += "' and entity='";
-    query.append(perm.entity);
-    query += "' AND loc='";
-    query.append(perm.loc);
-    query += "'";
-
-    Logger::log(query.c_str());
-
-    int ret = perform_query(query.c_str());
+    static const std::string sql = statement_sql("UPDATE ", PERM_LOC,
+            " SET op=? WHERE set_name=? AND entity=? AND loc=?");
+
+    MySQL_Binds params{4};
+    params.param(0, (int64_t) perm.op);
+    params.param(1, perm.set_name);
+    params.param(2, perm.entity);
+    params.param(3, perm.loc);
+    int ret = execute(sql, params);
         
-    std::string log_msg{"Exiting MySQL_Conn::update_permission() with return = "};
-    log_msg += std::to_string(ret);
-    Logger::log(log_msg, LogLevel::Debug);
+    ESO_LOG(LogLevel::Debug,
+            "Exiting MySQL_Conn::update_permission() with return = ", ret);
     return ret;
 }
 
@@ -178,32 +287,19 @@ int  MySQL_Conn::update_permission(const Permission perm) const
  */
 int MySQL_Conn::insert_permission(const Permission perm) const 
 {
-    Logger::log("Entering MySQL_Conn::insert_permission()", LogLevel::Debug);
-
-    // Form query
-    std::string query{"INSERT INTO "};
-    query.append(PERM_LOC);
-    query += "(set_name, entity, entity_type, op, loc) VALUES ('";
-    query.append(perm.set_name);
-    query += "', '";
-    query.append(perm.entity); 
-    query += "', ";
-    query.append(std::to_string(perm.entity_type));
-    query += ", ";
-    query.append(std::to_string(perm.op));
-    query += ", '";
-    query.append(perm.loc);
-    query += "') ON DUPLICATE KEY UPDATE op=VALUES(op)";
-
-    Logger::log(query.c_str());
-
-    int ret = perform_query(query.c_str());
-
-    std::string log_msg{"Exiting MySQL_Conn::insert_permission() with return = "};
-    log_msg += std::to_string(ret);
-    Logger::log(log_msg, LogLevel::Debug);
-    return ret;
+    ESO_LOG(LogLevel::Debug, "Entering MySQL_Conn::insert_permission()");
+
+    static const std::string sql = statement_sql("INSERT INTO ", PERM_LOC,
+            "(set_name, entity, entity_type, op, loc) VALUES (?, ?, ?, ?, ?)"
+            " ON DUPLICATE KEY UPDATE op=VALUES(op)");
 
+    MySQL_Binds params{5};
+    bind_permission_row(params, 0, perm);
+    int ret = execute(sql, params);
+
+    ESO_LOG(LogLevel::Debug,
+            "Exiting MySQL_Conn::insert_permission() with return = ", ret);
+    return ret;
 }
 
 /*
@@ -212,26 +308,17 @@ int MySQL_Conn::insert_permission(const Permission perm) const
  */
 int MySQL_Conn::delete_permission(const Permission perm) const
 {
-    Logger::log("Entering MySQL_Conn::delete_permission()", LogLevel::Debug);
-
-    // Form query
-    std::string query{"DELETE FROM "};
-    query.append(PERM_LOC);
-    query += " WHERE set_name='";
-    query.append(perm.set_name);
-    query += "' and entity='";
-    query.append(perm.entity);
-    query += "' AND loc='";
-    query.append(perm.loc);
-    query += "';";
+    ESO_LOG(LogLevel::Debug, "Entering MySQL_Conn::delete_permission()");
 
-    Logger::log(query.c_str());
+    static const std::string sql = statement_sql("DELETE FROM ", PERM_LOC,
+            " WHERE set_name=? AND entity=? AND loc=?");
 
-    int ret = perform_query(query.c_str());
+    MySQL_Binds params{3};
+    bind_permission_key(params, 0, perm);
+    int ret = execute(sql, params);
     
-    std::string log_msg{"Exiting MySQL_Conn::delete_permission() with return = "};
-    log_msg += std::to_string(ret);
-    Logger::log(log_msg, LogLevel::Debug);
+    ESO_LOG(LogLevel::Debug,
+            "Exiting MySQL_Conn::delete_permission() with return = ", ret);
     return ret;
 }
 
@@ -241,91 +328,111 @@ int MySQL_Conn::delete_permission(const Permission perm) const
  */
 int MySQL_Conn::create_credential(const Credential cred) const
 {
-    Logger::log("Entering MySQL_Conn::create_credential()", LogLevel::Debug);
+    ESO_LOG(LogLevel::Debug, "Entering MySQL_Conn::create_credential()");
 
     // TODO query to see if set_name already exists
 	
-    // Form query
     // TODO securely encrypt and mac inserted values.
-    std::string query{"INSERT INTO "};
-    query.append(CRED_LOC);
-    query += "(set_name, version, type, algo, size, p_owner, s_owner, ";
-    query += "expiration, ";
-    switch (cred.type)
-    {
-        case USERPASS:
-            query += "user, pass";
-            break;
-        case SYMMETRIC:
-            query += "symKey";
-            break;
-        case ASYMMETRIC:
-            query += "priKey, pubKey";
-            break;
-    }
-    query += ") VALUES('";
-    query += cred.set_name;
-    query += "', ";
-    query.append(std::to_string(cred.version));
-    query += ", ";
-    query.append(std::to_string(cred.type));
-    query += ", '";
-    query += cred.algo;
-    query += "', ";
-    query.append(std::to_string(cred.size));
-    query += ", '";
-    query += cred.p_owner;
-    query += "', '";
-    query += cred.s_owner;
-    query += "', '";
-    query += cred.expiration;
-    query += "', ";
-    switch (cred.type)
-    {
-        case USERPASS:
-            query += "'";
-            query += cred.user;
-            query += "', '";
-            query += cred.pass;
-            query += "'";
-            break;
-        case SYMMETRIC:
-            query += "'";
-            query += cred.symKey;
-            query += "'";
-            break;
-        case ASYMMETRIC:
-            query += "'";
-            query += cred.priKey;
-            query += "', '";
-            query += cred.pubKey;
-            query += "'";
-            break;
-    }
-    query += ")";
+    static const std::string sql = statement_sql("INSERT INTO ", CRED_LOC,
+            "(set_name, version, type, algo, size, p_owner, s_owner, "
+            "expiration, symKey, priKey, pubKey, user, pass) "
+            "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+
+    MySQL_Binds params{13};
+    bind_credential_row(params, 0, cred);
+    int ret = execute(sql, params);
+        
+    ESO_LOG(LogLevel::Debug,
+            "Exiting MySQL_Conn::create_credential() with return = ", ret);
 
-    Logger::log(query);
+    return ret;
+}
 
-    int ret = perform_query(query.c_str());
 
-    query.clear();
-        
-    std::string log_msg{"Exiting MySQL_Conn::create_credential() with return = "};
-    log_msg += std::to_string(ret);
-    Logger::log(log_msg, LogLevel::Debug);
+/*
+ * Deletes the credential with the given set name and version. Returns 0 on
+ * success, whether or not it existed.
+ */
+int MySQL_Conn::delete_credential(const Credential cred) const
+{
+    ESO_LOG(LogLevel::Debug, "Entering MySQL_Conn::delete_credential()");
+
+    static const std::string sql = statement_sql("DELETE FROM ", CRED_LOC,
+            " WHERE set_name=? AND version=?");
+
+    MySQL_Binds params{2};
+    params.param(0, cred.set_name);
+    params.param(1, (int64_t) cred.version);
+    int ret = execute(sql, params);
 
+    ESO_LOG(LogLevel::Debug,
+            "Exiting MySQL_Conn::delete_credential() with return = ", ret);
     return ret;
 }
 
+// The columns of a full credential row, as read by read_credential().
+const char *CREDENTIAL_COLUMNS = "set_name, version, type, algo, size, "
+    "expiration, symKey, priKey, pubKey, user, pass, p_owner, s_owner";
 
-/**
- * TODO
+/*
+ * Binds the CREDENTIAL_COLUMNS of a query's results.
+ */
+void bind_credential_columns(MySQL_Binds &results)
+{
+    results.string_column(0, SET_NAME_BYTES);
+    results.number_column(1);
+    results.number_column(2);
+    results.string_column(3, ALGO_BYTES);
+    results.number_column(4);
+    results.string_column(5, EXPIRATION_BYTES);
+    // The keys are read straight into secure buffers, which are wiped.
+    for (size_t i = 6; i < 11; i++)
+        results.deferred_column(i);
+    results.string_column(11, OWNER_BYTES);
+    results.string_column(12, OWNER_BYTES);
+}
+
+/*
+ * Reads the credential in the row just fetched. Only the key fields of the
+ * credential's type are read. The keys end up in ordinary memory; see
+ * assign_key().
  */
-int MySQL_Conn::delete_credential() const
+Credential read_credential(MySQL_Binds &results, MYSQL_STMT *stmt)
 {
-    // TODO
-    return 0;
+    Credential ret;
+    secure_vec key;
+
+    ret.set_name = results.string(0);
+    ret.version = results.number(1);
+    ret.type = results.number(2);
+    ret.algo = results.string(3);
+    ret.size = results.number(4);
+    ret.expiration = results.string(5);
+    switch (ret.type)
+    {
+        case SYMMETRIC:
+            if (results.fetch_secure(stmt, 6, key))
+                assign_key(ret.symKey, key);
+            break;
+        case ASYMMETRIC:
+        case ECDSA:
+        case ED25519:
+            if (results.fetch_secure(stmt, 7, key))
+                assign_key(ret.priKey, key);
+            if (results.fetch_secure(stmt, 8, key))
+                assign_key(ret.pubKey, key);
+            break;
+        case USERPASS:
+            if (results.fetch_secure(stmt, 9, key))
+                assign_key(ret.user, key);
+            if (results.fetch_secure(stmt, 10, key))
+                assign_key(ret.pass, key);
+            break;
+    }
+    ret.p_owner = results.string(11);
+    ret.s_owner = results.string(12);
 
+    return ret;
 }
 
 /**
@@ -335,57 +442,27 @@ int MySQL_Conn::delete_credential() const
  */
 Credential MySQL_Conn::get_credential(const Credential cred) const
 {
-    Logger::log("Entering MySQL_Conn::get_credential()", LogLevel::Debug);
+    ESO_LOG(LogLevel::Debug, "Entering MySQL_Conn::get_credential()");
 
-    // Build query.
-    std::string query{"SELECT set_name, version, type, algo, size, expiration, "};
-    query += "symKey, priKey, pubKey, user, pass, p_owner, s_owner FROM ";
-    query += CRED_LOC;
-    query += " WHERE set_name='";
-    query.append(cred.set_name);
-    query += "' AND version=";
-    query.append(std::to_string(cred.version));
-    query +=";";
+    static const std::string sql = std::string{"SELECT "}
+        + CREDENTIAL_COLUMNS + " FROM " + CRED_LOC
+        + " WHERE set_name=? AND version=?";
 
-    Logger::log(query);
+    MySQL_Binds params{2};
+    params.param(0, cred.set_name);
+    params.param(1, (int64_t) cred.version);
 
-    // Get results.
-    MYSQL_RES* mysqlResult = get_result(query.c_str());
+    MySQL_Binds results{13};
+    bind_credential_columns(results);
 
     Credential ret;
-    // Pack query results into return value.
-    MYSQL_ROW mysqlRow;
-    // Row pointer in the result set
     // There may be 0 or 1 results.
-    while ( (mysqlRow = mysql_fetch_row(mysqlResult)) )
+    query(sql, params, results, [&](MYSQL_STMT *stmt)
     {
-        ret.set_name = std::string{mysqlRow[0]};
-        ret.version = strtol(mysqlRow[1], nullptr, 0);
-        ret.type = strtol(mysqlRow[2], nullptr, 0);
-        ret.algo = std::string{mysqlRow[3]};
-        ret.size = strtol(mysqlRow[4], nullptr, 0);
-        ret.expiration = std::string{mysqlRow[5]};
-        switch (ret.type)
-        {
-            case SYMMETRIC:
-                ret.symKey = std::string{mysqlRow[6]};
-                break;
-            case ASYMMETRIC:
-                ret.priKey = std::string{mysqlRow[7]};
-                ret.pubKey = std::string{mysqlRow[8]};
-                break;
-            case USERPASS:
-                ret.user = std::string{mysqlRow[9]};
-                ret.pass = std::string{mysqlRow[10]};
-                break;
-        }
-        ret.p_owner = std::string{mysqlRow[11]};
-        ret.s_owner = std::string{mysqlRow[12]};
-    }
-    
-    mysql_free_result(mysqlResult); 
+        ret = read_credential(results, stmt);
+    });
 
-    Logger::log("Exiting MySQL_Conn::get_credential()", LogLevel::Debug);
+    ESO_LOG(LogLevel::Debug, "Exiting MySQL_Conn::get_credential()");
 
     return ret;
 }
@@ -395,104 +472,89 @@ Credential MySQL_Conn::get_credential(const Credential cred) const
  */
 std::vector<Credential> MySQL_Conn::get_all_credentials(const char * set_name) const
 {
-    Logger::log("Entering MySQL_Conn::get_all_credentials()", LogLevel::Debug);
+    ESO_LOG(LogLevel::Debug, "Entering MySQL_Conn::get_all_credentials()");
+
+    static const std::string sql = statement_sql("SELECT set_name, version, "
+            "type, expiration, p_owner, s_owner, algo, size FROM ", CRED_LOC,
+            " WHERE set_name=?");
+
+    std::string name{set_name};
+    MySQL_Binds params{1};
+    params.param(0, name);
+
+    MySQL_Binds results{8};
+    results.string_column(0, SET_NAME_BYTES);
+    results.number_column(1);
+    results.number_column(2);
+    results.string_column(3, EXPIRATION_BYTES);
+    results.string_column(4, OWNER_BYTES);
+    results.string_column(5, OWNER_BYTES);
+    results.string_column(6, ALGO_BYTES);
+    results.number_column(7);
 
     // Return value.
-    std::vector<Credential> results;
-
-    // Build query.
-    std::string query{"SELECT set_name, version, type, expiration, p_owner,"};
-    query += " s_owner, algo, size FROM ";
-    query += CRED_LOC;
-    query += " WHERE set_name='";
-    query.append(set_name);
-    query += "';";
-
-    Logger::log(query);
-
-    // Get results.
-    MYSQL_RES* mysqlResult = get_result(query.c_str());
-
-    // Pack query results into return value.
-    MYSQL_ROW mysqlRow;
-    // Row pointer in the result set
-    while ( (mysqlRow = mysql_fetch_row(mysqlResult)) )
+    std::vector<Credential> creds;
+    query(sql, params, results, [&](MYSQL_STMT *)
     {
         Credential cred;
-        cred.set_name = std::string{mysqlRow[0]};
-        cred.version = strtol(mysqlRow[1], nullptr, 0);
-        cred.type = strtol(mysqlRow[2], nullptr, 0);
-        cred.expiration = std::string{mysqlRow[3]};
-        cred.p_owner = std::string{mysqlRow[4]};
-        cred.s_owner = std::string{mysqlRow[5]};
-        cred.algo = std::string{mysqlRow[6]};
-        cred.size = strtol(mysqlRow[7], nullptr, 0);
-
-        results.push_back(cred);
-    }
-    
-    mysql_free_result(mysqlResult); 
+        cred.set_name = results.string(0);
+        cred.version = results.number(1);
+        cred.type = results.number(2);
+        cred.expiration = results.string(3);
+        cred.p_owner = results.string(4);
+        cred.s_owner = results.string(5);
+        cred.algo = results.string(6);
+        cred.size = results.number(7);
+
+        creds.push_back(cred);
+    });
     
-    Logger::log("Exiting MySQL_Conn::get_all_credentials()", LogLevel::Debug);
+    ESO_LOG(LogLevel::Debug, "Exiting MySQL_Conn::get_all_credentials()");
 
-    return results;
+    return creds;
 }
 
 /*
  * Returns a Permission representing the entries from the query.
  * There should only be one Permission because (set_name, entity, loc) is the 
  * primary key for the permissions table.
-
-    set_name VARCHAR(255) NOT NULL,
-    entity VARCHAR(32) NOT NULL,
-    entity_type INT UNSIGNED NOT NULL,
-    op INT UNSIGNED NOT NULL,
-    loc VARCHAR(300) NOT NULL
-*/
+ */
 Permission MySQL_Conn::get_permission(const Permission perm) const
 {
-    Logger::log("Entering MySQL_Conn::get_permissions()", LogLevel::Debug);
+    ESO_LOG(LogLevel::Debug, "Entering MySQL_Conn::get_permissions()");
 
-    // Build query.
-    std::string query{"SELECT set_name, entity, entity_type, op, loc FROM "}; 
-    query += PERM_LOC;
-    query += " WHERE set_name='";
-    query.append(perm.set_name);
-    query += "' AND entity='";
-    query.append(perm.entity);
-    query += "' AND loc='";
-    query.append(perm.loc);
-    query += "';";
+    static const std::string sql = statement_sql("SELECT set_name, entity, "
+            "entity_type, op, loc FROM ", PERM_LOC,
+            " WHERE set_name=? AND entity=? AND loc=?");
 
-    Logger::log(query);
+    MySQL_Binds params{3};
+    params.param(0, perm.set_name);
+    params.param(1, perm.entity);
+    params.param(2, perm.loc);
 
-    // Get results.
-    MYSQL_RES* mysqlResult = get_result(query.c_str());
+    MySQL_Binds results{5};
+    results.string_column(0, SET_NAME_BYTES);
+    results.string_column(1, ENTITY_BYTES);
+    results.number_column(2);
+    results.number_column(3);
+    results.string_column(4, LOC_BYTES);
 
     // Return value.
     Permission result;
 
-    // Row pointer in the result set.
-    MYSQL_ROW mysqlRow;
-    // Pack query results into return value.
-    // There should only be one return value, since (set_name,entity, loc) is the
-    // primary key for the permissions table.
     // There may be 0 or 1 results.
-    while ( (mysqlRow = mysql_fetch_row(mysqlResult)) )
+    query(sql, params, results, [&](MYSQL_STMT *)
     {
-        result.set_name= std::string{mysqlRow[0]};
-        result.entity = std::string{mysqlRow[1]};
-        result.entity_type = strtol(mysqlRow[2], nullptr, 0);
-        result.op = strtol(mysqlRow[3], nullptr, 0);
-        result.loc = std::string{mysqlRow[4]};
-    }
-    
-    mysql_free_result(mysqlResult); 
+        result.set_name = results.string(0);
+        result.entity = results.string(1);
+        result.entity_type = results.number(2);
+        result.op = results.number(3);
+        result.loc = results.string(4);
+    });
 
-    Logger::log("Exiting MySQL_Conn::get_permissions()", LogLevel::Debug);
+    ESO_LOG(LogLevel::Debug, "Exiting MySQL_Conn::get_permissions()");
 
     return result;
-
 }
 
 
@@ -502,112 +564,395 @@ Permission MySQL_Conn::get_permission(const Permission perm) const
 std::vector<Permission>
         MySQL_Conn::get_all_permissions(const char * set_name) const
 {
-    Logger::log("Entering MySQL_Conn::get_all_permissions()", LogLevel::Debug);
+    ESO_LOG(LogLevel::Debug, "Entering MySQL_Conn::get_all_permissions()");
 
-    // Build query.
-    std::string query{"SELECT entity, entity_type, op, loc FROM "}; 
-    query += PERM_LOC;
-    query += " WHERE set_name='";
-    query.append(set_name);
-    query += "';";
+    static const std::string sql = statement_sql("SELECT entity, "
+            "entity_type, op, loc FROM ", PERM_LOC, " WHERE set_name=?");
 
-    Logger::log(query);
+    std::string name{set_name};
+    MySQL_Binds params{1};
+    params.param(0, name);
 
-    // Get results.
-    MYSQL_RES* mysqlResult = get_result(query.c_str());
+    MySQL_Binds results{4};
+    results.string_column(0, ENTITY_BYTES);
+    results.number_column(1);
+    results.number_column(2);
+    results.string_column(3, LOC_BYTES);
 
     // Return value.
-    std::vector<Permission> results;
-
-    // Row pointer in the result set
-    MYSQL_ROW mysqlRow;
-    // Pack query results into return value.
-    while ( (mysqlRow = mysql_fetch_row(mysqlResult)) )
+    std::vector<Permission> perms;
+    query(sql, params, results, [&](MYSQL_STMT *)
     {
         Permission perm;
-        perm.entity = std::string{mysqlRow[0]};
-        perm.entity_type = strtol(mysqlRow[1], nullptr, 0);
-        perm.op = strtol(mysqlRow[2], nullptr, 0);
-        perm.loc = std::string{mysqlRow[3]};
+        perm.entity = results.string(0);
+        perm.entity_type = results.number(1);
+        perm.op = results.number(2);
+        perm.loc = results.string(3);
 
-        results.push_back(perm);
-    }
-    
-    mysql_free_result(mysqlResult); 
+        perms.push_back(perm);
+    });
 
-    Logger::log("Exiting MySQL_Conn::get_all_permissions()", LogLevel::Debug);
+    ESO_LOG(LogLevel::Debug, "Exiting MySQL_Conn::get_all_permissions()");
 
-    return results;
+    return perms;
 }
 
 /*
- * Logs any errors that occur due to the MySQL connection
+ * Sets perms to every permission in the table. Returns 0 on success.
  */
-void MySQL_Conn::log_error(MYSQL *conn) const
+int MySQL_Conn::scan_permissions(std::vector<Permission> &perms) const
 {
-    Logger::log("Entering MySQL_Conn::log_error().", LogLevel::Debug);
-    Logger::log(mysql_error(conn), LogLevel::Error);
+    ESO_LOG(LogLevel::Debug, "Entering MySQL_Conn::scan_permissions()");
+
+    static const std::string sql = statement_sql("SELECT set_name, entity, "
+            "entity_type, op, loc FROM ", PERM_LOC, "");
+
+    MySQL_Binds params{0};
+    MySQL_Binds results{5};
+    results.string_column(0, SET_NAME_BYTES);
+    results.string_column(1, ENTITY_BYTES);
+    results.number_column(2);
+    results.number_column(3);
+    results.string_column(4, LOC_BYTES);
+
+    perms.clear();
+    int ret = query(sql, params, results, [&](MYSQL_STMT *)
+    {
+        Permission perm;
+        perm.set_name = results.string(0);
+        perm.entity = results.string(1);
+        perm.entity_type = results.number(2);
+        perm.op = results.number(3);
+        perm.loc = results.string(4);
+
+        perms.push_back(perm);
+    });
+
+    ESO_LOG(LogLevel::Debug,
+            "Exiting MySQL_Conn::scan_permissions() with return = ", ret);
+    return ret;
 }
 
 /*
- * Performs the given query in the default database as the MySQL user esod.
- * Returns 0 if no error occured, else the error is logged.
+ * Sets creds to every credential in the table, with its keys. Returns 0 on
+ * success.
  */
-int MySQL_Conn::perform_query(const char* query) const 
+int MySQL_Conn::scan_credentials(std::vector<Credential> &creds) const
 {
-    MYSQL* conn = nullptr;
-    conn = mysql_init(nullptr);
+    ESO_LOG(LogLevel::Debug, "Entering MySQL_Conn::scan_credentials()");
+
+    static const std::string sql = std::string{"SELECT "}
+        + CREDENTIAL_COLUMNS + " FROM " + CRED_LOC;
 
-    // Connect to database
-    if(!mysql_real_connect(conn, LOC, 
-            HOST_USER, HOST_PASS, DB_LOC, 0, nullptr, 0))
+    MySQL_Binds params{0};
+    MySQL_Binds results{13};
+    bind_credential_columns(results);
+
+    creds.clear();
+    int ret = query(sql, params, results, [&](MYSQL_STMT *stmt)
     {
-        log_error(conn);
-        return CANNOT_CONNECT;
-    }
+        creds.push_back(read_credential(results, stmt));
+    });
+
+    ESO_LOG(LogLevel::Debug,
+            "Exiting MySQL_Conn::scan_credentials() with return = ", ret);
+    return ret;
+}
+
+/*
+ * Inserts the permissions, updating the op value of those that already
+ * exist, in one transaction. Returns 0 if all were written.
+ */
+int MySQL_Conn::insert_permissions(const std::vector<Permission> &perms) const
+{
+    ESO_LOG(LogLevel::Debug, "Entering MySQL_Conn::insert_permissions()");
+
+    int ret = write_rows(perms, "INSERT INTO ", PERM_LOC,
+            "(set_name, entity, entity_type, op, loc) VALUES ",
+            "(?, ?, ?, ?, ?)", ", ", " ON DUPLICATE KEY UPDATE op=VALUES(op)",
+            5, &bind_permission_row);
+
+    ESO_LOG(LogLevel::Debug,
+            "Exiting MySQL_Conn::insert_permissions() with return = ", ret);
+    return ret;
+}
+
+/*
+ * Deletes the permissions in one transaction. Returns 0 on success, whether
+ * or not they existed.
+ */
+int MySQL_Conn::delete_permissions(const std::vector<Permission> &perms) const
+{
+    ESO_LOG(LogLevel::Debug, "Entering MySQL_Conn::delete_permissions()");
+
+    int ret = write_rows(perms, "DELETE FROM ", PERM_LOC, " WHERE ",
+            "(set_name=? AND entity=? AND loc=?)", " OR ", "", 3,
+            &bind_permission_key);
+
+    ESO_LOG(LogLevel::Debug,
+            "Exiting MySQL_Conn::delete_permissions() with return = ", ret);
+    return ret;
+}
+
+/*
+ * Creates the credentials in one transaction. A credential that already
+ * exists is left as it is, as create_credential() would, but without
+ * failing the rest of the batch. Returns 0 on success.
+ */
+int MySQL_Conn::create_credentials(const std::vector<Credential> &creds) const
+{
+    ESO_LOG(LogLevel::Debug, "Entering MySQL_Conn::create_credentials()");
+
+    // TODO securely encrypt and mac inserted values.
+    int ret = write_rows(creds, "INSERT IGNORE INTO ", CRED_LOC,
+            "(set_name, version, type, algo, size, p_owner, s_owner, "
+            "expiration, symKey, priKey, pubKey, user, pass) VALUES ",
+            "(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", ", ", "", 13,
+            &bind_credential_row);
+
+    ESO_LOG(LogLevel::Debug,
+            "Exiting MySQL_Conn::create_credentials() with return = ", ret);
+    return ret;
+}
+
+/*
+ * Logs any errors that occur due to a statement.
+ */
+void MySQL_Conn::log_error(MYSQL_STMT *stmt) const
+{
+    ESO_LOG(LogLevel::Debug, "Entering MySQL_Conn::log_error().");
+    Logger::log(mysql_stmt_error(stmt), LogLevel::Error);
+}
+
+/*
+ * Executes the prepared statement for sql, which returns no rows, with the
+ * given parameters. Returns 0 if no error occured, else the error is logged.
+ */
+int MySQL_Conn::execute(const std::string &sql, MySQL_Binds &params) const
+{
+    // The statement is not tagged since its parameters may contain keys.
+    Span span{"mysql.perform_query"};
+    ESO_PROBE(mysql_query_start);
 
-    // Perform query
-    if(int ret = mysql_query(conn, query))
+    MySQL_Binds no_results{0};
+    bool found;
+    int ret = run(sql, params, no_results, nullptr, found);
+
+    ESO_PROBE1(mysql_query_done, ret);
+    return ret;
+}
+
+/*
+ * Executes the prepared statement for sql, a query, with the given
+ * parameters. results is bound to the columns of its rows, and on_row is
+ * called after each row is fetched. Returns 0 if no error occured, else the
+ * error is logged.
+ */
+int MySQL_Conn::query(const std::string &sql, MySQL_Binds &params,
+        MySQL_Binds &results,
+        const std::function<void(MYSQL_STMT *)> &on_row) const
+{
+    Span span{"mysql.get_result"};
+    ESO_PROBE(mysql_result_start);
+
+    bool found;
+    int ret = run(sql, params, results, on_row, found);
+
+    ESO_PROBE1(mysql_result_done, found);
+    return ret;
+}
+
+/*
+ * Executes a prepared statement on a pooled connection for execute() and
+ * query(). on_row is empty for statements that return no rows. Sets found
+ * if a row was read.
+ *
+ * A pooled connection may have been closed by the server since it was
+ * checked, so a statement that loses its connection before any row is read
+ * is tried once more on a new one.
+ */
+int MySQL_Conn::run(const std::string &sql, MySQL_Binds &params,
+        MySQL_Binds &results,
+        const std::function<void(MYSQL_STMT *)> &on_row, bool &found) const
+{
+    int ret = CANNOT_CONNECT;
+    found = false;
+    for (int attempt = 0; attempt < 2; attempt++)
     {
-        log_error(conn);
-        return ret;
+        PooledConnection *conn = MySQL_Pool::instance().acquire();
+        if (!conn)
+        {
+            ret = CANNOT_CONNECT;
+            break;
+        }
+
+        unsigned int err = 0;
+        ret = run_on(conn, sql, params, results, on_row, found, err);
+
+        bool lost = mysql_connection_lost(err);
+        MySQL_Pool::instance().release(conn, lost);
+        if (!lost || found)
+            break;
     }
 
-    mysql_close(conn);
-    return OK;
+    return ret;
 }
 
 /*
- * Returns the results from the given query.
- * nullptr is return if there was an error or no results.
+ * Executes the prepared statement for sql on conn. Sets err to the MySQL
+ * error number if it fails.
  */
-MYSQL_RES* MySQL_Conn::get_result(const char* query) const
+int MySQL_Conn::run_on(PooledConnection *conn, const std::string &sql,
+        MySQL_Binds &params, MySQL_Binds &results,
+        const std::function<void(MYSQL_STMT *)> &on_row, bool &found,
+        unsigned int &err) const
 {
-    MYSQL* conn = nullptr;
-    conn = mysql_init(nullptr);
-    MYSQL_RES* mysqlResult = nullptr;
+    MYSQL_STMT *stmt = conn->statement(sql);
+    if (!stmt)
+    {
+        err = mysql_errno(conn->mysql);
+        return CANNOT_QUERY;
+    }
+
+    if (mysql_stmt_bind_param(stmt, params.get())
+            || (on_row && mysql_stmt_bind_result(stmt, results.get()))
+            || mysql_stmt_execute(stmt))
+    {
+        log_error(stmt);
+        err = mysql_stmt_errno(stmt);
+        return CANNOT_QUERY;
+    }
 
-    // Connect to database
-    if(!mysql_real_connect(conn, LOC, 
-            HOST_USER, HOST_PASS, DB_LOC, 0, nullptr, 0))
+    if (!on_row)
+        return OK;
+
+    int ret = OK;
+    int fetched;
+    // Truncation is expected: the deferred columns have no buffer until
+    // fetch_secure() reads them.
+    while ((fetched = mysql_stmt_fetch(stmt)) == 0
+            || fetched == MYSQL_DATA_TRUNCATED)
+    {
+        found = true;
+        on_row(stmt);
+    }
+    if (fetched != MYSQL_NO_DATA)
     {
-        log_error(conn);
-        return mysqlResult;
+        log_error(stmt);
+        err = mysql_stmt_errno(stmt);
+        ret = CANNOT_QUERY;
     }
+    mysql_stmt_free_result(stmt);
+    return ret;
+}
+
+/*
+ * Runs body on one pooled connection inside a transaction, which is
+ * committed if body returns OK and rolled back otherwise. body sets its
+ * second argument to the MySQL error number when it fails.
+ *
+ * Like single statements, a transaction that loses its connection is tried
+ * once more on a new one. body must be safe to repeat.
+ */
+int MySQL_Conn::transaction(const std::function<int(PooledConnection *,
+            unsigned int &)> &body) const
+{
+    Span span{"mysql.transaction"};
+    ESO_PROBE(mysql_query_start);
 
-    // Perform query
-    if(mysql_query(conn, query))
+    int ret = CANNOT_CONNECT;
+    for (int attempt = 0; attempt < 2; attempt++)
     {
-        log_error(conn);
-        return mysqlResult;
+        PooledConnection *conn = MySQL_Pool::instance().acquire();
+        if (!conn)
+        {
+            ret = CANNOT_CONNECT;
+            break;
+        }
+
+        unsigned int err = 0;
+        if (mysql_query(conn->mysql, "START TRANSACTION"))
+            ret = CANNOT_QUERY;
+        else if ((ret = body(conn, err)) == OK && mysql_commit(conn->mysql))
+            ret = CANNOT_QUERY;
+
+        if (ret != OK)
+        {
+            if (!err)
+            {
+                err = mysql_errno(conn->mysql);
+                Logger::log(mysql_error(conn->mysql), LogLevel::Error);
+            }
+            if (!mysql_connection_lost(err))
+                mysql_rollback(conn->mysql);
+        }
+
+        bool lost = mysql_connection_lost(err);
+        MySQL_Pool::instance().release(conn, lost);
+        if (!lost)
+            break;
     }
 
-    // Get result set
-    mysqlResult = mysql_store_result(conn);
+    ESO_PROBE1(mysql_query_done, ret);
+    return ret;
+}
 
-    mysql_close(conn);
+// The most rows written by one multi-row statement.
+const size_t MAX_ROWS_PER_STATEMENT = 64;
 
-    return mysqlResult;
+/*
+ * Writes rows in one transaction with multi-row statements of the form
+ * "<prefix><table><middle><row><separator><row>...<suffix>", where row has
+ * row_params placeholders that bind() fills in for one row.
+ *
+ * Statements are prepared for power of two numbers of rows, up to
+ * MAX_ROWS_PER_STATEMENT, so that a connection caches at most a few of them
+ * whatever the sizes of the batches.
+ */
+template <class T>
+int MySQL_Conn::write_rows(const std::vector<T> &rows, const char *prefix,
+        const char *table, const char *middle, const char *row,
+        const char *separator, const char *suffix, size_t row_params,
+        void (*bind)(MySQL_Binds &, size_t, const T &)) const
+{
+    if (rows.empty())
+        return OK;
+
+    return transaction([&](PooledConnection *conn, unsigned int &err)
+    {
+        size_t done = 0;
+        while (done < rows.size())
+        {
+            size_t count = MAX_ROWS_PER_STATEMENT;
+            while (count > rows.size() - done)
+                count /= 2;
+
+            std::string sql{prefix};
+            sql += table;
+            sql += middle;
+            for (size_t i = 0; i < count; i++)
+            {
+                if (i)
+                    sql += separator;
+                sql += row;
+            }
+            sql += suffix;
+
+            MySQL_Binds params{count * row_params};
+            for (size_t i = 0; i < count; i++)
+                bind(params, i * row_params, rows[done + i]);
+
+            MySQL_Binds no_results{0};
+            bool found;
+            int ret = run_on(conn, sql, params, no_results, nullptr, found,
+                    err);
+            if (ret != OK)
+                return ret;
+
+            done += count;
+        }
+        return OK;
+    });
 }
 
 #endif
@@ -0,0 +1,288 @@
+#ifndef ESO_DATABASE_MYSQL_POOL
+#define ESO_DATABASE_MYSQL_POOL
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "db_error.h"
+#include "../logger/logger.h"
+#include "../stats/report.h"
+
+// Include these after all other files because of the min/max macro problems
+#include <my_global.h>
+#include <mysql.h>
+#include <errmsg.h>
+
+/*
+ * A pool of open connections to the daemon's MySQL database, shared by every
+ * MySQL_Conn in the process, so that a query does not pay for a TCP
+ * connection and a login.
+ *
+ * The pool opens connections as they are needed, up to MYSQL_POOL_SIZE
+ * (see the daemon's mysql_config.h). When all of them are in use, a caller
+ * waits up to MYSQL_POOL_TIMEOUT_MS for one to be returned. A connection
+ * that has been idle for MYSQL_POOL_PING_MS is pinged before it is handed
+ * out, and replaced if the server has closed it. A connection that fails
+ * during a query is closed rather than returned.
+ *
+ * Each connection keeps the statements prepared on it, so a query is only
+ * parsed by the server the first time it runs on a connection.
+ */
+
+// Idle connections older than this are checked before they are used.
+const int MYSQL_POOL_PING_MS = 5000;
+// How long connecting to the server may take.
+const unsigned int MYSQL_POOL_CONNECT_TIMEOUT_S = 5;
+
+/*
+ * An open connection and what the pool knows about it.
+ */
+struct PooledConnection
+{
+    // Returns the statement for sql, preparing it the first time. Returns
+    // nullptr if it cannot be prepared.
+    MYSQL_STMT *statement(const std::string &sql);
+
+    MYSQL *mysql;
+    // When the connection was last returned to the pool.
+    std::chrono::steady_clock::time_point last_used;
+    // The statements prepared on this connection, by their SQL.
+    std::unordered_map<std::string, MYSQL_STMT *> statements;
+};
+
+class MySQL_Pool
+{
+public:
+    static MySQL_Pool &instance();
+    // Returns an open connection, or nullptr if none became free within the
+    // timeout or the server cannot be reached. The caller must release it.
+    PooledConnection *acquire();
+    // Returns a connection to the pool. If broken, the connection is closed
+    // instead, e.g. after the server went away during a query.
+    void release(PooledConnection *conn, bool broken);
+    // Appends the pool's counters to a stats report.
+    void append_to(std::string &report);
+private:
+    MySQL_Pool();
+
+    // Opens a new connection. Returns nullptr on failure.
+    PooledConnection *connect();
+    // Closes and frees a connection.
+    void close(PooledConnection *conn);
+
+    std::mutex _mutex;
+    std::condition_variable _released;
+    // Connections not in use, the most recently used last.
+    std::vector<PooledConnection *> _idle;
+    // Connections open, in use or idle.
+    size_t _open;
+
+    uint64_t _acquired;
+    uint64_t _waited;
+    uint64_t _timed_out;
+    uint64_t _connected;
+    uint64_t _connect_failed;
+    uint64_t _dropped;
+};
+
+/*
+ * Returns true if err means that the connection is unusable, so that it
+ * should not go back in the pool.
+ */
+bool mysql_connection_lost(unsigned int err)
+{
+    return err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST;
+}
+
+bool mysql_connection_lost(MYSQL *mysql)
+{
+    return mysql_connection_lost(mysql_errno(mysql));
+}
+
+MYSQL_STMT *PooledConnection::statement(const std::string &sql)
+{
+    auto found = statements.find(sql);
+    if (found != statements.end())
+        return found->second;
+
+    MYSQL_STMT *stmt = mysql_stmt_init(mysql);
+    if (!stmt)
+        return nullptr;
+    if (mysql_stmt_prepare(stmt, sql.data(), sql.size()))
+    {
+        Logger::log(mysql_stmt_error(stmt), LogLevel::Error);
+        mysql_stmt_close(stmt);
+        return nullptr;
+    }
+
+    statements[sql] = stmt;
+    return stmt;
+}
+
+/*
+ * Makes the calling thread ready to use the MySQL client library, once per
+ * thread, and frees what the library keeps for it when the thread exits.
+ */
+void mysql_thread_ready()
+{
+    struct ThreadInit
+    {
+        ThreadInit() { mysql_thread_init(); }
+        ~ThreadInit() { mysql_thread_end(); }
+    };
+    static thread_local ThreadInit init;
+    (void) init;
+}
+
+MySQL_Pool &MySQL_Pool::instance()
+{
+    static MySQL_Pool *pool = new MySQL_Pool;
+    return *pool;
+}
+
+MySQL_Pool::MySQL_Pool()
+    : _open{0}, _acquired{0}, _waited{0}, _timed_out{0}, _connected{0},
+    _connect_failed{0}, _dropped{0}
+{
+    // mysql_init() would do this on first use, but it is not thread safe.
+    mysql_library_init(0, nullptr, nullptr);
+}
+
+PooledConnection *MySQL_Pool::connect()
+{
+    MYSQL *mysql = mysql_init(nullptr);
+    if (!mysql)
+        return nullptr;
+
+    mysql_options(mysql, MYSQL_OPT_CONNECT_TIMEOUT,
+            &MYSQL_POOL_CONNECT_TIMEOUT_S);
+    if (!mysql_real_connect(mysql, LOC, HOST_USER, HOST_PASS, DB_LOC, 0,
+                nullptr, 0))
+    {
+        Logger::log(mysql_error(mysql), LogLevel::Error);
+        mysql_close(mysql);
+        return nullptr;
+    }
+
+    return new PooledConnection{mysql, std::chrono::steady_clock::now(), {}};
+}
+
+void MySQL_Pool::close(PooledConnection *conn)
+{
+    for (auto &statement : conn->statements)
+        mysql_stmt_close(statement.second);
+    mysql_close(conn->mysql);
+    delete conn;
+}
+
+PooledConnection *MySQL_Pool::acquire()
+{
+    mysql_thread_ready();
+
+    auto deadline = std::chrono::steady_clock::now()
+        + std::chrono::milliseconds(MYSQL_POOL_TIMEOUT_MS);
+
+    std::unique_lock<std::mutex> lock{_mutex};
+    _acquired++;
+
+    bool waited = false;
+    while (_idle.empty() && _open >= MYSQL_POOL_SIZE)
+    {
+        waited = true;
+        if (_released.wait_until(lock, deadline) == std::cv_status::timeout
+                && _idle.empty() && _open >= MYSQL_POOL_SIZE)
+        {
+            _waited++;
+            _timed_out++;
+            Logger::log("MySQL_Pool: no connection free", LogLevel::Error);
+            return nullptr;
+        }
+    }
+    if (waited)
+        _waited++;
+
+    PooledConnection *conn = nullptr;
+    if (!_idle.empty())
+    {
+        conn = _idle.back();
+        _idle.pop_back();
+    }
+    // Reserve the slot, so the lock need not be held while connecting.
+    else
+    {
+        _open++;
+    }
+    lock.unlock();
+
+    // The server closes connections that are idle for too long, so check
+    // one that has not been used for a while.
+    if (conn && std::chrono::steady_clock::now() - conn->last_used
+            > std::chrono::milliseconds(MYSQL_POOL_PING_MS)
+            && mysql_ping(conn->mysql))
+    {
+        close(conn);
+        conn = nullptr;
+        lock.lock();
+        _dropped++;
+        lock.unlock();
+    }
+
+    if (!conn)
+    {
+        conn = connect();
+
+        lock.lock();
+        if (conn)
+        {
+            _connected++;
+        }
+        else
+        {
+            _connect_failed++;
+            _open--;
+            _released.notify_one();
+        }
+    }
+
+    return conn;
+}
+
+void MySQL_Pool::release(PooledConnection *conn, bool broken)
+{
+    if (broken)
+        close(conn);
+    else
+        conn->last_used = std::chrono::steady_clock::now();
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (broken)
+    {
+        _open--;
+        _dropped++;
+    }
+    else
+    {
+        _idle.push_back(conn);
+    }
+    _released.notify_one();
+}
+
+void MySQL_Pool::append_to(std::string &report)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    append_counter(report, "mysql_pool_open", _open);
+    append_counter(report, "mysql_pool_idle", _idle.size());
+    append_counter(report, "mysql_pool_acquired", _acquired);
+    append_counter(report, "mysql_pool_waited", _waited);
+    append_counter(report, "mysql_pool_timed_out", _timed_out);
+    append_counter(report, "mysql_pool_connected", _connected);
+    append_counter(report, "mysql_pool_connect_failed", _connect_failed);
+    append_counter(report, "mysql_pool_dropped", _dropped);
+}
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef ESO_DATABASE_MYSQL_STMT
+#define ESO_DATABASE_MYSQL_STMT
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../crypto/secure_arena.h"
+
+// Include these after all other files because of the min/max macro problems
+#include <my_global.h>
+#include <mysql.h>
+
+/*
+ * The parameters or result columns of a prepared statement, bound in their
+ * binary form so that nothing is formatted into or parsed out of SQL text.
+ *
+ * Strings are bound in place, so a bound parameter must outlive the
+ * statement's execution. String columns are read into a buffer of the
+ * column's size, except key columns, which are bound as deferred and read
+ * with fetch_secure() into a buffer of exactly their length.
+ */
+class MySQL_Binds
+{
+public:
+    explicit MySQL_Binds(size_t count);
+
+    // Binds parameter i to a string.
+    void param(size_t i, const std::string &value);
+    // Binds parameter i to a number.
+    void param(size_t i, int64_t value);
+    // Binds parameter i to NULL.
+    void null_param(size_t i);
+
+    // Binds result column i as a string of at most max_size bytes.
+    void string_column(size_t i, size_t max_size);
+    // Binds result column i as a number.
+    void number_column(size_t i);
+    // Binds result column i to be read by fetch_secure().
+    void deferred_column(size_t i);
+
+    // The string or number in column i of the fetched row. A NULL is empty
+    // or 0.
+    std::string string(size_t i) const;
+    int64_t number(size_t i) const;
+    // Reads deferred column i of the row just fetched into out. Returns
+    // false on error.
+    bool fetch_secure(MYSQL_STMT *stmt, size_t i, secure_vec &out);
+
+    MYSQL_BIND *get();
+private:
+    MySQL_Binds(const MySQL_Binds &) = delete;
+    MySQL_Binds &operator=(const MySQL_Binds &) = delete;
+
+    // The storage a bind points to.
+    struct Slot
+    {
+        std::vector<char> buffer;
+        int64_t number;
+        unsigned long length;
+        my_bool is_null;
+        my_bool error;
+    };
+
+    // Points bind i at slot i.
+    void attach(size_t i);
+
+    std::vector<MYSQL_BIND> _binds;
+    std::vector<Slot> _slots;
+};
+
+MySQL_Binds::MySQL_Binds(size_t count)
+    : _binds(count), _slots(count)
+{
+    memset(_binds.data(), 0, count * sizeof(MYSQL_BIND));
+    for (size_t i = 0; i < count; i++)
+        attach(i);
+}
+
+void MySQL_Binds::attach(size_t i)
+{
+    Slot &slot = _slots[i];
+    slot.number = 0;
+    slot.length = 0;
+    slot.is_null = 0;
+    slot.error = 0;
+    _binds[i].length = &slot.length;
+    _binds[i].is_null = &slot.is_null;
+    _binds[i].error = &slot.error;
+}
+
+void MySQL_Binds::param(size_t i, const std::string &value)
+{
+    _binds[i].buffer_type = MYSQL_TYPE_STRING;
+    _binds[i].buffer = (void *) value.data();
+    _binds[i].buffer_length = value.size();
+    _slots[i].length = value.size();
+    _slots[i].is_null = 0;
+}
+
+void MySQL_Binds::param(size_t i, int64_t value)
+{
+    _slots[i].number = value;
+    _binds[i].buffer_type = MYSQL_TYPE_LONGLONG;
+    _binds[i].buffer = &_slots[i].number;
+    _slots[i].is_null = 0;
+}
+
+void MySQL_Binds::null_param(size_t i)
+{
+    _binds[i].buffer_type = MYSQL_TYPE_NULL;
+    _slots[i].is_null = 1;
+}
+
+void MySQL_Binds::string_column(size_t i, size_t max_size)
+{
+    _slots[i].buffer.assign(max_size, 0);
+    _binds[i].buffer_type = MYSQL_TYPE_STRING;
+    _binds[i].buffer = _slots[i].buffer.data();
+    _binds[i].buffer_length = max_size;
+}
+
+void MySQL_Binds::number_column(size_t i)
+{
+    _binds[i].buffer_type = MYSQL_TYPE_LONGLONG;
+    _binds[i].buffer = &_slots[i].number;
+}
+
+void MySQL_Binds::deferred_column(size_t i)
+{
+    // With no buffer, fetching only records the column's length.
+    _binds[i].buffer_type = MYSQL_TYPE_BLOB;
+    _binds[i].buffer = nullptr;
+    _binds[i].buffer_length = 0;
+}
+
+std::string MySQL_Binds::string(size_t i) const
+{
+    const Slot &slot = _slots[i];
+    if (slot.is_null)
+        return std::string{};
+    return std::string{slot.buffer.data(),
+        std::min<size_t>(slot.length, slot.buffer.size())};
+}
+
+int64_t MySQL_Binds::number(size_t i) const
+{
+    return _slots[i].is_null ? 0 : _slots[i].number;
+}
+
+bool MySQL_Binds::fetch_secure(MYSQL_STMT *stmt, size_t i, secure_vec &out)
+{
+    out.clear();
+    if (_slots[i].is_null || _slots[i].length == 0)
+        return true;
+
+    out.assign(_slots[i].length, 0);
+
+    MYSQL_BIND bind;
+    memset(&bind, 0, sizeof bind);
+    unsigned long length = 0;
+    bind.buffer_type = MYSQL_TYPE_BLOB;
+    bind.buffer = out.data();
+    bind.buffer_length = out.size();
+    bind.length = &length;
+    return mysql_stmt_fetch_column(stmt, &bind, i, 0) == 0;
+}
+
+MYSQL_BIND *MySQL_Binds::get()
+{
+    return _binds.data();
+}
+
+#endif
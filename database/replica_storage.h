@@ -0,0 +1,526 @@
+#ifndef ESO_DATABASE_REPLICA_STORAGE
+#define ESO_DATABASE_REPLICA_STORAGE
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "credential.h"
+#include "db_error.h"
+#include "permission.h"
+#include "storage.h"
+#include "../logger/logger.h"
+#include "../stats/report.h"
+
+/*
+ * A Storage backend that keeps a full copy of another backend's rows in
+ * memory. Reads are served from the copy and never reach the other backend;
+ * writes go to the other backend first, for durability, and are applied to
+ * the copy once they succeed.
+ *
+ * The copy is loaded when the replica is created. If that fails, e.g.
+ * because MySQL is down, reads go to the other backend and the load is
+ * retried at most every REPLICA_RELOAD_MS until it succeeds.
+ */
+
+// How many shards each table of the copy is split into.
+const size_t REPLICA_SHARDS = 64;
+// How often a failed load is retried.
+const int REPLICA_RELOAD_MS = 1000;
+
+/*
+ * A hash map from primary key to row, read without locks.
+ *
+ * The map is split into shards by key hash. A shard is never changed once it
+ * is published: a writer copies the shards it changes, edits the copies and
+ * then publishes them in place of the old ones. A reader takes a reference
+ * to the current version of one shard and looks the row up in it, so readers
+ * never wait for writers or for each other, and a shard is freed when the
+ * last reader of its old version is done with it (RCU, with shared_ptr
+ * counts in place of grace periods).
+ *
+ * Writers must not run concurrently. Changes published together are not
+ * atomic across shards; a reader may see some of a batch before the rest.
+ */
+template <class Row>
+class ReplicaTable
+{
+public:
+    ReplicaTable();
+
+    // Sets row to the row with the key. Returns false if there is none.
+    bool get(const std::string &key, Row &row) const;
+    // Calls f(const Row &) for every row.
+    template <class F>
+    void for_each(F f) const;
+    // The number of rows.
+    size_t size() const;
+
+    // Writers only. Replaces every row with rows, publishing at once.
+    void load(const std::vector<Row> &rows,
+            std::string (*key)(const Row &));
+    // Writers only. Return the row as changed so far, or nullptr.
+    const Row *find(const std::string &key);
+    // Writers only. Change rows; nothing is visible until publish().
+    void put(const std::string &key, const Row &row);
+    void erase(const std::string &key);
+    void publish();
+private:
+    typedef std::unordered_map<std::string, Row> Shard;
+
+    static size_t shard_of(const std::string &key);
+    // Returns the writer's copy of shard i, copying it on first use.
+    Shard &edit(size_t i);
+
+    std::shared_ptr<const Shard> _shards[REPLICA_SHARDS];
+    // The shards being changed by the writer, not yet published.
+    std::unordered_map<size_t, std::shared_ptr<Shard>> _editing;
+    std::atomic<size_t> _size;
+};
+
+class ReplicaStorage : public Storage
+{
+public:
+    // Keeps a copy of durable's rows. durable must outlive the replica.
+    explicit ReplicaStorage(const Storage &durable);
+
+    int create_permission(const Permission perm) const;
+    int insert_permission(const Permission perm) const;
+    int update_permission(const Permission perm) const;
+    int delete_permission(const Permission perm) const;
+    int create_credential(const Credential cred) const;
+    int delete_credential(const Credential cred) const;
+
+    int insert_permissions(const std::vector<Permission> &perms) const;
+    int delete_permissions(const std::vector<Permission> &perms) const;
+    int create_credentials(const std::vector<Credential> &creds) const;
+
+    Credential get_credential(const Credential cred) const;
+    std::vector<Credential> get_all_credentials(const char *set_name) const;
+    Permission get_permission(const Permission perm) const;
+    std::vector<Permission> get_all_permissions(const char *set_name) const;
+
+    int scan_permissions(std::vector<Permission> &perms) const;
+    int scan_credentials(std::vector<Credential> &creds) const;
+
+    // Appends the size of the copy to a stats report.
+    void append_to(std::string &report) const;
+private:
+    // Returns true if the copy is loaded, trying to load it if it is not
+    // and the last try was long enough ago.
+    bool ready() const;
+    // Loads the copy. The caller holds _write_mutex.
+    bool load() const;
+    // Applies inserts of perms, which durable has written, to the copy. The
+    // caller holds _write_mutex.
+    void apply_inserts(const std::vector<Permission> &perms) const;
+
+    const Storage &_durable;
+
+    // Serializes writers, which change both durable and the copy.
+    mutable std::mutex _write_mutex;
+    mutable std::atomic<bool> _loaded;
+    mutable std::chrono::steady_clock::time_point _last_load;
+
+    mutable ReplicaTable<Permission> _permissions;
+    mutable ReplicaTable<Credential> _credentials;
+};
+
+template <class Row>
+ReplicaTable<Row>::ReplicaTable()
+    : _size{0}
+{
+    for (size_t i = 0; i < REPLICA_SHARDS; i++)
+        _shards[i] = std::make_shared<const Shard>();
+}
+
+template <class Row>
+size_t ReplicaTable<Row>::shard_of(const std::string &key)
+{
+    return std::hash<std::string>()(key) % REPLICA_SHARDS;
+}
+
+template <class Row>
+bool ReplicaTable<Row>::get(const std::string &key, Row &row) const
+{
+    std::shared_ptr<const Shard> shard =
+        std::atomic_load(&_shards[shard_of(key)]);
+    auto found = shard->find(key);
+    if (found == shard->end())
+        return false;
+    row = found->second;
+    return true;
+}
+
+template <class Row>
+template <class F>
+void ReplicaTable<Row>::for_each(F f) const
+{
+    for (size_t i = 0; i < REPLICA_SHARDS; i++)
+    {
+        std::shared_ptr<const Shard> shard = std::atomic_load(&_shards[i]);
+        for (auto &row : *shard)
+            f(row.second);
+    }
+}
+
+template <class Row>
+size_t ReplicaTable<Row>::size() const
+{
+    return _size.load();
+}
+
+template <class Row>
+void ReplicaTable<Row>::load(const std::vector<Row> &rows,
+        std::string (*key)(const Row &))
+{
+    std::shared_ptr<Shard> shards[REPLICA_SHARDS];
+    for (size_t i = 0; i < REPLICA_SHARDS; i++)
+        shards[i] = std::make_shared<Shard>();
+    for (const Row &row : rows)
+    {
+        std::string k = key(row);
+        (*shards[shard_of(k)])[k] = row;
+    }
+
+    _editing.clear();
+    size_t size = 0;
+    for (size_t i = 0; i < REPLICA_SHARDS; i++)
+    {
+        size += shards[i]->size();
+        std::atomic_store(&_shards[i],
+                std::shared_ptr<const Shard>{std::move(shards[i])});
+    }
+    _size = size;
+}
+
+template <class Row>
+typename ReplicaTable<Row>::Shard &ReplicaTable<Row>::edit(size_t i)
+{
+    std::shared_ptr<Shard> &copy = _editing[i];
+    if (!copy)
+        copy = std::make_shared<Shard>(*_shards[i]);
+    return *copy;
+}
+
+template <class Row>
+const Row *ReplicaTable<Row>::find(const std::string &key)
+{
+    size_t i = shard_of(key);
+    auto editing = _editing.find(i);
+    const Shard &shard = editing != _editing.end()
+        ? *editing->second : *_shards[i];
+    auto found = shard.find(key);
+    return found == shard.end() ? nullptr : &found->second;
+}
+
+template <class Row>
+void ReplicaTable<Row>::put(const std::string &key, const Row &row)
+{
+    Shard &shard = edit(shard_of(key));
+    if (shard.count(key) == 0)
+        _size++;
+    shard[key] = row;
+}
+
+template <class Row>
+void ReplicaTable<Row>::erase(const std::string &key)
+{
+    if (!find(key))
+        return;
+    edit(shard_of(key)).erase(key);
+    _size--;
+}
+
+template <class Row>
+void ReplicaTable<Row>::publish()
+{
+    for (auto &editing : _editing)
+        std::atomic_store(&_shards[editing.first],
+                std::shared_ptr<const Shard>{std::move(editing.second)});
+    _editing.clear();
+}
+
+ReplicaStorage::ReplicaStorage(const Storage &durable)
+    : _durable(durable), _loaded{false}
+{
+    std::lock_guard<std::mutex> lock{_write_mutex};
+    load();
+}
+
+bool ReplicaStorage::load() const
+{
+    _last_load = std::chrono::steady_clock::now();
+
+    std::vector<Permission> perms;
+    std::vector<Credential> creds;
+    if (_durable.scan_permissions(perms) != OK
+            || _durable.scan_credentials(creds) != OK)
+    {
+        Logger::log("ReplicaStorage: cannot load the rows; reading through "
+                "until they can be.", LogLevel::Error);
+        return false;
+    }
+
+    _permissions.load(perms, &permission_key);
+    _credentials.load(creds, &credential_key);
+    _loaded = true;
+
+    ESO_LOG(LogLevel::Info, "ReplicaStorage: loaded ", perms.size(),
+            " permissions and ", creds.size(), " credentials.");
+    return true;
+}
+
+bool ReplicaStorage::ready() const
+{
+    if (_loaded.load())
+        return true;
+
+    // Readers do not wait for a writer to try.
+    std::unique_lock<std::mutex> lock{_write_mutex, std::try_to_lock};
+    if (!lock.owns_lock() || _loaded.load())
+        return _loaded.load();
+    if (std::chrono::steady_clock::now() - _last_load
+            < std::chrono::milliseconds(REPLICA_RELOAD_MS))
+        return false;
+    return load();
+}
+
+int ReplicaStorage::create_permission(const Permission perm) const
+{
+    std::lock_guard<std::mutex> lock{_write_mutex};
+    int ret = _durable.create_permission(perm);
+    if (ret == OK && _loaded)
+    {
+        _permissions.put(permission_key(perm), perm);
+        _permissions.publish();
+    }
+    return ret;
+}
+
+/*
+ * Like INSERT ... ON DUPLICATE KEY UPDATE op, only the op of an existing
+ * permission changes.
+ */
+void ReplicaStorage::apply_inserts(const std::vector<Permission> &perms) const
+{
+    for (const Permission &perm : perms)
+    {
+        std::string key = permission_key(perm);
+        Permission row = perm;
+        if (const Permission *old = _permissions.find(key))
+        {
+            row = *old;
+            row.op = perm.op;
+        }
+        _permissions.put(key, row);
+    }
+    _permissions.publish();
+}
+
+int ReplicaStorage::insert_permission(const Permission perm) const
+{
+    return insert_permissions({perm});
+}
+
+int ReplicaStorage::update_permission(const Permission perm) const
+{
+    std::lock_guard<std::mutex> lock{_write_mutex};
+    int ret = _durable.update_permission(perm);
+    if (ret == OK && _loaded)
+    {
+        std::string key = permission_key(perm);
+        if (const Permission *old = _permissions.find(key))
+        {
+            Permission row = *old;
+            row.op = perm.op;
+            _permissions.put(key, row);
+            _permissions.publish();
+        }
+    }
+    return ret;
+}
+
+int ReplicaStorage::delete_permission(const Permission perm) const
+{
+    return delete_permissions({perm});
+}
+
+int ReplicaStorage::create_credential(const Credential cred) const
+{
+    std::lock_guard<std::mutex> lock{_write_mutex};
+    int ret = _durable.create_credential(cred);
+    if (ret == OK && _loaded)
+    {
+        _credentials.put(credential_key(cred), cred);
+        _credentials.publish();
+    }
+    return ret;
+}
+
+int ReplicaStorage::delete_credential(const Credential cred) const
+{
+    std::lock_guard<std::mutex> lock{_write_mutex};
+    int ret = _durable.delete_credential(cred);
+    if (ret == OK && _loaded)
+    {
+        _credentials.erase(credential_key(cred));
+        _credentials.publish();
+    }
+    return ret;
+}
+
+int ReplicaStorage::insert_permissions(const std::vector<Permission> &perms)
+    const
+{
+    std::lock_guard<std::mutex> lock{_write_mutex};
+    int ret = _durable.insert_permissions(perms);
+    if (ret == OK && _loaded)
+        apply_inserts(perms);
+    return ret;
+}
+
+int ReplicaStorage::delete_permissions(const std::vector<Permission> &perms)
+    const
+{
+    std::lock_guard<std::mutex> lock{_write_mutex};
+    int ret = _durable.delete_permissions(perms);
+    if (ret == OK && _loaded)
+    {
+        for (const Permission &perm : perms)
+            _permissions.erase(permission_key(perm));
+        _permissions.publish();
+    }
+    return ret;
+}
+
+/*
+ * Like INSERT IGNORE, credentials that already exist are left as they are.
+ */
+int ReplicaStorage::create_credentials(const std::vector<Credential> &creds)
+    const
+{
+    std::lock_guard<std::mutex> lock{_write_mutex};
+    int ret = _durable.create_credentials(creds);
+    if (ret == OK && _loaded)
+    {
+        for (const Credential &cred : creds)
+        {
+            std::string key = credential_key(cred);
+            if (!_credentials.find(key))
+                _credentials.put(key, cred);
+        }
+        _credentials.publish();
+    }
+    return ret;
+}
+
+Credential ReplicaStorage::get_credential(const Credential cred) const
+{
+    if (!ready())
+        return _durable.get_credential(cred);
+
+    Credential row;
+    _credentials.get(credential_key(cred), row);
+    return row;
+}
+
+/*
+ * A scan of the whole copy; esod only looks credentials up by key.
+ */
+std::vector<Credential> ReplicaStorage::get_all_credentials(
+        const char *set_name) const
+{
+    if (!ready())
+        return _durable.get_all_credentials(set_name);
+
+    std::vector<Credential> creds;
+    _credentials.for_each([&](const Credential &row)
+    {
+        if (row.set_name != set_name)
+            return;
+
+        // Without the keys, as from MySQL_Conn.
+        Credential cred;
+        cred.set_name = row.set_name;
+        cred.version = row.version;
+        cred.type = row.type;
+        cred.expiration = row.expiration;
+        cred.p_owner = row.p_owner;
+        cred.s_owner = row.s_owner;
+        cred.algo = row.algo;
+        cred.size = row.size;
+        creds.push_back(cred);
+    });
+    return creds;
+}
+
+Permission ReplicaStorage::get_permission(const Permission perm) const
+{
+    if (!ready())
+        return _durable.get_permission(perm);
+
+    Permission row;
+    _permissions.get(permission_key(perm), row);
+    return row;
+}
+
+/*
+ * A scan of the whole copy, like get_all_credentials().
+ */
+std::vector<Permission> ReplicaStorage::get_all_permissions(
+        const char *set_name) const
+{
+    if (!ready())
+        return _durable.get_all_permissions(set_name);
+
+    std::vector<Permission> perms;
+    _permissions.for_each([&](const Permission &row)
+    {
+        if (row.set_name == set_name)
+            perms.push_back(row);
+    });
+    return perms;
+}
+
+int ReplicaStorage::scan_permissions(std::vector<Permission> &perms) const
+{
+    if (!ready())
+        return _durable.scan_permissions(perms);
+
+    perms.clear();
+    perms.reserve(_permissions.size());
+    _permissions.for_each([&](const Permission &row)
+    {
+        perms.push_back(row);
+    });
+    return OK;
+}
+
+int ReplicaStorage::scan_credentials(std::vector<Credential> &creds) const
+{
+    if (!ready())
+        return _durable.scan_credentials(creds);
+
+    creds.clear();
+    creds.reserve(_credentials.size());
+    _credentials.for_each([&](const Credential &row)
+    {
+        creds.push_back(row);
+    });
+    return OK;
+}
+
+void ReplicaStorage::append_to(std::string &report) const
+{
+    append_counter(report, "replica_loaded", _loaded.load() ? 1 : 0);
+    append_counter(report, "replica_permissions", _permissions.size());
+    append_counter(report, "replica_credentials", _credentials.size());
+}
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef ESO_DATABASE_STORAGE
+#define ESO_DATABASE_STORAGE
+
+#include <string>
+#include <vector>
+
+#include "credential.h"
+#include "permission.h"
+
+/*
+ * Where a daemon keeps its credentials and permissions. The daemons use the
+ * backend returned by storage() (see backend.h), which their config selects.
+ *
+ * Write methods return 0 on success, else an error code from db_error.h.
+ * Reads return an empty Credential or Permission, or an empty vector, when
+ * nothing matches. Every method may be called from any thread.
+ */
+class Storage
+{
+public:
+    virtual ~Storage();
+
+    // Creates a new permission. Fails if it already exists.
+    virtual int create_permission(const Permission perm) const = 0;
+
+    // Creates a permission, or updates the op value of the existing one.
+    virtual int insert_permission(const Permission perm) const = 0;
+
+    // Updates the op value of the permission with the given set name,
+    // entity and location.
+    virtual int update_permission(const Permission perm) const = 0;
+
+    // Deletes the permission with the given set name, entity and location.
+    virtual int delete_permission(const Permission perm) const = 0;
+
+    // Creates a new credential. Fails if it already exists.
+    virtual int create_credential(const Credential cred) const = 0;
+
+    // Deletes the credential with the given set name and version.
+    virtual int delete_credential(const Credential cred) const = 0;
+
+    // Batch versions of insert_permission, delete_permission and
+    // create_credential. A batch is written entirely or not at all, except
+    // that create_credentials skips credentials that already exist.
+    virtual int insert_permissions(const std::vector<Permission> &perms)
+        const = 0;
+    virtual int delete_permissions(const std::vector<Permission> &perms)
+        const = 0;
+    virtual int create_credentials(const std::vector<Credential> &creds)
+        const = 0;
+
+    // Get the credential with the given set name and version.
+    virtual Credential get_credential(const Credential cred) const = 0;
+
+    // Get all credentials associated with the given set name. Only the
+    // set_name, version, type, expiration, owner, algo and size fields are
+    // filled.
+    virtual std::vector<Credential> get_all_credentials(const char *set_name)
+        const = 0;
+
+    // Get the permission with the given set name, entity and location.
+    virtual Permission get_permission(const Permission perm) const = 0;
+
+    // Get all permissions associated with the given set name.
+    virtual std::vector<Permission> get_all_permissions(const char *set_name)
+        const = 0;
+
+    // Set perms or creds to every permission or credential, with all
+    // fields. Return 0 on success.
+    virtual int scan_permissions(std::vector<Permission> &perms) const = 0;
+    virtual int scan_credentials(std::vector<Credential> &creds) const = 0;
+
+    // Appends the backend's own counters, if it has any, to a stats report.
+    virtual void append_to(std::string &report) const;
+};
+
+Storage::~Storage()
+{
+
+}
+
+void Storage::append_to(std::string &) const
+{
+
+}
+
+/*
+ * Returns the primary key of a permission, (set_name, entity, loc), or of a
+ * credential, (set_name, version), as one string for hash maps.
+ */
+std::string permission_key(const Permission &perm)
+{
+    std::string key{perm.set_name};
+    key += '\0';
+    key += perm.entity;
+    key += '\0';
+    key += perm.loc;
+    return key;
+}
+
+std::string credential_key(const Credential &cred)
+{
+    std::string key{cred.set_name};
+    key += '\0';
+    key += std::to_string(cred.version);
+    return key;
+}
+
+#endif
@@ -1,6 +1,52 @@
 #ifndef ESO_DISTRIBUTION_CONFIG_ESOD_CONFIG
 #define ESO_DISTRIBUTION_CONFIG_ESOD_CONFIG
 
-const char* ESOD_SOCKET_PATH = "/home/jac/Desktop/eso/distribution/esod/esod_socket";
+#include <cstddef>
+
+#include "../../global_config/paths.h"
+#include "../../logger/logger.h"
+
+const std::string ESOD_SOCKET_PATH = eso_path("distribution/esod/esod_socket");
+
+// Messages more verbose than this level are not logged.
+const LogLevel ESOD_LOG_LEVEL = LogLevel::Info;
+
+// Sampled request spans are appended here, one JSON object per line.
+const std::string ESOD_TRACE_PATH =
+    eso_path("distribution/esod/esod_trace.jsonl");
+// The fraction of requests that start a new trace. 0 disables tracing.
+const double ESOD_TRACE_SAMPLE_RATE = 0.01;
+
+// Threads answering GET_PERM and GET_CRED, or 0 for one per core, and how
+// many reads may wait for one before the accepting thread answers them
+// itself.
+const unsigned int ESOD_READ_THREADS = 0;
+const size_t ESOD_READ_QUEUE = 256;
+
+// The sequence number of the last change from esoca that has been written,
+// so that after a restart esod asks esoca only for the changes after it.
+const std::string ESOD_APPLIED_SEQ_PATH =
+    eso_path("distribution/esod/esod_applied_seq");
+
+// Connecting to esoca to catch up or compare trees, and each send and
+// receive on the connection, fail after this long.
+const int ESOD_ESOCA_TIMEOUT_MS = 30000;
+
+// How often esod compares its rows with esoca's hash tree, to find changes
+// that propagation lost (see tree_sync.h). 0 turns the check off.
+const unsigned int ESOD_TREE_SYNC_INTERVAL_S = 60;
+
+// Changes queued for a local daemon that has not acknowledged them. Past
+// ESOD_SUBSCRIBE_BACKLOG_MAX the queue is dropped and the daemon starts
+// over when it next subscribes (see subscriptions.h). Up to
+// ESOD_SUBSCRIBE_BATCH_MAX changes are sent at a time.
+const size_t ESOD_SUBSCRIBE_BACKLOG_MAX = 4096;
+const size_t ESOD_SUBSCRIBE_BATCH_MAX = 256;
+
+// Local daemons esod keeps changes for, and SUBSCRIBE connections it serves
+// at once, each on a thread of its own. Past either a daemon is refused and
+// subscribes to another esod.
+const size_t ESOD_SUBSCRIBERS_MAX = 4096;
+const size_t ESOD_SUBSCRIBE_CONNECTIONS_MAX = 4096;
 
 #endif
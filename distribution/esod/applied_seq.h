@@ -0,0 +1,129 @@
+#ifndef ESO_DISTRIBUTION_ESOD_APPLIED_SEQ
+#define ESO_DISTRIBUTION_ESOD_APPLIED_SEQ
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+#include "../config/esod_config.h"
+#include "../config/mysql_config.h"
+#include "../../logger/logger.h"
+#include "../../stats/report.h"
+
+/*
+ * How far esod has got through esoca's numbered changes.
+ *
+ * esod applies the changes esoca pushes in order. When one arrives that is
+ * not the next, esod has missed some and asks esoca for them with
+ * GET_CHANGES (see central/esoca/change_log.h), as it also does when it
+ * starts. It asks too when sent changes before the last one it applied, as
+ * esoca numbers over from 1 if its log is lost. esoca then sends every row,
+ * and the number goes back to esoca's.
+ *
+ * The number is saved to ESOD_APPLIED_SEQ_PATH once the changes up to it
+ * have been written to the database, so a restarted esod asks only for what
+ * it missed while it was down. The file is replaced by a rename but not
+ * synced, so after a crash it may hold an older number; the changes after
+ * it are then applied again, which is harmless. With in-memory storage
+ * nothing survives a restart, so the file is not read.
+ */
+class AppliedSeq
+{
+public:
+    static AppliedSeq &instance();
+
+    // The last change applied, or queued to be written.
+    uint64_t applied() const;
+    void set(uint64_t seq);
+
+    // Saves seq, once every change up to it has been written.
+    void written(uint64_t seq);
+
+    // Held while a change is applied and set, so that a thread holding it
+    // sees no change half applied.
+    std::mutex &applying();
+
+    // Appends the applied and saved sequence numbers to a stats report.
+    void append_to(std::string &report) const;
+private:
+    explicit AppliedSeq(const std::string &path);
+
+    std::string _path;
+    std::atomic<uint64_t> _applied;
+    std::mutex _applying;
+
+    mutable std::mutex _mutex;
+    uint64_t _saved;
+};
+
+AppliedSeq &AppliedSeq::instance()
+{
+    static AppliedSeq *applied_seq = new AppliedSeq{ESOD_APPLIED_SEQ_PATH};
+    return *applied_seq;
+}
+
+AppliedSeq::AppliedSeq(const std::string &path)
+    : _path{path}, _applied{0}, _saved{0}
+{
+    if (strcmp(STORAGE_BACKEND, "memory") == 0)
+        return;
+
+    std::ifstream input{_path};
+    if (!(input >> _saved))
+        _saved = 0;
+    _applied = _saved;
+}
+
+uint64_t AppliedSeq::applied() const
+{
+    return _applied.load();
+}
+
+void AppliedSeq::set(uint64_t seq)
+{
+    _applied = seq;
+}
+
+void AppliedSeq::written(uint64_t seq)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (seq == _saved)
+        return;
+
+    std::string tmp_path = _path + ".tmp";
+    {
+        std::ofstream output{tmp_path, std::ios::trunc};
+        output << seq << '\n';
+        if (!output.flush())
+        {
+            Logger::log("esod cannot write " + tmp_path, LogLevel::Error);
+            return;
+        }
+    }
+    if (rename(tmp_path.c_str(), _path.c_str()) != 0)
+    {
+        Logger::log("esod cannot rename " + tmp_path + ": " + strerror(errno),
+                LogLevel::Error);
+        return;
+    }
+    _saved = seq;
+}
+
+std::mutex &AppliedSeq::applying()
+{
+    return _applying;
+}
+
+void AppliedSeq::append_to(std::string &report) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    append_counter(report, "applied_seq", _applied.load());
+    append_counter(report, "applied_seq_saved", _saved);
+}
+
+#endif
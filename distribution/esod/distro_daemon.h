@@ -1,23 +1,38 @@
 #ifndef ESO_DISTRIBUTION_ESOD_DISTRO_DAEMON
 #define ESO_DISTRIBUTION_ESOD_DISTRO_DAEMON
 
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unistd.h>
+#include <unordered_set>
 #include <vector>
 
+#include "applied_seq.h"
+#include "subscriptions.h"
+#include "tree_sync.h"
 #include "../config/esod_config.h"
 #include "../config/mysql_config.h"
 #include "../../daemon/daemon.h"
+#include "../../daemon/propagation.h"
+#include "../../daemon/worker_pool.h"
 #include "../../global_config/global_config.h"
 #include "../../global_config/message_config.h"
 #include "../../global_config/types.h"
 #include "../../logger/logger.h"
 #include "../../socket/tcp_socket.h"
 #include "../../socket/tcp_stream.h"
+#include "../../stats/histogram.h"
+#include "../../stats/propagation.h"
+#include "../../stats/report.h"
+#include "../../stats/trace.h"
 #include "../../util/parser.h"
 #include "../../util/network.h"
 
-#include "../../database/mysql_conn.h"
+#include "../../database/backend.h"
+#include "../../database/group_commit.h"
+#include "../../database/hash_tree.h"
 
 
 /* 
@@ -30,6 +45,29 @@ class DistroDaemon : public Daemon
     private:
         int work() const;
         const char * lock_path() const;
+        // Writes a change from esoca and sends it on to the local daemons.
+        // seq is recorded as applied once it is written, unless it is 0.
+        void apply_change(const uchar_vec &msg_type, const std::string &msg,
+                const PropagationStamp &stamp, uint64_t seq) const;
+        // Tells the local daemons a credential has changed.
+        void invalidate_credential(const Credential &cred,
+                const PropagationStamp &stamp) const;
+        // Fetches and applies the changes after the last one applied.
+        bool catch_up() const;
+        // Deletes the rows whose keys esoca did not send in a full catch-up
+        // reply at change seq. Returns false if one could not be deleted.
+        bool drop_missing(const std::unordered_set<std::string> &perm_keys,
+                const std::unordered_set<std::string> &cred_keys,
+                uint64_t seq) const;
+        // Applies the batches esoca sends on a CHANGE_STREAM connection.
+        void receive_changes(TCP_Stream &stream) const;
+        // Compares esod's rows with esoca's every ESOD_TREE_SYNC_INTERVAL_S
+        // and repairs any that differ.
+        void tree_sync_loop() const;
+        void tree_sync() const;
+        // Answers a GET_PERM or GET_CRED request.
+        void handle_read(TCP_Stream &stream, const uchar_vec &msg_type,
+                const TraceContext &parent) const;
 };
 
 int DistroDaemon::start() const
@@ -39,13 +77,16 @@ int DistroDaemon::start() const
 
 const char * DistroDaemon::lock_path() const
 {
-    // TODO create config file?
-    std::string path = "/home/jac/Desktop/eso/distribution/esod/esod_lock";
+    static const std::string path = eso_path("distribution/esod/esod_lock");
     return path.c_str();
 }
 
 int DistroDaemon::work() const
 {
+    Logger::set_level(ESOD_LOG_LEVEL);
+    Tracer::instance().configure("esod", ESOD_TRACE_PATH,
+            ESOD_TRACE_SAMPLE_RATE);
+
     std::string my_hostname = get_fqdn();
 
     // The socket that will accept incoming connections.
@@ -55,8 +96,7 @@ int DistroDaemon::work() const
     bool connnected = false;
 
     // Read conifg file for distribution locations.
-    // TODO config this location somewhere
-    std::ifstream input( "/home/jac/Desktop/eso/global_config/locations_config" );
+    std::ifstream input{LOCATIONS_CONFIG_PATH};
     for (std::string line; getline(input, line); )
     {
         auto values = split_string(line, LOC_DELIMITER);
@@ -87,173 +127,604 @@ int DistroDaemon::work() const
     
     Logger::log("esod listening to TCP successfully.");
 
-    // TODO multithread
-    // ex: std::thread(handle(incoming_stream);
+    // Load the copy of the tables before serving from it.
+    storage();
+
+    // Save how far esod has got as changes are written, and fetch the
+    // changes missed while it was down. If esoca cannot be reached now, they
+    // are fetched when the first change arrives.
+    GroupCommit::instance().on_written([](uint64_t seq)
+    {
+        AppliedSeq::instance().written(seq);
+    });
+    catch_up();
+
+    if (ESOD_TREE_SYNC_INTERVAL_S > 0)
+        std::thread{&DistroDaemon::tree_sync_loop, this}.detach();
+
+    // Reads are answered on these threads, from the copy in memory, while
+    // this thread goes on accepting. Changes are still applied here, one at
+    // a time, so they take effect in the order they arrive.
+    WorkerPool readers{ESOD_READ_THREADS, ESOD_READ_QUEUE};
+
     while(true)
     {
-        Logger::log("esod is waiting for new TCP connection.", LogLevel::Debug);
+        ESO_LOG(LogLevel::Debug, "esod is waiting for new TCP connection.");
         TCP_Stream incoming_stream = tcp_in_socket.accept();
-        Logger::log("esod accepted new TCP connection.", LogLevel::Debug);
+        ESO_LOG(LogLevel::Debug, "esod accepted new TCP connection.");
 
-        uchar_vec recv_msg = incoming_stream.recv();
-        Logger::log(std::string{"Requested from esod: "} + to_string(recv_msg));
+        TraceContext parent;
+        uchar_vec recv_msg = recv_request(incoming_stream, parent);
+        ESO_LOG(LogLevel::Info, "Requested from esod: ", recv_msg);
 
-        /*
-         * Occurs when the CA sends an updated Permission to this distribution
-         * daemon.
-         */
-        if (recv_msg == UPDATE_PERM)
+        if (recv_msg == GET_PERM || recv_msg == GET_CRED)
         {
-            recv_msg = incoming_stream.recv();
-            Logger::log(std::string{"esod received: "} + to_string(recv_msg));
-
-            Permission perm = Permission{recv_msg};
-
-            // Update distribution server database.
-            MySQL_Conn conn;
-            conn.insert_permission(perm); 
+            // A std::function must be copyable, so the stream is shared.
+            auto stream = std::make_shared<TCP_Stream>(
+                    std::move(incoming_stream));
+            if (!readers.submit([this, stream, recv_msg, parent]()
+                    {
+                        handle_read(*stream, recv_msg, parent);
+                    }))
+                handle_read(*stream, recv_msg, parent);
+            continue;
+        }
 
-            // Send update to the local daemon.
-            // TODO This obvious assumes the local daemon is running...
-            TCP_Socket tcp_out_socket;
-            TCP_Stream local_stream = 
-                tcp_out_socket.connect(perm.loc, std::to_string(ESOL_PORT));
+        if (recv_msg == CHANGE_STREAM)
+        {
+            // The connection stays open, so it gets a thread of its own.
+            auto stream = std::make_shared<TCP_Stream>(
+                    std::move(incoming_stream));
+            std::thread{[this, stream]()
+            {
+                receive_changes(*stream);
+            }}.detach();
+            continue;
+        }
 
-            std::string log_msg{"esod to esol: "};
-            log_msg += perm.serialize();
-            Logger::log(log_msg, LogLevel::Debug);
+        if (recv_msg == SUBSCRIBE)
+        {
+            // The connection stays open too, so their number is capped.
+            if (!Subscriptions::instance().admit())
+            {
+                Logger::log("esod is serving too many subscriptions; "
+                        "refused one.", LogLevel::Warning);
+                incoming_stream.send(INVALID_REQUEST);
+                continue;
+            }
+            auto stream = std::make_shared<TCP_Stream>(
+                    std::move(incoming_stream));
+            std::thread{[stream]()
+            {
+                Subscriptions::instance().serve(*stream);
+            }}.detach();
+            continue;
+        }
 
-            local_stream.send(UPDATE_PERM);
-            local_stream.send(perm.serialize());
+        // Continues the trace of the esoca change, if any.
+        Span request_span{"esod.request", parent};
 
-            Logger::log("esod is closing TCP connection.", LogLevel::Debug);
-        }
         /*
-         * Occurs when the CA requests that a Permission be deleted due to a
-         * deletion on the admin interface.
+         * Occurs when the CA sends a change: an updated or deleted
+         * Permission, or a new Credential.
          */
-        else if (recv_msg == DELETE_PERM)
+        if (recv_msg == UPDATE_PERM || recv_msg == DELETE_PERM
+                || recv_msg == NEW_CRED)
         {
-            // Create Permission object.
-            Permission perm = Permission{incoming_stream.recv()};
+            request_span.tag("op", recv_msg == UPDATE_PERM ? "update_perm"
+                    : recv_msg == DELETE_PERM ? "delete_perm" : "new_cred");
+            std::string msg = to_string(incoming_stream.recv());
+            ESO_LOG(LogLevel::Info, "esod received: ", msg);
+
+            PropagationStamp stamp;
+            bool stamped = stamp.parse(incoming_stream.recv());
+            if (stamped)
+                propagation_received(stamp);
+
+            AppliedSeq &applied = AppliedSeq::instance();
+            std::lock_guard<std::mutex> lock{applied.applying()};
+            if (!stamped)
+            {
+                apply_change(recv_msg, msg, stamp, 0);
+            }
+            else if (stamp.seq == applied.applied() + 1)
+            {
+                apply_change(recv_msg, msg, stamp, stamp.seq);
+                applied.set(stamp.seq);
+            }
+            else if (stamp.seq > applied.applied())
+            {
+                // Changes before this one were missed. Fetching them
+                // fetches this one too.
+                Logger::log("esod missed changes " + std::to_string(
+                            applied.applied() + 1) + " to " + std::to_string(
+                            stamp.seq - 1) + "; catching up.",
+                        LogLevel::Warning);
+                if (!catch_up() || applied.applied() < stamp.seq)
+                    apply_change(recv_msg, msg, stamp, 0);
+            }
+            else if (stamp.seq < applied.applied())
+            {
+                // Most likely sent again, but esoca may have started
+                // numbering over; catching up tells which.
+                Logger::log("esod is at change " + std::to_string(
+                            applied.applied()) + " and was sent change "
+                        + std::to_string(stamp.seq) + "; checking with "
+                        "esoca.", LogLevel::Warning);
+                catch_up();
+            }
+            else
+            {
+                ESO_LOG(LogLevel::Debug, "esod already has change ",
+                        stamp.seq);
+            }
+        }
+        else if (recv_msg == PING)
+        {
+            incoming_stream.send(PING);
+        }
+        else if (recv_msg == REQUEST_STATS)
+        {
+            std::string report = stats_report_header("esod");
+            append_propagation_report(report);
+            MySQL_Pool::instance().append_to(report);
+            GroupCommit::instance().append_to(report);
+            AppliedSeq::instance().append_to(report);
+            TreeSync::instance().append_to(report);
+            Subscriptions::instance().append_to(report);
+            storage().append_to(report);
+            incoming_stream.send(report);
+        }
+        else
+        {
+            // TODO
+            // Invalid request.
+            std::string log_msg{"esod invalid request: "};
+            log_msg += std::string{recv_msg.begin(), recv_msg.end()};
+            Logger::log(log_msg);
 
-            // Update our database
-            MySQL_Conn conn;
-            conn.delete_permission(perm);
-            
-            // Send DELETE_PERM to the local daemon.
-            // TODO This obvious assumes the local daemon is running...
-            TCP_Socket tcp_out_socket;
-            TCP_Stream local_stream = 
-                tcp_out_socket.connect(perm.loc, std::to_string(ESOL_PORT));
+        }
+    }
 
-            std::string log_msg{"esod to esol: "};
-            log_msg += perm.serialize();
-            Logger::log(log_msg, LogLevel::Debug);
+}
 
-            local_stream.send(DELETE_PERM);
-            local_stream.send(perm.serialize());
+/*
+ * Queues a change to be written and sends it on to the local daemons that
+ * have subscribed: a permission to the one on its host, and a credential,
+ * as an invalidation, to all of them.
+ */
+void DistroDaemon::apply_change(const uchar_vec &msg_type,
+        const std::string &msg, const PropagationStamp &stamp,
+        uint64_t seq) const
+{
+    if (msg_type == NEW_CRED)
+    {
+        Credential cred{msg};
+        GroupCommit::instance().create_credential(cred, seq);
+        invalidate_credential(cred, stamp);
+        return;
+    }
 
-        }
-        /*
-         * Occurs when a local daemon queries this distribution daemon for a
-         * Permission.
-         */
-        else if (recv_msg == GET_PERM)
-        {
-            recv_msg = incoming_stream.recv();
-            Logger::log(std::string{"esod received: "} + 
-                    std::string{recv_msg.begin(), recv_msg.end()});
+    Permission perm = Permission{msg};
+    if (msg_type == UPDATE_PERM)
+        GroupCommit::instance().insert_permission(perm, seq);
+    else
+        GroupCommit::instance().delete_permission(perm, seq);
 
-            Permission perm = Permission{recv_msg};
+    ESO_LOG(LogLevel::Debug, "esod to esol: ", perm.serialize());
 
-            // TODO ensure the local daemon is the designated location for this
-            // credential? esol only uses Permissions that are marked with its
-            // FQDN so this may not matter.
+    Subscriptions::instance().push(perm.loc, msg_type, perm.serialize(),
+            stamp);
+}
 
-            // Update distribution server database.
-            MySQL_Conn conn;
-            conn.get_permission(perm); 
+/*
+ * Tells the local daemons to drop their copy of a credential. Only its set
+ * name and version are sent.
+ */
+void DistroDaemon::invalidate_credential(const Credential &cred,
+        const PropagationStamp &stamp) const
+{
+    Credential key;
+    key.set_name = cred.set_name;
+    key.version = cred.version;
+    Subscriptions::instance().push_all(INVALIDATE_CRED, key.serialize(),
+            stamp);
+}
 
-            std::string log_msg{"esod to esol: "};
-            log_msg += perm.serialize();
-            Logger::log(log_msg, LogLevel::Debug);
+/*
+ * Asks esoca for the changes after the last one applied with GET_CHANGES,
+ * and applies them, until there are none left. After each reply the changes
+ * are flushed and the new position saved, unless a change could not be
+ * written, so that they are fetched again after a restart.
+ *
+ * If esoca no longer has the changes, it sends every row instead, and the
+ * rows it did not send are deleted.
+ *
+ * Returns false if esoca could not be reached or sent a bad reply. The
+ * changes not fetched are asked for again when the next gap is seen.
+ */
+bool DistroDaemon::catch_up() const
+{
+    Span span{"esod.catch_up"};
+    AppliedSeq &applied = AppliedSeq::instance();
+    uint64_t fetched = 0;
 
-            incoming_stream.send(perm.serialize());
+    try
+    {
+        while (true)
+        {
+            TCP_Socket tcp_socket;
+            TCP_Stream stream = tcp_socket.connect(ESOCA_HOST,
+                    std::to_string(ESOCA_PORT), ESOD_ESOCA_TIMEOUT_MS);
+            send_trace(stream);
+            stream.send(GET_CHANGES);
+            stream.send(std::to_string(applied.applied()));
+
+            std::vector<std::string> header = split_string(stream.recv(),
+                    MSG_DELIMITER);
+            if (header.size() != 4)
+            {
+                Logger::log("esod: esoca refused GET_CHANGES.",
+                        LogLevel::Error);
+                return false;
+            }
+            uint64_t count = std::stoull(header[0]);
+            uint64_t through = std::stoull(header[1]);
+            uint64_t last = std::stoull(header[2]);
+            // Every row esoca has, so the others were deleted.
+            bool full = header[3] == "1";
+            std::unordered_set<std::string> perm_keys, cred_keys;
+
+            for (uint64_t i = 0; i < count; i++)
+            {
+                uchar_vec msg_type = stream.recv();
+                std::string msg = to_string(stream.recv());
+                PropagationStamp stamp;
+                if (!stamp.parse(stream.recv()))
+                {
+                    Logger::log("esod: bad stamp from esoca in catch-up.",
+                            LogLevel::Error);
+                    return false;
+                }
+                propagation_received_shared(stamp);
+                if (full && msg_type == NEW_CRED)
+                    cred_keys.insert(credential_key(Credential{msg}));
+                else if (full)
+                    perm_keys.insert(permission_key(Permission{msg}));
+                apply_change(msg_type, msg, stamp, 0);
+            }
+            fetched += count;
+
+            applied.set(through);
+            bool written = GroupCommit::instance().flush();
+            if (full)
+                written = drop_missing(perm_keys, cred_keys, through)
+                    && written;
+            if (written)
+                applied.written(through);
+
+            if (count == 0 || through >= last)
+                break;
         }
-        /*
-         * Occurs when a local daemon queries this distribution daemon for a
-         * Credential.
-         */
-        else if (recv_msg == GET_CRED)
+    }
+    catch (const connect_exception &e)
+    {
+        Logger::log("esod cannot reach esoca to catch up.", LogLevel::Error);
+        return false;
+    }
+    catch (const std::exception &e)
+    {
+        Logger::log("esod: bad GET_CHANGES reply from esoca.",
+                LogLevel::Error);
+        return false;
+    }
+
+    span.tag("changes", std::to_string(fetched));
+    ESO_LOG(LogLevel::Info, "esod caught up to change ", applied.applied(),
+            " with ", fetched, " changes.");
+    return true;
+}
+
+/*
+ * Called once the rows of the reply are written. The permissions are
+ * deleted as changes, so the local daemons are sent them too.
+ */
+bool DistroDaemon::drop_missing(
+        const std::unordered_set<std::string> &perm_keys,
+        const std::unordered_set<std::string> &cred_keys, uint64_t seq) const
+{
+    Storage &conn = storage();
+    std::vector<Permission> perms;
+    std::vector<Credential> creds;
+    if (conn.scan_permissions(perms) != OK
+            || conn.scan_credentials(creds) != OK)
+    {
+        Logger::log("esod cannot scan its rows for those esoca deleted.",
+                LogLevel::Error);
+        return false;
+    }
+
+    PropagationStamp stamp;
+    stamp.seq = seq;
+    stamp.origin_us = wall_now_us();
+    size_t dropped = 0;
+    bool deleted = true;
+    for (const Permission &perm : perms)
+        if (!perm_keys.count(permission_key(perm)))
+        {
+            apply_change(DELETE_PERM, perm.serialize(), stamp, 0);
+            dropped++;
+        }
+    for (const Credential &cred : creds)
+        if (!cred_keys.count(credential_key(cred)))
         {
-            // TODO Ensure that location is authorized to receive this cred.
+            deleted = conn.delete_credential(cred) == OK && deleted;
+            invalidate_credential(cred, stamp);
+            dropped++;
+        }
+    deleted = GroupCommit::instance().flush() && deleted;
 
-            // Parse request parameters. See the parameter order in
-            // message_config.h
-            recv_msg = incoming_stream.recv();
+    if (dropped > 0)
+        Logger::log("esod deleted " + std::to_string(dropped) + " rows that "
+                "esoca no longer has.", LogLevel::Warning);
+    return deleted;
+}
 
-            std::string log_msg{"esod: GET_CRED received: "};
-            log_msg += std::string{recv_msg.begin(), recv_msg.end()};
-            Logger::log(log_msg, LogLevel::Debug);
+/*
+ * Runs on its own thread until esoca closes the connection, which it opens
+ * again for its next batch. Changes in a batch that esod already has are
+ * skipped. If the batch does not follow on from the last change applied,
+ * the changes in between are fetched from esoca's log first. If it ends
+ * before the last change applied, esoca may have lost its log and started
+ * numbering over, so esod catches up then too: esoca answers a change it
+ * has not reached with every row, and esod starts from its number. The last
+ * change written carries the batch's end, so that is saved as esod's
+ * position once it is written, as the batch covers the changes esoca
+ * dropped because a newer one replaced them.
+ */
+void DistroDaemon::receive_changes(TCP_Stream &stream) const
+{
+    struct Change
+    {
+        uchar_vec msg_type;
+        std::string msg;
+        PropagationStamp stamp;
+    };
+
+    AppliedSeq &applied = AppliedSeq::instance();
+    std::vector<Change> changes;
+    while (true)
+    {
+        std::vector<std::string> header = split_string(stream.recv(),
+                MSG_DELIMITER);
+        if (stream.failed() || header.size() != 3)
+            break;
 
-            Credential cred = Credential{recv_msg};
+        uint64_t first, through, count;
+        try
+        {
+            first = std::stoull(header[0]);
+            through = std::stoull(header[1]);
+            count = std::stoull(header[2]);
+        }
+        catch (const std::exception &e)
+        {
+            break;
+        }
 
-            log_msg = std::string{"In esod, cred params: "};
-            log_msg += cred.serialize();
-            Logger::log(log_msg);
+        changes.clear();
+        for (uint64_t i = 0; i < count && !stream.failed(); i++)
+        {
+            Change change;
+            change.msg_type = stream.recv();
+            change.msg = to_string(stream.recv());
+            if (!change.stamp.parse(stream.recv()))
+                break;
+            changes.push_back(std::move(change));
+        }
+        if (changes.size() != count)
+            break;
+
+        Span span{"esod.change_batch"};
+        span.tag("changes", std::to_string(count));
+        {
+            std::lock_guard<std::mutex> lock{applied.applying()};
 
-            // Query our database.
-            MySQL_Conn conn;
-            cred = conn.get_credential(cred);
-            // If the result is valid, serialize and send it.
-            if (!cred.set_name.empty())
+            bool in_order = true;
+            if (through < applied.applied())
             {
-                log_msg = std::string{"esod to esol: cred serialized: "};
-                log_msg += cred.serialize();
-                Logger::log(log_msg, LogLevel::Debug);
-                incoming_stream.send(cred.serialize());
+                Logger::log("esod is at change " + std::to_string(
+                            applied.applied()) + " and was sent changes up "
+                        "to " + std::to_string(through) + "; checking with "
+                        "esoca.", LogLevel::Warning);
+                in_order = catch_up() && applied.applied() + 1 >= first;
             }
-            else
+            else if (applied.applied() + 1 < first)
             {
-                Logger::log("Invalid cred requested from esod.");
-                incoming_stream.send(INVALID_REQUEST);
+                Logger::log("esod missed changes " + std::to_string(
+                            applied.applied() + 1) + " to " + std::to_string(
+                            first - 1) + "; catching up.", LogLevel::Warning);
+                in_order = catch_up() && applied.applied() + 1 >= first;
             }
 
+            for (size_t i = 0; i < changes.size(); i++)
+            {
+                Change &change = changes[i];
+                propagation_received_shared(change.stamp);
+                if (change.stamp.seq <= applied.applied())
+                    continue;
+
+                bool last = i + 1 == changes.size();
+                apply_change(change.msg_type, change.msg, change.stamp,
+                        in_order && last ? through : 0);
+            }
+            if (in_order && through > applied.applied())
+                applied.set(through);
         }
-        /*
-         * Occurs when a new Credential has been created by the CA due to some
-         * interaction with the admin interface.
-         */
-        else if (recv_msg == NEW_CRED)
-        {
-            // Receive serialized Credential.
-            recv_msg = incoming_stream.recv();
 
-            std::string log_msg{"In esod, new cred: "};
-            log_msg += std::string{recv_msg.begin(), recv_msg.end()};
-            Logger::log(log_msg, LogLevel::Debug);
+        stream.send(std::to_string(applied.applied()));
+    }
 
-            // Insert Credential into database.
-            Credential cred = Credential{recv_msg};
-            MySQL_Conn conn;
+    ESO_LOG(LogLevel::Info, "esod: esoca closed the change stream.");
+}
+
+void DistroDaemon::tree_sync_loop() const
+{
+    while (true)
+    {
+        sleep(ESOD_TREE_SYNC_INTERVAL_S);
+        tree_sync();
+    }
+}
+
+/*
+ * Builds a hash tree of esod's rows and compares it with esoca's, which
+ * only works while both are at the same change. The differences are then
+ * written, if esod is still at that change, straight to storage while
+ * changes are held up, and sent on to the local daemons that have
+ * subscribed.
+ */
+void DistroDaemon::tree_sync() const
+{
+    AppliedSeq &applied = AppliedSeq::instance();
+    TreeSync &tree_sync = TreeSync::instance();
+    Span span{"esod.tree_sync"};
+
+    uint64_t seq = applied.applied();
+    GroupCommit::instance().flush();
+
+    Storage &conn = storage();
+    std::vector<Permission> perms;
+    std::vector<Credential> creds;
+    if (conn.scan_permissions(perms) != OK
+            || conn.scan_credentials(creds) != OK)
+        return;
+    if (applied.applied() != seq)
+    {
+        tree_sync.skipped();
+        return;
+    }
+
+    SyncRepairs repairs;
+    HashTree tree{std::move(perms), std::move(creds)};
+    if (!tree_sync.compare(seq, tree, repairs) || repairs.empty())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock{applied.applying()};
+        if (applied.applied() != seq)
+        {
+            tree_sync.skipped();
+            return;
+        }
+        GroupCommit::instance().flush();
+
+        for (const Permission &perm : repairs.delete_perms)
+            conn.delete_permission(perm);
+        for (const Permission &perm : repairs.put_perms)
+        {
+            // insert_permission only updates the op of an existing row.
+            if (conn.get_permission(perm).entity_type != perm.entity_type)
+                conn.delete_permission(perm);
+            conn.insert_permission(perm);
+        }
+        for (const Credential &cred : repairs.delete_creds)
+            conn.delete_credential(cred);
+        for (const Credential &cred : repairs.put_creds)
+        {
+            conn.delete_credential(cred);
             conn.create_credential(cred);
         }
-        else if (recv_msg == PING)
+    }
+
+    size_t rows = repairs.put_perms.size() + repairs.put_creds.size()
+        + repairs.delete_perms.size() + repairs.delete_creds.size();
+    tree_sync.repaired(rows);
+    span.tag("repaired", std::to_string(rows));
+    Logger::log("esod repaired " + std::to_string(rows) + " rows that "
+            "differed from esoca's at change " + std::to_string(seq) + ".",
+            LogLevel::Warning);
+
+    PropagationStamp stamp;
+    stamp.seq = seq;
+    stamp.origin_us = wall_now_us();
+    for (auto *changed : {&repairs.delete_perms, &repairs.put_perms})
+        for (const Permission &perm : *changed)
+            Subscriptions::instance().push(perm.loc,
+                    changed == &repairs.put_perms ? UPDATE_PERM : DELETE_PERM,
+                    perm.serialize(), stamp);
+    for (auto *changed : {&repairs.delete_creds, &repairs.put_creds})
+        for (const Credential &cred : *changed)
+            invalidate_credential(cred, stamp);
+}
+
+/*
+ * Answers a local daemon's query for a Permission or a Credential. Runs on
+ * the read threads, so it only reads.
+ */
+void DistroDaemon::handle_read(TCP_Stream &stream, const uchar_vec &msg_type,
+        const TraceContext &parent) const
+{
+    // Continues the trace of the esol fetch, if any.
+    Span request_span{"esod.request", parent};
+
+    // Changes that have been received must be visible first.
+    GroupCommit::instance().flush();
+    Storage &conn = storage();
+
+    if (msg_type == GET_PERM)
+    {
+        request_span.tag("op", "get_perm");
+        uchar_vec recv_msg = stream.recv();
+        ESO_LOG(LogLevel::Info, "esod received: ", recv_msg);
+
+        Permission perm = Permission{recv_msg};
+
+        // TODO ensure the local daemon is the designated location for this
+        // credential? esol only uses Permissions that are marked with its
+        // FQDN so this may not matter.
+
+        perm = conn.get_permission(perm);
+        if (!perm.set_name.empty())
         {
-            incoming_stream.send(PING);
+            ESO_LOG(LogLevel::Debug, "esod to esol: ", perm.serialize());
+            stream.send(perm.serialize());
         }
         else
         {
-            // TODO
-            // Invalid request.
-            std::string log_msg{"esod invalid request: "};
-            log_msg += std::string{recv_msg.begin(), recv_msg.end()};
-            Logger::log(log_msg);
-
+            Logger::log("Invalid perm requested from esod.");
+            stream.send(INVALID_REQUEST);
         }
     }
+    else
+    {
+        request_span.tag("op", "get_cred");
+        // TODO Ensure that location is authorized to receive this cred.
 
+        // Parse request parameters. See the parameter order in
+        // message_config.h
+        uchar_vec recv_msg = stream.recv();
+
+        ESO_LOG(LogLevel::Debug, "esod: GET_CRED received: ", recv_msg);
+
+        Credential cred = Credential{recv_msg};
+
+        ESO_LOG(LogLevel::Info, "In esod, cred params: ", cred.serialize());
+
+        cred = conn.get_credential(cred);
+        // If the result is valid, serialize and send it.
+        if (!cred.set_name.empty())
+        {
+            ESO_LOG(LogLevel::Debug, "esod to esol: cred serialized: ",
+                    cred.serialize());
+            stream.send(cred.serialize());
+        }
+        else
+        {
+            Logger::log("Invalid cred requested from esod.");
+            stream.send(INVALID_REQUEST);
+        }
+    }
 }
 
 #endif
@@ -0,0 +1,476 @@
+#ifndef ESO_DISTRIBUTION_ESOD_SUBSCRIPTIONS
+#define ESO_DISTRIBUTION_ESOD_SUBSCRIPTIONS
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../config/esod_config.h"
+#include "../../global_config/global_config.h"
+#include "../../global_config/message_config.h"
+#include "../../global_config/types.h"
+#include "../../logger/logger.h"
+#include "../../socket/tcp_stream.h"
+#include "../../stats/histogram.h"
+#include "../../stats/propagation.h"
+#include "../../stats/report.h"
+#include "../../stats/trace.h"
+#include "../../util/network.h"
+#include "../../util/parser.h"
+
+/*
+ * Sends the local daemons the changes for their hosts.
+ *
+ * Each esol keeps a SUBSCRIBE connection open to one esod, picked by a hash
+ * ring over locations_config (see local/esol/subscription.h), and esod
+ * sends it its host's permission changes and every credential change, in
+ * order, down that connection. Nothing is sent to a host that has not
+ * subscribed to this esod: esol fetches what it is missing when it
+ * subscribes.
+ *
+ * The changes for a host are numbered and kept until esol acknowledges
+ * them, so that if the connection drops esol can subscribe again and be
+ * sent the changes after the last one it acknowledged. The numbers start
+ * over when esod does, so each run has its own epoch and a subscription
+ * from an earlier one cannot resume. Neither can one whose host fell more
+ * than ESOD_SUBSCRIBE_BACKLOG_MAX changes behind: esol is told to drop its
+ * rows instead, and fetches them again as it needs them.
+ *
+ * esod sends the next batch once the last one is acknowledged, so the
+ * changes that arrive meanwhile go out together: a host on a slow link gets
+ * fewer, larger batches. When there is nothing to send for
+ * SUBSCRIBE_HEARTBEAT_MS, an empty batch shows esol the connection is
+ * still up.
+ *
+ * A host may only subscribe from one of its own addresses, so that another
+ * cannot take its changes. At most ESOD_SUBSCRIBERS_MAX hosts are kept, and
+ * at most ESOD_SUBSCRIBE_CONNECTIONS_MAX connections served at once; esol
+ * is refused past either and tries another esod.
+ */
+class Subscriptions
+{
+public:
+    static Subscriptions &instance();
+
+    // Queues a change for host. Does nothing if host has not subscribed.
+    void push(const std::string &host, const uchar_vec &msg_type,
+            const std::string &msg, const PropagationStamp &stamp);
+    // Queues a change for every host that has subscribed.
+    void push_all(const uchar_vec &msg_type, const std::string &msg,
+            const PropagationStamp &stamp);
+
+    // Reserves a connection for serve(). Returns false if
+    // ESOD_SUBSCRIBE_CONNECTIONS_MAX are being served.
+    bool admit();
+    // Sends a host the changes it subscribes to with SUBSCRIBE until the
+    // connection fails or the host subscribes again. The connection must
+    // have been admitted, and is released when this returns.
+    void serve(TCP_Stream &stream);
+
+    // Appends the subscription counters to a stats report.
+    void append_to(std::string &report);
+private:
+    Subscriptions();
+
+    // A change waiting to be acknowledged.
+    struct Entry
+    {
+        uint64_t seq;
+        uchar_vec msg_type;
+        std::string msg;
+        PropagationStamp stamp;
+    };
+
+    // A host that has subscribed, and its changes.
+    struct Subscriber
+    {
+        std::string host;
+
+        std::mutex mutex;
+        // Signalled when a change is queued or the host subscribes again.
+        std::condition_variable queued_cv;
+        // In order.
+        std::deque<Entry> backlog;
+        // The number of the next change.
+        uint64_t next_seq;
+        // Set when the backlog was dropped, until the host subscribes again.
+        bool overflowed;
+        // The connection serving the host. An earlier one stops when it
+        // sees this change.
+        uint64_t connection;
+        bool connected;
+    };
+
+    // Does the work of serve().
+    void subscribe(TCP_Stream &stream);
+    // Returns the host's Subscriber, or nullptr if there is no room for a
+    // new one. _mutex is held.
+    Subscriber *subscriber(const std::string &host);
+
+    // Queues a change for sub. sub.mutex is held.
+    void queue(Subscriber &sub, const uchar_vec &msg_type,
+            const std::string &msg, const PropagationStamp &stamp);
+    // Drops the changes up to seq. sub.mutex is held.
+    void acked(Subscriber &sub, uint64_t seq, bool delivered);
+    // Sends one batch and reads the acknowledgement. Returns false on
+    // failure.
+    bool send_batch(TCP_Stream &stream, const Subscriber &sub, uint64_t first,
+            std::vector<Entry> &batch);
+
+    // The start time of this run, in microseconds.
+    const uint64_t _epoch;
+
+    std::mutex _mutex;
+    // By host. Subscribers are never removed, as their connections use them.
+    std::map<std::string, std::unique_ptr<Subscriber>> _subscribers;
+    uint64_t _connections;
+    // Connections admitted and not yet done.
+    size_t _serving;
+
+    // Guarded by _mutex, for the stats report.
+    uint64_t _refused;
+    uint64_t _resumed;
+    uint64_t _reset;
+    uint64_t _overflows;
+    uint64_t _batches;
+    uint64_t _heartbeats;
+    uint64_t _changes_sent;
+};
+
+Subscriptions &Subscriptions::instance()
+{
+    static Subscriptions *subscriptions = new Subscriptions;
+    return *subscriptions;
+}
+
+Subscriptions::Subscriptions()
+    : _epoch{wall_now_us()}, _connections{0}, _serving{0}, _refused{0},
+    _resumed{0}, _reset{0}, _overflows{0}, _batches{0}, _heartbeats{0},
+    _changes_sent{0}
+{
+
+}
+
+void Subscriptions::push(const std::string &host, const uchar_vec &msg_type,
+        const std::string &msg, const PropagationStamp &stamp)
+{
+    Subscriber *sub;
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        auto found = _subscribers.find(host);
+        if (found == _subscribers.end())
+            return;
+        sub = found->second.get();
+    }
+
+    std::lock_guard<std::mutex> lock{sub->mutex};
+    queue(*sub, msg_type, msg, stamp);
+}
+
+void Subscriptions::push_all(const uchar_vec &msg_type,
+        const std::string &msg, const PropagationStamp &stamp)
+{
+    std::vector<Subscriber *> subs;
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        for (auto &entry : _subscribers)
+            subs.push_back(entry.second.get());
+    }
+
+    for (Subscriber *sub : subs)
+    {
+        std::lock_guard<std::mutex> lock{sub->mutex};
+        queue(*sub, msg_type, msg, stamp);
+    }
+}
+
+void Subscriptions::queue(Subscriber &sub, const uchar_vec &msg_type,
+        const std::string &msg, const PropagationStamp &stamp)
+{
+    // The host starts over when it subscribes again.
+    if (sub.overflowed)
+        return;
+
+    if (sub.backlog.size() >= ESOD_SUBSCRIBE_BACKLOG_MAX)
+    {
+        Logger::log("esod dropped the changes queued for " + sub.host
+                + ", which is too far behind.", LogLevel::Warning);
+        acked(sub, sub.next_seq - 1, false);
+        sub.overflowed = true;
+        sub.queued_cv.notify_all();
+
+        std::lock_guard<std::mutex> lock{_mutex};
+        _overflows++;
+        return;
+    }
+
+    DestinationStats::instance().queued(sub.host);
+    sub.backlog.push_back(Entry{sub.next_seq++, msg_type, msg, stamp});
+    sub.queued_cv.notify_all();
+}
+
+void Subscriptions::acked(Subscriber &sub, uint64_t seq, bool delivered)
+{
+    while (!sub.backlog.empty() && sub.backlog.front().seq <= seq)
+    {
+        DestinationStats::instance().done(sub.host, delivered);
+        sub.backlog.pop_front();
+    }
+}
+
+bool Subscriptions::admit()
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (_serving >= ESOD_SUBSCRIBE_CONNECTIONS_MAX)
+    {
+        _refused++;
+        return false;
+    }
+    _serving++;
+    return true;
+}
+
+void Subscriptions::serve(TCP_Stream &stream)
+{
+    subscribe(stream);
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    _serving--;
+}
+
+Subscriptions::Subscriber *Subscriptions::subscriber(const std::string &host)
+{
+    auto found = _subscribers.find(host);
+    if (found != _subscribers.end())
+        return found->second.get();
+    if (_subscribers.size() >= ESOD_SUBSCRIBERS_MAX)
+        return nullptr;
+
+    Subscriber *sub = new Subscriber;
+    sub->host = host;
+    sub->next_seq = 1;
+    sub->overflowed = false;
+    sub->connection = 0;
+    sub->connected = false;
+    _subscribers[host].reset(sub);
+    return sub;
+}
+
+void Subscriptions::subscribe(TCP_Stream &stream)
+{
+    // A connection that sends nothing does not hold its thread for long.
+    stream.set_timeout(SUBSCRIBE_TIMEOUT_MS);
+
+    std::vector<std::string> request = split_string(stream.recv(),
+            MSG_DELIMITER);
+    if (stream.failed() || request.size() != 3 || request[0].empty())
+        return;
+
+    // The host must be the one connecting.
+    std::string peer = stream.peer_address();
+    std::vector<std::string> addresses = resolve_addresses(request[0]);
+    if (std::find(addresses.begin(), addresses.end(), peer)
+            == addresses.end())
+    {
+        Logger::log("esod refused a subscription for " + request[0]
+                + " from " + peer + ", which is not that host.",
+                LogLevel::Warning);
+        stream.send(INVALID_REQUEST);
+        std::lock_guard<std::mutex> lock{_mutex};
+        _refused++;
+        return;
+    }
+
+    uint64_t epoch, acked_seq;
+    try
+    {
+        epoch = std::stoull(request[1]);
+        acked_seq = std::stoull(request[2]);
+    }
+    catch (const std::exception &e)
+    {
+        return;
+    }
+
+    Subscriber *sub;
+    uint64_t connection;
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        sub = subscriber(request[0]);
+        if (sub)
+            connection = ++_connections;
+        else
+            _refused++;
+    }
+    if (!sub)
+    {
+        Logger::log("esod refused a subscription for " + request[0]
+                + ": it already has " + std::to_string(ESOD_SUBSCRIBERS_MAX)
+                + " hosts.", LogLevel::Warning);
+        stream.send(INVALID_REQUEST);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock{sub->mutex};
+    // The changes after acked_seq can be sent if this run has them all.
+    uint64_t oldest = sub->backlog.empty() ? sub->next_seq
+        : sub->backlog.front().seq;
+    bool reset = epoch != _epoch || sub->overflowed
+        || acked_seq + 1 < oldest || acked_seq >= sub->next_seq;
+    uint64_t from;
+    if (reset)
+    {
+        // esol drops everything, so what is queued is no longer needed.
+        from = sub->next_seq - 1;
+        acked(*sub, from, true);
+        sub->overflowed = false;
+    }
+    else
+    {
+        from = acked_seq;
+        acked(*sub, from, true);
+    }
+    sub->connection = connection;
+    sub->connected = true;
+    sub->queued_cv.notify_all();
+    lock.unlock();
+
+    {
+        std::lock_guard<std::mutex> stats_lock{_mutex};
+        if (reset)
+            _reset++;
+        else
+            _resumed++;
+    }
+    Logger::log(sub->host + " subscribed to esod" + (reset ? "; it starts "
+                "over." : " from change " + std::to_string(from) + "."));
+
+    stream.send(std::to_string(_epoch) + MSG_DELIMITER + std::to_string(from)
+            + MSG_DELIMITER + (reset ? "1" : "0"));
+
+    uint64_t next = from + 1;
+    std::vector<Entry> batch;
+    while (true)
+    {
+        lock.lock();
+        sub->queued_cv.wait_for(lock,
+                std::chrono::milliseconds(SUBSCRIBE_HEARTBEAT_MS), [&]
+        {
+            return !sub->backlog.empty() || sub->overflowed
+                || sub->connection != connection;
+        });
+        // Subscribed again, or must start over: either way this
+        // connection is done.
+        if (sub->connection != connection || sub->overflowed)
+            break;
+
+        batch.clear();
+        for (const Entry &entry : sub->backlog)
+        {
+            if (batch.size() == ESOD_SUBSCRIBE_BATCH_MAX)
+                break;
+            batch.push_back(entry);
+        }
+        lock.unlock();
+
+        if (!send_batch(stream, *sub, next, batch))
+        {
+            lock.lock();
+            break;
+        }
+        next += batch.size();
+
+        lock.lock();
+        acked(*sub, next - 1, true);
+        lock.unlock();
+    }
+
+    if (sub->connection == connection)
+        sub->connected = false;
+    lock.unlock();
+    ESO_LOG(LogLevel::Info, "esod: the subscription of ", sub->host,
+            " ended.");
+}
+
+bool Subscriptions::send_batch(TCP_Stream &stream, const Subscriber &sub,
+        uint64_t first, std::vector<Entry> &batch)
+{
+    uint64_t start = stats_now_ns();
+    Span span{"esod.push"};
+    span.tag("dest", sub.host);
+    span.tag("changes", std::to_string(batch.size()));
+
+    stream.send(std::to_string(first) + MSG_DELIMITER
+            + std::to_string(batch.size()));
+    for (Entry &entry : batch)
+    {
+        entry.stamp.sent_us = wall_now_us();
+        stream.send(entry.msg_type);
+        stream.send(entry.msg);
+        stream.send(entry.stamp.serialize());
+    }
+
+    // esol acknowledges with the last change it has applied.
+    std::string ack = to_string(stream.recv());
+    if (!batch.empty())
+        propagation_record_shared(PROP_FORWARD, start);
+    if (stream.failed() || ack != std::to_string(first + batch.size() - 1))
+    {
+        Logger::log("Lost the subscription of " + sub.host + ".",
+                LogLevel::Error);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (batch.empty())
+    {
+        _heartbeats++;
+    }
+    else
+    {
+        _batches++;
+        _changes_sent += batch.size();
+    }
+    return true;
+}
+
+void Subscriptions::append_to(std::string &report)
+{
+    std::vector<Subscriber *> subs;
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        append_counter(report, "subscribe_refused", _refused);
+        append_counter(report, "subscribe_resumed", _resumed);
+        append_counter(report, "subscribe_reset", _reset);
+        append_counter(report, "subscribe_overflows", _overflows);
+        append_counter(report, "subscribe_batches", _batches);
+        append_counter(report, "subscribe_heartbeats", _heartbeats);
+        append_counter(report, "subscribe_changes_sent", _changes_sent);
+        for (auto &entry : _subscribers)
+            subs.push_back(entry.second.get());
+    }
+
+    uint64_t connected = 0, backlog = 0;
+    for (Subscriber *sub : subs)
+    {
+        std::lock_guard<std::mutex> lock{sub->mutex};
+        connected += sub->connected;
+        backlog += sub->backlog.size();
+    }
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        append_counter(report, "subscribe_connections", _serving);
+    }
+    append_counter(report, "subscribers", subs.size());
+    append_counter(report, "subscribers_connected", connected);
+    append_counter(report, "subscribe_backlog", backlog);
+}
+
+#endif
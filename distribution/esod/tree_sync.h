@@ -0,0 +1,284 @@
+#ifndef ESO_DISTRIBUTION_ESOD_TREE_SYNC
+#define ESO_DISTRIBUTION_ESOD_TREE_SYNC
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../config/esod_config.h"
+#include "../../database/credential.h"
+#include "../../database/hash_tree.h"
+#include "../../database/permission.h"
+#include "../../database/storage.h"
+#include "../../global_config/global_config.h"
+#include "../../global_config/message_config.h"
+#include "../../logger/logger.h"
+#include "../../socket/exception.h"
+#include "../../socket/tcp_socket.h"
+#include "../../socket/tcp_stream.h"
+#include "../../stats/report.h"
+#include "../../util/parser.h"
+
+/*
+ * The rows esod must change to match esoca.
+ */
+struct SyncRepairs
+{
+    bool empty() const;
+
+    // esoca's rows that esod is missing or holds differently.
+    std::vector<Permission> put_perms;
+    std::vector<Credential> put_creds;
+    // esod's rows that esoca does not have.
+    std::vector<Permission> delete_perms;
+    std::vector<Credential> delete_creds;
+};
+
+bool SyncRepairs::empty() const
+{
+    return put_perms.empty() && put_creds.empty() && delete_perms.empty()
+        && delete_creds.empty();
+}
+
+/*
+ * Compares esod's rows with esoca's over SYNC_TREE (see message_config.h),
+ * as a check on propagation: a change that was lost on the way, and is not
+ * in esoca's change log either, is found here.
+ *
+ * The hash trees are walked down from the root, asking esoca only for the
+ * children of nodes that differ, so two copies that agree exchange one hash
+ * and a few lost rows cost a few hundred bytes per level plus the rows of
+ * the leaves they are in.
+ */
+class TreeSync
+{
+public:
+    static TreeSync &instance();
+
+    // Compares tree, of esod's rows as of change seq, with esoca's, and sets
+    // repairs to what differs. Returns false if there was no comparison,
+    // because esoca could not be reached or is not at seq.
+    bool compare(uint64_t seq, const HashTree &tree, SyncRepairs &repairs);
+
+    // Records a comparison that was not made because a change arrived.
+    void skipped();
+    // Records the rows repaired after a comparison.
+    void repaired(size_t rows);
+
+    // Appends the counters to a stats report.
+    void append_to(std::string &report) const;
+private:
+    TreeSync();
+
+    // Sends msg to esoca and counts it.
+    void send(TCP_Stream &stream, const std::string &msg);
+    // Receives a message from esoca and counts it.
+    uchar_vec recv(TCP_Stream &stream);
+    // Sets repairs to the differences between esod's rows in the leaves and
+    // esoca's, which are read from stream.
+    void compare_leaves(TCP_Stream &stream, const HashTree &tree,
+            const std::vector<size_t> &leaves, SyncRepairs &repairs);
+
+    mutable std::mutex _mutex;
+    uint64_t _compared;
+    uint64_t _in_sync;
+    uint64_t _skipped;
+    uint64_t _repaired;
+    uint64_t _bytes_sent;
+    uint64_t _bytes_received;
+};
+
+TreeSync &TreeSync::instance()
+{
+    static TreeSync *tree_sync = new TreeSync;
+    return *tree_sync;
+}
+
+TreeSync::TreeSync()
+    : _compared{0}, _in_sync{0}, _skipped{0}, _repaired{0}, _bytes_sent{0},
+    _bytes_received{0}
+{
+
+}
+
+void TreeSync::send(TCP_Stream &stream, const std::string &msg)
+{
+    stream.send(msg);
+    std::lock_guard<std::mutex> lock{_mutex};
+    _bytes_sent += msg.size();
+}
+
+uchar_vec TreeSync::recv(TCP_Stream &stream)
+{
+    uchar_vec msg = stream.recv();
+    std::lock_guard<std::mutex> lock{_mutex};
+    _bytes_received += msg.size();
+    return msg;
+}
+
+bool TreeSync::compare(uint64_t seq, const HashTree &tree,
+        SyncRepairs &repairs)
+{
+    repairs = SyncRepairs{};
+
+    try
+    {
+        TCP_Socket tcp_socket;
+        TCP_Stream stream = tcp_socket.connect(ESOCA_HOST,
+                std::to_string(ESOCA_PORT), ESOD_ESOCA_TIMEOUT_MS);
+        stream.send(SYNC_TREE);
+        send(stream, std::to_string(seq));
+
+        uchar_vec root = recv(stream);
+        if (root.size() != 8)
+        {
+            skipped();
+            return false;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock{_mutex};
+            _compared++;
+            if (get_hash(root, 0) == tree.node(0, 0))
+                _in_sync++;
+        }
+
+        // The nodes of the current level that differ.
+        std::vector<size_t> nodes;
+        if (get_hash(root, 0) != tree.node(0, 0))
+            nodes.push_back(0);
+
+        for (unsigned int level = 0; level < HASH_TREE_DEPTH
+                && !nodes.empty(); level++)
+        {
+            std::string request = std::to_string(level) + MSG_DELIMITER;
+            for (size_t i = 0; i < nodes.size(); i++)
+                request += (i ? "," : "") + std::to_string(nodes[i]);
+            send(stream, request);
+
+            uchar_vec hashes = recv(stream);
+            if (hashes.size() != nodes.size() * HASH_TREE_FANOUT * 8)
+            {
+                Logger::log("esod: bad SYNC_TREE reply from esoca.",
+                        LogLevel::Error);
+                return false;
+            }
+
+            std::vector<size_t> children;
+            for (size_t i = 0; i < nodes.size(); i++)
+                for (size_t j = 0; j < HASH_TREE_FANOUT; j++)
+                {
+                    size_t child = nodes[i] * HASH_TREE_FANOUT + j;
+                    uint64_t hash = get_hash(hashes,
+                            (i * HASH_TREE_FANOUT + j) * 8);
+                    if (hash != tree.node(level + 1, child))
+                        children.push_back(child);
+                }
+            nodes.swap(children);
+        }
+
+        if (nodes.empty())
+        {
+            send(stream, std::to_string(HASH_TREE_DEPTH) + MSG_DELIMITER);
+            return true;
+        }
+        compare_leaves(stream, tree, nodes, repairs);
+    }
+    catch (const connect_exception &e)
+    {
+        Logger::log("esod cannot reach esoca to compare trees.",
+                LogLevel::Error);
+        return false;
+    }
+    catch (const std::exception &e)
+    {
+        Logger::log("esod: bad SYNC_TREE reply from esoca.", LogLevel::Error);
+        return false;
+    }
+    return true;
+}
+
+void TreeSync::compare_leaves(TCP_Stream &stream, const HashTree &tree,
+        const std::vector<size_t> &leaves, SyncRepairs &repairs)
+{
+    std::string request = std::to_string(HASH_TREE_DEPTH) + MSG_DELIMITER;
+    for (size_t i = 0; i < leaves.size(); i++)
+        request += (i ? "," : "") + std::to_string(leaves[i]);
+    send(stream, request);
+
+    // esod's rows in the leaves, by key.
+    std::unordered_map<std::string, const Permission *> perms;
+    std::unordered_map<std::string, const Credential *> creds;
+    for (size_t leaf : leaves)
+    {
+        for (const Permission *perm : tree.permissions(leaf))
+            perms[permission_key(*perm)] = perm;
+        for (const Credential *cred : tree.credentials(leaf))
+            creds[credential_key(*cred)] = cred;
+    }
+
+    uint64_t count = std::stoull(to_string(recv(stream)));
+    for (uint64_t i = 0; i < count; i++)
+    {
+        uchar_vec type = recv(stream);
+        uchar_vec row = recv(stream);
+        if (stream.failed())
+        {
+            repairs = SyncRepairs{};
+            return;
+        }
+        if (type == UPDATE_PERM)
+        {
+            Permission perm{row};
+            auto found = perms.find(permission_key(perm));
+            if (found == perms.end()
+                    || HashTree::hash(*found->second) != HashTree::hash(perm))
+                repairs.put_perms.push_back(perm);
+            if (found != perms.end())
+                perms.erase(found);
+        }
+        else
+        {
+            Credential cred{row};
+            auto found = creds.find(credential_key(cred));
+            if (found == creds.end()
+                    || HashTree::hash(*found->second) != HashTree::hash(cred))
+                repairs.put_creds.push_back(cred);
+            if (found != creds.end())
+                creds.erase(found);
+        }
+    }
+
+    // What is left esoca does not have.
+    for (auto &row : perms)
+        repairs.delete_perms.push_back(*row.second);
+    for (auto &row : creds)
+        repairs.delete_creds.push_back(*row.second);
+}
+
+void TreeSync::skipped()
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    _skipped++;
+}
+
+void TreeSync::repaired(size_t rows)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    _repaired += rows;
+}
+
+void TreeSync::append_to(std::string &report) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    append_counter(report, "tree_sync_compared", _compared);
+    append_counter(report, "tree_sync_in_sync", _in_sync);
+    append_counter(report, "tree_sync_skipped", _skipped);
+    append_counter(report, "tree_sync_repaired_rows", _repaired);
+    append_counter(report, "tree_sync_bytes_sent", _bytes_sent);
+    append_counter(report, "tree_sync_bytes_received", _bytes_received);
+}
+
+#endif
@@ -1,8 +1,28 @@
 #ifndef ESO_GLOBAL_CONFIG_GLOBAL_CONFIG
 #define ESO_GLOBAL_CONFIG_GLOBAL_CONFIG
 
-// All local daemons (esol) must listen on this port.
-int ESOL_PORT = 4321;
+#include <string>
+
+#include "paths.h"
+
+// All local daemons (esol) must listen on this port. ESO_ESOL_PORT overrides
+// it, for running more than one copy on a machine.
+int ESOL_PORT = eso_env_int("ESO_ESOL_PORT", 4321);
+
+// esoca answers the distribution servers' GET_CHANGES here. ESO_ESOCA_HOST
+// and ESO_ESOCA_PORT override them.
+const char *ESOCA_HOST = eso_env("ESO_ESOCA_HOST", "localhost");
+int ESOCA_PORT = eso_env_int("ESO_ESOCA_PORT", 4320);
+
+// The distribution servers, one "<fqdn> <port>" per line.
+const std::string LOCATIONS_CONFIG_PATH =
+    eso_path("global_config/locations_config");
+
+// esod sends a heartbeat on a SUBSCRIBE connection that has been idle this
+// long, and esol gives up on one that has been silent for
+// SUBSCRIBE_TIMEOUT_MS and subscribes again.
+const int SUBSCRIBE_HEARTBEAT_MS = 5000;
+const int SUBSCRIBE_TIMEOUT_MS = 3 * SUBSCRIBE_HEARTBEAT_MS;
 
 /*
  * General message stuff.
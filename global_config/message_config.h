@@ -32,6 +32,55 @@ uchar_vec GET_CRED{'G','E','T','_','C','R','E','D'};
 // When sent from esoca to esod, it is followed by the serialized credential.
 uchar_vec NEW_CRED{'N','E','W','_','C','R','E','D'};
 
+// Request the changes esoca has propagated after a sequence number. Sent by
+// esod to esoca's TCP port. Should be followed by the sequence number.
+// The reply is count;through;last;full, where through is the sequence number
+// esod has reached once it applies the reply and last is esoca's newest,
+// and then count changes, each sent as it was propagated: the message type,
+// the message and the stamp. If esoca no longer has all of the changes, it
+// sends every row instead, as UPDATE_PERM and NEW_CRED changes, with full
+// set to 1, and esod deletes the rows it holds that were not sent.
+// Only the hosts in locations_config are answered.
+uchar_vec GET_CHANGES{'G','E','T','_','C','H','A','N','G','E','S'};
+
+// Opens a connection on which esoca sends esod batches of changes, for as
+// long as both keep it open. Each batch is first;through;count and then
+// count changes, each as the message type, the message and the stamp. The
+// batch covers every change from first to through, but holds only the
+// newest change to each row. esod replies to each batch with the sequence
+// number of the last change it has applied.
+uchar_vec CHANGE_STREAM{'C','H','A','N','G','E','_','S','T','R','E','A','M'};
+
+// Compare esod's rows with esoca's, using the hash trees of
+// database/hash_tree.h. Sent by esod to esoca's TCP port. Should be followed
+// by the sequence number of the last change esod has applied. esoca replies
+// INVALID_REQUEST if that is not its last change, and otherwise with its
+// root hash. esod then sends level;index,index,... for nodes that differ, in
+// increasing order, and esoca replies with the hashes of their children, in
+// order, or INVALID_REQUEST if an index is repeated or past the level. For nodes at
+// the leaf level, esoca replies instead with count and then count rows, each
+// as UPDATE_PERM or NEW_CRED and the serialized row, and the exchange ends.
+// An empty list of nodes also ends it. Hashes are sent as 8 bytes, most
+// significant first. Only the hosts in locations_config are answered.
+uchar_vec SYNC_TREE{'S','Y','N','C','_','T','R','E','E'};
+
+// Opens a connection on which esod sends esol the changes for its host, for
+// as long as both keep it open. Sent by esol to esod's TCP port. Should be
+// followed by host;epoch;acked, where epoch and acked are from esol's last
+// subscription to this esod, or 0. esod replies epoch;from;reset and then
+// sends the changes after from, in batches of first;count followed by count
+// changes, each as the message type, the message and the stamp. The changes
+// in a batch are numbered first to first + count - 1, and a batch with no
+// changes is a heartbeat. esol replies to each batch with the number of the
+// last change it has applied. If reset is 1, esod cannot send the changes
+// since acked, and esol must drop the rows it holds.
+uchar_vec SUBSCRIBE{'S','U','B','S','C','R','I','B','E'};
+
+// Sent on a SUBSCRIBE connection when a credential changes. Followed by
+// set_name;version, serialized as a Credential. esol drops its copy and
+// fetches the credential again when it next needs it.
+uchar_vec INVALIDATE_CRED{'I','N','V','A','L','I','D','A','T','E','_','C','R','E','D'};
+
 // Used to ping one of the services.
 uchar_vec PING{'P','I','N','G'};
 
@@ -56,6 +105,25 @@ uchar_vec REQUEST_SIGN{'R','E','Q','U','E','S','T', '_','S','I','G','N'};
 // to use.
 uchar_vec REQUEST_VERIFY{'R','E','Q','U','E','S','T','_','V','E','R','I','F','Y'};
 
+// Used to request envelope encryption services from the local daemon.
+// Should be followed by the set, version, and then the actual data to encrypt.
+// The set must hold an asymmetric credential. See crypto/envelope.h for the
+// format of the returned blob.
+uchar_vec REQUEST_ENVELOPE_ENCRYPT{'R','E','Q','U','E','S','T','_','E','N','V','_','E','N','C','R','Y','P','T'};
+
+// Used to request envelope decryption services from the local daemon.
+// Should be followed by the set, version, and then the envelope blob.
+uchar_vec REQUEST_ENVELOPE_DECRYPT{'R','E','Q','U','E','S','T','_','E','N','V','_','D','E','C','R','Y','P','T'};
+
+// Used to request esol's latency histograms and counters. Takes no
+// parameters. The reply is text; see local/esol/esol_stats.h for the format.
+uchar_vec REQUEST_STATS{'R','E','Q','U','E','S','T','_','S','T','A','T','S'};
+
+// Sent in front of a request that is part of a sampled trace. Should be
+// followed by the serialized TraceContext and then the request itself. See
+// stats/trace.h.
+uchar_vec TRACE{'T','R','A','C','E'};
+
 // The return value if a query is invalid for some reason. For example:
 // requesting a non-existant credential from a distribution server.
 uchar_vec INVALID_REQUEST{'I','N','V','A','L','I','D','_','R','E','Q','U','E','S','T'};
@@ -0,0 +1,62 @@
+#ifndef ESO_GLOBAL_CONFIG_PATHS
+#define ESO_GLOBAL_CONFIG_PATHS
+
+#include <cstdlib>
+#include <string>
+
+/*
+ * Locations that can be overridden from the environment, so that several
+ * copies of Eso can run side by side (see harness/run).
+ *
+ *   ESO_ROOT  The directory that sockets, lock files, logs and
+ *             global_config/locations_config are under.
+ */
+
+// Where the files are when ESO_ROOT is not set.
+const char* DEFAULT_ESO_ROOT = "/home/jac/Desktop/eso";
+
+/*
+ * Returns the value of the environment variable name, or fallback if it is
+ * not set or empty.
+ */
+const char *eso_env(const char *name, const char *fallback)
+{
+    const char *value = getenv(name);
+    return (value && *value) ? value : fallback;
+}
+
+/*
+ * Returns the environment variable name as an int, or fallback if it is not
+ * set or not a number.
+ */
+int eso_env_int(const char *name, int fallback)
+{
+    const char *value = getenv(name);
+    if (!value || !*value)
+        return fallback;
+
+    char *end;
+    long result = strtol(value, &end, 10);
+    return *end ? fallback : (int) result;
+}
+
+/*
+ * Returns the root directory of this installation, without a trailing '/'.
+ */
+std::string eso_root()
+{
+    std::string root{eso_env("ESO_ROOT", DEFAULT_ESO_ROOT)};
+    while (root.size() > 1 && root.back() == '/')
+        root.pop_back();
+    return root;
+}
+
+/*
+ * Returns the absolute path of relative, which is relative to the root.
+ */
+std::string eso_path(const std::string &relative)
+{
+    return eso_root() + "/" + relative;
+}
+
+#endif
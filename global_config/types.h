@@ -1,11 +1,65 @@
 #ifndef ESO_GLOBAL_CONFIG_TYPES
 #define ESO_GLOBAL_CONFIG_TYPES
 
+#include <cstddef>
 #include <string>
 #include <vector>
 
 typedef std::vector<unsigned char> uchar_vec;
 
+/**
+ * A read-only view of contiguous bytes that it does not own. Lets callers pass
+ * any buffer (uchar_vec, secure_vec, std::string, part of a frame) to the
+ * crypto functions without copying it into a new uchar_vec.
+ */
+class const_uchar_span
+{
+public:
+    const_uchar_span() : _data{nullptr}, _size{0} {}
+    const_uchar_span(const unsigned char *data, size_t size)
+        : _data{data}, _size{size} {}
+    // Any contiguous container of bytes.
+    template <class C>
+    const_uchar_span(const C &c)
+        : _data{reinterpret_cast<const unsigned char *>(c.data())},
+        _size{c.size()} {}
+
+    const unsigned char *data() const { return _data; }
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+private:
+    const unsigned char *_data;
+    size_t _size;
+};
+
+/**
+ * A writable view of contiguous bytes that it does not own. Used for output
+ * buffers supplied by the caller.
+ */
+class uchar_span
+{
+public:
+    uchar_span() : _data{nullptr}, _size{0} {}
+    uchar_span(unsigned char *data, size_t size) : _data{data}, _size{size} {}
+    // Any contiguous container of bytes.
+    template <class C>
+    uchar_span(C &c) : _data{c.data()}, _size{c.size()} {}
+
+    unsigned char *data() const { return _data; }
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+    // The view starting offset bytes in.
+    uchar_span subspan(size_t offset) const
+    {
+        return offset < _size
+            ? uchar_span{_data + offset, _size - offset}
+            : uchar_span{};
+    }
+private:
+    unsigned char *_data;
+    size_t _size;
+};
+
 /**
  * Converts a uchar_vec to a std::string.
  */
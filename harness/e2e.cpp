@@ -0,0 +1,320 @@
+/*
+ * Drives a running esoca, esod and esol end to end. Creates sets through
+ * esoca's UDS protocol, as the web app does, and measures how long each new
+ * permission takes to become usable at esol. Run by harness/run, which starts
+ * the daemons and then runs esolbench with the keys file written here.
+ *
+ * Usage: e2e [options]
+ *
+ *   -n sets    Symmetric sets to create (default 20).
+ *   -a sets    RSA sets to create (default 2).
+ *   -p prefix  Prefix of the set names (default e2e).
+ *   -k file    Write the sets as an esolbench keys file.
+ *   -t secs    Give up on a permission that is not usable after this long
+ *              (default 10).
+ *   -C path    esoca's socket (default ESOCA_SOCKET_PATH).
+ *   -s path    esol's socket (default ESOL_SOCKET_PATH).
+ *   -R         Print the results as a stats report (see stats/report.h)
+ *              for scripts that compare runs.
+ *
+ * The credentials are created first. A permission for the user running e2e
+ * on this machine (ESO_FQDN, see util/network.h) is then created for each
+ * set in turn, and esol is asked to use the set until it succeeds. That time
+ * is the set's time to visibility. It covers esoca's database write and
+ * whichever of esoca's push through esod or esol's own request to esod on
+ * the miss reaches esol first.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <pwd.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "../central/config/esoca_config.h"
+#include "../crypto/constants.h"
+#include "../database/credential.h"
+#include "../database/db_types.h"
+#include "../database/permission.h"
+#include "../global_config/message_config.h"
+#include "../global_config/types.h"
+#include "../local/config/esol_config.h"
+#include "../socket/exception.h"
+#include "../socket/uds_socket.h"
+#include "../socket/uds_stream.h"
+#include "../stats/histogram.h"
+#include "../stats/report.h"
+#include "../util/network.h"
+
+// Far enough away that no run outlives the sets it creates.
+const char *E2E_EXPIRATION = "2099-12-31";
+
+struct E2EConfig
+{
+    std::string esoca_path{ESOCA_SOCKET_PATH};
+    std::string esol_path{ESOL_SOCKET_PATH};
+    std::string prefix{"e2e"};
+    std::string keys_path;
+    int symmetric = 20;
+    int asymmetric = 2;
+    double timeout = 10;
+    bool raw = false;
+};
+
+E2EConfig config;
+
+/**
+ * Returns s as a frame to send.
+ */
+uchar_vec frame(const std::string &s)
+{
+    return uchar_vec{s.begin(), s.end()};
+}
+
+/**
+ * Sends a request of frames on a new connection to the socket at path. If
+ * reply is given, waits for and stores the first frame of the answer.
+ * Returns false if the daemon cannot be reached.
+ */
+bool exchange(const std::string &path, const std::vector<uchar_vec> &frames,
+        uchar_vec *reply = nullptr)
+{
+    try
+    {
+        UDS_Socket uds_socket{path};
+        UDS_Stream uds_stream = uds_socket.connect();
+        for (const uchar_vec &frame : frames)
+            uds_stream.send(frame);
+        if (reply)
+            *reply = uds_stream.recv();
+        return true;
+    }
+    catch (const connect_exception &e)
+    {
+        return false;
+    }
+}
+
+/**
+ * Returns true once the daemon at path answers a PING. esoca serves one
+ * request at a time, so its answer also means every earlier request has
+ * been handled.
+ */
+bool ping(const std::string &path)
+{
+    uchar_vec reply;
+    return exchange(path, {PING}, &reply) && reply == PING;
+}
+
+/**
+ * Waits up to config.timeout seconds for the daemon at path to answer.
+ */
+bool wait_for(const std::string &path)
+{
+    auto deadline = std::chrono::steady_clock::now()
+        + std::chrono::duration<double>(config.timeout);
+    while (!ping(path))
+    {
+        if (std::chrono::steady_clock::now() > deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+/**
+ * Returns true if esol will use the set: an encrypt for symmetric sets, a
+ * sign for RSA sets.
+ */
+bool usable(const Credential &cred)
+{
+    uchar_vec data{'e', '2', 'e'};
+    uchar_vec reply;
+    if (cred.type == SYMMETRIC)
+        exchange(config.esol_path, {REQUEST_ENCRYPT, frame(cred.set_name),
+                frame(std::to_string(cred.version)), data}, &reply);
+    else
+        exchange(config.esol_path, {REQUEST_SIGN, frame(cred.set_name),
+                frame(std::to_string(cred.version)), data,
+                frame(std::to_string(SHA256))}, &reply);
+    return !reply.empty();
+}
+
+/**
+ * Returns the name of the user running e2e, which esol checks permissions
+ * against.
+ */
+std::string current_user()
+{
+    struct passwd *pw = getpwuid(getuid());
+    return pw ? std::string{pw->pw_name} : std::string{};
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg{argv[i]};
+        if (arg == "-R")
+        {
+            config.raw = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "e2e: %s needs a value\n", argv[i]);
+            return 2;
+        }
+
+        const char *value = argv[++i];
+        if (arg == "-n")
+            config.symmetric = atoi(value);
+        else if (arg == "-a")
+            config.asymmetric = atoi(value);
+        else if (arg == "-p")
+            config.prefix = value;
+        else if (arg == "-k")
+            config.keys_path = value;
+        else if (arg == "-t")
+            config.timeout = atof(value);
+        else if (arg == "-C")
+            config.esoca_path = value;
+        else if (arg == "-s")
+            config.esol_path = value;
+        else
+        {
+            fprintf(stderr, "e2e: unknown option %s\n", argv[i - 1]);
+            return 2;
+        }
+    }
+
+    if (config.symmetric < 0 || config.asymmetric < 0
+            || config.symmetric + config.asymmetric == 0
+            || config.timeout <= 0)
+    {
+        fprintf(stderr, "usage: e2e [-n sets] [-a sets] [-p prefix] "
+                "[-k file] [-t secs] [-C path] [-s path] [-R]\n");
+        return 2;
+    }
+
+    if (!wait_for(config.esoca_path) || !wait_for(config.esol_path))
+    {
+        fprintf(stderr, "e2e: esoca or esol is not answering\n");
+        return 1;
+    }
+
+    std::vector<Credential> creds;
+    for (int i = 0; i < config.symmetric + config.asymmetric; i++)
+    {
+        Credential cred;
+        bool symmetric = i < config.symmetric;
+        cred.set_name = config.prefix + (symmetric ? "_sym_" : "_rsa_")
+            + std::to_string(i);
+        cred.version = 1;
+        cred.type = symmetric ? SYMMETRIC : ASYMMETRIC;
+        cred.algo = symmetric ? "AES" : "RSA";
+        cred.size = symmetric ? 256 : 2048;
+        cred.p_owner = current_user();
+        cred.s_owner = current_user();
+        cred.expiration = E2E_EXPIRATION;
+        creds.push_back(cred);
+    }
+
+    // Create every credential, timing each until esoca has finished with it.
+    Histogram cred_latency;
+    for (const Credential &cred : creds)
+    {
+        uint64_t start = stats_now_ns();
+        if (!exchange(config.esoca_path,
+                    {NEW_CRED, frame(cred.serialize())})
+                || !ping(config.esoca_path))
+        {
+            fprintf(stderr, "e2e: esoca went away\n");
+            return 1;
+        }
+        cred_latency.record(stats_now_ns() - start);
+    }
+
+    // Create the permissions one at a time, so each is timed on its own.
+    Histogram visibility[2];
+    uint64_t timed_out = 0;
+    for (const Credential &cred : creds)
+    {
+        Permission perm;
+        perm.set_name = cred.set_name;
+        perm.entity = current_user();
+        perm.entity_type = USER_TYPE;
+        perm.op = SIGN_OP | VERIFY_OP | ENCRYPT_OP | DECRYPT_OP | HMAC_OP;
+        perm.loc = get_fqdn();
+
+        uint64_t start = stats_now_ns();
+        uint64_t timeout_ns = (uint64_t) (config.timeout * 1e9);
+        exchange(config.esoca_path, {NEW_PERM, frame(perm.serialize())});
+
+        bool visible;
+        while (!(visible = usable(cred))
+                && stats_now_ns() - start < timeout_ns)
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+
+        if (visible)
+        {
+            visibility[cred.type == SYMMETRIC ? 0 : 1].record(
+                    stats_now_ns() - start);
+        }
+        else
+        {
+            fprintf(stderr, "e2e: %s not usable after %gs\n",
+                    cred.set_name.c_str(), config.timeout);
+            timed_out++;
+        }
+    }
+
+    if (!config.keys_path.empty())
+    {
+        std::ofstream keys{config.keys_path};
+        for (const Credential &cred : creds)
+            keys << cred.set_name << ' ' << cred.version << ' '
+                << (cred.type == SYMMETRIC ? "encrypt,decrypt,hmac"
+                        : "sign,verify") << '\n';
+    }
+
+    HistogramSnapshot new_cred, sym, rsa, all;
+    cred_latency.add_to(new_cred);
+    visibility[0].add_to(sym);
+    visibility[1].add_to(rsa);
+    visibility[0].add_to(all);
+    visibility[1].add_to(all);
+
+    if (config.raw)
+    {
+        std::string report = stats_report_header("e2e");
+        append_counter(report, "sets", creds.size());
+        append_counter(report, "timed_out", timed_out);
+        append_latency(report, "esoca", "new_cred", new_cred);
+        append_latency(report, "visibility", "all", all);
+        append_latency(report, "visibility", "symmetric", sym);
+        append_latency(report, "visibility", "rsa", rsa);
+        fputs(report.c_str(), stdout);
+    }
+    else
+    {
+        printf("%zu sets, %llu not usable within %gs\n", creds.size(),
+                (unsigned long long) timed_out, config.timeout);
+        printf("\n%-24s %8s %10s %10s %10s %10s\n", "latency (ms)", "count",
+                "p50", "p90", "p99", "max");
+        struct { const char *name; const HistogramSnapshot &h; } rows[] = {
+            {"esoca new_cred", new_cred}, {"visibility all", all},
+            {"visibility symmetric", sym}, {"visibility rsa", rsa}};
+        for (auto &row : rows)
+            printf("%-24s %8llu %10.2f %10.2f %10.2f %10.2f\n", row.name,
+                    (unsigned long long) row.h.count,
+                    row.h.percentile(50) / 1e6, row.h.percentile(90) / 1e6,
+                    row.h.percentile(99) / 1e6, row.h.max / 1e6);
+    }
+
+    return timed_out ? 1 : 0;
+}
@@ -0,0 +1,39 @@
+-- The tables esoca and esod use (see database/mysql_conn.h). harness/run
+-- loads this into each daemon's database before a run, which empties it.
+--
+-- One-time setup, as a MySQL administrator:
+--
+--   CREATE DATABASE eso_harness_ca;
+--   CREATE DATABASE eso_harness_d;
+--   CREATE USER 'eso_harness'@'localhost' IDENTIFIED BY 'eso_harness';
+--   GRANT ALL ON eso_harness_ca.* TO 'eso_harness'@'localhost';
+--   GRANT ALL ON eso_harness_d.* TO 'eso_harness'@'localhost';
+
+DROP TABLE IF EXISTS permissions;
+DROP TABLE IF EXISTS credentials;
+
+CREATE TABLE permissions (
+    set_name VARCHAR(255) NOT NULL,
+    entity VARCHAR(32) NOT NULL,
+    entity_type INT UNSIGNED NOT NULL,
+    op INT UNSIGNED NOT NULL,
+    loc VARCHAR(300) NOT NULL,
+    primary KEY (set_name, entity, loc)
+);
+
+CREATE TABLE credentials (
+    set_name VARCHAR(255) NOT NULL,
+    version INT UNSIGNED NOT NULL,
+    type INT UNSIGNED NOT NULL,
+    algo VARCHAR(255) NOT NULL,
+    size INT UNSIGNED NOT NULL,
+    p_owner VARCHAR(32) NOT NULL,
+    s_owner VARCHAR(32) NOT NULL,
+    expiration VARCHAR(32) NOT NULL,
+    symKey VARBINARY(8192),
+    priKey VARBINARY(8192),
+    pubKey VARBINARY(8192),
+    user VARBINARY(8192),
+    pass VARBINARY(8192),
+    PRIMARY KEY (set_name, version)
+);
@@ -0,0 +1,104 @@
+/*
+ * Checks that the MySQL backend stores a credential of every type as it was
+ * given: each is written, read back and compared, once with the single-row
+ * write and once with the batch write, and then deleted. Run by harness/run
+ * on each daemon's database before the daemons start.
+ *
+ * Usage: storage_check
+ *
+ * The database and the account are those of esoca's mysql_config.h, with
+ * the usual ESO_MYSQL_* overrides. Exits 1 if a credential did not come
+ * back as it went in.
+ */
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "../central/config/mysql_config.h"
+#include "../database/credential.h"
+#include "../database/db_error.h"
+#include "../database/db_types.h"
+#include "../database/mysql_conn.h"
+
+/**
+ * Returns a credential of the given type, with its type's key fields set.
+ */
+Credential check_credential(unsigned int type, const std::string &name)
+{
+    Credential cred;
+    cred.set_name = name;
+    cred.version = 1;
+    cred.type = type;
+    cred.algo = "check";
+    cred.size = 256;
+    cred.p_owner = "storage_check";
+    cred.s_owner = "storage_check";
+    cred.expiration = "2099-12-31";
+    switch (type)
+    {
+        case USERPASS:
+            cred.user = "check_user";
+            cred.pass = "check_pass";
+            break;
+        case SYMMETRIC:
+            cred.symKey = "c3ltbWV0cmljIGtleQ==";
+            break;
+        default:
+            cred.priKey = "cHJpdmF0ZSBrZXk=";
+            cred.pubKey = "cHVibGljIGtleQ==";
+            break;
+    }
+    return cred;
+}
+
+/**
+ * Reads cred back and compares it with what was written. Returns true if
+ * they match.
+ */
+bool read_back(const MySQL_Conn &conn, const Credential &cred,
+        const char *write)
+{
+    Credential stored = conn.get_credential(cred);
+    if (stored.serialize() == cred.serialize())
+        return true;
+
+    fprintf(stderr, "storage_check: %s wrote %s\n  but read back %s\n",
+            write, cred.serialize().c_str(), stored.serialize().c_str());
+    return false;
+}
+
+int main()
+{
+    MySQL_Conn conn;
+    bool ok = true;
+
+    const unsigned int types[] = {USERPASS, SYMMETRIC, ASYMMETRIC, ECDSA,
+        ED25519};
+    for (unsigned int type : types)
+    {
+        std::string name = "storage_check_" + std::to_string(type);
+        Credential one = check_credential(type, name + "_one");
+        Credential batch = check_credential(type, name + "_batch");
+        conn.delete_credential(one);
+        conn.delete_credential(batch);
+
+        if (conn.create_credential(one) != OK
+                || conn.create_credentials({batch}) != OK)
+        {
+            fprintf(stderr, "storage_check: cannot write type %u\n", type);
+            ok = false;
+        }
+        else
+        {
+            ok = read_back(conn, one, "create_credential") && ok;
+            ok = read_back(conn, batch, "create_credentials") && ok;
+        }
+
+        conn.delete_credential(one);
+        conn.delete_credential(batch);
+    }
+
+    printf("storage_check: %s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -72,6 +72,33 @@ public class EsoLocal implements AutoCloseable
      */
     public native byte[] decrypt(String set, int version, byte[] data);
 
+    /**
+     * Encrypts data of any size using the specified version of the asymmetric
+     * credentials found at the given set. The data is encrypted with a new
+     * AES-GCM key, which is itself encrypted with the public key of the set.
+     * The result must be decrypted with envelopeDecrypt.
+     *
+     * @param set The name of the set containing the credentials.
+     * @param version The version of the credentials to use.
+     * @param data The data to encrypt.
+     *
+     * @return The encrypted envelope.
+     */
+    public native byte[] envelopeEncrypt(String set, int version, byte[] data);
+
+    /**
+     * Decrypts an envelope produced by envelopeEncrypt using the specified
+     * version of the asymmetric credentials found at the given set.
+     *
+     * @param set The name of the set containing the credentials.
+     * @param version The version of the credentials to use.
+     * @param data The envelope to decrypt.
+     *
+     * @return The decrypted data, or an empty array if the envelope was
+     * invalid or had been modified.
+     */
+    public native byte[] envelopeDecrypt(String set, int version, byte[] data);
+
     /**
      * Computes the message authentication code of the data using the specified
      * version of the credentials found at the given set and the specified hash
@@ -106,6 +133,8 @@ public class EsoLocal implements AutoCloseable
 
     /**
      * Computes the signaure of the data using the specified algorithm.
+     * Sets may hold RSA, ECDSA or Ed25519 keys. Ed25519 hashes the data
+     * itself, so algo is ignored for Ed25519 sets.
      *
      * @param set The name of the set containing the credentials.
      * @param version The version of the credentials to use.
@@ -146,6 +146,110 @@ JNIEXPORT jbyteArray JNICALL Java_EsoLocal_EsoLocal_decrypt
 
 }
 
+/*
+ * Native method for EsoLocal.EsoLocal_EsoLocal.
+ * Contacts the local daemon and requests in_data to be envelope encrypted
+ * using the credentials from set in_set.
+ */
+JNIEXPORT jbyteArray JNICALL Java_EsoLocal_EsoLocal_envelopeEncrypt
+  (JNIEnv *env, jobject obj, jstring in_set, jint version, jbyteArray in_data)
+{
+    UDS_Socket uds_socket{std::string{ESOL_SOCKET_PATH}};
+
+    try
+    {
+        // Send envelope encrypt request message.
+        UDS_Stream uds_stream = uds_socket.connect();
+        uds_stream.send(REQUEST_ENVELOPE_ENCRYPT);
+
+        // Get the set name from the input parameters.
+        jboolean isCopy;
+        const char *set_name = env->GetStringUTFChars(in_set, &isCopy);
+
+        // Get the data array.
+        int len = env->GetArrayLength(in_data);
+        unsigned char* data = new unsigned char[len];
+        env->GetByteArrayRegion(in_data, 0, len, reinterpret_cast<jbyte*>(data));
+
+        // Send encryption parameters.
+        uds_stream.send(set_name);
+        uds_stream.send(std::to_string(version));
+        uds_stream.send(uchar_vec{&data[0], &data[0]+len});
+
+        // Receive the encrypted data.
+        uchar_vec encryption = uds_stream.recv();
+
+        // Convert encryption from native to Java.
+        len = encryption.size();
+        jbyteArray outArray = env->NewByteArray(len);
+        env->SetByteArrayRegion(outArray, 0, len, (jbyte*)&encryption[0]);
+
+        // Release the set_name.
+        env->ReleaseStringUTFChars(in_set, set_name);
+        // Free the data message. 
+        delete [] data;
+
+        return outArray; 
+    }
+    catch (std::exception e)
+    {
+        // TODO
+    }
+
+}
+
+/*
+ * Native method for EsoLocal.EsoLocal_EsoLocal.
+ * Contacts the local daemon and requests in_data to be envelope decrypted
+ * using the credentials from set in_set.
+ */
+JNIEXPORT jbyteArray JNICALL Java_EsoLocal_EsoLocal_envelopeDecrypt
+  (JNIEnv *env, jobject obj, jstring in_set, jint version, jbyteArray in_data)
+{
+    UDS_Socket uds_socket{std::string{ESOL_SOCKET_PATH}};
+
+    try
+    {
+        // Send envelope decrypt request message.
+        UDS_Stream uds_stream = uds_socket.connect();
+        uds_stream.send(REQUEST_ENVELOPE_DECRYPT);
+
+        // Get the set name from the input parameters.
+        jboolean isCopy;
+        const char *set_name = env->GetStringUTFChars(in_set, &isCopy);
+
+        // Get the data array.
+        int len = env->GetArrayLength(in_data);
+        unsigned char* data = new unsigned char[len];
+        env->GetByteArrayRegion(in_data, 0, len, reinterpret_cast<jbyte*>(data));
+
+        // Send decryption parameters.
+        uds_stream.send(set_name);
+        uds_stream.send(std::to_string(version));
+        uds_stream.send(uchar_vec{&data[0], &data[0]+len});
+
+        // Receive the decrypted data.
+        uchar_vec decryption = uds_stream.recv();
+
+        // Convert decryption from native to Java.
+        len = decryption.size();
+        jbyteArray outArray = env->NewByteArray(len);
+        env->SetByteArrayRegion(outArray, 0, len, (jbyte*)&decryption[0]);
+
+        // Release the set_name.
+        env->ReleaseStringUTFChars(in_set, set_name);
+        // Free the data message. 
+        delete [] data;
+
+        return outArray; 
+    }
+    catch (std::exception e)
+    {
+        // TODO
+    }
+
+}
+
 /*
  * Native method for EsoLocal.EsoLocal_EsoLocal.
  * Contacts the local daemon and requests an HMAC.
@@ -31,6 +31,22 @@ JNIEXPORT jbyteArray JNICALL Java_EsoLocal_EsoLocal_encrypt
 JNIEXPORT jbyteArray JNICALL Java_EsoLocal_EsoLocal_decrypt
   (JNIEnv *, jobject, jstring, jint, jbyteArray);
 
+/*
+ * Class:     EsoLocal_EsoLocal
+ * Method:    envelopeEncrypt
+ * Signature: (Ljava/lang/String;I[B)[B
+ */
+JNIEXPORT jbyteArray JNICALL Java_EsoLocal_EsoLocal_envelopeEncrypt
+  (JNIEnv *, jobject, jstring, jint, jbyteArray);
+
+/*
+ * Class:     EsoLocal_EsoLocal
+ * Method:    envelopeDecrypt
+ * Signature: (Ljava/lang/String;I[B)[B
+ */
+JNIEXPORT jbyteArray JNICALL Java_EsoLocal_EsoLocal_envelopeDecrypt
+  (JNIEnv *, jobject, jstring, jint, jbyteArray);
+
 /*
  * Class:     EsoLocal_EsoLocal
  * Method:    hmac
@@ -112,6 +112,72 @@ class Example
         System.out.println("=====");
     }
 
+    /**
+     * Envelope encryption example for Eso. Unlike encrypt, envelopeEncrypt is
+     * not limited by the size of the RSA key.
+     */
+    private static void envelopeExamples(EsoLocal eso)
+    {
+        System.out.println("=====");
+        System.out.println("Envelope encrypt/decrypt example:");
+        System.out.println("-----");
+
+        // Parameters of the envelope example.
+        // Sample asymmetric set name, a large message, and key version.
+        String setName = "com.joshuac.test.asym";
+        StringBuilder builder = new StringBuilder();
+        for (int i = 0; i < 1000; i++)
+            builder.append("Josh is cool. ");
+        String message = builder.toString();
+        int version = 2;
+
+        System.out.println("Original length: " + message.length());
+
+        byte[] envelope = eso.envelopeEncrypt(setName, version, message.getBytes());
+        System.out.println("Envelope length: " + envelope.length);
+
+        byte[] decryptedMsg = eso.envelopeDecrypt(setName, version, envelope);
+        System.out.println("Decrypted message matches?: " + message.equals(new String(decryptedMsg)));
+
+        System.out.println("=====");
+    }
+
+    /**
+     * Some elliptic-curve examples for Eso. Elliptic-curve sets only support
+     * signing and verification.
+     */
+    private static void ellipticCurveExamples(EsoLocal eso)
+    {
+        System.out.println("=====");
+        System.out.println("Elliptic-curve sign/verify example:");
+        System.out.println("-----");
+
+        // Parameters of the elliptic-curve example.
+        // Sample ECDSA set name, a message, and key version.
+        String setName = "com.joshuac.test.ecdsa";
+        String message = "Josh is cool";
+        int version = 1;
+
+        byte[] signature = eso.sign(setName, version, message.getBytes(), EsoLocal.Hash.SHA256);
+        System.out.println("ECDSA signature: " + Arrays.toString(signature));
+
+        boolean validity = eso.verify(setName, version, signature, message.getBytes(), EsoLocal.Hash.SHA256);
+        System.out.println("Was signature valid?: " +  validity);
+
+        System.out.println("-----");
+
+        // Ed25519 does not use the hash parameter.
+        setName = "com.joshuac.test.ed25519";
+
+        signature = eso.sign(setName, version, message.getBytes(), EsoLocal.Hash.DEFAULT);
+        System.out.println("Ed25519 signature: " + Arrays.toString(signature));
+
+        validity = eso.verify(setName, version, signature, message.getBytes(), EsoLocal.Hash.DEFAULT);
+        System.out.println("Was signature valid?: " +  validity);
+
+        System.out.println("=====");
+    }
+
     
     /**
      * Driver for the examples.
@@ -137,6 +203,10 @@ class Example
         symmetricKeyExamples(eso);
 
         asymmetricKeyExamples(eso); 
+
+        envelopeExamples(eso);
+
+        ellipticCurveExamples(eso);
     }
 
 }
@@ -1,6 +1,31 @@
 #ifndef ESO_LOCAL_CONFIG_ESOL_CONFIG
 #define ESO_LOCAL_CONFIG_ESOL_CONFIG
 
-const char* ESOL_SOCKET_PATH = "/home/jac/Desktop/eso/local/esol/esol_socket";
+#include <cstdint>
+
+#include "../../global_config/paths.h"
+#include "../../logger/logger.h"
+
+const std::string ESOL_SOCKET_PATH = eso_path("local/esol/esol_socket");
+
+// Messages more verbose than this level are not logged.
+const LogLevel ESOL_LOG_LEVEL = LogLevel::Info;
+
+// Sampled request spans are appended here, one JSON object per line.
+const std::string ESOL_TRACE_PATH =
+    eso_path("local/esol/esol_trace.jsonl");
+// The fraction of requests that start a new trace. 0 disables tracing.
+const double ESOL_TRACE_SAMPLE_RATE = 0.01;
+
+// The esod esol last subscribed to and how far it got, so that after a
+// restart it is sent only the changes it missed (see subscription.h).
+const std::string ESOL_SUBSCRIPTION_PATH =
+    eso_path("local/esol/esol_subscription");
+// Each esod's points on the ring that picks the one esol subscribes to.
+const unsigned int ESOL_SUBSCRIBE_RING_POINTS = 64;
+// How long esol waits before trying the esods again when none of them
+// could be reached. The wait doubles with each round, up to the maximum.
+const uint64_t ESOL_SUBSCRIBE_RETRY_MIN_MS = 100;
+const uint64_t ESOL_SUBSCRIBE_RETRY_MAX_MS = 30000;
 
 #endif
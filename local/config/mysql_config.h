@@ -1,23 +1,49 @@
 #ifndef ESO_CENTRAL_CONFIG_MYSQL_CONFIG
 #define ESO_CENTRAL_CONFIG_MYSQL_CONFIG
 
+#include <cstddef>
+
+#include "../../global_config/paths.h"
+
 /*
  * The configuration file for the central authority's MySQL database.
+ *
+ * ESO_MYSQL_HOST, ESO_MYSQL_DB, ESO_MYSQL_USER and ESO_MYSQL_PASS override
+ * the values below.
  */
 
 // Address.
-const char* LOC = "localhost";
+const char* LOC = eso_env("ESO_MYSQL_HOST", "localhost");
 // Table.
-const char* DB_LOC = "eso_l";
+const char* DB_LOC = eso_env("ESO_MYSQL_DB", "eso_l");
 
 /*
  * Harcoded user and password. It is advised that the central authority is
  * running on a dedicated machine.
  */
-const char* HOST_USER = "eso_l";
-const char* HOST_PASS = "esod123";
+const char* HOST_USER = eso_env("ESO_MYSQL_USER", "eso_l");
+const char* HOST_PASS = eso_env("ESO_MYSQL_PASS", "esod123");
 
 const char* CRED_LOC = "credentials";
 const char* PERM_LOC = "permissions";
 
+// Where the credentials and permissions are kept: "mysql"; "replica", in
+// MySQL with a full copy in memory that reads are served from; "file", in
+// STORAGE_PATH.log and STORAGE_PATH.snapshot; or "memory", in the daemon
+// only, losing them when it exits (see database/backend.h). ESO_STORAGE
+// overrides this.
+const char* STORAGE_BACKEND = eso_env("ESO_STORAGE", "file");
+const std::string STORAGE_PATH = eso_path("local/esol/esol_store");
+
+// Connections kept open to the database (see database/mysql_pool.h), and
+// how long a query waits for one when all are in use.
+const size_t MYSQL_POOL_SIZE = 8;
+const int MYSQL_POOL_TIMEOUT_MS = 2000;
+
+// Propagated changes are written in batches (see database/group_commit.h):
+// a batch is written this long after its first change arrives, or once it
+// has this many changes.
+const int GROUP_COMMIT_WINDOW_US = 2000;
+const size_t GROUP_COMMIT_MAX = 512;
+
 #endif
@@ -0,0 +1,254 @@
+#ifndef ESO_LOCAL_ESOL_ESOL_STATS
+#define ESO_LOCAL_ESOL_ESOL_STATS
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../../crypto/data_key_cache.h"
+#include "../../crypto/secure_arena.h"
+#include "../../stats/histogram.h"
+#include "../../stats/propagation.h"
+#include "../../stats/report.h"
+#include "../../stats/thread_stats.h"
+#include "../../util/probes.h"
+
+/*
+ * Latency and counters for the requests esol serves, reported by
+ * REQUEST_STATS.
+ *
+ * Every request is timed as a whole and split into stages, so that the time
+ * spent waiting on MySQL or esod can be told apart from the time spent on
+ * crypto. Each thread records into its own EsolStatsBlock; see
+ * stats/thread_stats.h.
+ */
+
+// The requests statistics are kept for.
+enum EsolStatsOp
+{
+    STATS_OP_PING,
+    STATS_OP_ENCRYPT,
+    STATS_OP_DECRYPT,
+    STATS_OP_ENVELOPE_ENCRYPT,
+    STATS_OP_ENVELOPE_DECRYPT,
+    STATS_OP_HMAC,
+    STATS_OP_SIGN,
+    STATS_OP_VERIFY,
+    STATS_OP_STATS,
+    STATS_OP_INVALID,
+    NUM_STATS_OPS
+};
+
+const char *STATS_OP_NAMES[NUM_STATS_OPS] = {"ping", "encrypt", "decrypt",
+    "envelope_encrypt", "envelope_decrypt", "hmac", "sign", "verify", "stats",
+    "invalid"};
+
+// The stages a request's time is split into.
+enum EsolStatsStage
+{
+    // Reading the request and writing the reply.
+    STAGE_IO,
+    // has_permission_to(), including any esod fetch.
+    STAGE_PERMISSION,
+    // get_credential(), including any esod fetch.
+    STAGE_CREDENTIAL,
+    // Base64 and DER decoding of keys.
+    STAGE_KEY_DECODE,
+    STAGE_CRYPTO,
+    NUM_STATS_STAGES
+};
+
+const char *STATS_STAGE_NAMES[NUM_STATS_STAGES] = {"io", "permission",
+    "credential", "key_decode", "crypto"};
+
+// Events counted outside of any one request type.
+enum EsolStatsEvent
+{
+    // Whether a permission or credential was found in the local database.
+    EVENT_PERM_DB_HIT,
+    EVENT_PERM_DB_MISS,
+    EVENT_CRED_DB_HIT,
+    EVENT_CRED_DB_MISS,
+    // Requests sent to esod after a miss, and misses no esod could fill.
+    EVENT_ESOD_FETCH,
+    EVENT_ESOD_FETCH_FAILED,
+    NUM_STATS_EVENTS
+};
+
+const char *STATS_EVENT_NAMES[NUM_STATS_EVENTS] = {"permission_db_hit",
+    "permission_db_miss", "credential_db_hit", "credential_db_miss",
+    "esod_fetch", "esod_fetch_failed"};
+
+// One thread's statistics.
+struct EsolStatsBlock
+{
+    Histogram total[NUM_STATS_OPS];
+    Histogram stages[NUM_STATS_OPS][NUM_STATS_STAGES];
+    Counter requests[NUM_STATS_OPS];
+    // Requests refused by the permission check.
+    Counter denied[NUM_STATS_OPS];
+    Counter events[NUM_STATS_EVENTS];
+};
+
+typedef ThreadStats<EsolStatsBlock> EsolStats;
+
+/*
+ * Counts one occurrence of event.
+ */
+void esol_count(EsolStatsEvent event)
+{
+    EsolStats::local().events[event].add();
+}
+
+/*
+ * Times one request. It starts in STAGE_IO and records the time spent in each
+ * stage, and in total, when it goes out of scope, so every early return of a
+ * handler is still counted.
+ */
+class RequestStats
+{
+public:
+    RequestStats();
+    ~RequestStats();
+    // Sets the request type once the opcode has been read.
+    void set_op(EsolStatsOp op);
+    // Ends the current stage and starts the given one.
+    void stage(EsolStatsStage stage);
+    // Marks the request as refused by the permission check.
+    void denied();
+private:
+    EsolStatsBlock &_block;
+    EsolStatsOp _op;
+    EsolStatsStage _stage;
+    bool _denied;
+    uint64_t _start;
+    uint64_t _mark;
+    // Time spent in each stage, or -1 if the stage was never entered.
+    int64_t _stage_ns[NUM_STATS_STAGES];
+};
+
+RequestStats::RequestStats()
+    : _block(EsolStats::local()), _op{STATS_OP_INVALID}, _stage{STAGE_IO},
+    _denied{false}, _start{stats_now_ns()}, _mark{_start}
+{
+    ESO_PROBE(esol_request_start);
+
+    for (int s = 0; s < NUM_STATS_STAGES; s++)
+        _stage_ns[s] = -1;
+    _stage_ns[STAGE_IO] = 0;
+}
+
+RequestStats::~RequestStats()
+{
+    uint64_t now = stats_now_ns();
+    _stage_ns[_stage] += now - _mark;
+
+    _block.requests[_op].add();
+    _block.total[_op].record(now - _start);
+    for (int s = 0; s < NUM_STATS_STAGES; s++)
+        if (_stage_ns[s] >= 0)
+            _block.stages[_op][s].record(_stage_ns[s]);
+
+    ESO_PROBE2(esol_request_done, (int) _op, _denied);
+}
+
+void RequestStats::set_op(EsolStatsOp op)
+{
+    _op = op;
+}
+
+void RequestStats::stage(EsolStatsStage stage)
+{
+    uint64_t now = stats_now_ns();
+    _stage_ns[_stage] += now - _mark;
+    _mark = now;
+
+    _stage = stage;
+    if (_stage_ns[_stage] < 0)
+        _stage_ns[_stage] = 0;
+}
+
+void RequestStats::denied()
+{
+    _block.denied[_op].add();
+    _denied = true;
+}
+
+/*
+ * Returns the statistics of every thread as a report (see stats/report.h).
+ * Besides the common records there is one
+ *
+ *   request <op> <count> <denied>
+ *
+ * record for each request type, followed by its latencies. The stage "total"
+ * covers the whole request. Request types that have not been seen are left
+ * out. The propagation metrics of permission updates from esod follow.
+ */
+std::string esol_stats_report(const DataKeyCache &cache)
+{
+    uint64_t requests[NUM_STATS_OPS] = {};
+    uint64_t denied[NUM_STATS_OPS] = {};
+    uint64_t events[NUM_STATS_EVENTS] = {};
+    std::vector<HistogramSnapshot> total(NUM_STATS_OPS);
+    std::vector<HistogramSnapshot> stages(NUM_STATS_OPS * NUM_STATS_STAGES);
+
+    EsolStats::for_each([&](const EsolStatsBlock &block)
+    {
+        for (int op = 0; op < NUM_STATS_OPS; op++)
+        {
+            requests[op] += block.requests[op].get();
+            denied[op] += block.denied[op].get();
+            block.total[op].add_to(total[op]);
+            for (int s = 0; s < NUM_STATS_STAGES; s++)
+                block.stages[op][s].add_to(stages[op * NUM_STATS_STAGES + s]);
+        }
+        for (int e = 0; e < NUM_STATS_EVENTS; e++)
+            events[e] += block.events[e].get();
+    });
+
+    std::string report = stats_report_header("esol");
+
+    std::vector<std::pair<std::string, uint64_t>> counters;
+    for (int e = 0; e < NUM_STATS_EVENTS; e++)
+        counters.emplace_back(STATS_EVENT_NAMES[e], events[e]);
+    counters.emplace_back("data_key_cache_hit", cache.hits());
+    counters.emplace_back("data_key_cache_miss", cache.misses());
+
+    SecureArenaStats arena = SecureArena::instance().stats();
+    counters.emplace_back("secure_arena_reserved", arena.reserved);
+    counters.emplace_back("secure_arena_unlocked", arena.unlocked);
+    counters.emplace_back("secure_arena_in_use", arena.in_use);
+    counters.emplace_back("secure_arena_peak_in_use", arena.peak_in_use);
+
+    for (auto &counter : counters)
+        append_counter(report, counter.first, counter.second);
+
+    for (int op = 0; op < NUM_STATS_OPS; op++)
+    {
+        if (requests[op] == 0)
+            continue;
+
+        report += "request ";
+        report += STATS_OP_NAMES[op];
+        report += ' ';
+        report += std::to_string(requests[op]);
+        report += ' ';
+        report += std::to_string(denied[op]);
+        report += '\n';
+
+        append_latency(report, STATS_OP_NAMES[op], "total", total[op]);
+        for (int s = 0; s < NUM_STATS_STAGES; s++)
+        {
+            const HistogramSnapshot &h = stages[op * NUM_STATS_STAGES + s];
+            if (h.count)
+                append_latency(report, STATS_OP_NAMES[op],
+                        STATS_STAGE_NAMES[s], h);
+        }
+    }
+
+    append_propagation_report(report);
+    return report;
+}
+
+#endif
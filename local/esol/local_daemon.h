@@ -9,10 +9,14 @@
 #include "../config/mysql_config.h"
 #include "../../crypto/aes.h"
 #include "../../crypto/base64.h"
+#include "../../crypto/data_key_cache.h"
+#include "../../crypto/ec.h"
+#include "../../crypto/envelope.h"
 #include "../../crypto/hmac.h"
 #include "../../crypto/memory.h"
 #include "../../crypto/rsa.h"
 #include "../../daemon/daemon.h"
+#include "../../daemon/propagation.h"
 #include "../../database/db_types.h"
 #include "../../global_config/global_config.h"
 #include "../../logger/logger.h"
@@ -20,10 +24,17 @@
 #include "../../socket/tcp_stream.h"
 #include "../../socket/uds_socket.h"
 #include "../../socket/uds_stream.h"
+#include "../../stats/histogram.h"
+#include "../../stats/propagation.h"
+#include "../../stats/trace.h"
+#include "../../util/alloc_counter.h"
 #include "../../util/parser.h"
 #include "../../util/network.h"
+#include "esol_stats.h"
+#include "subscription.h"
 
-#include "../../database/mysql_conn.h"
+#include "../../database/backend.h"
+#include "../../database/group_commit.h"
 
 /* 
  * Local daemon implementation
@@ -37,6 +48,9 @@ class LocalDaemon : public Daemon
         const char * lock_path() const;
         void handleTCP() const;
         void handleUDS() const;
+        // Sends a request to an esod and returns its reply.
+        uchar_vec request_esod(const std::string host, const std::string port,
+                const uchar_vec &msg_type, const std::string request) const;
         // Retrieves the requested credential.
         Credential get_credential(const Credential) const;
         // Retrieves the requested permission.
@@ -47,6 +61,8 @@ class LocalDaemon : public Daemon
                 const std::string set_name, const int op) const;
         // Returns true if the Credential is expired.
         bool is_expired(const Credential cred) const;
+        // Data keys unwrapped by envelope decryption.
+        mutable DataKeyCache _data_key_cache;
 };
 
 int LocalDaemon::start() const
@@ -59,13 +75,13 @@ int LocalDaemon::start() const
  */
 const char * LocalDaemon::lock_path() const
 {
-    // TODO create config file?
-    std::string path = "/home/jac/Desktop/eso/local/esol/esol_lock";
+    static const std::string path = eso_path("local/esol/esol_lock");
     return path.c_str();
 }
 
 /*
- * Handle incoming TCP connections.
+ * Handle incoming TCP connections: changes pushed by esods that send one
+ * per connection rather than on a subscription (see subscription.h).
  */
 void LocalDaemon::handleTCP() const
 {
@@ -81,35 +97,46 @@ void LocalDaemon::handleTCP() const
     // TODO multithread?
     while(true)
     {
-        Logger::log("esol is waiting for a new TCP connection.", 
-                LogLevel::Debug);
+        ESO_LOG(LogLevel::Debug, "esol is waiting for a new TCP connection.");
         TCP_Stream incoming_stream = tcp_socket.accept();
-        Logger::log("esol accepted new TCP connection.", LogLevel::Debug);
+        ESO_LOG(LogLevel::Debug, "esol accepted new TCP connection.");
 
-        uchar_vec recv_msg = incoming_stream.recv();
-        Logger::log(std::string{"Requested from esol: "} + to_string(recv_msg));
+        TraceContext parent;
+        uchar_vec recv_msg = recv_request(incoming_stream, parent);
+        ESO_LOG(LogLevel::Info, "Requested from esol: ", recv_msg);
+
+        // Continues the trace of the change that esod is sending on.
+        Span request_span{"esol.propagated", parent};
 
         if (recv_msg == UPDATE_PERM)
         {
+            request_span.tag("op", "update_perm");
             recv_msg = incoming_stream.recv();
-            Logger::log(std::string{"esol received: "} + to_string(recv_msg));
+            ESO_LOG(LogLevel::Info, "esol received: ", recv_msg);
 
             Permission perm = Permission{recv_msg};
 
+            PropagationStamp stamp;
+            if (stamp.parse(incoming_stream.recv()))
+                propagation_received(stamp);
+
             // Update distribution server database.
-            MySQL_Conn conn;
-            conn.insert_permission(perm);
+            GroupCommit::instance().insert_permission(perm);
         }
         else if (recv_msg == DELETE_PERM)
         {
+            request_span.tag("op", "delete_perm");
             recv_msg = incoming_stream.recv();
-            Logger::log(std::string{"esol received: "} + to_string(recv_msg));
+            ESO_LOG(LogLevel::Info, "esol received: ", recv_msg);
 
             Permission perm = Permission{recv_msg};
 
+            PropagationStamp stamp;
+            if (stamp.parse(incoming_stream.recv()))
+                propagation_received(stamp);
+
             // Update distribution server database.
-            MySQL_Conn conn;
-            conn.delete_permission(perm);
+            GroupCommit::instance().delete_permission(perm);
         }
         else
         {
@@ -117,13 +144,45 @@ void LocalDaemon::handleTCP() const
             // Invalid request.
         }
 
-        Logger::log("esol is closing TCP connection.", LogLevel::Debug);
+        ESO_LOG(LogLevel::Debug, "esol is closing TCP connection.");
 
     }
 
     Logger::log("TCP accept() error", LogLevel::Error);
 }
 
+/**
+ * Sends a request (GET_CRED or GET_PERM) to the esod at host:port and returns
+ * its reply. Returns INVALID_REQUEST if the esod cannot be reached, so that
+ * callers move on to the next distribution server.
+ */
+uchar_vec LocalDaemon::request_esod(const std::string host, 
+        const std::string port, const uchar_vec &msg_type,
+        const std::string request) const
+{
+    esol_count(EVENT_ESOD_FETCH);
+    Span span{"esol.esod_fetch"};
+    span.tag("dest", destination_name(host, port));
+
+    try
+    {
+        TCP_Socket tcp_socket;
+        TCP_Stream tcp_stream = tcp_socket.connect(host, port);
+
+        send_trace(tcp_stream);
+        tcp_stream.send(msg_type);
+        tcp_stream.send(request);
+
+        return tcp_stream.recv();
+    }
+    catch (const connect_exception &e)
+    {
+        Logger::log("esol: Could not reach esod at " + host + ".",
+                LogLevel::Error);
+        return INVALID_REQUEST;
+    }
+}
+
 /**
  * Returns the Credential with the given set_name and version.
  * First checks the local database, and then queries the distribution servers
@@ -131,26 +190,28 @@ void LocalDaemon::handleTCP() const
  */
 Credential LocalDaemon::get_credential(const Credential in_cred) const
 {
-    MySQL_Conn conn;
+    Span span{"esol.get_credential"};
+
+    // Changes esod has sent must be visible before we look.
+    GroupCommit::instance().flush();
+    Storage &conn = storage();
 
     Credential cred = conn.get_credential(in_cred);
     // If credential is empty, we will request it, update our database,
     // and then proceed.
     if (cred.set_name.empty())
     {
+        esol_count(EVENT_CRED_DB_MISS);
         Logger::log("esol: Credential not found, contacting esod.");
 
         // Try requesting all distribution locations.
         // Read config file for distribution locations.
-        // TODO config this location somewhere
-        std::ifstream input( "/home/jac/Desktop/eso/global_config/locations_config" );
+        std::ifstream input{LOCATIONS_CONFIG_PATH};
         for (std::string line; getline(input, line); )
         {
             auto dist_info = split_string(line, LOC_DELIMITER);
-
-            TCP_Socket tcp_socket;
-            TCP_Stream tcp_stream = tcp_socket.connect(
-                    dist_info[0], dist_info[1]);
+            if (dist_info.size() < 2)
+                continue;
 
             // Form message to send.
             // set_name;version
@@ -158,14 +219,10 @@ Credential LocalDaemon::get_credential(const Credential in_cred) const
             req_cred.set_name = in_cred.set_name;
             req_cred.version = in_cred.version;
 
-            std::string log_msg{"esol to esod: "};
-            log_msg += req_cred.serialize();
-            Logger::log(log_msg, LogLevel::Debug);
+            ESO_LOG(LogLevel::Debug, "esol to esod: ", req_cred.serialize());
 
-            tcp_stream.send(GET_CRED);
-            tcp_stream.send(req_cred.serialize());
-
-            uchar_vec tcp_received = tcp_stream.recv();
+            uchar_vec tcp_received = request_esod(dist_info[0], dist_info[1],
+                    GET_CRED, req_cred.serialize());
             // Our request was successful. Update our database.
             if (tcp_received != INVALID_REQUEST)
             {
@@ -174,8 +231,14 @@ Credential LocalDaemon::get_credential(const Credential in_cred) const
                 break;
             }
         }
+        if (cred.set_name.empty())
+            esol_count(EVENT_ESOD_FETCH_FAILED);
         // TODO If not valid, throw exception.
     }
+    else
+    {
+        esol_count(EVENT_CRED_DB_HIT);
+    }
     return cred;
 }
 
@@ -190,10 +253,14 @@ Credential LocalDaemon::get_credential(const Credential in_cred) const
  */
 Permission LocalDaemon::get_permission(Permission in_perm) const
 {
+    Span span{"esol.get_permission"};
+
     // Set our current FQDN.
     in_perm.loc = get_fqdn();
 
-    MySQL_Conn conn;
+    // Changes esod has sent must be visible before we look.
+    GroupCommit::instance().flush();
+    Storage &conn = storage();
 
     // This is the permission that we will return.
     Permission perm = conn.get_permission(in_perm);
@@ -201,19 +268,17 @@ Permission LocalDaemon::get_permission(Permission in_perm) const
     // and then proceed.
     if (perm.set_name.empty())
     {
+        esol_count(EVENT_PERM_DB_MISS);
         Logger::log("esol: Permission not found, contacting esod.");
 
         // Try requesting all distribution locations.
         // Read config file for distribution locations.
-        // TODO config this location somewhere
-        std::ifstream input( "/home/jac/Desktop/eso/global_config/locations_config" );
+        std::ifstream input{LOCATIONS_CONFIG_PATH};
         for (std::string line; getline(input, line); )
         {
             auto dist_info = split_string(line, LOC_DELIMITER);
-
-            TCP_Socket tcp_socket;
-            TCP_Stream tcp_stream = tcp_socket.connect(
-                    dist_info[0], dist_info[1]);
+            if (dist_info.size() < 2)
+                continue;
 
             // Form message to send.
             // set_name;version
@@ -222,14 +287,10 @@ Permission LocalDaemon::get_permission(Permission in_perm) const
             req_perm.entity = in_perm.entity;
             req_perm.loc = in_perm.loc;
 
-            std::string log_msg{"esol to esod: "};
-            log_msg += req_perm.serialize();
-            Logger::log(log_msg, LogLevel::Debug);
-
-            tcp_stream.send(GET_PERM);
-            tcp_stream.send(req_perm.serialize());
+            ESO_LOG(LogLevel::Debug, "esol to esod: ", req_perm.serialize());
 
-            uchar_vec tcp_received = tcp_stream.recv();
+            uchar_vec tcp_received = request_esod(dist_info[0], dist_info[1],
+                    GET_PERM, req_perm.serialize());
             // Our request was successful. Update our database.
             if (tcp_received != INVALID_REQUEST)
             {
@@ -238,8 +299,14 @@ Permission LocalDaemon::get_permission(Permission in_perm) const
                 break;
             }
         }
+        if (perm.set_name.empty())
+            esol_count(EVENT_ESOD_FETCH_FAILED);
         // TODO If not valid, throw exception.
     }
+    else
+    {
+        esol_count(EVENT_PERM_DB_HIT);
+    }
     return perm;
 }
 
@@ -329,28 +396,42 @@ void LocalDaemon::handleUDS() const
     // TODO multithread?
     while (true)
     {
-        Logger::log("esol is waiting for UDS connection.", LogLevel::Debug);
+        ESO_LOG(LogLevel::Debug, "esol is waiting for UDS connection.");
 
         UDS_Stream uds_stream = uds_in_socket.accept();
 
+        // Logs the heap allocations made by this request when built with
+        // ESO_COUNT_ALLOCS.
+        AllocCounter request_allocs{"esol UDS request"};
+        // Records the latency of this request, split by stage.
+        RequestStats req_stats;
+
         // Get the username of the user we are connected to.
         std::string curr_user = uds_in_socket._user;
 
-        std::string log_msg("esol accepted new UDS connection with: ");
-        log_msg += uds_stream.get_user();
-        Logger::log(log_msg, LogLevel::Debug);
+        ESO_LOG(LogLevel::Debug, "esol accepted new UDS connection with: ",
+                uds_stream.get_user());
 
         // Implement protocol
 
-        uchar_vec recv_msg = uds_stream.recv();
-        Logger::log(std::string{"Requested from esol: "} + to_string(recv_msg));
+        TraceContext parent;
+        uchar_vec recv_msg = recv_request(uds_stream, parent);
+        ESO_LOG(LogLevel::Info, "Requested from esol: ", recv_msg);
+
+        // The root span of the request, unless the caller sent a trace.
+        Span request_span{"esol.request", parent};
 
         if (recv_msg == PING)
         {
+            req_stats.set_op(STATS_OP_PING);
+            request_span.tag("op", STATS_OP_NAMES[STATS_OP_PING]);
             uds_stream.send(PING);
         }
         else if (recv_msg == REQUEST_ENCRYPT)
         {
+            req_stats.set_op(STATS_OP_ENCRYPT);
+            request_span.tag("op", STATS_OP_NAMES[STATS_OP_ENCRYPT]);
+
             // Receive parameters.
             recv_msg = uds_stream.recv();
             std::string set_name = to_string(recv_msg);
@@ -367,12 +448,15 @@ void LocalDaemon::handleUDS() const
             // Check permissions to see if encrypt is allowed.
             // If the entity does not have permission, we will send an empty
             // string and continue.
+            req_stats.stage(STAGE_PERMISSION);
             if (!has_permission_to(curr_user, cred.set_name, ENCRYPT_OP))
             {
+                req_stats.denied();
                 uds_stream.send(std::string{});
                 continue; 
             }
 
+            req_stats.stage(STAGE_CREDENTIAL);
             // TODO get_credential should throw an exception if the request was
             // not valid.
             cred = get_credential(cred); 
@@ -391,62 +475,72 @@ void LocalDaemon::handleUDS() const
             }
             else if (cred.type == SYMMETRIC)
             {
-                int len = cred.symKey.length();
-                // Base64 decode the returned symmetric key.
-                // TODO Error check len because base64_decode might fail.
-                unsigned char *key = base64_decode((unsigned char *)cred.symKey.c_str(), (size_t *)&len);
+                // Base64 decode the returned symmetric key. The key is
+                // wiped when it goes out of scope.
+                req_stats.stage(STAGE_KEY_DECODE);
+                secure_vec key = base64_decode(cred.symKey);
+                if (key.empty())
+                {
+                    uds_stream.send(uchar_vec{});
+                    continue;
+                }
                 
-                // Encrypt data.
-                uchar_vec encryption = 
-                    aes_encrypt(key, data, cred.size);
+                // Encrypt data directly into the outgoing message.
+                uchar_span out = 
+                    uds_stream.reserve_frame(aes_encrypt_size(data.size()));
+                req_stats.stage(STAGE_CRYPTO);
+                int len = aes_encrypt(&key[0], data, cred.size, out);
                 
                 // Send data.
-                uds_stream.send(encryption);
+                req_stats.stage(STAGE_IO);
+                uds_stream.commit_frame(len < 0 ? 0 : len);
 
-                Logger::log("esol: Clearing encryption data.", LogLevel::Debug);
+                ESO_LOG(LogLevel::Debug, "esol: Clearing encryption data.");
                 // Securely zero out memory.
-                // TODO Debug zeroing the key.
-                //Logger::log("esol: Zeroing key.", LogLevel::Debug);
-                //secure_memset(key, 0, cred.symKey.length() - 1);
-                Logger::log("esol: Zeroing msg data.", LogLevel::Debug);
-                secure_memset(&encryption[0], 0, encryption.size());
-                // Free memory.
-                Logger::log("esol: Freeing msg data.", LogLevel::Debug);
-                Logger::log("esol: Freeing key data.", LogLevel::Debug);
-                free(key);
-                Logger::log("esol: Done freeing encryption data.", LogLevel::Debug);
+                secure_memset(data.data(), 0, data.size());
 
             // This ends the symmetric encryption case.
             }
             else if (cred.type == ASYMMETRIC)
             {
-                int len;
                 // Base64 decode the returned public key.
-                // TODO Error check len because base64_decode might fail.
-                unsigned char *public_store = base64_decode((unsigned char*) cred.pubKey.c_str(), (size_t *) &len);
+                req_stats.stage(STAGE_KEY_DECODE);
+                secure_vec public_store = base64_decode(cred.pubKey);
 
                 // DER decode the public key.
-                RSA *public_key = DER_decode_RSA_public(public_store, len);
-
-                uchar_vec encryption = rsa_encrypt(public_key, data);
+                RSA *public_key = DER_decode_RSA_public(public_store.data(),
+                        public_store.size());
+
+                // Encrypt directly into the outgoing message.
+                int len = -1;
+                if (public_key)
+                {
+                    uchar_span out =
+                        uds_stream.reserve_frame(rsa_size(public_key));
+                    req_stats.stage(STAGE_CRYPTO);
+                    len = rsa_encrypt(public_key, data, out);
+                }
 
                 // Send the encrypted message.
-                uds_stream.send(encryption);
+                req_stats.stage(STAGE_IO);
+                if (len < 0)
+                    uds_stream.send(uchar_vec{});
+                else
+                    uds_stream.commit_frame(len);
 
                 // Securely zero out memory.
-                // TODO Debug secure_memset calls.
-                // secure_memset(public_store, 0, len);
-                // secure_memset(cipher, 0, encrypted_length);
-                // secure_memset(bcipher, 0, strlen(bcipher));
+                secure_memset(data.data(), 0, data.size());
                 // Free memory.
                 RSA_free(public_key);
-                free(public_store);
             // This ends the asymmetric encrypt case.
             }
         // This ends the encrypt case.
         }
         else if (recv_msg == REQUEST_DECRYPT)
         {
+            req_stats.set_op(STATS_OP_DECRYPT);
+            request_span.tag("op", STATS_OP_NAMES[STATS_OP_DECRYPT]);
+
             // Receive parameters.
             recv_msg = uds_stream.recv();
             std::string set_name = to_string(recv_msg);
@@ -463,13 +557,16 @@ void LocalDaemon::handleUDS() const
             // Check permissions to see if decrypt is allowed.
             // If the entity does not have permission, we will send an empty
             // string and continue.
+            req_stats.stage(STAGE_PERMISSION);
             if (!has_permission_to(curr_user, cred.set_name, DECRYPT_OP))
             {
+                req_stats.denied();
                 uds_stream.send(uchar_vec{});
                 continue; 
             }
 
 
+            req_stats.stage(STAGE_CREDENTIAL);
             // TODO get_credential should throw an exception if the request was
             // not valid.
             cred = get_credential(cred); 
@@ -477,8 +574,6 @@ void LocalDaemon::handleUDS() const
             // We will not check if the credential is expired because data
             // should be able to be decrypted with an expired credential.
 
-            // The length of the data to be encrypted.
-            int len;
             // Encrypt and return ciphertext.
             if (cred.type == USERPASS)
             {
@@ -486,60 +581,220 @@ void LocalDaemon::handleUDS() const
             }
             else if (cred.type == SYMMETRIC)
             {
-                len = cred.symKey.length();
-                // Base64 decode the returned symmetric key.
-                // TODO Error check len because base64_decode might fail.
-                unsigned char *key = base64_decode((unsigned char *)cred.symKey.c_str(), (size_t *)&len);
-
-                // Decrypt the data.
-                uchar_vec decryption = aes_decrypt(key, data, cred.size);
+                // Base64 decode the returned symmetric key. The key is
+                // wiped when it goes out of scope.
+                req_stats.stage(STAGE_KEY_DECODE);
+                secure_vec key = base64_decode(cred.symKey);
+                if (key.empty())
+                {
+                    uds_stream.send(uchar_vec{});
+                    continue;
+                }
+
+                // Decrypt the data directly into the outgoing message, which
+                // is wiped once it is sent.
+                uchar_span out =
+                    uds_stream.reserve_frame(aes_decrypt_size(data.size()));
+                req_stats.stage(STAGE_CRYPTO);
+                int len = aes_decrypt(&key[0], data, cred.size, out);
                 // Send the decryption.
-                uds_stream.send(decryption);
-
-                Logger::log("esol: Clearing decryption data", LogLevel::Debug);
-                // Securely zero out memory.
-                // TODO Debug zeroing the key.
-                //Logger::log("esol: Zeroing key.", LogLevel::Debug);
-                //secure_memset(key, 0, cred.symKey.length());
-                Logger::log("esol: Zeroing msg.", LogLevel::Debug);
-                secure_memset(&decryption[0], 0, decryption.size());
-                // Free memory.
-                Logger::log("esol: Freeing key.", LogLevel::Debug);
-                free(key);
-                Logger::log("esol: Done clearing decryption data.", LogLevel::Debug);
+                req_stats.stage(STAGE_IO);
+                uds_stream.commit_frame(len < 0 ? 0 : len);
 
             
             // This ends the symmetric decypt case.
             }
             else if (cred.type == ASYMMETRIC)
             {
-                int len;
-                // Base64 decode the returned private key.
-                // TODO Error check len because base64_decode might fail.
-                unsigned char *private_store = base64_decode((unsigned char*) cred.priKey.c_str(), (size_t *) &len);
+                // Base64 decode the returned private key. The key is wiped
+                // when it goes out of scope.
+                req_stats.stage(STAGE_KEY_DECODE);
+                secure_vec private_store = base64_decode(cred.priKey);
                 // DER decode the private key.
-                RSA *private_key = DER_decode_RSA_private(private_store, len);
-
-                uchar_vec decryption = rsa_decrypt(private_key, data);
+                RSA *private_key = DER_decode_RSA_private(private_store.data(),
+                        private_store.size());
+
+                // Decrypt directly into the outgoing message, which is wiped
+                // once it is sent.
+                int len = -1;
+                if (private_key)
+                {
+                    uchar_span out =
+                        uds_stream.reserve_frame(rsa_size(private_key));
+                    req_stats.stage(STAGE_CRYPTO);
+                    len = rsa_decrypt(private_key, data, out);
+                }
 
                 // Send the decrypted messge.
-                uds_stream.send(decryption);
+                req_stats.stage(STAGE_IO);
+                if (len < 0)
+                    uds_stream.send(uchar_vec{});
+                else
+                    uds_stream.commit_frame(len);
 
-                // Securely zero out memory.
-                // TODO Debug secure_memset calls.
-                // secure_memset(private_store, 0, len);
-                // secure_memset(orig, 0, orig_size);
-                // secure_memset(msg, 0, mlen); 
                 // Free memory.
                 RSA_free(private_key);
-                free(private_store);
             // This ends the asymmetric decrypt case.
             }
 
         // This ends the decrypt case.
         }
+        else if (recv_msg == REQUEST_ENVELOPE_ENCRYPT)
+        {
+            req_stats.set_op(STATS_OP_ENVELOPE_ENCRYPT);
+            request_span.tag("op", STATS_OP_NAMES[STATS_OP_ENVELOPE_ENCRYPT]);
+
+            // Receive parameters.
+            recv_msg = uds_stream.recv();
+            std::string set_name = to_string(recv_msg);
+
+            recv_msg = uds_stream.recv();
+            int version = std::stol(to_string(recv_msg));
+
+            uchar_vec data = uds_stream.recv();
+
+            Credential cred;
+            cred.set_name = set_name;
+            cred.version = version;
+
+            // Envelope encryption uses the same permission as encryption.
+            req_stats.stage(STAGE_PERMISSION);
+            if (!has_permission_to(curr_user, cred.set_name, ENCRYPT_OP))
+            {
+                req_stats.denied();
+                uds_stream.send(uchar_vec{});
+                continue; 
+            }
+
+            req_stats.stage(STAGE_CREDENTIAL);
+            // TODO get_credential should throw an exception if the request was
+            // not valid.
+            cred = get_credential(cred); 
+
+            // Only asymmetric credentials can wrap data keys.
+            if (cred.type != ASYMMETRIC || is_expired(cred))
+            {
+                uds_stream.send(uchar_vec{});
+                continue; 
+            }
+
+            // Base64 decode the returned public key.
+            req_stats.stage(STAGE_KEY_DECODE);
+            secure_vec public_store = base64_decode(cred.pubKey);
+            // DER decode the public key.
+            RSA *public_key = DER_decode_RSA_public(public_store.data(),
+                    public_store.size());
+
+            req_stats.stage(STAGE_CRYPTO);
+            uchar_vec envelope;
+            if (public_key)
+                envelope = envelope_seal(public_key, data);
+
+            req_stats.stage(STAGE_IO);
+            uds_stream.send(envelope);
+
+            // Securely zero out memory.
+            secure_memset(data.data(), 0, data.size());
+            RSA_free(public_key);
+        }
+        else if (recv_msg == REQUEST_ENVELOPE_DECRYPT)
+        {
+            req_stats.set_op(STATS_OP_ENVELOPE_DECRYPT);
+            request_span.tag("op", STATS_OP_NAMES[STATS_OP_ENVELOPE_DECRYPT]);
+
+            // Receive parameters.
+            recv_msg = uds_stream.recv();
+            std::string set_name = to_string(recv_msg);
+
+            recv_msg = uds_stream.recv();
+            int version = std::stol(to_string(recv_msg));
+
+            uchar_vec blob = uds_stream.recv();
+
+            Credential cred;
+            cred.set_name = set_name;
+            cred.version = version;
+
+            // Envelope decryption uses the same permission as decryption.
+            req_stats.stage(STAGE_PERMISSION);
+            if (!has_permission_to(curr_user, cred.set_name, DECRYPT_OP))
+            {
+                req_stats.denied();
+                uds_stream.send(uchar_vec{});
+                continue; 
+            }
+
+            req_stats.stage(STAGE_KEY_DECODE);
+            Envelope env;
+            if (!parse_envelope(blob, env))
+            {
+                uds_stream.send(uchar_vec{});
+                continue; 
+            }
+
+            // Repeated decrypts of blobs sharing a wrapped key skip the RSA
+            // private key operation. As with decrypt, expired credentials
+            // may still be used.
+            uchar_vec wrapped_digest = sha256_digest(env.wrapped_key);
+            secure_vec data_key;
+            if (!_data_key_cache.get(set_name, version, wrapped_digest, 
+                        data_key))
+            {
+                req_stats.stage(STAGE_CREDENTIAL);
+                // TODO get_credential should throw an exception if the 
+                // request was not valid.
+                cred = get_credential(cred); 
+
+                if (cred.type != ASYMMETRIC)
+                {
+                    uds_stream.send(uchar_vec{});
+                    continue; 
+                }
+
+                // Base64 decode the returned private key.
+                req_stats.stage(STAGE_KEY_DECODE);
+                secure_vec private_store = base64_decode(cred.priKey);
+                // DER decode the private key.
+                RSA *private_key = DER_decode_RSA_private(private_store.data(),
+                        private_store.size());
+
+                // Unwrap straight into secure memory.
+                req_stats.stage(STAGE_CRYPTO);
+                if (private_key)
+                {
+                    data_key.resize(rsa_size(private_key));
+                    int len = rsa_decrypt(private_key, env.wrapped_key,
+                            data_key);
+                    data_key.resize(len < 0 ? 0 : len);
+                }
+
+                RSA_free(private_key);
+
+                if (!data_key.empty())
+                    _data_key_cache.put(set_name, version, wrapped_digest,
+                            data_key);
+            }
+
+            req_stats.stage(STAGE_CRYPTO);
+            uchar_vec decryption;
+            if (!envelope_decrypt(env, data_key, decryption))
+            {
+                uds_stream.send(uchar_vec{});
+                continue;
+            }
+
+            // Send the decryption.
+            req_stats.stage(STAGE_IO);
+            uds_stream.send(decryption);
+
+            // Securely zero out memory. The data key is wiped by secure_vec.
+            secure_memset(decryption.data(), 0, decryption.size());
+        }
         else if (recv_msg == REQUEST_HMAC)
         {
+            req_stats.set_op(STATS_OP_HMAC);
+            request_span.tag("op", STATS_OP_NAMES[STATS_OP_HMAC]);
+
             // Receive a parameters.
             recv_msg = uds_stream.recv();
             std::string set_name = to_string(recv_msg);
@@ -559,12 +814,15 @@ void LocalDaemon::handleUDS() const
             // Check permissions to see if encrypt is allowed.
             // If the entity does not have permission, we will send an empty
             // string and continue.
+            req_stats.stage(STAGE_PERMISSION);
             if (!has_permission_to(curr_user, cred.set_name, HMAC_OP))
             {
+                req_stats.denied();
                 uds_stream.send(uchar_vec{});
                 continue; 
             }
 
+            req_stats.stage(STAGE_CREDENTIAL);
             // TODO get_credential should throw an exception if the request was
             // not valid.
             cred = get_credential(cred); 
@@ -582,8 +840,12 @@ void LocalDaemon::handleUDS() const
             }
             else if (cred.type == SYMMETRIC)
             {
-                uchar_vec hmac_data = hmac(cred.symKey, data, hash);
-                uds_stream.send(hmac_data);
+                // Compute the HMAC directly into the outgoing message.
+                uchar_span out = uds_stream.reserve_frame(hmac_size(hash));
+                req_stats.stage(STAGE_CRYPTO);
+                int len = hmac(cred.symKey, data, hash, out);
+                req_stats.stage(STAGE_IO);
+                uds_stream.commit_frame(len < 0 ? 0 : len);
             }
             else if (cred.type == ASYMMETRIC)
             {
@@ -593,6 +855,9 @@ void LocalDaemon::handleUDS() const
         }
         else if (recv_msg == REQUEST_SIGN)
         {
+            req_stats.set_op(STATS_OP_SIGN);
+            request_span.tag("op", STATS_OP_NAMES[STATS_OP_SIGN]);
+
             // Receive parameters.
             recv_msg = uds_stream.recv();
             std::string set_name = to_string(recv_msg);
@@ -612,12 +877,15 @@ void LocalDaemon::handleUDS() const
             // Check permissions to see if sign is allowed.
             // If the entity does not have permission, we will send an empty
             // string and continue.
+            req_stats.stage(STAGE_PERMISSION);
             if (!has_permission_to(curr_user, cred.set_name, SIGN_OP))
             {
+                req_stats.denied();
                 uds_stream.send(uchar_vec{});
                 continue; 
             }
 
+            req_stats.stage(STAGE_CREDENTIAL);
             // TODO get_credential should throw an exception if the request was
             // not valid.
             cred = get_credential(cred); 
@@ -631,20 +899,53 @@ void LocalDaemon::handleUDS() const
 
             if (cred.type == ASYMMETRIC)
             {
-                int len;
-                // Base64 decode the returned private key.
-                // TODO Error check len because base64_decode might fail.
-                unsigned char *private_store = base64_decode((unsigned char*) cred.priKey.c_str(), (size_t *) &len);
+                // Base64 decode the returned private key. The key is wiped
+                // when it goes out of scope.
+                req_stats.stage(STAGE_KEY_DECODE);
+                secure_vec private_store = base64_decode(cred.priKey);
                 // DER decode the private key.
-                RSA *private_key = DER_decode_RSA_private(private_store, len);
+                RSA *private_key = DER_decode_RSA_private(private_store.data(),
+                        private_store.size());
+
+                // Compute the signature directly into the outgoing message.
+                int len = -1;
+                if (private_key)
+                {
+                    uchar_span out =
+                        uds_stream.reserve_frame(rsa_size(private_key));
+                    req_stats.stage(STAGE_CRYPTO);
+                    len = rsa_sign(private_key, data, hash, out);
+                }
+
+                // Free allocated material.
+                RSA_free(private_key);
+
+                req_stats.stage(STAGE_IO);
+                if (len < 0)
+                    uds_stream.send(uchar_vec{});
+                else
+                    uds_stream.commit_frame(len);
+            }
+            else if (cred.type == ECDSA || cred.type == ED25519)
+            {
+                // Base64 decode the returned private key. The key is wiped
+                // when it goes out of scope.
+                req_stats.stage(STAGE_KEY_DECODE);
+                secure_vec private_store = base64_decode(cred.priKey);
+                size_t len = private_store.size();
+                // Decode the private key.
+                EVP_PKEY *private_key = (cred.type == ECDSA)
+                    ? decode_ECDSA_private(private_store.data(), len)
+                    : decode_Ed25519_private(private_store.data(), len);
 
                 // Compute the signature.
-                uchar_vec sig = rsa_sign(private_key, data, hash);
+                req_stats.stage(STAGE_CRYPTO);
+                uchar_vec sig = ec_sign(private_key, data, hash);
 
                 // Free allocated material.
-                RSA_free(private_key);
-                free(private_store);
+                EVP_PKEY_free(private_key);
 
+                req_stats.stage(STAGE_IO);
                 uds_stream.send(sig);
             }
             else
@@ -654,6 +955,9 @@ void LocalDaemon::handleUDS() const
         }
         else if (recv_msg == REQUEST_VERIFY)
         {
+            req_stats.set_op(STATS_OP_VERIFY);
+            request_span.tag("op", STATS_OP_NAMES[STATS_OP_VERIFY]);
+
             recv_msg = uds_stream.recv();
             std::string set_name = to_string(recv_msg);
 
@@ -673,12 +977,15 @@ void LocalDaemon::handleUDS() const
             // Check permissions to see if verify is allowed.
             // If the entity does not have permission, we will send an empty
             // string and continue.
+            req_stats.stage(STAGE_PERMISSION);
             if (!has_permission_to(curr_user, cred.set_name, VERIFY_OP))
             {
+                req_stats.denied();
                 uds_stream.send(uchar_vec{});
                 continue; 
             }
 
+            req_stats.stage(STAGE_CREDENTIAL);
             // TODO get_credential should throw an exception if the request was
             // not valid.
             cred = get_credential(cred); 
@@ -692,21 +999,47 @@ void LocalDaemon::handleUDS() const
 
             if (cred.type == ASYMMETRIC)
             {
-                int len;
                 // Base64 decode the returned public key.
-                // TODO Error check len because base64_decode might fail.
-                unsigned char *public_store = base64_decode((unsigned char*) cred.pubKey.c_str(), (size_t *) &len);
+                req_stats.stage(STAGE_KEY_DECODE);
+                secure_vec public_store = base64_decode(cred.pubKey);
                 // DER decode the public key.
-                RSA *public_key = DER_decode_RSA_public(public_store, len);
+                RSA *public_key = DER_decode_RSA_public(public_store.data(),
+                        public_store.size());
 
                 // Verify the signature.
-                bool validity = rsa_verify(public_key, sig, data, hash);
+                req_stats.stage(STAGE_CRYPTO);
+                bool validity = public_key
+                    && rsa_verify(public_key, sig, data, hash);
 
                 // Free materials.
                 RSA_free(public_key);
-                free(public_store);
 
                 // Send validity.
+                req_stats.stage(STAGE_IO);
+                uchar_vec ret_msg{};
+                ret_msg.push_back(validity);
+                uds_stream.send(ret_msg);
+            }
+            else if (cred.type == ECDSA || cred.type == ED25519)
+            {
+                // Base64 decode the returned public key.
+                req_stats.stage(STAGE_KEY_DECODE);
+                secure_vec public_store = base64_decode(cred.pubKey);
+                size_t len = public_store.size();
+                // Decode the public key.
+                EVP_PKEY *public_key = (cred.type == ECDSA)
+                    ? decode_ECDSA_public(public_store.data(), len, cred.size)
+                    : decode_Ed25519_public(public_store.data(), len);
+
+                // Verify the signature.
+                req_stats.stage(STAGE_CRYPTO);
+                bool validity = ec_verify(public_key, sig, data, hash);
+
+                // Free materials.
+                EVP_PKEY_free(public_key);
+
+                // Send validity.
+                req_stats.stage(STAGE_IO);
                 uchar_vec ret_msg{};
                 ret_msg.push_back(validity);
                 uds_stream.send(ret_msg);
@@ -717,6 +1050,19 @@ void LocalDaemon::handleUDS() const
             }
 
         }
+        else if (recv_msg == REQUEST_STATS)
+        {
+            req_stats.set_op(STATS_OP_STATS);
+            request_span.tag("op", STATS_OP_NAMES[STATS_OP_STATS]);
+
+            // Statistics hold no key material, so any local user may read
+            // them.
+            std::string report = esol_stats_report(_data_key_cache);
+            MySQL_Pool::instance().append_to(report);
+            GroupCommit::instance().append_to(report);
+            Subscription::instance().append_to(report);
+            uds_stream.send(report);
+        }
         else
         {
             // TODO 
@@ -732,13 +1078,23 @@ void LocalDaemon::handleUDS() const
 
 int LocalDaemon::work() const
 {
+    Logger::set_level(ESOL_LOG_LEVEL);
+    Tracer::instance().configure("esol", ESOL_TRACE_PATH,
+            ESOL_TRACE_SAMPLE_RATE);
+
+    // Open the store before serving, rather than on the first request.
+    storage();
+
     std::thread udp_thread(&LocalDaemon::handleUDS, this);
     std::thread tcp_thread(&LocalDaemon::handleTCP, this);
+    std::thread subscription_thread(&Subscription::run,
+            &Subscription::instance());
 
     // The threads should loop infinitely, so we will keep the main thread
     // waiting.
     udp_thread.join();
     tcp_thread.join();
+    subscription_thread.join();
 }
 
 #endif
@@ -0,0 +1,376 @@
+#ifndef ESO_LOCAL_ESOL_SUBSCRIPTION
+#define ESO_LOCAL_ESOL_SUBSCRIPTION
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../config/esol_config.h"
+#include "../config/mysql_config.h"
+#include "../../daemon/propagation.h"
+#include "../../database/backend.h"
+#include "../../database/credential.h"
+#include "../../database/group_commit.h"
+#include "../../database/permission.h"
+#include "../../global_config/global_config.h"
+#include "../../global_config/message_config.h"
+#include "../../global_config/types.h"
+#include "../../logger/logger.h"
+#include "../../socket/exception.h"
+#include "../../socket/tcp_socket.h"
+#include "../../socket/tcp_stream.h"
+#include "../../stats/propagation.h"
+#include "../../stats/report.h"
+#include "../../util/hash_ring.h"
+#include "../../util/network.h"
+#include "../../util/parser.h"
+
+/*
+ * esol's subscription to the changes for its host (see SUBSCRIBE in
+ * message_config.h and distribution/esod/subscriptions.h).
+ *
+ * esol subscribes to one esod, the first after its host on a hash ring over
+ * locations_config, so the hosts are spread over the esods and each esod
+ * sends a change to a host only if the host is its own. If that esod cannot
+ * be reached, esol tries the next one on the ring, and stays with the one
+ * it reaches until the connection drops; it then starts again from the
+ * first. If none can be reached, it waits and tries again.
+ *
+ * The esod it subscribed to, that esod's epoch and the last change applied
+ * are saved to ESOL_SUBSCRIPTION_PATH after each batch, once the batch has
+ * been written, so that after a restart esol can resume where it stopped.
+ * A batch that could not all be written is not acknowledged: esol drops the
+ * connection, and is sent the batch again when it subscribes again.
+ * When esod cannot resume, esol drops every permission and credential it
+ * holds, as it may have missed changes to any of them, and fetches them
+ * again as they are used.
+ */
+class Subscription
+{
+public:
+    static Subscription &instance();
+
+    // Keeps a subscription open for the life of the daemon.
+    void run();
+
+    // Appends the subscription counters to a stats report.
+    void append_to(std::string &report) const;
+private:
+    explicit Subscription(const std::string &path);
+
+    // Subscribes to the esod at host:port, and applies what it sends until
+    // the connection drops. Returns false if it could not subscribe.
+    bool subscribe(const std::string &host, const std::string &port,
+            bool failover);
+    // Applies one change from esod. Returns false if it could not be.
+    bool apply(const uchar_vec &msg_type, const std::string &msg);
+    // Drops every permission and credential held.
+    void drop_all();
+    // Saves _esod, _epoch and _acked.
+    void save();
+
+    std::string _path;
+    // This host, as esod knows it.
+    std::string _host;
+
+    mutable std::mutex _mutex;
+    // host:port of the esod subscribed to, its epoch and the last change
+    // from it that has been applied.
+    std::string _esod;
+    uint64_t _epoch;
+    uint64_t _acked;
+
+    // Guarded by _mutex, for the stats report.
+    uint64_t _subscribes;
+    uint64_t _failovers;
+    uint64_t _resets;
+    uint64_t _batches;
+    uint64_t _heartbeats;
+    uint64_t _changes;
+};
+
+Subscription &Subscription::instance()
+{
+    static Subscription *subscription =
+        new Subscription{ESOL_SUBSCRIPTION_PATH};
+    return *subscription;
+}
+
+Subscription::Subscription(const std::string &path)
+    : _path{path}, _host{get_fqdn()}, _epoch{0}, _acked{0}, _subscribes{0},
+    _failovers{0}, _resets{0}, _batches{0}, _heartbeats{0}, _changes{0}
+{
+    // With in-memory storage nothing survives a restart, so there is
+    // nothing to resume.
+    if (strcmp(STORAGE_BACKEND, "memory") == 0)
+        return;
+
+    std::ifstream input{_path};
+    if (!(input >> _esod >> _epoch >> _acked))
+    {
+        _esod.clear();
+        _epoch = _acked = 0;
+    }
+}
+
+void Subscription::run()
+{
+    uint64_t backoff_ms = 0;
+    while (true)
+    {
+        // Read conifg file for distribution locations.
+        HashRing ring;
+        std::map<std::string, std::pair<std::string, std::string>> esods;
+        std::ifstream input{LOCATIONS_CONFIG_PATH};
+        for (std::string line; getline(input, line); )
+        {
+            auto values = split_string(line, LOC_DELIMITER);
+            if (values.size() < 2)
+                continue;
+
+            std::string name = destination_name(values[0], values[1]);
+            ring.add(name, ESOL_SUBSCRIBE_RING_POINTS);
+            esods[name] = std::make_pair(values[0], values[1]);
+        }
+
+        std::vector<std::string> order = ring.order(_host);
+        bool subscribed = false;
+        for (size_t i = 0; i < order.size() && !subscribed; i++)
+        {
+            auto &esod = esods[order[i]];
+            subscribed = subscribe(esod.first, esod.second, i > 0);
+        }
+        if (subscribed)
+        {
+            backoff_ms = 0;
+            continue;
+        }
+
+        backoff_ms = backoff_ms == 0 ? ESOL_SUBSCRIBE_RETRY_MIN_MS
+            : std::min(backoff_ms * 2, ESOL_SUBSCRIBE_RETRY_MAX_MS);
+        Logger::log("esol could not subscribe to any esod; trying again in "
+                + std::to_string(backoff_ms) + " ms.", LogLevel::Error);
+        std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
+    }
+}
+
+bool Subscription::subscribe(const std::string &host,
+        const std::string &port, bool failover)
+{
+    std::string esod = destination_name(host, port);
+    std::unique_ptr<TCP_Stream> stream;
+    try
+    {
+        TCP_Socket tcp_socket;
+        stream.reset(new TCP_Stream{tcp_socket.connect(host, port)});
+    }
+    catch (const connect_exception &e)
+    {
+        Logger::log("esol: Could not reach esod at " + esod + " to "
+                "subscribe.", LogLevel::Error);
+        return false;
+    }
+    stream->set_timeout(SUBSCRIBE_TIMEOUT_MS);
+
+    uint64_t epoch, next;
+    {
+        // Another esod cannot resume this one's changes.
+        std::lock_guard<std::mutex> lock{_mutex};
+        epoch = _esod == esod ? _epoch : 0;
+        next = _esod == esod ? _acked : 0;
+    }
+    stream->send(SUBSCRIBE);
+    stream->send(_host + MSG_DELIMITER + std::to_string(epoch)
+            + MSG_DELIMITER + std::to_string(next));
+
+    std::vector<std::string> reply = split_string(stream->recv(),
+            MSG_DELIMITER);
+    if (stream->failed() || reply.size() != 3)
+        return false;
+    try
+    {
+        epoch = std::stoull(reply[0]);
+        next = std::stoull(reply[1]) + 1;
+    }
+    catch (const std::exception &e)
+    {
+        return false;
+    }
+
+    bool reset = reply[2] == "1";
+    if (reset)
+        drop_all();
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        _esod = esod;
+        _epoch = epoch;
+        _acked = next - 1;
+        _subscribes++;
+        _failovers += failover;
+        _resets += reset;
+    }
+    save();
+    Logger::log("esol subscribed to esod at " + esod + (reset ? "; it "
+                "starts over." : " from change " + std::to_string(next - 1)
+                + "."));
+
+    while (true)
+    {
+        std::vector<std::string> header = split_string(stream->recv(),
+                MSG_DELIMITER);
+        if (stream->failed() || header.size() != 2)
+            break;
+
+        uint64_t first, count;
+        try
+        {
+            first = std::stoull(header[0]);
+            count = std::stoull(header[1]);
+        }
+        catch (const std::exception &e)
+        {
+            break;
+        }
+        if (first != next)
+        {
+            Logger::log("esol expected change " + std::to_string(next)
+                    + " from esod but was sent " + std::to_string(first)
+                    + ".", LogLevel::Error);
+            break;
+        }
+
+        uint64_t since = GroupCommit::instance().position();
+        bool written = true;
+        uint64_t applied = 0;
+        for (; applied < count; applied++)
+        {
+            uchar_vec msg_type = stream->recv();
+            std::string msg = to_string(stream->recv());
+            PropagationStamp stamp;
+            if (!stamp.parse(stream->recv()))
+                break;
+            propagation_received(stamp);
+            written = apply(msg_type, msg) && written;
+        }
+        if (applied != count)
+            break;
+
+        // Acknowledged changes must survive a restart.
+        if (count > 0 && !(GroupCommit::instance().flush(since) && written))
+        {
+            Logger::log("esol could not write changes " + std::to_string(next)
+                    + " to " + std::to_string(next + count - 1) + " from "
+                    "esod; they will be sent again.", LogLevel::Error);
+            break;
+        }
+
+        next += count;
+        if (count > 0)
+        {
+            {
+                std::lock_guard<std::mutex> lock{_mutex};
+                _acked = next - 1;
+                _batches++;
+                _changes += count;
+            }
+            save();
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock{_mutex};
+            _heartbeats++;
+        }
+        stream->send(std::to_string(next - 1));
+    }
+
+    Logger::log("esol lost its subscription to esod at " + esod + ".",
+            LogLevel::Warning);
+    return true;
+}
+
+/*
+ * Permissions are queued to be written, and only fail when they are.
+ */
+bool Subscription::apply(const uchar_vec &msg_type, const std::string &msg)
+{
+    ESO_LOG(LogLevel::Info, "esol received: ", msg);
+
+    if (msg_type == UPDATE_PERM)
+        GroupCommit::instance().insert_permission(Permission{msg});
+    else if (msg_type == DELETE_PERM)
+        GroupCommit::instance().delete_permission(Permission{msg});
+    else if (msg_type == INVALIDATE_CRED)
+        return storage().delete_credential(Credential{msg}) == OK;
+    else
+        Logger::log("esol was sent an unknown change: " + to_string(msg_type),
+                LogLevel::Error);
+    return true;
+}
+
+void Subscription::drop_all()
+{
+    GroupCommit::instance().flush();
+    Storage &conn = storage();
+
+    std::vector<Permission> perms;
+    if (conn.scan_permissions(perms) == 0)
+        conn.delete_permissions(perms);
+    std::vector<Credential> creds;
+    if (conn.scan_credentials(creds) == 0)
+        for (const Credential &cred : creds)
+            conn.delete_credential(cred);
+
+    Logger::log("esol dropped " + std::to_string(perms.size())
+            + " permissions and " + std::to_string(creds.size())
+            + " credentials, as it may have missed changes to them.",
+            LogLevel::Warning);
+}
+
+void Subscription::save()
+{
+    std::string line;
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        line = _esod + " " + std::to_string(_epoch) + " "
+            + std::to_string(_acked);
+    }
+
+    std::string tmp_path = _path + ".tmp";
+    {
+        std::ofstream output{tmp_path, std::ios::trunc};
+        output << line << '\n';
+        if (!output.flush())
+        {
+            Logger::log("esol cannot write " + tmp_path, LogLevel::Error);
+            return;
+        }
+    }
+    if (rename(tmp_path.c_str(), _path.c_str()) != 0)
+        Logger::log("esol cannot rename " + tmp_path + ": " + strerror(errno),
+                LogLevel::Error);
+}
+
+void Subscription::append_to(std::string &report) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    append_counter(report, "subscribe_acked", _acked);
+    append_counter(report, "subscribe_subscribes", _subscribes);
+    append_counter(report, "subscribe_failovers", _failovers);
+    append_counter(report, "subscribe_resets", _resets);
+    append_counter(report, "subscribe_batches", _batches);
+    append_counter(report, "subscribe_heartbeats", _heartbeats);
+    append_counter(report, "subscribe_changes", _changes);
+}
+
+#endif
@@ -0,0 +1,650 @@
+/*
+ * Load generator for esol. Sends encrypt, decrypt, hmac, sign and verify
+ * requests over the UDS protocol and reports throughput and latency
+ * percentiles per request type.
+ *
+ * Usage: esolbench -k keys [options]
+ *
+ *   -k file    The sets to use, one "set_name version [op,op...]" per line.
+ *              The user running esolbench must have permission for them. A
+ *              set is only used for the listed ops (all if none are given),
+ *              e.g. symmetric sets for hmac and RSA sets for sign/verify.
+ *              With -Z the first line is the hottest.
+ *   -m mix     Request mix as op=weight pairs (default encrypt=1), e.g.
+ *              encrypt=50,decrypt=40,hmac=10.
+ *   -z sizes   Payload sizes in bytes as size=weight pairs (default 1024),
+ *              e.g. 64=80,4096=20.
+ *   -Z s       Choose sets with a Zipfian distribution of exponent s, e.g.
+ *              0.99. The default, 0, chooses uniformly.
+ *   -c n       Closed loop: n clients that each send a request as soon as
+ *              the previous one is answered (default 8). In open loop mode,
+ *              the number of clients available to send requests.
+ *   -r rate    Open loop: start rate requests per second no matter how long
+ *              earlier ones take. Latency is measured from when a request was
+ *              due to start, so a slow esol is not hidden by the generator
+ *              slowing down (coordinated omission).
+ *   -P         In open loop mode, use Poisson rather than evenly spaced
+ *              arrivals.
+ *   -d secs    How long to measure for (default 10).
+ *   -w secs    How long to run before measuring (default 2).
+ *   -s path    esol's socket (default ESOL_SOCKET_PATH).
+ *   -R         Print the results as a stats report (see stats/report.h)
+ *              for scripts that compare runs.
+ *
+ * Requests for decrypt and verify use ciphertexts and signatures made by
+ * esol for each set and size before the run starts.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../config/esol_config.h"
+#include "../../crypto/constants.h"
+#include "../../global_config/message_config.h"
+#include "../../global_config/types.h"
+#include "../../socket/exception.h"
+#include "../../socket/uds_socket.h"
+#include "../../socket/uds_stream.h"
+#include "../../stats/histogram.h"
+#include "../../stats/report.h"
+#include "../../util/parser.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+enum BenchOp
+{
+    OP_ENCRYPT,
+    OP_DECRYPT,
+    OP_HMAC,
+    OP_SIGN,
+    OP_VERIFY,
+    NUM_OPS
+};
+
+const char *OP_NAMES[NUM_OPS] = {"encrypt", "decrypt", "hmac", "sign",
+    "verify"};
+
+// Every request is signed and verified with this hash.
+const std::string BENCH_HASH = std::to_string(SHA256);
+
+/*
+ * Picks an index at random with probability proportional to its weight.
+ */
+class WeightedChoice
+{
+public:
+    WeightedChoice() {}
+    explicit WeightedChoice(const std::vector<double> &weights);
+    size_t pick(std::mt19937_64 &rng) const;
+    bool empty() const;
+private:
+    std::vector<double> _cdf;
+};
+
+WeightedChoice::WeightedChoice(const std::vector<double> &weights)
+{
+    double total = 0;
+    for (double w : weights)
+        _cdf.push_back(total += w);
+    for (double &c : _cdf)
+        c /= total;
+}
+
+size_t WeightedChoice::pick(std::mt19937_64 &rng) const
+{
+    double u = std::uniform_real_distribution<double>{0, 1}(rng);
+    size_t i = std::lower_bound(_cdf.begin(), _cdf.end(), u) - _cdf.begin();
+    return i < _cdf.size() ? i : _cdf.size() - 1;
+}
+
+bool WeightedChoice::empty() const
+{
+    return _cdf.empty();
+}
+
+/*
+ * A set and version to send requests for.
+ */
+struct BenchKey
+{
+    std::string set_name;
+    std::string version;
+    // Bit i is set if the key may be used for BenchOp i.
+    unsigned ops;
+};
+
+struct BenchConfig
+{
+    std::string socket_path{ESOL_SOCKET_PATH};
+    std::string keys_path;
+    std::string mix{"encrypt=1"};
+    std::string sizes{"1024"};
+    double zipf = 0;
+    int clients = 8;
+    // Requests per second in open loop mode, 0 for closed loop.
+    double rate = 0;
+    bool poisson = false;
+    double duration = 10;
+    double warmup = 2;
+    bool raw = false;
+};
+
+BenchConfig config;
+
+std::vector<BenchKey> keys;
+// The keys each op may use and how to choose between them.
+std::vector<size_t> op_keys[NUM_OPS];
+WeightedChoice op_key_choice[NUM_OPS];
+
+std::vector<BenchOp> mix_ops;
+WeightedChoice mix_choice;
+
+std::vector<size_t> sizes;
+WeightedChoice size_choice;
+
+// Random data that payloads are taken from.
+uchar_vec payload;
+
+// Ciphertexts for decrypt and signatures for verify, by key and size index.
+std::map<std::pair<size_t, size_t>, uchar_vec> ciphertexts;
+std::map<std::pair<size_t, size_t>, uchar_vec> signatures;
+
+/*
+ * The measurements of one client thread.
+ */
+struct ClientStats
+{
+    Histogram latency[NUM_OPS];
+    uint64_t ok[NUM_OPS] = {};
+    uint64_t failed[NUM_OPS] = {};
+    // Open loop requests that started over a millisecond late because every
+    // client was busy.
+    uint64_t late = 0;
+};
+
+/**
+ * Parses "name=weight,name=weight". The weight defaults to 1.
+ */
+std::vector<std::pair<std::string, double>> parse_weights(
+        const std::string &spec)
+{
+    std::vector<std::pair<std::string, double>> weights;
+    for (const std::string &item : split_string(spec, ','))
+    {
+        size_t eq = item.find('=');
+        double weight = eq == std::string::npos
+            ? 1 : atof(item.c_str() + eq + 1);
+        if (weight > 0)
+            weights.push_back(std::make_pair(item.substr(0, eq), weight));
+    }
+    return weights;
+}
+
+/**
+ * Returns the BenchOp called name, or NUM_OPS.
+ */
+BenchOp parse_op(const std::string &name)
+{
+    for (int op = 0; op < NUM_OPS; op++)
+        if (name == OP_NAMES[op])
+            return (BenchOp) op;
+    return NUM_OPS;
+}
+
+/**
+ * Sends one request on a new connection and returns esol's reply. Returns an
+ * empty reply if esol cannot be reached, as esol does for failed requests.
+ */
+uchar_vec exchange(const std::vector<const_uchar_span> &frames)
+{
+    try
+    {
+        UDS_Socket uds_socket{config.socket_path};
+        UDS_Stream uds_stream = uds_socket.connect();
+        for (const const_uchar_span &frame : frames)
+            uds_stream.send(uchar_vec{frame.data(),
+                    frame.data() + frame.size()});
+        return uds_stream.recv();
+    }
+    catch (const connect_exception &e)
+    {
+        return uchar_vec{};
+    }
+}
+
+/**
+ * Sends a request of type op for a key and payload size. Returns true if esol
+ * answered it successfully.
+ */
+bool send_request(BenchOp op, size_t key, size_t size)
+{
+    const BenchKey &k = keys[key];
+    const_uchar_span data{payload.data(), sizes[size]};
+
+    switch (op)
+    {
+        case OP_ENCRYPT:
+            return !exchange({REQUEST_ENCRYPT, k.set_name, k.version, data})
+                .empty();
+        case OP_DECRYPT:
+            return !exchange({REQUEST_DECRYPT, k.set_name, k.version,
+                    ciphertexts.at(std::make_pair(key, size))}).empty();
+        case OP_HMAC:
+            return !exchange({REQUEST_HMAC, k.set_name, k.version, data,
+                    BENCH_HASH}).empty();
+        case OP_SIGN:
+            return !exchange({REQUEST_SIGN, k.set_name, k.version, data,
+                    BENCH_HASH}).empty();
+        case OP_VERIFY:
+        {
+            uchar_vec reply = exchange({REQUEST_VERIFY, k.set_name, k.version,
+                    signatures.at(std::make_pair(key, size)), data, BENCH_HASH});
+            return reply.size() == 1 && reply[0] == 1;
+        }
+        default:
+            return false;
+    }
+}
+
+/**
+ * Reads the keys file and sets up the choice of keys for each op. Returns
+ * false if an op in the mix has no keys.
+ */
+bool load_keys()
+{
+    std::ifstream input{config.keys_path};
+    for (std::string line; std::getline(input, line); )
+    {
+        std::istringstream fields{line};
+        BenchKey key;
+        std::string ops;
+        if (!(fields >> key.set_name >> key.version) || key.set_name[0] == '#')
+            continue;
+
+        key.ops = 0;
+        if (fields >> ops)
+            for (const std::string &name : split_string(ops, ','))
+            {
+                if (parse_op(name) != NUM_OPS)
+                    key.ops |= 1u << parse_op(name);
+            }
+        else
+            key.ops = (1u << NUM_OPS) - 1;
+
+        keys.push_back(key);
+    }
+
+    for (int op = 0; op < NUM_OPS; op++)
+    {
+        // Rank r is chosen with weight 1 / r^s; s = 0 is uniform.
+        std::vector<double> weights;
+        for (size_t i = 0; i < keys.size(); i++)
+            if (keys[i].ops & (1u << op))
+            {
+                op_keys[op].push_back(i);
+                weights.push_back(1 / std::pow(op_keys[op].size(),
+                            config.zipf));
+            }
+        op_key_choice[op] = WeightedChoice{weights};
+    }
+
+    for (BenchOp op : mix_ops)
+        if (op_keys[op].empty())
+        {
+            fprintf(stderr, "esolbench: no keys in %s for %s\n",
+                    config.keys_path.c_str(), OP_NAMES[op]);
+            return false;
+        }
+    return true;
+}
+
+/**
+ * Has esol encrypt and sign the payload of each size for every key that
+ * decrypt and verify requests may use. Returns false if esol refuses.
+ */
+bool prepare()
+{
+    bool decrypt = std::count(mix_ops.begin(), mix_ops.end(), OP_DECRYPT);
+    bool verify = std::count(mix_ops.begin(), mix_ops.end(), OP_VERIFY);
+    if (!decrypt)
+        op_keys[OP_DECRYPT].clear();
+    if (!verify)
+        op_keys[OP_VERIFY].clear();
+
+    for (size_t s = 0; s < sizes.size(); s++)
+    {
+        const_uchar_span data{payload.data(), sizes[s]};
+
+        for (size_t key : op_keys[OP_DECRYPT])
+        {
+            const BenchKey &k = keys[key];
+            uchar_vec reply = exchange({REQUEST_ENCRYPT, k.set_name, k.version,
+                    data});
+            if (reply.empty())
+            {
+                fprintf(stderr, "esolbench: esol would not encrypt with %s %s\n",
+                        k.set_name.c_str(), k.version.c_str());
+                return false;
+            }
+            ciphertexts[std::make_pair(key, s)] = reply;
+        }
+
+        for (size_t key : op_keys[OP_VERIFY])
+        {
+            const BenchKey &k = keys[key];
+            uchar_vec reply = exchange({REQUEST_SIGN, k.set_name, k.version,
+                    data, BENCH_HASH});
+            if (reply.empty())
+            {
+                fprintf(stderr, "esolbench: esol would not sign with %s %s\n",
+                        k.set_name.c_str(), k.version.c_str());
+                return false;
+            }
+            signatures[std::make_pair(key, s)] = reply;
+        }
+    }
+    return true;
+}
+
+/*
+ * Hands out the start times of open loop requests.
+ */
+class Schedule
+{
+public:
+    Schedule(bench_clock::time_point start, double rate, bool poisson);
+    // Returns when the next request is due.
+    bench_clock::time_point next();
+private:
+    std::mutex _mutex;
+    bench_clock::time_point _next;
+    std::chrono::duration<double> _interval;
+    bool _poisson;
+    std::mt19937_64 _rng;
+};
+
+Schedule::Schedule(bench_clock::time_point start, double rate, bool poisson)
+    : _next{start}, _interval{1 / rate}, _poisson{poisson},
+    _rng{std::random_device{}()}
+{
+
+}
+
+bench_clock::time_point Schedule::next()
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    bench_clock::time_point due = _next;
+    std::chrono::duration<double> gap = _interval;
+    if (_poisson)
+        gap *= std::exponential_distribution<double>{1}(_rng);
+    _next += std::chrono::duration_cast<bench_clock::duration>(gap);
+    return due;
+}
+
+/**
+ * Runs one client until end. Requests that start before measure_from are not
+ * recorded. schedule is null in closed loop mode.
+ */
+void run_client(ClientStats &stats, Schedule *schedule,
+        bench_clock::time_point measure_from, bench_clock::time_point end)
+{
+    std::mt19937_64 rng{std::random_device{}()};
+
+    while (true)
+    {
+        bench_clock::time_point start;
+        if (schedule)
+        {
+            start = schedule->next();
+            if (start >= end)
+                break;
+            std::this_thread::sleep_until(start);
+            if (bench_clock::now() - start > std::chrono::milliseconds{1}
+                    && start >= measure_from)
+                stats.late++;
+        }
+        else
+        {
+            start = bench_clock::now();
+            if (start >= end)
+                break;
+        }
+
+        BenchOp op = mix_ops[mix_choice.pick(rng)];
+        size_t key = op_keys[op][op_key_choice[op].pick(rng)];
+        size_t size = size_choice.pick(rng);
+
+        bool ok = send_request(op, key, size);
+        bench_clock::time_point done = bench_clock::now();
+
+        if (start < measure_from)
+            continue;
+
+        stats.latency[op].record(std::chrono::duration_cast<
+                std::chrono::nanoseconds>(done - start).count());
+        if (ok)
+            stats.ok[op]++;
+        else
+            stats.failed[op]++;
+    }
+}
+
+/**
+ * Prints the results, either as tables or as a stats report.
+ */
+void report(const std::vector<std::unique_ptr<ClientStats>> &clients)
+{
+    std::vector<HistogramSnapshot> latency(NUM_OPS + 1);
+    uint64_t ok[NUM_OPS + 1] = {};
+    uint64_t failed[NUM_OPS + 1] = {};
+    uint64_t late = 0;
+
+    // The last entry covers every op.
+    for (auto &client : clients)
+    {
+        for (int op = 0; op < NUM_OPS; op++)
+        {
+            client->latency[op].add_to(latency[op]);
+            client->latency[op].add_to(latency[NUM_OPS]);
+            ok[op] += client->ok[op];
+            ok[NUM_OPS] += client->ok[op];
+            failed[op] += client->failed[op];
+            failed[NUM_OPS] += client->failed[op];
+        }
+        late += client->late;
+    }
+
+    if (config.raw)
+    {
+        std::string report = stats_report_header("esolbench");
+        append_counter(report, "clients", config.clients);
+        append_counter(report, "rate", config.rate);
+        append_counter(report, "duration_s", config.duration);
+        append_counter(report, "late_starts", late);
+        for (int op = 0; op <= NUM_OPS; op++)
+        {
+            if (!latency[op].count)
+                continue;
+            // request <op> <count> <failed>, as esol reports denied.
+            const char *name = op < NUM_OPS ? OP_NAMES[op] : "all";
+            report += "request ";
+            report += name;
+            report += ' ';
+            report += std::to_string(ok[op] + failed[op]);
+            report += ' ';
+            report += std::to_string(failed[op]);
+            report += '\n';
+            append_latency(report, name, "total", latency[op]);
+        }
+        fputs(report.c_str(), stdout);
+        return;
+    }
+
+    if (config.rate > 0)
+        printf("open loop, %.0f req/s%s, %d clients, %.0f s\n", config.rate,
+                config.poisson ? " (Poisson)" : "", config.clients,
+                config.duration);
+    else
+        printf("closed loop, %d clients, %.0f s\n", config.clients,
+                config.duration);
+
+    printf("\n%-10s %10s %8s %10s %10s %10s %10s %10s %10s\n", "op",
+            "requests", "failed", "req/s", "p50 (us)", "p90", "p99", "p99.9",
+            "max");
+    for (int op = 0; op <= NUM_OPS; op++)
+    {
+        const HistogramSnapshot &h = latency[op];
+        if (!h.count)
+            continue;
+        printf("%-10s %10llu %8llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                op < NUM_OPS ? OP_NAMES[op] : "all",
+                (unsigned long long) h.count,
+                (unsigned long long) failed[op], h.count / config.duration,
+                h.percentile(50) / 1000.0, h.percentile(90) / 1000.0,
+                h.percentile(99) / 1000.0, h.percentile(99.9) / 1000.0,
+                h.max / 1000.0);
+    }
+
+    if (late)
+        printf("\n%llu requests started over 1 ms late; use more clients "
+                "(-c) for this rate.\n", (unsigned long long) late);
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg{argv[i]};
+        if (arg == "-P")
+        {
+            config.poisson = true;
+            continue;
+        }
+        if (arg == "-R")
+        {
+            config.raw = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "esolbench: %s needs a value\n", argv[i]);
+            return 2;
+        }
+
+        const char *value = argv[++i];
+        if (arg == "-k")
+            config.keys_path = value;
+        else if (arg == "-m")
+            config.mix = value;
+        else if (arg == "-z")
+            config.sizes = value;
+        else if (arg == "-Z")
+            config.zipf = atof(value);
+        else if (arg == "-c")
+            config.clients = atoi(value);
+        else if (arg == "-r")
+            config.rate = atof(value);
+        else if (arg == "-d")
+            config.duration = atof(value);
+        else if (arg == "-w")
+            config.warmup = atof(value);
+        else if (arg == "-s")
+            config.socket_path = value;
+        else
+        {
+            fprintf(stderr, "esolbench: unknown option %s\n", argv[i - 1]);
+            return 2;
+        }
+    }
+
+    if (config.keys_path.empty() || config.clients < 1
+            || config.duration <= 0)
+    {
+        fprintf(stderr, "usage: esolbench -k keys [-m mix] [-z sizes] [-Z s] "
+                "[-c clients] [-r rate [-P]] [-d secs] [-w secs] [-s path] "
+                "[-R]\n");
+        return 2;
+    }
+
+    std::vector<double> weights;
+    for (auto &w : parse_weights(config.mix))
+    {
+        BenchOp op = parse_op(w.first);
+        if (op == NUM_OPS)
+        {
+            fprintf(stderr, "esolbench: unknown op %s\n", w.first.c_str());
+            return 2;
+        }
+        mix_ops.push_back(op);
+        weights.push_back(w.second);
+    }
+    mix_choice = WeightedChoice{weights};
+
+    weights.clear();
+    for (auto &w : parse_weights(config.sizes))
+    {
+        size_t size = strtoull(w.first.c_str(), nullptr, 10);
+        // A frame holds at most 64 KiB, and ciphertexts are a block longer.
+        if (size == 0 || size > 0xFFFF - 64)
+        {
+            fprintf(stderr, "esolbench: bad payload size %s\n",
+                    w.first.c_str());
+            return 2;
+        }
+        sizes.push_back(size);
+        weights.push_back(w.second);
+    }
+    size_choice = WeightedChoice{weights};
+
+    if (mix_ops.empty() || sizes.empty() || !load_keys())
+        return 2;
+
+    std::mt19937_64 rng{std::random_device{}()};
+    payload.resize(*std::max_element(sizes.begin(), sizes.end()));
+    for (unsigned char &c : payload)
+        c = rng();
+
+    if (!prepare())
+        return 1;
+
+    bench_clock::time_point start = bench_clock::now();
+    bench_clock::time_point measure_from = start
+        + std::chrono::duration_cast<bench_clock::duration>(
+                std::chrono::duration<double>(config.warmup));
+    bench_clock::time_point end = measure_from
+        + std::chrono::duration_cast<bench_clock::duration>(
+                std::chrono::duration<double>(config.duration));
+
+    std::unique_ptr<Schedule> schedule;
+    if (config.rate > 0)
+        schedule.reset(new Schedule{start, config.rate, config.poisson});
+
+    std::vector<std::unique_ptr<ClientStats>> clients;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < config.clients; i++)
+    {
+        clients.emplace_back(new ClientStats);
+        threads.emplace_back(run_client, std::ref(*clients.back()),
+                schedule.get(), measure_from, end);
+    }
+    for (std::thread &t : threads)
+        t.join();
+
+    report(clients);
+    return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * Prints the latency histograms and counters of the local esol, or of any
+ * other daemon that answers REQUEST_STATS.
+ *
+ * Usage: esolstat [-r] [socket path | -t host:port]
+ *
+ *   -r  Print the report exactly as it was sent, for scripts. See
+ *       stats/report.h for the format.
+ *   -t  Query an esod over TCP instead of a UNIX socket. The socket path of
+ *       esoca may be given to query esoca.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../config/esol_config.h"
+#include "../../global_config/message_config.h"
+#include "../../global_config/types.h"
+#include "../../socket/exception.h"
+#include "../../socket/tcp_socket.h"
+#include "../../socket/tcp_stream.h"
+#include "../../socket/uds_socket.h"
+#include "../../socket/uds_stream.h"
+
+/**
+ * Prints a "latency" record with the times converted to microseconds.
+ */
+void print_latency(std::istringstream &fields)
+{
+    std::string op, stage;
+    unsigned long long count, sum, p50, p90, p99, p999, max;
+    fields >> op >> stage >> count >> sum >> p50 >> p90 >> p99 >> p999 >> max;
+
+    std::string name = op + " " + stage;
+    printf("  %-28s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            name.c_str(), count, count ? sum / 1000.0 / count : 0.0,
+            p50 / 1000.0, p90 / 1000.0, p99 / 1000.0, p999 / 1000.0,
+            max / 1000.0);
+}
+
+/**
+ * Prints the report as tables.
+ */
+void print_report(const std::string &report)
+{
+    std::istringstream lines{report};
+    std::string section;
+
+    for (std::string line; std::getline(lines, line); )
+    {
+        std::istringstream fields{line};
+        std::string kind;
+        fields >> kind;
+
+        // Print a heading whenever the record type changes.
+        if (kind != section && (kind == "counter" || kind == "request"
+                    || kind == "destination"
+                    || (kind == "latency" && section == "counter")))
+        {
+            section = kind;
+            if (kind == "counter")
+                printf("\n%-30s %10s\n", "counter", "value");
+            else if (kind == "destination")
+                printf("\n%-30s %10s %10s %10s\n", "destination", "sent",
+                        "failed", "backlog");
+            else
+                printf("\n%-30s %10s %10s %10s %10s %10s %10s %10s\n",
+                        "latency (us)", "count", "mean", "p50", "p90", "p99",
+                        "p99.9", "max");
+        }
+
+        if (kind.size() > 6 && kind.compare(kind.size() - 6, 6, "_stats") == 0)
+        {
+            section.clear();
+            printf("%s", kind.substr(0, kind.size() - 6).c_str());
+        }
+        else if (kind == "uptime_s")
+        {
+            std::string uptime;
+            fields >> uptime;
+            printf(" up %ss\n", uptime.c_str());
+        }
+        else if (kind == "counter")
+        {
+            std::string name, value;
+            fields >> name >> value;
+            printf("  %-28s %10s\n", name.c_str(), value.c_str());
+        }
+        else if (kind == "request")
+        {
+            std::string op, count, denied;
+            fields >> op >> count >> denied;
+            printf("%s: %s requests, %s denied\n", op.c_str(), count.c_str(),
+                    denied.c_str());
+        }
+        else if (kind == "latency")
+        {
+            print_latency(fields);
+        }
+        else if (kind == "destination")
+        {
+            std::string name, sent, failed, backlog;
+            fields >> name >> sent >> failed >> backlog;
+            printf("  %-28s %10s %10s %10s\n", name.c_str(), sent.c_str(),
+                    failed.c_str(), backlog.c_str());
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bool raw = false;
+    std::string path{ESOL_SOCKET_PATH};
+    std::string host;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-r") == 0)
+            raw = true;
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            host = argv[++i];
+        else
+            path = argv[i];
+    }
+
+    uchar_vec reply;
+    try
+    {
+        if (host.empty())
+        {
+            UDS_Socket uds_socket{path};
+            UDS_Stream uds_stream = uds_socket.connect();
+            uds_stream.send(REQUEST_STATS);
+            reply = uds_stream.recv();
+        }
+        else
+        {
+            size_t colon = host.rfind(':');
+            if (colon == std::string::npos)
+            {
+                fprintf(stderr, "esolstat: -t takes host:port\n");
+                return 1;
+            }
+
+            TCP_Socket tcp_socket;
+            TCP_Stream tcp_stream = tcp_socket.connect(host.substr(0, colon),
+                    host.substr(colon + 1));
+            tcp_stream.send(REQUEST_STATS);
+            reply = tcp_stream.recv();
+        }
+    }
+    catch (const connect_exception &e)
+    {
+        fprintf(stderr, "esolstat: cannot connect to %s\n",
+                host.empty() ? path.c_str() : host.c_str());
+        return 1;
+    }
+
+    // Every report starts with "<daemon>_stats 1".
+    std::string report = to_string(reply);
+    size_t first_space = report.find(' ');
+    if (first_space == std::string::npos || first_space < 6
+            || report.compare(first_space - 6, 7, "_stats ") != 0)
+    {
+        fprintf(stderr, "esolstat: unexpected reply\n");
+        return 1;
+    }
+
+    if (raw)
+        fputs(report.c_str(), stdout);
+    else
+        print_report(report);
+
+    return 0;
+}
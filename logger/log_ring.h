@@ -0,0 +1,127 @@
+#ifndef ESO_LOGGER_LOG_RING
+#define ESO_LOGGER_LOG_RING
+
+#include <atomic>
+#include <cstring>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+ * A single-producer, single-consumer byte ring holding formatted log lines.
+ *
+ * Each logging thread owns one ring and is its only producer. The logger's
+ * writer is the only consumer. Lines are appended whole, so the consumer can
+ * write out whatever is between head and tail without any framing. head and
+ * tail only ever increase; they are reduced modulo the capacity when indexing.
+ */
+class LogRing
+{
+public:
+    // capacity must be a power of two.
+    LogRing(size_t capacity);
+    ~LogRing();
+    // Appends prefix, msg and a newline as one line. Returns false, without
+    // writing anything, if there is not enough room.
+    bool push(const char *prefix, size_t prefix_len, const char *msg,
+            size_t msg_len);
+    // Bytes waiting to be written.
+    size_t used() const;
+    size_t capacity() const;
+    // Writes everything between head and tail to fd. Only the consumer may
+    // call this.
+    void drain(int fd);
+
+    // Set once the owning thread has exited. The ring is freed once drained.
+    std::atomic<bool> closed;
+    // Lines that did not fit. Written by the producer, read by the consumer.
+    std::atomic<unsigned long> dropped;
+private:
+    // Copies len bytes to position pos, wrapping around the end.
+    void copy_in(size_t pos, const char *src, size_t len);
+
+    char *_buf;
+    size_t _capacity;
+    std::atomic<size_t> _head;
+    std::atomic<size_t> _tail;
+};
+
+LogRing::LogRing(size_t capacity)
+    : closed{false}, dropped{0}, _buf{new char[capacity]},
+    _capacity{capacity}, _head{0}, _tail{0}
+{
+
+}
+
+LogRing::~LogRing()
+{
+    delete [] _buf;
+}
+
+void LogRing::copy_in(size_t pos, const char *src, size_t len)
+{
+    size_t off = pos & (_capacity - 1);
+    size_t first = len < _capacity - off ? len : _capacity - off;
+
+    memcpy(_buf + off, src, first);
+    memcpy(_buf, src + first, len - first);
+}
+
+bool LogRing::push(const char *prefix, size_t prefix_len, const char *msg,
+        size_t msg_len)
+{
+    size_t len = prefix_len + msg_len + 1;
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    size_t head = _head.load(std::memory_order_acquire);
+
+    if (len > _capacity - (tail - head))
+        return false;
+
+    copy_in(tail, prefix, prefix_len);
+    copy_in(tail + prefix_len, msg, msg_len);
+    copy_in(tail + prefix_len + msg_len, "\n", 1);
+
+    // Publish the whole line at once.
+    _tail.store(tail + len, std::memory_order_release);
+    return true;
+}
+
+size_t LogRing::used() const
+{
+    return _tail.load(std::memory_order_acquire)
+        - _head.load(std::memory_order_acquire);
+}
+
+size_t LogRing::capacity() const
+{
+    return _capacity;
+}
+
+void LogRing::drain(int fd)
+{
+    size_t head = _head.load(std::memory_order_relaxed);
+    size_t tail = _tail.load(std::memory_order_acquire);
+
+    while (head != tail)
+    {
+        size_t off = head & (_capacity - 1);
+        size_t len = tail - head;
+        size_t first = len < _capacity - off ? len : _capacity - off;
+
+        // Write both halves of a wrapped region with one call.
+        struct iovec iov[2];
+        iov[0].iov_base = _buf + off;
+        iov[0].iov_len = first;
+        iov[1].iov_base = _buf;
+        iov[1].iov_len = len - first;
+
+        ssize_t n = fd < 0 ? len : writev(fd, iov, 2);
+        // Give up on errors rather than spin; the lines are lost either way.
+        if (n <= 0)
+            n = len;
+
+        head += n;
+        _head.store(head, std::memory_order_release);
+    }
+}
+
+#endif
@@ -1,62 +1,538 @@
 #ifndef ESO_LOGGER_LOGGER
 #define ESO_LOGGER_LOGGER
 
-#include <iostream>
-#include <fstream> 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <fcntl.h>
+#include <mutex>
+#include <pthread.h>
 #include <string>
+#include <sys/uio.h>
 #include <time.h>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
+
+#include "log_ring.h"
+#include "../global_config/paths.h"
 #include "../global_config/types.h"
 
 enum class LogLevel {Fatal, Error, Warning, Info, Debug, Debug1};
 
+/*
+ * The most verbose level that is compiled in at all, as the integer value of
+ * a LogLevel (0 = Fatal ... 5 = Debug1). ESO_LOG calls above it are removed by
+ * the compiler, e.g. build with -DESO_LOG_COMPILED_LEVEL=3 to drop every
+ * Debug message from a release binary.
+ */
+#ifndef ESO_LOG_COMPILED_LEVEL
+#define ESO_LOG_COMPILED_LEVEL 5
+#endif
+
+/*
+ * Logs a message built from the remaining arguments at the given level.
+ *
+ *   ESO_LOG(LogLevel::Debug, "esol: request from ", user, " for ", set_name);
+ *
+ * The arguments are only evaluated and formatted if the level passes both the
+ * compiled-in and the runtime threshold, so a filtered call costs one branch.
+ */
+#define ESO_LOG(level, ...) \
+    do \
+    { \
+        if (static_cast<int>(level) <= ESO_LOG_COMPILED_LEVEL \
+                && Logger::enabled(level)) \
+            Logger::log(log_format(__VA_ARGS__), level); \
+    } while (0)
+
 /* Class for logging */
 class Logger
 {
 public:
-    static void log(std::string msg, LogLevel level = LogLevel::Info);
-    static void log(uchar_vec msg, LogLevel level = LogLevel::Info);
+    static void log(const std::string &msg, LogLevel level = LogLevel::Info);
+    static void log(const uchar_vec &msg, LogLevel level = LogLevel::Info);
+    // Messages more verbose than level are discarded. Defaults to Debug1,
+    // i.e. everything is logged.
+    static void set_level(LogLevel level);
+    static LogLevel get_level();
+    // Returns true if messages at level are currently logged.
+    static bool enabled(LogLevel level)
+    {
+        return static_cast<int>(level)
+            <= _level.load(std::memory_order_relaxed);
+    }
+    // Writes out every buffered message before returning.
+    static void flush();
+    // Sets the file messages are written to. Messages already logged are
+    // written to the previous file first.
+    static void set_path(const std::string &path);
 
-private: 
+private:
     Logger();
     ~Logger();
+
+    // The runtime threshold as the integer value of a LogLevel.
+    static std::atomic<int> _level;
 };
 
+std::atomic<int> Logger::_level{static_cast<int>(LogLevel::Debug1)};
+
+/*
+ * Appends the text form of a value to a log message. Used by log_format.
+ */
+void log_append(std::string &out, const std::string &s)
+{
+    out += s;
+}
+
+void log_append(std::string &out, const char *s)
+{
+    out += s;
+}
+
+void log_append(std::string &out, char c)
+{
+    out += c;
+}
+
+void log_append(std::string &out, const uchar_vec &v)
+{
+    out.append(v.begin(), v.end());
+}
+
+template <class T>
+typename std::enable_if<std::is_arithmetic<T>::value>::type
+log_append(std::string &out, T v)
+{
+    out += std::to_string(v);
+}
+
+void log_format_into(std::string &)
+{
+
+}
+
+template <class T, class... Rest>
+void log_format_into(std::string &out, const T &first, const Rest &... rest)
+{
+    log_append(out, first);
+    log_format_into(out, rest...);
+}
+
+/*
+ * Concatenates the arguments into one message.
+ */
+template <class... Args>
+std::string log_format(const Args &... args)
+{
+    std::string out;
+    log_format_into(out, args...);
+    return out;
+}
+
+/*
+ * Asynchronous writer behind Logger.
+ *
+ * Every thread formats its lines into its own LogRing, which costs a memcpy
+ * and no system calls. A background thread drains the rings into a file
+ * descriptor that stays open, every FLUSH_INTERVAL or sooner when a ring
+ * fills up. Lines are complete when written, but lines from different threads
+ * may be written out of order; each carries its own timestamp.
+ *
+ * The writer is started by the first message, restarted in the child after
+ * fork() (the daemons fork twice while starting), and drained at exit().
+ * Lines that do not fit in a full ring are dropped and counted, except Fatal
+ * and Error lines which are written directly.
+ */
+class LogWriter
+{
+public:
+    static LogWriter &instance();
+    void log(const std::string &msg, LogLevel level);
+    void flush();
+    void set_path(const std::string &path);
+private:
+    LogWriter();
+
+    // Returns the calling thread's ring, creating it on first use, or
+    // nullptr if the thread is exiting.
+    LogRing *thread_ring();
+    // Starts the writer thread if it is not running.
+    void ensure_started();
+    // Drains every ring. The caller must hold _mutex.
+    void drain_locked();
+    // Writes one line directly, bypassing the rings.
+    void write_direct(const char *prefix, size_t prefix_len,
+            const std::string &msg);
+    // Opens _path. The caller must hold _mutex.
+    void open_locked();
+
+    static void *run(void *arg);
+    static void at_exit();
+    static void before_fork();
+    static void after_fork_parent();
+    static void after_fork_child();
+
+    // Per-thread ring size.
+    static const size_t RING_SIZE = 256 * 1024;
+    // How often the rings are drained when nothing wakes the writer.
+    static constexpr std::chrono::milliseconds FLUSH_INTERVAL{100};
+
+    enum class State {Idle, Running, Stopped};
+
+    // Guards _rings, _fd and _path, and serializes draining.
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::vector<LogRing *> _rings;
+    std::atomic<State> _state;
+    // Set to wake the writer before FLUSH_INTERVAL has passed.
+    std::atomic<bool> _wake;
+    bool _stop;
+    pthread_t _thread;
+    int _fd;
+    std::string _path;
+};
+
+constexpr std::chrono::milliseconds LogWriter::FLUSH_INTERVAL;
+
+/*
+ * The formatted time prefix, refreshed at most once per second per thread.
+ */
+struct LogTimestamp
+{
+    time_t sec = -1;
+    char buf[80];
+    size_t len = 0;
+};
+
+static thread_local LogTimestamp log_timestamp;
+
+// The calling thread's ring. Plain pointers so that they remain usable while
+// thread_local destructors run.
+static thread_local LogRing *log_thread_ring = nullptr;
+static thread_local bool log_thread_exiting = false;
+
+/*
+ * Marks the thread's ring as closed when the thread exits, so that the writer
+ * frees it once it is drained.
+ */
+struct LogRingOwner
+{
+    ~LogRingOwner()
+    {
+        log_thread_exiting = true;
+        if (log_thread_ring)
+            log_thread_ring->closed.store(true, std::memory_order_release);
+        log_thread_ring = nullptr;
+    }
+};
+
+static thread_local LogRingOwner log_ring_owner;
+
+/*
+ * Returns the time prefix for a line logged now.
+ */
+const LogTimestamp &log_time()
+{
+    time_t now = time(nullptr);
+    if (now != log_timestamp.sec)
+    {
+        struct tm timeinfo;
+        localtime_r(&now, &timeinfo);
+        log_timestamp.len = strftime(log_timestamp.buf,
+                sizeof log_timestamp.buf, "%F %r:\t", &timeinfo);
+        log_timestamp.sec = now;
+    }
+    return log_timestamp;
+}
+
+LogWriter &LogWriter::instance()
+{
+    // Never destroyed, so that messages logged by other destructors during
+    // exit are still written.
+    static LogWriter *writer = new LogWriter;
+    return *writer;
+}
 
-// TODO generalize output path and add logging level
 // TODO integrity checks
-/**
- * Logs the message to the output location.
+LogWriter::LogWriter()
+    : _state{State::Idle}, _wake{false}, _stop{false}, _fd{-1},
+    _path{eso_path("default.log")}
+{
+    pthread_atfork(&LogWriter::before_fork, &LogWriter::after_fork_parent,
+            &LogWriter::after_fork_child);
+    std::atexit(&LogWriter::at_exit);
+}
+
+void LogWriter::open_locked()
+{
+    if (_fd >= 0)
+        close(_fd);
+    _fd = open(_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+            0644);
+}
+
+LogRing *LogWriter::thread_ring()
+{
+    if (log_thread_ring || log_thread_exiting)
+        return log_thread_ring;
+
+    // Touch the owner so that its destructor runs when this thread exits.
+    (void) &log_ring_owner;
+
+    log_thread_ring = new LogRing(RING_SIZE);
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    _rings.push_back(log_thread_ring);
+    return log_thread_ring;
+}
+
+void LogWriter::ensure_started()
+{
+    if (_state.load(std::memory_order_acquire) != State::Idle)
+        return;
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (_state.load() != State::Idle)
+        return;
+
+    if (_fd < 0)
+        open_locked();
+
+    _stop = false;
+    if (pthread_create(&_thread, nullptr, &LogWriter::run, this) == 0)
+        _state.store(State::Running, std::memory_order_release);
+    else
+        _state.store(State::Stopped, std::memory_order_release);
+}
+
+void LogWriter::write_direct(const char *prefix, size_t prefix_len,
+        const std::string &msg)
+{
+    struct iovec iov[3];
+    iov[0].iov_base = (void *) prefix;
+    iov[0].iov_len = prefix_len;
+    iov[1].iov_base = (void *) msg.data();
+    iov[1].iov_len = msg.size();
+    iov[2].iov_base = (void *) "\n";
+    iov[2].iov_len = 1;
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (_fd < 0)
+        open_locked();
+    if (_fd >= 0)
+        writev(_fd, iov, 3);
+}
+
+void LogWriter::log(const std::string &msg, LogLevel level)
+{
+    ensure_started();
+
+    const LogTimestamp &ts = log_time();
+    LogRing *ring = _state.load(std::memory_order_acquire) == State::Running
+        ? thread_ring() : nullptr;
+
+    // Without a writer thread or ring, write synchronously.
+    if (!ring)
+    {
+        write_direct(ts.buf, ts.len, msg);
+        return;
+    }
+
+    if (!ring->push(ts.buf, ts.len, msg.data(), msg.size()))
+    {
+        if (level == LogLevel::Fatal || level == LogLevel::Error
+                || msg.size() + ts.len >= ring->capacity())
+            write_direct(ts.buf, ts.len, msg);
+        else
+            ring->dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (level == LogLevel::Fatal)
+        flush();
+    // Wake the writer early rather than let the ring fill.
+    else if (ring->used() > ring->capacity() / 2 && !_wake.exchange(true))
+    {
+        std::lock_guard<std::mutex> lock{_mutex};
+        _cv.notify_one();
+    }
+}
+
+void LogWriter::drain_locked()
+{
+    for (auto it = _rings.begin(); it != _rings.end(); )
+    {
+        LogRing *ring = *it;
+        // Read closed before draining so no line pushed before the thread
+        // exited is missed.
+        bool closed = ring->closed.load(std::memory_order_acquire);
+
+        ring->drain(_fd);
+
+        unsigned long dropped = ring->dropped.exchange(0);
+        if (dropped)
+        {
+            std::string msg{"Logger dropped "};
+            msg += std::to_string(dropped) + " messages.\n";
+            if (_fd >= 0)
+                write(_fd, msg.data(), msg.size());
+        }
+
+        if (closed)
+        {
+            delete ring;
+            it = _rings.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+void LogWriter::flush()
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    drain_locked();
+}
+
+void LogWriter::set_path(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    drain_locked();
+    _path = path;
+    open_locked();
+}
+
+void *LogWriter::run(void *arg)
+{
+    LogWriter *writer = (LogWriter *) arg;
+
+    std::unique_lock<std::mutex> lock{writer->_mutex};
+    while (!writer->_stop)
+    {
+        writer->_cv.wait_for(lock, FLUSH_INTERVAL,
+                [writer] { return writer->_wake.load() || writer->_stop; });
+        writer->_wake = false;
+        writer->drain_locked();
+    }
+
+    return nullptr;
+}
+
+/*
+ * Stops the writer thread and writes out everything it had not written.
+ * Messages logged afterwards are written synchronously.
+ */
+void LogWriter::at_exit()
+{
+    LogWriter &writer = instance();
+
+    if (writer._state.load() == State::Running)
+    {
+        {
+            std::lock_guard<std::mutex> lock{writer._mutex};
+            writer._stop = true;
+            writer._cv.notify_one();
+        }
+        pthread_join(writer._thread, nullptr);
+    }
+
+    writer._state.store(State::Stopped);
+    writer.flush();
+}
+
+/*
+ * Drain before forking so the child does not inherit lines the parent is
+ * about to write, and hold the lock so the child gets a consistent copy.
  */
-void Logger::log(std::string msg, LogLevel level)
+void LogWriter::before_fork()
 {
-    // The logger output location.
-    // TODO Configure.
-    std::string log_loc{"/home/jac/Desktop/eso/default.log"};
+    LogWriter &writer = instance();
+    writer._mutex.lock();
+    writer.drain_locked();
+}
 
-    std::ofstream out;
-    out.open(log_loc, 
-            std::ios_base::app | std::ios_base::in | std::ios_base::out);
+void LogWriter::after_fork_parent()
+{
+    instance()._mutex.unlock();
+}
 
-    // Formatted time
-    time_t rawtime;
-    struct tm * timeinfo;
-    time(&rawtime);
-    timeinfo = localtime(&rawtime);
-    char time_buffer [80];
-    strftime (time_buffer, 80, "%F %r:\t", timeinfo);
+/*
+ * Only the forking thread exists in the child. The other rings belong to the
+ * parent's threads, so they are freed, and a new writer is started by the
+ * next message.
+ */
+void LogWriter::after_fork_child()
+{
+    LogWriter &writer = instance();
 
-    out << time_buffer 
-        << msg << std::endl;
-    out.close();
+    for (auto it = writer._rings.begin(); it != writer._rings.end(); )
+    {
+        if (*it == log_thread_ring)
+            ++it;
+        else
+        {
+            delete *it;
+            it = writer._rings.erase(it);
+        }
+    }
+
+    if (writer._state.load() == State::Running)
+        writer._state.store(State::Idle);
+    writer._mutex.unlock();
+}
+
+/**
+ * Logs the message to the output location.
+ */
+void Logger::log(const std::string &msg, LogLevel level)
+{
+    if (!enabled(level))
+        return;
+
+    LogWriter::instance().log(msg, level);
 }
 
 /**
  * Delegates to another logging method.
  * Added to support logging char_vec's.
  */
-void Logger::log(uchar_vec msg, LogLevel level)
+void Logger::log(const uchar_vec &msg, LogLevel level)
 {
+    if (!enabled(level))
+        return;
+
     Logger::log(to_string(msg), level);
 }
 
+/**
+ * Sets the runtime threshold.
+ */
+void Logger::set_level(LogLevel level)
+{
+    _level.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+LogLevel Logger::get_level()
+{
+    return static_cast<LogLevel>(_level.load(std::memory_order_relaxed));
+}
+
+/**
+ * Blocks until every message logged so far has been written.
+ */
+void Logger::flush()
+{
+    LogWriter::instance().flush();
+}
+
+/**
+ * Changes the log file.
+ */
+void Logger::set_path(const std::string &path)
+{
+    LogWriter::instance().set_path(path);
+}
+
 #endif
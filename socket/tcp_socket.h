@@ -7,10 +7,13 @@
 #include <netdb.h>
 #include <string>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
 
+#include "exception.h"
 #include "tcp_stream.h"
 #include "../logger/logger.h"
+#include "../util/probes.h"
 
 /*
  * Abstraction over a TCP socket.
@@ -23,17 +26,22 @@ public:
     int listen(std::string port);
     // Accept an incoming connection
     TCP_Stream accept();
-    // Connect to somewhere.
-    TCP_Stream connect(std::string hostname, std::string port);
+    // Connect to somewhere. Throws connect_exception on failure. The stream
+    // owns the connection, and may outlive the socket. If timeout_ms is not
+    // 0, connecting fails after that long, and the stream is given it as
+    // with TCP_Stream::set_timeout().
+    TCP_Stream connect(std::string hostname, std::string port,
+            int timeout_ms = 0);
 private:
-    int socket_fd;
+    int socket_fd = -1;
     struct sockaddr_in servaddr;  //  Socket address structure.
     const int MAX_QUEUE_SIZE = 5;
 };
 
 TCP_Socket::~TCP_Socket()
 {
-    close(socket_fd);
+    if (socket_fd >= 0)
+        close(socket_fd);
 }
 
 /*
@@ -64,6 +72,7 @@ int TCP_Socket::listen(std::string port)
         Logger::log("Error binding socket in TCP_Socket::listen().",
                 LogLevel::Error);
         close(socket_fd);
+        socket_fd = -1;
         return 1;
     }
 
@@ -72,6 +81,7 @@ int TCP_Socket::listen(std::string port)
         Logger::log("Error listening in TCP_Socket::listen()",
                 LogLevel::Error);
         close(socket_fd);
+        socket_fd = -1;
         return 1;
     }
  
@@ -85,7 +95,9 @@ TCP_Stream TCP_Socket::accept()
 {
     // TODO error checking
 
+    ESO_PROBE1(tcp_accept_start, socket_fd);
     int conn_fd = ::accept(socket_fd, nullptr, nullptr);
+    ESO_PROBE1(tcp_accept_done, conn_fd);
 
     if (conn_fd == -1)
     {
@@ -99,12 +111,16 @@ TCP_Stream TCP_Socket::accept()
 
 /*
  * Connects to the port at the given hostname.
+ *
+ * @throws connect_exception if the host cannot be reached, so that callers
+ * trying several hosts can move on to the next one.
  * 
  * TODO Current only handles IPv4. To use IPv6, update instances of AF_INET and 
  * update serv_addr.sin_family to the appropriate family when attempting 
  * to connect.
  */
-TCP_Stream TCP_Socket::connect(std::string hostname, std::string port)
+TCP_Stream TCP_Socket::connect(std::string hostname, std::string port,
+        int timeout_ms)
 {
     // Where we want to connect to
     struct sockaddr_in serv_addr; 
@@ -112,15 +128,30 @@ TCP_Stream TCP_Socket::connect(std::string hostname, std::string port)
     struct addrinfo hints, *p; 
     struct addrinfo *servinfo; 
 
+    // The fd is -1 in tcp_connect_done if the connection failed.
+    ESO_PROBE2(tcp_connect_start, hostname.c_str(), port.c_str());
+
     // Create a socket.
     if ((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
     {
         Logger::log("Could not create socket in TCP_Socket::connect().",
                 LogLevel::Error);
-
-        exit(1);
+        ESO_PROBE1(tcp_connect_done, -1);
+        throw connect_exception();
     } 
 
+    // On Linux the send timeout also bounds connect().
+    if (timeout_ms > 0)
+    {
+        struct timeval timeout;
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_usec = (timeout_ms % 1000) * 1000;
+        setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                sizeof timeout);
+        setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                sizeof timeout);
+    }
+
     // Fill in server's data structure.
     memset(&serv_addr, 0, sizeof(serv_addr)); 
     serv_addr.sin_family = AF_INET;
@@ -133,11 +164,12 @@ TCP_Stream TCP_Socket::connect(std::string hostname, std::string port)
     hints.ai_flags    = AI_PASSIVE; 
 
     // Resolve the hostname. 
-    if ((getaddrinfo(hostname.c_str(), nullptr, &hints, &servinfo)) == -1)
+    if ((getaddrinfo(hostname.c_str(), nullptr, &hints, &servinfo)) != 0)
     {
         Logger::log("getaddrinfo() error in TCP_Socket::connect()", 
                 LogLevel::Error);
-        exit(1);
+        ESO_PROBE1(tcp_connect_done, -1);
+        throw connect_exception();
     }       
 
     bool connected = false;
@@ -178,10 +210,16 @@ TCP_Stream TCP_Socket::connect(std::string hostname, std::string port)
 
     freeaddrinfo(servinfo);     
 
-    if (connected)
-        return TCP_Stream{socket_fd}; 
-    else
-        exit(1);
+    if (!connected)
+    {
+        ESO_PROBE1(tcp_connect_done, -1);
+        throw connect_exception();
+    }
+
+    ESO_PROBE1(tcp_connect_done, socket_fd);
+    int con_fd = socket_fd;
+    socket_fd = -1;
+    return TCP_Stream{con_fd};
 }
 
 #endif
@@ -1,11 +1,21 @@
 #ifndef ESO_SOCKET_TCP_STREAM
 #define ESO_SOCKET_TCP_STREAM
 
+#include <arpa/inet.h>
+#include <cerrno>
 #include <cstring>
+#include <netinet/in.h>
 #include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <utility>
 
+#include "../crypto/memory.h"
 #include "../global_config/message_config.h"
 #include "../global_config/types.h"
+#include "../logger/logger.h"
+#include "../util/probes.h"
 
 /*
  * Wrapper for a TCP stream.
@@ -14,19 +24,48 @@ class TCP_Stream
 {
 public:
     TCP_Stream(int con_fd); 
+    // Takes over other's connection, e.g. to hand it to another thread.
+    TCP_Stream(TCP_Stream &&other);
     ~TCP_Stream();
     // Send data.
-    void send(uchar_vec msg) const;
+    void send(const uchar_vec &msg) const;
     void send(std::string msg) const;
+    // Returns a writable region of up to max_len bytes for the next message,
+    // with room left in front of it for the message header.
+    uchar_span reserve_frame(size_t max_len);
+    // Sends the first len bytes of the reserved region as one message.
+    void commit_frame(size_t len);
+    // Receive a message. Returns an empty message, and sets failed(), if the
+    // peer has gone away or the receive timed out.
     uchar_vec recv();
+    // Returns true if a send or receive on this stream has failed.
+    bool failed() const;
+    // Makes a send or receive that blocks for longer than ms fail, for
+    // connections kept open to a peer that may hang.
+    void set_timeout(int ms);
+    // Returns the peer's IPv4 address, e.g. "127.0.0.1", or "" if it is not
+    // connected.
+    std::string peer_address() const;
 private:
     int _con_fd;
+    // Set when a send or receive fails, e.g. because the peer has gone away.
+    mutable bool _failed = false;
+    // Reads what has arrived into msg_buffer. Returns false on error or
+    // end of stream.
+    bool fill(unsigned char *buf);
     // Max length of data we will read in at a time.
     const int MAX_LENGTH = 1024;
     // Size of the message header. Contains the size of the following message.
     int MSG_HEADER_SIZE = 2;
     // Buffer holding partially constructed messages.
     uchar_vec msg_buffer{};
+    // Largest message the header can describe.
+    size_t MAX_MSG_SIZE = 0xFFFF;
+    // Outgoing message built in place by reserve_frame(). Kept between
+    // messages so that its memory is reused.
+    uchar_vec _frame{};
+    // Writes the whole buffer to the socket.
+    void send_all(const unsigned char *buf, size_t len) const;
 };
 
 TCP_Stream::TCP_Stream(int con_fd) : _con_fd{con_fd}
@@ -34,32 +73,85 @@ TCP_Stream::TCP_Stream(int con_fd) : _con_fd{con_fd}
 
 }
 
+TCP_Stream::TCP_Stream(TCP_Stream &&other)
+    : _con_fd{other._con_fd}, _failed{other._failed},
+    msg_buffer(std::move(other.msg_buffer)), _frame(std::move(other._frame))
+{
+    other._con_fd = -1;
+}
+
 TCP_Stream::~TCP_Stream()
 {
-    close(_con_fd);
+    if (_con_fd >= 0)
+        close(_con_fd);
 }
 
 /**
  * Send data. The first two chars are the message size.
  */
-void TCP_Stream::send(uchar_vec msg) const
+void TCP_Stream::send(const uchar_vec &msg) const
 {
-    // Position in buffer.
-    unsigned char *pos = &msg[0];
     // Length of data to send
     size_t len = msg.size();
-    // Number of characters sent.
-    ssize_t n;
+    if (len > MAX_MSG_SIZE)
+    {
+        std::string error_msg{"Message too large in TCP_Stream::send() "};
+        error_msg += std::to_string(len);
+        Logger::log(error_msg, LogLevel::Error);
+        _failed = true;
+        return;
+    }
+
+    ESO_PROBE3(tcp_send_start, _con_fd, msg.data(), len);
 
     unsigned char msg_header[MSG_HEADER_SIZE];
     msg_header[0] = len >> 8;   // Upper 8 bits.
     msg_header[1] = len & 0xFF; // Lower 8 bits.
-    ::send(_con_fd, msg_header, MSG_HEADER_SIZE, 0);
+
+    // Send the header and message together, without copying them into one
+    // buffer.
+    struct iovec iov[2];
+    iov[0].iov_base = msg_header;
+    iov[0].iov_len = MSG_HEADER_SIZE;
+    iov[1].iov_base = (void *) msg.data();
+    iov[1].iov_len = len;
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof hdr);
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = 2;
+
+    // A peer that has gone away is reported by failed() rather than by
+    // SIGPIPE, which would end the daemon.
+    ssize_t n = ::sendmsg(_con_fd, &hdr, MSG_NOSIGNAL);
+    if (n < 0)
+        n = 0;
+
+    // Ensure that the rest of the data is sent.
+    size_t sent = n;
+    if (sent < (size_t) MSG_HEADER_SIZE)
+    {
+        send_all(msg_header + sent, MSG_HEADER_SIZE - sent);
+        sent = MSG_HEADER_SIZE;
+    }
+    sent -= MSG_HEADER_SIZE;
+    send_all(msg.data() + sent, len - sent);
+
+    ESO_PROBE2(tcp_send_done, _con_fd, len);
+}
+
+/**
+ * Sends len bytes of buf, retrying partial sends.
+ */
+void TCP_Stream::send_all(const unsigned char *buf, size_t len) const
+{
+    // Number of characters sent.
+    ssize_t n = 0;
 
     // Ensure that all data is sent.
-    while (len > 0 && (n = ::send(_con_fd, pos, len, 0)) > 0)
+    while (len > 0 && (n = ::send(_con_fd, buf, len, MSG_NOSIGNAL)) > 0)
     {
-        pos += n;
+        buf += n;
         len -= (size_t) n;
     }
     if (len > 0 || n < 0)
@@ -67,9 +159,93 @@ void TCP_Stream::send(uchar_vec msg) const
         std::string error_msg{"Something went wrong in TCP_Stream::send() "};
         error_msg += std::to_string(len);
         Logger::log(error_msg, LogLevel::Error);
+        _failed = true;
     }
 }
 
+bool TCP_Stream::failed() const
+{
+    return _failed;
+}
+
+void TCP_Stream::set_timeout(int ms)
+{
+    struct timeval timeout;
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_usec = (ms % 1000) * 1000;
+    setsockopt(_con_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    setsockopt(_con_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+}
+
+std::string TCP_Stream::peer_address() const
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof addr;
+    char text[INET_ADDRSTRLEN];
+    if (getpeername(_con_fd, (struct sockaddr *) &addr, &len) != 0
+            || addr.sin_family != AF_INET
+            || !inet_ntop(AF_INET, &addr.sin_addr, text, sizeof text))
+        return std::string{};
+    return std::string{text};
+}
+
+bool TCP_Stream::fill(unsigned char *buf)
+{
+    ssize_t len;
+    do
+        len = ::recv(_con_fd, buf, MAX_LENGTH, 0);
+    while (len < 0 && errno == EINTR);
+
+    if (len <= 0)
+    {
+        std::string error_msg{"Something went wrong in TCP_Stream::recv() "};
+        error_msg += std::to_string(len);
+        Logger::log(error_msg, LogLevel::Error);
+        _failed = true;
+        return false;
+    }
+    msg_buffer.insert(msg_buffer.end(), buf, buf + len);
+    return true;
+}
+
+/**
+ * Returns a region that results (ciphertext, MACs, signatures) can be written
+ * into directly. The region is smaller than max_len if max_len exceeds the
+ * largest message. It stays valid until commit_frame() is called.
+ */
+uchar_span TCP_Stream::reserve_frame(size_t max_len)
+{
+    if (max_len > MAX_MSG_SIZE)
+        max_len = MAX_MSG_SIZE;
+
+    _frame.resize(MSG_HEADER_SIZE + max_len);
+    return uchar_span{&_frame[MSG_HEADER_SIZE], max_len};
+}
+
+/**
+ * Fills in the header of the reserved frame and sends the header and the
+ * first len bytes of the region in one buffer. The region is wiped afterwards
+ * since it may have held plaintext.
+ */
+void TCP_Stream::commit_frame(size_t len)
+{
+    if (_frame.size() < MSG_HEADER_SIZE + len)
+    {
+        Logger::log("TCP_Stream::commit_frame() without a large enough frame",
+                LogLevel::Error);
+        len = 0;
+        _frame.resize(MSG_HEADER_SIZE);
+    }
+
+    _frame[0] = len >> 8;   // Upper 8 bits.
+    _frame[1] = len & 0xFF; // Lower 8 bits.
+    ESO_PROBE3(tcp_send_start, _con_fd, &_frame[MSG_HEADER_SIZE], len);
+    send_all(&_frame[0], MSG_HEADER_SIZE + len);
+    ESO_PROBE2(tcp_send_done, _con_fd, len);
+
+    secure_memset(&_frame[0], 0, _frame.size());
+}
+
 /**
  * Included for backwards compatibility. 
  * Delegates to send(uchar_vec).
@@ -85,45 +261,24 @@ void TCP_Stream::send(std::string msg) const
 uchar_vec TCP_Stream::recv()
 {
     unsigned char recv_msg[MAX_LENGTH];
-    // The total message size and the amount we have left to read.
-    int total, remaining;
+    // The total message size.
+    int total;
+
+    ESO_PROBE1(tcp_recv_start, _con_fd);
 
     // We need to recv() until we have MSG_HEADER_SIZE bytes.
     while (msg_buffer.size() < MSG_HEADER_SIZE)
-    {
-        // Read the size of the message.
-        if(int len = ::recv(_con_fd, recv_msg, MAX_LENGTH, 0))
-        {
-            msg_buffer.insert(msg_buffer.end(), &recv_msg[0], &recv_msg[len]);
-       }
-        else
-        {
-            std::string error_msg{"Something went wrong in TCP_Stream::recv() "};
-            error_msg += std::to_string(len);
-            Logger::log(error_msg, LogLevel::Error);
-        }
-    }
+        if (!fill(recv_msg))
+            return uchar_vec{};
 
     // Compute the message size.
-    total = remaining = (msg_buffer[0] << 8) + msg_buffer[1];
+    total = (msg_buffer[0] << 8) + msg_buffer[1];
     msg_buffer = uchar_vec{msg_buffer.begin()+2, msg_buffer.end()};
-    remaining -= msg_buffer.size();
 
     // Read until we find a complete message.
-    while (remaining > 0)
-    {
-        if(int len = ::recv(_con_fd, recv_msg, MAX_LENGTH, 0))
-        {
-            msg_buffer.insert(msg_buffer.end(), &recv_msg[0], &recv_msg[len]);
-            remaining -= len;
-        }
-        else
-        {
-            std::string error_msg{"Something went wrong in TCP_Stream::recv() "};
-            error_msg += std::to_string(len);
-            Logger::log(error_msg, LogLevel::Error);
-        }
-    }
+    while (msg_buffer.size() < (size_t) total)
+        if (!fill(recv_msg))
+            return uchar_vec{};
 
     // Return message.
     uchar_vec ret_msg = uchar_vec{msg_buffer.begin(), msg_buffer.begin()+total};
@@ -131,6 +286,7 @@ uchar_vec TCP_Stream::recv()
     // Update message buffer to exclude return message.
     msg_buffer = uchar_vec{msg_buffer.begin()+total, msg_buffer.end()};
 
+    ESO_PROBE3(tcp_recv_done, _con_fd, ret_msg.data(), ret_msg.size());
     return ret_msg;
 }
 
@@ -1,15 +1,19 @@
 #ifndef ESO_SOCKET_UDS_STREAM
 #define ESO_SOCKET_UDS_STREAM
 
+#include <cstring>
 #include <string>
 #include <sys/socket.h>
 #include <sys/types.h> 
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <vector>
 
+#include "../crypto/memory.h"
 #include "../global_config/message_config.h"
 #include "../global_config/types.h"
 #include "../logger/logger.h"
+#include "../util/probes.h"
 
 /*
  * Wrapper for a Unix Domain socket stream.
@@ -20,8 +24,13 @@ public:
     UDS_Stream(int con_fd, sockaddr_un remote, int remote_len);
     ~UDS_Stream();
     // Send data.
-    void send(uchar_vec msg) const;
+    void send(const uchar_vec &msg) const;
     void send(std::string msg) const;
+    // Returns a writable region of up to max_len bytes for the next message,
+    // with room left in front of it for the message header.
+    uchar_span reserve_frame(size_t max_len);
+    // Sends the first len bytes of the reserved region as one message.
+    void commit_frame(size_t len);
     // Receive data.
     uchar_vec recv();
     // Set the user we are currenting corresponding with.
@@ -36,6 +45,13 @@ private:
     int MSG_HEADER_SIZE = 2;
     // Buffer holding partially constructed messages.
     uchar_vec msg_buffer{};
+    // Largest message the header can describe.
+    size_t MAX_MSG_SIZE = 0xFFFF;
+    // Outgoing message built in place by reserve_frame(). Kept between
+    // messages so that its memory is reused.
+    uchar_vec _frame{};
+    // Writes the whole buffer to the socket.
+    void send_all(const unsigned char *buf, size_t len) const;
     // The user we are corresponding with.
     std::string _user;
 };
@@ -55,24 +71,66 @@ UDS_Stream::~UDS_Stream()
  * Send data. Includes MSG_END to allow the receiver to distinguish between 
  * messages.
  */
-void UDS_Stream::send(uchar_vec msg) const
+void UDS_Stream::send(const uchar_vec &msg) const
 {
-    // Position in buffer.
-    unsigned char *pos = &msg[0];
     // Length of data to send
     size_t len = msg.size();
-    // Number of characters sent.
-    ssize_t n;
+    if (len > MAX_MSG_SIZE)
+    {
+        std::string error_msg{"Message too large in UDS_Stream::send() "};
+        error_msg += std::to_string(len);
+        Logger::log(error_msg, LogLevel::Error);
+        return;
+    }
+
+    ESO_PROBE3(uds_send_start, _con_fd, msg.data(), len);
 
     unsigned char msg_header[MSG_HEADER_SIZE];
     msg_header[0] = len >> 8;   // Upper 8 bits.
     msg_header[1] = len & 0xFF; // Lower 8 bits.
-    ::send(_con_fd, msg_header, MSG_HEADER_SIZE, 0);
+
+    // Send the header and message together, without copying them into one
+    // buffer.
+    struct iovec iov[2];
+    iov[0].iov_base = msg_header;
+    iov[0].iov_len = MSG_HEADER_SIZE;
+    iov[1].iov_base = (void *) msg.data();
+    iov[1].iov_len = len;
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof hdr);
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = 2;
+
+    ssize_t n = ::sendmsg(_con_fd, &hdr, 0);
+    if (n < 0)
+        n = 0;
+
+    // Ensure that the rest of the data is sent.
+    size_t sent = n;
+    if (sent < (size_t) MSG_HEADER_SIZE)
+    {
+        send_all(msg_header + sent, MSG_HEADER_SIZE - sent);
+        sent = MSG_HEADER_SIZE;
+    }
+    sent -= MSG_HEADER_SIZE;
+    send_all(msg.data() + sent, len - sent);
+
+    ESO_PROBE2(uds_send_done, _con_fd, len);
+}
+
+/**
+ * Sends len bytes of buf, retrying partial sends.
+ */
+void UDS_Stream::send_all(const unsigned char *buf, size_t len) const
+{
+    // Number of characters sent.
+    ssize_t n = 0;
 
     // Ensure that all data is sent.
-    while (len > 0 && (n = ::send(_con_fd, pos, len, 0)) > 0)
+    while (len > 0 && (n = ::send(_con_fd, buf, len, 0)) > 0)
     {
-        pos += n;
+        buf += n;
         len -= (size_t) n;
     }
     if (len > 0 || n < 0)
@@ -83,6 +141,44 @@ void UDS_Stream::send(uchar_vec msg) const
     }
 }
 
+/**
+ * Returns a region that results (ciphertext, MACs, signatures) can be written
+ * into directly. The region is smaller than max_len if max_len exceeds the
+ * largest message. It stays valid until commit_frame() is called.
+ */
+uchar_span UDS_Stream::reserve_frame(size_t max_len)
+{
+    if (max_len > MAX_MSG_SIZE)
+        max_len = MAX_MSG_SIZE;
+
+    _frame.resize(MSG_HEADER_SIZE + max_len);
+    return uchar_span{&_frame[MSG_HEADER_SIZE], max_len};
+}
+
+/**
+ * Fills in the header of the reserved frame and sends the header and the
+ * first len bytes of the region in one buffer. The region is wiped afterwards
+ * since it may have held plaintext.
+ */
+void UDS_Stream::commit_frame(size_t len)
+{
+    if (_frame.size() < MSG_HEADER_SIZE + len)
+    {
+        Logger::log("UDS_Stream::commit_frame() without a large enough frame",
+                LogLevel::Error);
+        len = 0;
+        _frame.resize(MSG_HEADER_SIZE);
+    }
+
+    _frame[0] = len >> 8;   // Upper 8 bits.
+    _frame[1] = len & 0xFF; // Lower 8 bits.
+    ESO_PROBE3(uds_send_start, _con_fd, &_frame[MSG_HEADER_SIZE], len);
+    send_all(&_frame[0], MSG_HEADER_SIZE + len);
+    ESO_PROBE2(uds_send_done, _con_fd, len);
+
+    secure_memset(&_frame[0], 0, _frame.size());
+}
+
 /**
  * Included for backwards compatibility.
  * Delegates to send(uchar_vec).
@@ -101,6 +197,8 @@ uchar_vec UDS_Stream::recv()
     // The total message size and the amount we have left to read.
     int total, remaining;
 
+    ESO_PROBE1(uds_recv_start, _con_fd);
+
     // We need to recv() until we have MSG_HEADER_SIZE bytes.
     while (msg_buffer.size() < MSG_HEADER_SIZE)
     {
@@ -144,6 +242,7 @@ uchar_vec UDS_Stream::recv()
     // Update message buffer to exclude return message.
     msg_buffer = uchar_vec{msg_buffer.begin()+total, msg_buffer.end()};
 
+    ESO_PROBE3(uds_recv_done, _con_fd, ret_msg.data(), ret_msg.size());
     return ret_msg;
 }
 
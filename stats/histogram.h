@@ -0,0 +1,171 @@
+#ifndef ESO_STATS_HISTOGRAM
+#define ESO_STATS_HISTOGRAM
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/*
+ * A latency histogram with HDR-style log-linear buckets.
+ *
+ * Values below SUB_BUCKETS get a bucket each. Above that every power of two
+ * is split into SUB_BUCKETS equal buckets, so a recorded value is known to
+ * within 1/SUB_BUCKETS (about 6%) at any magnitude. Values are in
+ * nanoseconds and anything above MAX_VALUE (about 68 seconds) is clamped.
+ *
+ * A Histogram has a single writer, the thread that owns it, so record() is a
+ * few relaxed loads and stores with no locked instructions. Any thread may
+ * read it through add_to(). Readers may see a record half applied, which only
+ * skews a snapshot by one sample.
+ */
+
+// Returns a monotonic timestamp in nanoseconds.
+uint64_t stats_now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * A point in time copy of one or more histograms.
+ */
+struct HistogramSnapshot
+{
+    HistogramSnapshot();
+    // Returns the value below which p percent of the samples fall, rounded up
+    // to the top of its bucket.
+    uint64_t percentile(double p) const;
+
+    std::vector<uint64_t> counts;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+class Histogram
+{
+public:
+    Histogram();
+    // Adds a sample. Only the owning thread may call this.
+    void record(uint64_t value);
+    // Adds this histogram's samples to snapshot.
+    void add_to(HistogramSnapshot &snapshot) const;
+
+    static const int SUB_BUCKET_BITS = 4;
+    static const uint64_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int MAX_BITS = 36;
+    static const uint64_t MAX_VALUE = (uint64_t{1} << MAX_BITS) - 1;
+    static const size_t NUM_BUCKETS =
+        (MAX_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    // Returns the bucket value falls in.
+    static size_t bucket(uint64_t value);
+    // Returns the largest value that falls in bucket b.
+    static uint64_t bucket_max(size_t b);
+private:
+    // Adds n to a counter that only this thread writes.
+    static void bump(std::atomic<uint64_t> &counter, uint64_t n);
+
+    std::atomic<uint64_t> _counts[NUM_BUCKETS];
+    std::atomic<uint64_t> _sum;
+    std::atomic<uint64_t> _max;
+};
+
+const int Histogram::SUB_BUCKET_BITS;
+const uint64_t Histogram::SUB_BUCKETS;
+const int Histogram::MAX_BITS;
+const uint64_t Histogram::MAX_VALUE;
+const size_t Histogram::NUM_BUCKETS;
+
+HistogramSnapshot::HistogramSnapshot()
+    : counts(Histogram::NUM_BUCKETS, 0), count{0}, sum{0}, max{0}
+{
+
+}
+
+uint64_t HistogramSnapshot::percentile(double p) const
+{
+    if (count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) std::ceil(p / 100.0 * count);
+    if (rank == 0)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (size_t b = 0; b < counts.size(); b++)
+    {
+        seen += counts[b];
+        if (seen >= rank)
+        {
+            uint64_t value = Histogram::bucket_max(b);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+Histogram::Histogram()
+    : _sum{0}, _max{0}
+{
+    for (size_t b = 0; b < NUM_BUCKETS; b++)
+        _counts[b].store(0, std::memory_order_relaxed);
+}
+
+size_t Histogram::bucket(uint64_t value)
+{
+    if (value > MAX_VALUE)
+        value = MAX_VALUE;
+    if (value < SUB_BUCKETS)
+        return value;
+
+    // The position of the highest set bit picks the power of two, and the
+    // bits below it pick the sub-bucket.
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - SUB_BUCKET_BITS;
+    return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS
+        + (value >> shift) - SUB_BUCKETS;
+}
+
+uint64_t Histogram::bucket_max(size_t b)
+{
+    if (b < SUB_BUCKETS)
+        return b;
+
+    int shift = b / SUB_BUCKETS - 1;
+    uint64_t sub = b % SUB_BUCKETS + SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void Histogram::bump(std::atomic<uint64_t> &counter, uint64_t n)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+            std::memory_order_relaxed);
+}
+
+void Histogram::record(uint64_t value)
+{
+    bump(_counts[bucket(value)], 1);
+    bump(_sum, value);
+    if (value > _max.load(std::memory_order_relaxed))
+        _max.store(value, std::memory_order_relaxed);
+}
+
+void Histogram::add_to(HistogramSnapshot &snapshot) const
+{
+    for (size_t b = 0; b < NUM_BUCKETS; b++)
+    {
+        uint64_t n = _counts[b].load(std::memory_order_relaxed);
+        snapshot.counts[b] += n;
+        snapshot.count += n;
+    }
+    snapshot.sum += _sum.load(std::memory_order_relaxed);
+
+    uint64_t max = _max.load(std::memory_order_relaxed);
+    if (max > snapshot.max)
+        snapshot.max = max;
+}
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef ESO_STATS_PROPAGATION
+#define ESO_STATS_PROPAGATION
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+#include "report.h"
+#include "thread_stats.h"
+#include "../global_config/global_config.h"
+#include "../global_config/types.h"
+#include "../util/parser.h"
+
+/*
+ * Metrics for changes as they propagate from esoca through esod to esol.
+ *
+ * esoca stamps each change with a sequence number and the time it accepted
+ * the change. Every hop sends the stamp after the message, with the time it
+ * was sent updated. The receiver then records how long the last hop took
+ * (hop_lag) and how long since esoca accepted the change (origin_lag). Both
+ * are wall clock differences between hosts, so they are only as accurate as
+ * the clock synchronization; a negative lag caused by skew is recorded as
+ * zero.
+ */
+
+// Returns the wall clock time in microseconds since the epoch.
+uint64_t wall_now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// The highest sequence number this daemon has assigned or received.
+std::atomic<uint64_t> propagation_last_seq{0};
+
+/*
+ * The stamp sent with every propagated message.
+ */
+struct PropagationStamp
+{
+    PropagationStamp();
+    // Returns a stamp with the next sequence number. Used by esoca.
+    static PropagationStamp next();
+    // Parses a serialized stamp. Returns false if msg is not a valid stamp.
+    bool parse(const uchar_vec &msg);
+    // seq;origin_us;sent_us
+    std::string serialize() const;
+
+    uint64_t seq;
+    // When esoca accepted the change.
+    uint64_t origin_us;
+    // When the previous hop sent the message.
+    uint64_t sent_us;
+};
+
+PropagationStamp::PropagationStamp()
+    : seq{0}, origin_us{0}, sent_us{0}
+{
+
+}
+
+PropagationStamp PropagationStamp::next()
+{
+    PropagationStamp stamp;
+    stamp.seq = propagation_last_seq.fetch_add(1) + 1;
+    stamp.origin_us = stamp.sent_us = wall_now_us();
+    return stamp;
+}
+
+bool PropagationStamp::parse(const uchar_vec &msg)
+{
+    std::vector<std::string> fields = split_string(msg, MSG_DELIMITER);
+    if (fields.size() != 3)
+        return false;
+
+    try
+    {
+        seq = std::stoull(fields[0]);
+        origin_us = std::stoull(fields[1]);
+        sent_us = std::stoull(fields[2]);
+    }
+    catch (const std::exception &e)
+    {
+        return false;
+    }
+    return true;
+}
+
+std::string PropagationStamp::serialize() const
+{
+    std::string msg{std::to_string(seq)};
+    msg += MSG_DELIMITER;
+    msg += std::to_string(origin_us);
+    msg += MSG_DELIMITER;
+    msg += std::to_string(sent_us);
+    return msg;
+}
+
+// The latencies recorded for propagated changes.
+enum PropagationMetric
+{
+    // From the previous hop sending the change to this daemon reading it.
+    PROP_HOP_LAG,
+    // From esoca accepting the change to this daemon reading it.
+    PROP_ORIGIN_LAG,
+    // Writing the change to this daemon's database.
+    PROP_APPLY,
+    // Sending the change on to one destination, including connecting.
+    PROP_FORWARD,
+    NUM_PROP_METRICS
+};
+
+const char *PROP_METRIC_NAMES[NUM_PROP_METRICS] = {"hop_lag", "origin_lag",
+    "apply", "forward"};
+
+// One thread's propagation metrics.
+struct PropagationBlock
+{
+    Histogram latency[NUM_PROP_METRICS];
+    Counter received;
+};
+
+typedef ThreadStats<PropagationBlock> PropagationStats;
+
+/*
+ * Records the arrival of a change with the given stamp in block.
+ */
+void propagation_add_received(PropagationBlock &block,
+        const PropagationStamp &stamp)
+{
+    uint64_t now = wall_now_us();
+
+    block.received.add();
+    block.latency[PROP_HOP_LAG].record(
+            now > stamp.sent_us ? (now - stamp.sent_us) * 1000 : 0);
+    block.latency[PROP_ORIGIN_LAG].record(
+            now > stamp.origin_us ? (now - stamp.origin_us) * 1000 : 0);
+
+    uint64_t last = propagation_last_seq.load();
+    while (stamp.seq > last
+            && !propagation_last_seq.compare_exchange_weak(last, stamp.seq))
+        ;
+}
+
+/*
+ * Records the arrival of a change with the given stamp.
+ */
+void propagation_received(const PropagationStamp &stamp)
+{
+    propagation_add_received(PropagationStats::local(), stamp);
+}
+
+/*
+ * Records the time from start_ns, a stats_now_ns() timestamp, until now.
+ */
+void propagation_record(PropagationMetric metric, uint64_t start_ns)
+{
+    PropagationStats::local().latency[metric].record(stats_now_ns() - start_ns);
+}
+
+/*
+ * As propagation_received() and propagation_record(), for threads that
+ * serve one connection each (see ThreadStats::shared()).
+ */
+void propagation_received_shared(const PropagationStamp &stamp)
+{
+    PropagationStats::shared([&](PropagationBlock &block)
+    {
+        propagation_add_received(block, stamp);
+    });
+}
+
+void propagation_record_shared(PropagationMetric metric, uint64_t start_ns)
+{
+    uint64_t elapsed = stats_now_ns() - start_ns;
+    PropagationStats::shared([&](PropagationBlock &block)
+    {
+        block.latency[metric].record(elapsed);
+    });
+}
+
+/*
+ * Delivery counts and backlog for each destination changes are sent to.
+ * Destinations are named host:port. Updates take a lock, which is cheap next
+ * to the network round trip each one accompanies.
+ */
+class DestinationStats
+{
+public:
+    static DestinationStats &instance();
+    // Adds a message to the destination's backlog.
+    void queued(const std::string &dest);
+    // Removes a message from the backlog and counts whether it was delivered.
+    void done(const std::string &dest, bool delivered);
+    // Appends a "destination <name> <sent> <failed> <backlog>" record for
+    // each destination.
+    void append_to(std::string &report) const;
+private:
+    DestinationStats() {}
+
+    struct Destination
+    {
+        uint64_t sent;
+        uint64_t failed;
+        uint64_t backlog;
+    };
+
+    std::map<std::string, Destination> _dests;
+    mutable std::mutex _mutex;
+};
+
+DestinationStats &DestinationStats::instance()
+{
+    static DestinationStats *stats = new DestinationStats;
+    return *stats;
+}
+
+void DestinationStats::queued(const std::string &dest)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    _dests[dest].backlog++;
+}
+
+void DestinationStats::done(const std::string &dest, bool delivered)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    Destination &d = _dests[dest];
+    if (d.backlog)
+        d.backlog--;
+    if (delivered)
+        d.sent++;
+    else
+        d.failed++;
+}
+
+void DestinationStats::append_to(std::string &report) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    for (auto &entry : _dests)
+    {
+        report += "destination ";
+        report += entry.first;
+        report += ' ';
+        report += std::to_string(entry.second.sent);
+        report += ' ';
+        report += std::to_string(entry.second.failed);
+        report += ' ';
+        report += std::to_string(entry.second.backlog);
+        report += '\n';
+    }
+}
+
+/*
+ * Appends the propagation metrics of every thread to a stats report.
+ */
+void append_propagation_report(std::string &report)
+{
+    uint64_t received = 0;
+    std::vector<HistogramSnapshot> latency(NUM_PROP_METRICS);
+
+    PropagationStats::for_each([&](const PropagationBlock &block)
+    {
+        received += block.received.get();
+        for (int m = 0; m < NUM_PROP_METRICS; m++)
+            block.latency[m].add_to(latency[m]);
+    });
+
+    append_counter(report, "propagation_received", received);
+    append_counter(report, "propagation_last_seq", propagation_last_seq);
+    for (int m = 0; m < NUM_PROP_METRICS; m++)
+        if (latency[m].count)
+            append_latency(report, "propagation", PROP_METRIC_NAMES[m],
+                    latency[m]);
+    DestinationStats::instance().append_to(report);
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef ESO_STATS_REPORT
+#define ESO_STATS_REPORT
+
+#include <cstdint>
+#include <string>
+
+#include "histogram.h"
+
+/*
+ * Helpers for the text reports the daemons return for REQUEST_STATS. A
+ * report has one record per line, with space separated fields:
+ *
+ *   <daemon>_stats 1
+ *   uptime_s <seconds>
+ *   counter <name> <value>
+ *   latency <group> <name> <count> <sum> <p50> <p90> <p99> <p99.9> <max>
+ *
+ * Latencies are in nanoseconds. Daemons may add their own record types;
+ * readers should skip the ones they do not know.
+ */
+
+// When the daemon started, for the reported uptime.
+const uint64_t STATS_START_NS = stats_now_ns();
+
+/*
+ * Returns the first two lines of a report for the named daemon.
+ */
+std::string stats_report_header(const std::string &daemon)
+{
+    std::string report{daemon};
+    report += "_stats 1\nuptime_s ";
+    report += std::to_string((stats_now_ns() - STATS_START_NS) / 1000000000);
+    report += '\n';
+    return report;
+}
+
+/*
+ * Appends a "counter" record.
+ */
+void append_counter(std::string &report, const std::string &name,
+        uint64_t value)
+{
+    report += "counter ";
+    report += name;
+    report += ' ';
+    report += std::to_string(value);
+    report += '\n';
+}
+
+/*
+ * Appends a "latency" record for the snapshot.
+ */
+void append_latency(std::string &report, const std::string &group,
+        const std::string &name, const HistogramSnapshot &h)
+{
+    report += "latency ";
+    report += group;
+    report += ' ';
+    report += name;
+    for (uint64_t v : {h.count, h.sum, h.percentile(50), h.percentile(90),
+            h.percentile(99), h.percentile(99.9), h.max})
+    {
+        report += ' ';
+        report += std::to_string(v);
+    }
+    report += '\n';
+}
+
+#endif
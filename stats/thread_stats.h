@@ -0,0 +1,179 @@
+#ifndef ESO_STATS_THREAD_STATS
+#define ESO_STATS_THREAD_STATS
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/*
+ * A counter with a single writer, the thread that owns it. add() is a
+ * relaxed load and store, so it never contends with other threads. Any
+ * thread may read it.
+ */
+class Counter
+{
+public:
+    Counter();
+    // Only the owning thread may call this.
+    void add(uint64_t n = 1);
+    uint64_t get() const;
+private:
+    std::atomic<uint64_t> _value;
+};
+
+Counter::Counter()
+    : _value{0}
+{
+
+}
+
+void Counter::add(uint64_t n)
+{
+    _value.store(_value.load(std::memory_order_relaxed) + n,
+            std::memory_order_relaxed);
+}
+
+uint64_t Counter::get() const
+{
+    return _value.load(std::memory_order_relaxed);
+}
+
+/*
+ * Gives every thread its own instance of Block, a struct of Counters and
+ * Histograms, and lets a reader visit all of them.
+ *
+ * A thread's block is allocated and registered the first time it calls
+ * local(). After that recording a metric touches only that thread's block,
+ * so the hot path takes no lock and shares no cache lines. When the thread
+ * exits its block is kept, so that its counts are still reported, and handed
+ * to the next thread that needs one. There are never more blocks than
+ * threads recording at once, however many threads come and go.
+ *
+ * Threads that each serve one connection, of which there may be many at
+ * once, record with shared() instead, into one block under a lock.
+ */
+template <class Block>
+class ThreadStats
+{
+public:
+    // Returns the calling thread's block.
+    static Block &local();
+    // Calls f(Block &) on the block shared by every thread that calls it,
+    // with its lock held.
+    template <class F>
+    static void shared(F f);
+    // Calls f(const Block &) for every block.
+    template <class F>
+    static void for_each(F f);
+private:
+    // Returns the thread's block to the free list when the thread exits.
+    struct Owner
+    {
+        Block *block = nullptr;
+        ~Owner();
+    };
+
+    // Function statics so that they exist before any other static uses them.
+    static std::mutex &mutex();
+    static std::vector<Block *> &blocks();
+    // Blocks whose threads have exited.
+    static std::vector<Block *> &free_blocks();
+    // The block for shared() and its lock. Not templates, so that every f
+    // uses the same ones.
+    static std::mutex &shared_mutex();
+    static Block &shared_block();
+};
+
+template <class Block>
+std::mutex &ThreadStats<Block>::mutex()
+{
+    static std::mutex *m = new std::mutex;
+    return *m;
+}
+
+template <class Block>
+std::vector<Block *> &ThreadStats<Block>::blocks()
+{
+    static std::vector<Block *> *b = new std::vector<Block *>;
+    return *b;
+}
+
+template <class Block>
+std::vector<Block *> &ThreadStats<Block>::free_blocks()
+{
+    static std::vector<Block *> *b = new std::vector<Block *>;
+    return *b;
+}
+
+template <class Block>
+std::mutex &ThreadStats<Block>::shared_mutex()
+{
+    static std::mutex *m = new std::mutex;
+    return *m;
+}
+
+template <class Block>
+Block &ThreadStats<Block>::shared_block()
+{
+    static Block *b = []
+    {
+        Block *block = new Block;
+        std::lock_guard<std::mutex> lock{mutex()};
+        blocks().push_back(block);
+        return block;
+    }();
+    return *b;
+}
+
+template <class Block>
+ThreadStats<Block>::Owner::~Owner()
+{
+    if (!block)
+        return;
+
+    std::lock_guard<std::mutex> lock{mutex()};
+    free_blocks().push_back(block);
+}
+
+template <class Block>
+Block &ThreadStats<Block>::local()
+{
+    static thread_local Owner owner;
+    if (!owner.block)
+    {
+        // The lock also orders the previous owner's writes before ours.
+        std::lock_guard<std::mutex> lock{mutex()};
+        if (free_blocks().empty())
+        {
+            owner.block = new Block;
+            blocks().push_back(owner.block);
+        }
+        else
+        {
+            owner.block = free_blocks().back();
+            free_blocks().pop_back();
+        }
+    }
+    return *owner.block;
+}
+
+template <class Block>
+template <class F>
+void ThreadStats<Block>::shared(F f)
+{
+    Block &block = shared_block();
+    std::lock_guard<std::mutex> lock{shared_mutex()};
+    f(block);
+}
+
+template <class Block>
+template <class F>
+void ThreadStats<Block>::for_each(F f)
+{
+    std::lock_guard<std::mutex> lock{mutex()};
+    for (const Block *block : blocks())
+        f(*block);
+}
+
+#endif
@@ -0,0 +1,363 @@
+#ifndef ESO_STATS_TRACE
+#define ESO_STATS_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "../global_config/global_config.h"
+#include "../global_config/message_config.h"
+#include "../global_config/types.h"
+#include "../util/parser.h"
+
+/*
+ * Request tracing across esol, esod and esoca.
+ *
+ * A trace is a tree of spans, each a timed piece of work in one daemon. A
+ * daemon starts a trace for a request that arrives without one, and samples
+ * it at the configured rate. Only sampled traces are recorded or sent on, so
+ * requests that are not sampled cost a branch per span.
+ *
+ * A sampled trace is carried to the next daemon by sending a TRACE frame and
+ * the serialized TraceContext in front of the request; see recv_request().
+ * Receivers continue the trace. A daemon that receives a request without a
+ * context makes its own sampling decision.
+ *
+ * Finished spans are appended to the daemon's trace file, one JSON object per
+ * line:
+ *
+ *   {"trace":"<16 hex>","span":"<16 hex>","parent":"<16 hex>",
+ *    "daemon":"esol","name":"esol.request","start_us":<epoch us>,
+ *    "duration_us":<us>,"tags":{"op":"encrypt"}}
+ *
+ * parent is all zeros for the root span of a trace.
+ */
+
+/*
+ * Identifies the span that work is being done for.
+ */
+struct TraceContext
+{
+    TraceContext();
+    // Parses a serialized context. Returns false if msg is not one.
+    bool parse(const uchar_vec &msg);
+    // trace_id;span_id;sampled, with the IDs in hex.
+    std::string serialize() const;
+
+    uint64_t trace_id;
+    uint64_t span_id;
+    bool sampled;
+};
+
+TraceContext::TraceContext()
+    : trace_id{0}, span_id{0}, sampled{false}
+{
+
+}
+
+bool TraceContext::parse(const uchar_vec &msg)
+{
+    std::vector<std::string> fields = split_string(msg, MSG_DELIMITER);
+    if (fields.size() != 3)
+        return false;
+
+    try
+    {
+        trace_id = std::stoull(fields[0], nullptr, 16);
+        span_id = std::stoull(fields[1], nullptr, 16);
+    }
+    catch (const std::exception &e)
+    {
+        return false;
+    }
+    sampled = fields[2] == "1";
+    return trace_id != 0;
+}
+
+/*
+ * Returns id as 16 hex digits.
+ */
+std::string trace_hex(uint64_t id)
+{
+    char buf[17];
+    snprintf(buf, sizeof buf, "%016llx", (unsigned long long) id);
+    return std::string{buf};
+}
+
+std::string TraceContext::serialize() const
+{
+    std::string msg = trace_hex(trace_id);
+    msg += MSG_DELIMITER;
+    msg += trace_hex(span_id);
+    msg += MSG_DELIMITER;
+    msg += sampled ? '1' : '0';
+    return msg;
+}
+
+/*
+ * Appends finished spans to the trace file.
+ */
+class Tracer
+{
+public:
+    static Tracer &instance();
+    // Sets the daemon name written with every span, the trace file and the
+    // fraction of new traces that are sampled (0 disables tracing).
+    void configure(const std::string &daemon, const std::string &path,
+            double sample_rate);
+    // Returns true if a new trace should be sampled.
+    bool sample();
+    // Returns a random, non-zero ID.
+    uint64_t new_id();
+    // Writes one finished span.
+    void write(const TraceContext &context, uint64_t parent_id,
+            const char *name, uint64_t start_us, uint64_t duration_us,
+            const std::string &tags);
+private:
+    Tracer();
+
+    std::string _daemon;
+    int _fd;
+    // new_id() and sample() draw from a per-thread generator, so the rate is
+    // the only shared state they read.
+    std::atomic<double> _sample_rate;
+    std::mutex _mutex;
+};
+
+Tracer &Tracer::instance()
+{
+    static Tracer *tracer = new Tracer;
+    return *tracer;
+}
+
+Tracer::Tracer()
+    : _fd{-1}, _sample_rate{0}
+{
+
+}
+
+void Tracer::configure(const std::string &daemon, const std::string &path,
+        double sample_rate)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    if (_fd >= 0)
+        close(_fd);
+
+    _daemon = daemon;
+    _fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    _sample_rate.store(_fd >= 0 ? sample_rate : 0);
+}
+
+/*
+ * Returns the calling thread's random number generator.
+ */
+std::mt19937_64 &trace_rng()
+{
+    static thread_local std::mt19937_64 rng{std::random_device{}()};
+    return rng;
+}
+
+bool Tracer::sample()
+{
+    double rate = _sample_rate.load(std::memory_order_relaxed);
+    if (rate <= 0)
+        return false;
+    return std::uniform_real_distribution<double>{0, 1}(trace_rng()) < rate;
+}
+
+uint64_t Tracer::new_id()
+{
+    uint64_t id;
+    while ((id = trace_rng()()) == 0)
+        ;
+    return id;
+}
+
+void Tracer::write(const TraceContext &context, uint64_t parent_id,
+        const char *name, uint64_t start_us, uint64_t duration_us,
+        const std::string &tags)
+{
+    std::string line{"{\"trace\":\""};
+    line += trace_hex(context.trace_id);
+    line += "\",\"span\":\"";
+    line += trace_hex(context.span_id);
+    line += "\",\"parent\":\"";
+    line += trace_hex(parent_id);
+    line += "\",\"daemon\":\"";
+    line += _daemon;
+    line += "\",\"name\":\"";
+    line += name;
+    line += "\",\"start_us\":";
+    line += std::to_string(start_us);
+    line += ",\"duration_us\":";
+    line += std::to_string(duration_us);
+    line += ",\"tags\":{";
+    line += tags;
+    line += "}}\n";
+
+    // One write per line with O_APPEND keeps lines from different threads
+    // whole.
+    std::lock_guard<std::mutex> lock{_mutex};
+    // Stop sampling rather than keep failing, e.g. on a full disk.
+    if (_fd >= 0 && ::write(_fd, line.data(), line.size()) < 0)
+        _sample_rate.store(0);
+}
+
+/*
+ * Returns the calling thread's current trace context. Its trace_id is 0 when
+ * the thread is not working on a sampled trace.
+ */
+TraceContext &current_trace()
+{
+    static thread_local TraceContext context;
+    return context;
+}
+
+/*
+ * A timed piece of work. While a sampled span is alive it is the thread's
+ * current span, so spans started inside it become its children and requests
+ * sent to other daemons carry its context.
+ */
+class Span
+{
+public:
+    // Starts a child of the thread's current span. Does nothing unless the
+    // current trace is sampled.
+    explicit Span(const char *name);
+    // Starts a span for a request from another daemon. It continues the
+    // trace in parent if there is one, else it starts a new trace, which is
+    // sampled at the configured rate.
+    Span(const char *name, const TraceContext &parent);
+    ~Span();
+    // Records a key and value with the span. Neither may need JSON escaping.
+    void tag(const char *key, const std::string &value);
+    // Returns true if the span will be recorded.
+    bool sampled() const;
+private:
+    Span(const Span &) = delete;
+    Span &operator=(const Span &) = delete;
+
+    // Makes this the current span, as a child of parent.
+    void begin(const TraceContext &parent);
+
+    const char *_name;
+    bool _sampled;
+    TraceContext _context;
+    uint64_t _parent_id;
+    // The span that was current before this one.
+    TraceContext _previous;
+    uint64_t _start_us;
+    std::chrono::steady_clock::time_point _start;
+    std::string _tags;
+};
+
+Span::Span(const char *name)
+    : _name{name}, _sampled{false}
+{
+    if (current_trace().sampled)
+        begin(current_trace());
+}
+
+Span::Span(const char *name, const TraceContext &parent)
+    : _name{name}, _sampled{false}
+{
+    if (parent.trace_id)
+    {
+        if (parent.sampled)
+            begin(parent);
+    }
+    else if (Tracer::instance().sample())
+    {
+        TraceContext root;
+        root.trace_id = Tracer::instance().new_id();
+        root.sampled = true;
+        begin(root);
+    }
+}
+
+void Span::begin(const TraceContext &parent)
+{
+    _sampled = true;
+    _context.trace_id = parent.trace_id;
+    _context.span_id = Tracer::instance().new_id();
+    _context.sampled = true;
+    _parent_id = parent.span_id;
+    _previous = current_trace();
+    _start_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    _start = std::chrono::steady_clock::now();
+    current_trace() = _context;
+}
+
+Span::~Span()
+{
+    if (!_sampled)
+        return;
+
+    uint64_t duration_us = std::chrono::duration_cast<
+        std::chrono::microseconds>(std::chrono::steady_clock::now() - _start)
+        .count();
+    Tracer::instance().write(_context, _parent_id, _name, _start_us,
+            duration_us, _tags);
+    current_trace() = _previous;
+}
+
+void Span::tag(const char *key, const std::string &value)
+{
+    if (!_sampled)
+        return;
+
+    if (!_tags.empty())
+        _tags += ',';
+    _tags += '"';
+    _tags += key;
+    _tags += "\":\"";
+    _tags += value;
+    _tags += '"';
+}
+
+bool Span::sampled() const
+{
+    return _sampled;
+}
+
+/*
+ * Reads the next request type from stream. If the sender is tracing the
+ * request it first sends TRACE and its context; these are read into parent.
+ * Otherwise parent is left empty.
+ */
+template <class Stream>
+uchar_vec recv_request(Stream &stream, TraceContext &parent)
+{
+    uchar_vec msg = stream.recv();
+    if (msg == TRACE)
+    {
+        parent.parse(stream.recv());
+        msg = stream.recv();
+    }
+    return msg;
+}
+
+/*
+ * Sends TRACE and the current context if the calling thread is working on a
+ * sampled trace. Called before sending a request to another daemon.
+ */
+template <class Stream>
+void send_trace(Stream &stream)
+{
+    if (current_trace().sampled)
+    {
+        stream.send(TRACE);
+        stream.send(current_trace().serialize());
+    }
+}
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef ESO_UTIL_ALLOC_COUNTER
+#define ESO_UTIL_ALLOC_COUNTER
+
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include "../logger/logger.h"
+
+/*
+ * Counts heap allocations made through operator new by the current thread, so
+ * that the number of allocations per request can be measured.
+ *
+ * Counting replaces the global operator new and delete, so it is only compiled
+ * in when ESO_COUNT_ALLOCS is defined (see the daemons' "allocs" make
+ * targets). Otherwise the counts are always zero. malloc calls made inside
+ * OpenSSL are not counted.
+ */
+
+#ifdef ESO_COUNT_ALLOCS
+
+// The allocations made by this thread so far.
+static thread_local unsigned long eso_thread_allocs = 0;
+
+void *operator new(size_t n)
+{
+    ++eso_thread_allocs;
+
+    void *p = malloc(n ? n : 1);
+    if (!p)
+        throw std::bad_alloc{};
+    return p;
+}
+
+void *operator new[](size_t n)
+{
+    return operator new(n);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+unsigned long thread_alloc_count()
+{
+    return eso_thread_allocs;
+}
+
+#else
+
+unsigned long thread_alloc_count()
+{
+    return 0;
+}
+
+#endif
+
+/*
+ * Counts the allocations made by this thread while it is in scope. If it is
+ * given a label, the count is logged at Debug level when it goes out of
+ * scope.
+ */
+class AllocCounter
+{
+public:
+    AllocCounter(std::string label = "");
+    ~AllocCounter();
+    // Allocations since construction.
+    unsigned long count() const;
+private:
+    std::string _label;
+    unsigned long _start;
+};
+
+AllocCounter::AllocCounter(std::string label)
+    : _label{label}, _start{thread_alloc_count()}
+{
+
+}
+
+AllocCounter::~AllocCounter()
+{
+#ifdef ESO_COUNT_ALLOCS
+    if (!_label.empty())
+        ESO_LOG(LogLevel::Debug, _label, ": ", count(), " allocations");
+#endif
+}
+
+unsigned long AllocCounter::count() const
+{
+    return thread_alloc_count() - _start;
+}
+
+#endif
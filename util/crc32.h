@@ -0,0 +1,34 @@
+#ifndef ESO_UTIL_CRC32
+#define ESO_UTIL_CRC32
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Returns the CRC-32 (the zlib and Ethernet one) of size bytes at data,
+ * continuing from crc, the CRC of the bytes before them. Used to detect
+ * records that were torn or damaged on disk, not tampering.
+ */
+uint32_t crc32(const void *data, size_t size, uint32_t crc = 0)
+{
+    static const uint32_t *table = []()
+    {
+        uint32_t *t = new uint32_t[256];
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int bit = 0; bit < 8; bit++)
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+#endif
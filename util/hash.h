@@ -0,0 +1,29 @@
+#ifndef ESO_UTIL_HASH
+#define ESO_UTIL_HASH
+
+#include <cstdint>
+#include <string>
+
+/*
+ * Returns a 64-bit hash of data: FNV-1a, followed by a finalizer so that
+ * every input bit affects every output bit. Different seeds give unrelated
+ * hashes of the same data. Used to spread keys, not to authenticate them.
+ */
+uint64_t hash_bytes(const std::string &data, uint64_t seed = 0)
+{
+    uint64_t hash = 14695981039346656037ULL ^ seed;
+    for (unsigned char c : data)
+    {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef ESO_UTIL_HASH_RING
+#define ESO_UTIL_HASH_RING
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "hash.h"
+
+/*
+ * A consistent hash ring. Each node is placed at several points on the ring,
+ * so that keys are spread evenly, and a key belongs to the first node after
+ * it. Adding or removing a node moves only the keys next to its points.
+ */
+class HashRing
+{
+public:
+    // Places node at points points on the ring.
+    void add(const std::string &node, unsigned int points);
+
+    // Returns every node, in the order key tries them: its own first, then
+    // each other one in the order they follow it on the ring.
+    std::vector<std::string> order(const std::string &key) const;
+private:
+    // (point, node) in point order.
+    std::vector<std::pair<uint64_t, std::string>> _points;
+};
+
+void HashRing::add(const std::string &node, unsigned int points)
+{
+    for (unsigned int i = 0; i < points; i++)
+        _points.emplace_back(hash_bytes(node + "#" + std::to_string(i)),
+                node);
+    std::sort(_points.begin(), _points.end());
+}
+
+std::vector<std::string> HashRing::order(const std::string &key) const
+{
+    std::vector<std::string> nodes;
+    if (_points.empty())
+        return nodes;
+
+    size_t start = std::lower_bound(_points.begin(), _points.end(),
+            std::make_pair(hash_bytes(key), std::string{})) - _points.begin();
+    for (size_t i = 0; i < _points.size(); i++)
+    {
+        const std::string &node = _points[(start + i) % _points.size()].second;
+        if (std::find(nodes.begin(), nodes.end(), node) == nodes.end())
+            nodes.push_back(node);
+    }
+    return nodes;
+}
+
+#endif
@@ -1,17 +1,26 @@
 #ifndef ESO_UTIL_NETWORK
 #define ESO_UTIL_NETWORK
 
+#include <arpa/inet.h>
 #include <cstring>
 #include <netdb.h>
+#include <netinet/in.h>
 #include <string>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <vector>
+
+#include "../global_config/paths.h"
 
 /**
- * Returns the fully qualified domain name associated with this machine.
+ * Returns the fully qualified domain name associated with this machine, or
+ * ESO_FQDN if it is set (e.g. to localhost, to keep a test on loopback).
  */
 std::string get_fqdn()
 {
+    if (const char *fqdn = eso_env("ESO_FQDN", nullptr))
+        return std::string{fqdn};
+
     struct addrinfo hints, *info, *p;
 
     // SUSv2 guarantees that "Host names are limited to 255 bytes".
@@ -50,4 +59,31 @@ std::string get_fqdn()
     return result;
 }
 
+/**
+ * Returns the IPv4 addresses hostname resolves to, as TCP_Stream's
+ * peer_address() gives them. Returns none if it cannot be resolved.
+ */
+std::vector<std::string> resolve_addresses(const std::string &hostname)
+{
+    std::vector<std::string> addresses;
+
+    struct addrinfo hints, *info, *p;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(hostname.c_str(), nullptr, &hints, &info) != 0)
+        return addresses;
+
+    for (p = info; p; p = p->ai_next)
+    {
+        char text[INET_ADDRSTRLEN];
+        struct sockaddr_in *addr = (struct sockaddr_in *) p->ai_addr;
+        if (inet_ntop(AF_INET, &addr->sin_addr, text, sizeof text))
+            addresses.push_back(std::string{text});
+    }
+
+    freeaddrinfo(info);
+    return addresses;
+}
+
 #endif
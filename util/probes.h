@@ -0,0 +1,70 @@
+#ifndef ESO_UTIL_PROBES
+#define ESO_UTIL_PROBES
+
+/*
+ * Statically defined tracepoints (USDT) for profiling running daemons with
+ * bpftrace or perf. See probes/ for example scripts.
+ *
+ * Each probe compiles to a single nop and a note in the binary, so it costs
+ * nothing until a tracer attaches to it. The probes are built in whenever
+ * <sys/sdt.h> (systemtap-sdt-dev) is installed; define ESO_NO_PROBES to leave
+ * them out. Without <sys/sdt.h> the macros expand to nothing.
+ *
+ * All probes are in the "eso" provider. Timed operations have a <name>_start
+ * and a <name>_done probe, fired on the same thread, so a script can measure
+ * the time between them:
+ *
+ *   uds_send_start(fd, data, len)     uds_send_done(fd, len)
+ *   uds_recv_start(fd)                uds_recv_done(fd, data, len)
+ *   tcp_send_start(fd, data, len)     tcp_send_done(fd, len)
+ *   tcp_recv_start(fd)                tcp_recv_done(fd, data, len)
+ *   tcp_connect_start(host, port)     tcp_connect_done(fd)
+ *   tcp_accept_start(fd)              tcp_accept_done(fd)
+ *   mysql_query_start()               mysql_query_done(status)
+ *   mysql_result_start()              mysql_result_done(found)
+ *   <crypto op>_start(len)            <crypto op>_done()
+ *   esol_request_start()              esol_request_done(op, denied)
+ *
+ * data is the message being sent or received, so the opcode of a request is
+ * str(arg1, arg2) of the probe that sends or receives it. The crypto ops are
+ * aes_encrypt, aes_decrypt, aes_gcm_encrypt, aes_gcm_decrypt, hmac,
+ * rsa_encrypt, rsa_decrypt, rsa_sign, rsa_verify, ec_sign, ec_verify,
+ * envelope_seal and envelope_decrypt; len is the size of their input. op is
+ * an EsolStatsOp (see local/esol/esol_stats.h).
+ */
+
+#if !defined(ESO_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define ESO_PROBES_ENABLED
+#endif
+#endif
+
+#ifdef ESO_PROBES_ENABLED
+
+#define ESO_PROBE(name) DTRACE_PROBE(eso, name)
+#define ESO_PROBE1(name, a) DTRACE_PROBE1(eso, name, a)
+#define ESO_PROBE2(name, a, b) DTRACE_PROBE2(eso, name, a, b)
+#define ESO_PROBE3(name, a, b, c) DTRACE_PROBE3(eso, name, a, b, c)
+
+#else
+
+#define ESO_PROBE(name) do {} while (0)
+#define ESO_PROBE1(name, a) do {} while (0)
+#define ESO_PROBE2(name, a, b) do {} while (0)
+#define ESO_PROBE3(name, a, b, c) do {} while (0)
+
+#endif
+
+/*
+ * Fires name_start with len now, and name_done when the enclosing scope
+ * exits, however it exits. For functions with several returns.
+ */
+#define ESO_PROBE_SCOPE(name, len) \
+    ESO_PROBE1(name##_start, len); \
+    struct EsoProbeDone_##name \
+    { \
+        ~EsoProbeDone_##name() { ESO_PROBE(name##_done); } \
+    } eso_probe_done_##name
+
+#endif